@@ -1,23 +1,163 @@
 #ifndef BITARRAY_H
 #define BITARRAY_H
 
+#include <algorithm>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <functional>
 #include <immintrin.h>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <stddef.h>
 #include <stdexcept>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
+/**
+ * The widest instruction set tier the kernels are compiled for, all of them by default. Building
+ * with e.g. -DBITARRAY_MAX_ISA=BITARRAY_ISA_SSE2 leaves out the AVX2 and AVX-512 kernels, so that
+ * the lower tiers can be benchmarked, or used, on a machine that has the higher ones. The SSE2
+ * tier includes the POPCNT and PCLMULQDQ kernels, the AVX2 tier the BMI2 ones.
+ */
+#define BITARRAY_ISA_DEFAULT 0
+#define BITARRAY_ISA_SSE2 1
+#define BITARRAY_ISA_AVX2 2
+#define BITARRAY_ISA_AVX512 3
+#ifndef BITARRAY_MAX_ISA
+#define BITARRAY_MAX_ISA BITARRAY_ISA_AVX512
+#endif
+
 class BitArray;
+class BitExpr;
+class BitMatrix;
+class BitRecord;
+class BitSpan;
+class CompressedBitArray;
+class Convolver;
+class Crc;
+class Interleaver;
+class Lfsr;
+class SparseBitMatrix;
 
 /**
  * Helper methods to count bits with both hardware and non-hardware versions.
  */
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
 __attribute__((target("popcnt"))) 
 inline long long countBits(long long x) { return _mm_popcnt_u64(x); }
+#endif
 __attribute__((target("default"))) 
 inline long long countBits(long long x) { return __builtin_popcountll(x); }
 
+/**
+ * The implementations of the kernels that have several, and which one each kernel runs. The CPU is
+ * probed once, on first use, and every kernel runs the widest implementation the CPU supports.
+ * Hosts that downclock on wide vectors can pin kernels to narrower ones with Select or with the
+ * BITARRAY_DISPATCH environment variable, read by the probe, e.g. "dotprod=avx2,convolve=default"
+ * or "*=avx2" for every kernel. Entries of the variable that cannot be parsed are ignored.
+ *
+ * Implementations are named after their instruction set, one of default, sse2, popcnt, pclmul, avx2,
+ * bmi, bmi2 or avx512, popcnt and pclmul being in the SSE2 tier and bmi and bmi2 in the AVX2 one.
+ * Asking for one the kernel or the CPU does not have picks the widest one below it, so "*=avx2"
+ * keeps every kernel at AVX2 or below. The scalar POPCNT, BMI2 and PCLMULQDQ code of RankSelect and Lfsr::Jump is left to the
+ * compiler's target dispatch.
+ */
+class Dispatch {
+  friend class BitArray;
+  friend class BitMatrix;
+  friend class Crc;
+  friend class Interleaver;
+  friend class Lfsr;
+
+public:
+  /**
+   * The kernels, and the implementations of one that are compiled in and supported by the CPU,
+   * narrowest first.
+   */
+  static std::vector<std::string> Kernels();
+  static std::vector<std::string> Implementations(const std::string &kernel);
+
+  /**
+   * The implementation a kernel runs.
+   */
+  static std::string Selected(const std::string &kernel);
+
+  /**
+   * Has a kernel, or every kernel for "*", run the named implementation or the widest one below
+   * it, "auto" for the widest the CPU supports. Must not be called while kernels run on other
+   * threads.
+   */
+  static void Select(const std::string &kernel, const std::string &implementation);
+
+  /**
+   * Selects a comma separated list of kernel=implementation like BITARRAY_DISPATCH.
+   */
+  static void Configure(const std::string &spec);
+
+private:
+  enum Kernel {
+    DOTPROD,
+    CORRELATE,
+    CONVOLVE,
+    ENCODE,
+    VITERBI,
+    BITEXPR,
+    PACK,
+    UNPACK,
+    TRANSPOSE,
+    CRC,
+    LFSR,
+    INTERLEAVE,
+    FIXEDCONVOLVE,
+    SCORE,
+    GF2MULTIPLY,
+    FIND,
+    POSITIONS,
+    NUM_KERNELS
+  };
+
+  typedef void (*Function)();
+
+  struct Implementation {
+    const char *name;
+    int isa;               // The BITARRAY_ISA tier
+    bool supported;        // by the CPU
+    Function functions[3]; // The entry points, the BitExpr kernel has three
+  };
+
+  Dispatch();
+  static Dispatch &Instance();
+  static size_t Find(const std::string &kernel);
+  static int Tier(const std::string &implementation);
+  template <class F> void Add(Kernel kernel, const char *name, int isa, bool supported, F f0, F f1 = NULL, F f2 = NULL);
+  void Pick(size_t kernel, int isa);
+  void Apply(const std::string &spec, bool strict);
+
+  /**
+   * The selected entry point of a kernel.
+   */
+  template <class F> static F Get(Kernel kernel, size_t i = 0) { return reinterpret_cast<F>(Instance()._selected[kernel]->functions[i]); }
+
+  /**
+   * The tier of the selected implementation, for the kernels that are templates and so have a
+   * version per tier rather than an entry point.
+   */
+  static int Isa(Kernel kernel) { return Instance()._selected[kernel]->isa; }
+
+  std::vector<Implementation> _implementations[NUM_KERNELS]; // Narrowest first
+  const Implementation *_selected[NUM_KERNELS];
+};
+
 /**
  * A class to act as a proxy to a bit in an array.
  * Used to set, and get bits as well as pass a reference
@@ -25,6 +165,9 @@ inline long long countBits(long long x) { return __builtin_popcountll(x); }
  */
 class ProxyBit {
   friend class BitArray;
+  friend class BitSpan;
+  friend class MappedBitArray;
+  template <size_t N> friend class FixedBitArray;
 
 public:
   virtual ~ProxyBit();
@@ -49,8 +192,55 @@ private:
   size_t _pos;
 };
 
+/**
+ * An allocator handing out 64-byte aligned memory, a cache line and an AVX-512 register, so the
+ * words of a BitArray never straddle cache lines.
+ */
+template <class T> struct CacheLineAllocator {
+  typedef T value_type;
+
+  CacheLineAllocator() {}
+  template <class U> CacheLineAllocator(const CacheLineAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    void *p = NULL;
+    if (posix_memalign(&p, 64, n * sizeof(T)))
+      throw std::bad_alloc();
+    return (T *)p;
+  }
+
+  void deallocate(T *p, size_t) { free(p); }
+};
+
+template <class T, class U> bool operator==(const CacheLineAllocator<T> &, const CacheLineAllocator<U> &) { return true; }
+template <class T, class U> bool operator!=(const CacheLineAllocator<T> &, const CacheLineAllocator<U> &) { return false; }
+
 class BitArray {
+  friend class BitMatrix;
+  friend class CompressedBitArray;
+  friend class Convolver;
+  friend class Dispatch;
+  friend class Interleaver;
+  friend class Lfsr;
+
 public:
+  /**
+   * How many threads the parallel Convolve and DotProd use, 0 for one per core, and the size in
+   * bits below which they run on the calling thread alone. Each thread works on whole 64 byte
+   * lines of the result so that no two threads write to the same cache line.
+   */
+  struct Parallel {
+    explicit Parallel(size_t threads = 0, size_t minBits = size_t(1) << 24);
+
+    /**
+     * The number of threads to use for numBits bits.
+     */
+    size_t Threads(size_t numBits) const;
+
+    size_t threads;
+    size_t minBits;
+  };
+
   /**
    * Construct a zero filled proxybit of length len bits
    */
@@ -64,7 +254,7 @@ public:
   /**
    * Create a bit Array as such BitArray("10101000 10101110")
    */
-  BitArray(const std::string s);
+  BitArray(const std::string &s);
 
   /**
    * Returns the size, in bits, of the array.
@@ -72,7 +262,7 @@ public:
   size_t size() const;
 
   /**
-   * Pass through to the vector _data both const and non-const versions
+   * Pass through to the vector _data both const and non-const versions, the data is 64-byte aligned.
    */
   const uint8_t *data() const;
   uint8_t *data();
@@ -83,368 +273,6011 @@ public:
   ProxyBit operator[](size_t i);
 
   /**
-   * Performs a dot product on a range of two ProxyBits.
-   * Since the two ProxyBits could be offset they get aligned first
-   * Both a default, and an SSE2 version exist
+   * Reads a bit of a const array.
    */
-  __attribute__((target("default"))) 
-  static uint64_t DotProd(const ProxyBit &pb_a, const ProxyBit &pb_b, size_t len);
-  __attribute__((target("sse2"))) 
-  static uint64_t DotProd(const ProxyBit &pb_a, const ProxyBit &pb_b, size_t len);
+  bool operator[](size_t i) const;
 
   /**
-   * Performs a convolution operation on bits using taps and stores it into result. If flush is true
-   * zeros will be pushed into the taps at the end resulting in a total output size of taps.size() +
-   * bits.size() - 1. The memory of the registers can optionally be initialized with the initial fill
-   * and the final fill will be returned in initialFill.
+   * Changes the size to len bits, keeping the bits below len and clearing any new ones. Storage
+   * grows geometrically so that appending is amortized constant time per bit, Reserve allocates
+   * ahead for len bits.
    */
-  __attribute__((target("default"))) 
-  static void Convolve(const BitArray &taps, const BitArray &bits, BitArray &result, bool flush = true, uint32_t *pInitialFill = NULL);
-  __attribute__((target("sse2"))) 
-  static void Convolve(const BitArray &taps, const BitArray &bits, BitArray &result, bool flush = true, uint32_t *pInitialFill = NULL);
-  __attribute__((target("avx2")))
-  static void Convolve(const BitArray &taps, const BitArray &bits, BitArray &result, bool flush = true, uint32_t *pInitialFill = NULL);
+  void Resize(size_t len);
+  void Reserve(size_t len);
 
-private:
-  size_t _size;               // Size in bits
-  std::vector<uint8_t> _data; // The underlying container holding the bits, TODO: make aligned and perhaps support a constructor that takes a pointer to data.
-};
+  /**
+   * Appends bits, or a single bit, to the end of the array.
+   */
+  void Append(const BitSpan &bits);
+  void Append(bool bit);
 
-// Private constructor
-ProxyBit::ProxyBit(uint8_t &byte, size_t pos) : _byte(byte), _pos(pos) {}
+  /**
+   * A new array of bits begin to begin + len - 1.
+   */
+  BitArray Slice(size_t begin, size_t len) const;
 
-ProxyBit::~ProxyBit() {}
+  /**
+   * A new array of the parts one after the other, e.g. a header and a payload of any bit lengths.
+   */
+  static BitArray Concat(const std::vector<BitSpan> &parts);
 
-ProxyBit::operator bool() const { return _byte & (1 << _pos); }
+  /**
+   * Copies src to bits pos to pos + src.size() - 1 of dest. They may overlap, like memmove.
+   */
+  static void Copy(const BitSpan &src, BitArray &dest, size_t pos = 0);
 
-void ProxyBit::operator=(bool b) const { _byte = b ? _byte | (1 << _pos) : _byte & ~(1 << _pos); }
+  /**
+   * Evaluates a BitExpr, e.g. BitArray c = a ^ (b & mask), in a single pass over the operands.
+   */
+  BitArray(const BitExpr &expr);
+  BitArray &operator=(const BitExpr &expr);
 
-ProxyBit &ProxyBit::operator=(const ProxyBit &other) {
-  *this = bool(other);
-  return *this;
-}
+  /**
+   * Whole array operators, the other side must be the same size. The shifts keep the size and
+   * fill with zeros, moving bit i to bit i + n for << and to bit i - n for >>, like std::bitset.
+   * The &, |, ^, ~, << and >> operators building a BitExpr are declared after it.
+   */
+  BitArray &operator&=(const BitExpr &expr);
+  BitArray &operator|=(const BitExpr &expr);
+  BitArray &operator^=(const BitExpr &expr);
+  BitArray &operator<<=(size_t n);
+  BitArray &operator>>=(size_t n);
 
-// Very lazy, extra 7 bytes of zeros so I do not have to do extra work at the tail end.
-BitArray::BitArray(size_t len) : _size(len), _data((_size - 1) / 8 + 1 + 7) {}
+  /**
+   * The len bits starting at a ProxyBit as an operand of a BitExpr, and writing a BitExpr to the
+   * expr.size() bits starting at a ProxyBit, so that like DotProd any bit offset can be used, e.g.
+   * BitArray::Assign(frame[13], BitArray::Range(frame[13], n) ^ scrambler).
+   */
+  static BitExpr Range(const ProxyBit &start, size_t len);
+  static void Assign(const ProxyBit &start, const BitExpr &expr);
 
-BitArray::BitArray() : _size(0), _data(0) {}
+  /**
+   * Performs a dot product on a range of two ProxyBits.
+   * Since the two ProxyBits could be offset they get aligned first
+   * A default, an SSE2, an AVX2 and an AVX-512 implementation exist, see Dispatch.
+   */
+  static uint64_t DotProd(const ProxyBit &pb_a, const ProxyBit &pb_b, size_t len);
 
-BitArray::BitArray(const std::string s) : _size(0) {
-  for (size_t i = 0; i < s.size(); ++i)
-    if (s[i] == '1' or s[i] == '0')
-      ++_size;
-  _data.resize((_size - 1) / 8 + 1 + 7);
-  size_t idx(0);
-  for (size_t i = 0; i < s.size(); ++i)
-    if (s[i] == '1' or s[i] == '0') {
-      if (s[i] == '1')
-        (*this)[idx] = 1;
-      ++idx;
-    }
-}
+  /**
+   * Same as above on two views of the same size, e.g. over memory not held by a BitArray.
+   */
+  static uint64_t DotProd(const BitSpan &a, const BitSpan &b);
 
-size_t BitArray::size() const { return _size; }
+  /**
+   * Same as above with the sum split over the threads of policy.
+   */
+  static uint64_t DotProd(const Parallel &policy, const BitSpan &a, const BitSpan &b);
 
-/**
- * Pass through to the vector _data both const and non-const versions
- */
-const uint8_t *BitArray::data() const { return _data.data(); }
+  /**
+   * Slides pattern over bits and counts the agreeing bits, pattern.size() minus the Hamming
+   * distance, at each of the bits.size() - pattern.size() + 1 offsets into agreements. Patterns of
+   * 1 to 65535 bits are supported.
+   */
+  static void Correlate(const BitArray &pattern, const BitSpan &bits, std::vector<uint16_t> &agreements);
 
-uint8_t *BitArray::data() { return _data.data(); }
+  /**
+   * The offsets, in increasing order, where pattern is within a Hamming distance of maxDistance of
+   * bits, e.g. for finding a sync word.
+   */
+  static std::vector<size_t> Search(const BitArray &pattern, const BitSpan &bits, size_t maxDistance);
 
-ProxyBit BitArray::operator[](size_t i) {
-  assert(i < _size);
-  return ProxyBit(_data[i / 8], (i & 7));
-}
+  /**
+   * The position of the first bit equal to value, of the first after pos, or of the last before
+   * pos, bits.size() when there is none. Words without one are skipped a vector at a time, so
+   * sparse bits cost about a word load per 64 bits. Going through the set bits reads
+   * for (size_t i = FindFirst(bits); i < bits.size(); i = FindNext(bits, i)).
+   */
+  static size_t FindFirst(const BitSpan &bits, bool value = true);
+  static size_t FindNext(const BitSpan &bits, size_t pos, bool value = true);
+  static size_t FindPrev(const BitSpan &bits, size_t pos, bool value = true);
 
-__attribute__((target("default"))) 
-uint64_t BitArray::DotProd(const ProxyBit &pb_a, const ProxyBit &pb_b, size_t len) {
-  uint64_t accum(0);
-  uint64_t first_seven_mask = 0x00FFFFFFFFFFFFFF;
+  /**
+   * Sets positions to the positions of the set bits, in increasing order. Runs of zero words are
+   * skipped and the others decoded a bit per TZCNT, or 16 per compress on AVX-512. Positions of
+   * 32 bits take arrays of up to 2^32 bits.
+   */
+  static void Positions(const BitSpan &bits, std::vector<uint32_t> &positions);
+  static void Positions(const BitSpan &bits, std::vector<uint64_t> &positions);
 
-  uint8_t *a_ptr = &pb_a._byte;
-  uint8_t *b_ptr = &pb_b._byte;
+  /**
+   * Performs a convolution operation on bits using taps and stores it into result. If flush is true
+   * zeros will be pushed into the taps at the end resulting in a total output size of taps.size() +
+   * bits.size() - 1. The memory of the registers can optionally be initialized with the initial fill
+   * and the final fill will be returned in initialFill.
+   *
+   * The fill holds the last taps.size() bits pushed into the register, the oldest bit in bit 0.
+   * Bits of the initial fill above taps.size() are ignored. Taps of any length are supported, a
+   * uint32_t fill can only be used with up to 32 taps.
+   */
+  static void Convolve(const BitArray &taps, const BitSpan &bits, BitArray &result, bool flush = true, uint32_t *pInitialFill = NULL);
 
-  for (size_t i = 0; len != 0; len -= (7 * 8), i += 7) {
-    uint64_t a_64t = (*(uint64_t *)&a_ptr[i]);
-    a_64t = (a_64t >> pb_a._pos);
+  /**
+   * Same as above with the fill held in the first taps.size() bits of a BitArray, for taps of any length.
+   */
+  static void Convolve(const BitArray &taps, const BitSpan &bits, BitArray &result, bool flush, BitArray &fill);
 
-    uint64_t b_64t = (*(uint64_t *)&b_ptr[i]);
-    b_64t = (b_64t >> pb_b._pos);
+  /**
+   * The two above with the result split over the threads of policy, each segment starting from the
+   * input preceding it as its register. The result is identical to the serial one.
+   */
+  static void Convolve(const Parallel &policy, const BitArray &taps, const BitSpan &bits, BitArray &result, bool flush = true, uint32_t *pInitialFill = NULL);
+  static void Convolve(const Parallel &policy, const BitArray &taps, const BitSpan &bits, BitArray &result, bool flush, BitArray &fill);
 
-    if (len < 7 * 8) {
-      a_64t = (a_64t << (64 - len));
-      b_64t = (b_64t << (64 - len));
-      accum += countBits(a_64t & b_64t);
-      break;
-    }
+  /**
+   * Same as the first with up to 64 taps fixed at compile time, given in the same order as the
+   * taps of the others, e.g. Convolve<1, 0, 1, 1, 0, 1, 1>(bits, result) for BitArray("1011011").
+   * Every shift and mask is then a constant, so sparse taps like the usual K=7 generators cost a
+   * few instructions per word and several words go through each vector. Dense taps can be faster
+   * as a BitArray on CPUs with VPCLMULQDQ, which multiplies whatever the number of set taps.
+   */
+  template <int... Taps> static void Convolve(const BitSpan &bits, BitArray &result, bool flush = true, uint32_t *pInitialFill = NULL);
 
-    accum += countBits(first_seven_mask & a_64t & b_64t);
-  }
+  /**
+   * Encodes bits with a rate 1/n convolutional code reading the input only once. Each of the n taps
+   * is a generator, they must all be the same size, and results receives one stream per generator
+   * exactly as Convolve would produce it. The optional fill is shared by all of the generators and
+   * works like the BitArray fill of Convolve.
+   */
+  static void Encode(const std::vector<BitArray> &taps, const BitSpan &bits, std::vector<BitArray> &results, bool flush = true, BitArray *pFill = NULL);
 
-  return accum;
-}
+  /**
+   * Same as above with the n streams interleaved into result, bit i of stream j going to bit
+   * i * n + j. When puncture is not empty it holds one row per generator, all of the same period,
+   * and bit i of stream j is only kept when puncture[j][i % period] is set, e.g. rows "11" and "10"
+   * for rate 2/3 or "110" and "101" for rate 3/4. The pattern starts over at every call. Returns the
+   * number of bits written, see EncodedSize.
+   */
+  static size_t Encode(const std::vector<BitArray> &taps, const BitSpan &bits, BitArray &result, bool flush = true, BitArray *pFill = NULL,
+                       const std::vector<BitArray> &puncture = std::vector<BitArray>());
 
-__attribute__((target("sse2"))) 
-uint64_t BitArray::DotProd(const ProxyBit &pb_a, const ProxyBit &pb_b, size_t len) {
-  uint64_t accum(0);
-  uint64_t tmp[2];
+  /**
+   * The number of bits the interleaved Encode writes for len input bits.
+   */
+  static size_t EncodedSize(const std::vector<BitArray> &taps, size_t len, bool flush = true, const std::vector<BitArray> &puncture = std::vector<BitArray>());
 
-  // Even with SIMD we still deal with 64-bit integers at a time (for now).
-  // We load all we can (2 for SSE2, 4 for AVX etc.) of the first BitArray
-  // into the register then bit shift left to align it with the proxy bit in
-  // question, do the same with the second BitArray do our and operator; shift
-  // right 8 to get rid of the last byte (this is b/c the left shift may have
-  // brought 0-7 zero bits in which are not valid), then finally popcount both
-  char *p_packedBits_A = (char *)&pb_a._byte;
-  char *p_packedBits_B = (char *)&pb_b._byte;
+  /**
+   * Viterbi decodes the interleaved, unpunctured, output of Encode with the same taps and flush.
+   * With flush the last taps.size() - 1 decoded bits are the flushed zeros, they are dropped and
+   * the path is traced back from the zero state, otherwise from the best state. A tracebackLength of
+   * zero traces back once over the whole input, otherwise bits are decided tracebackLength at a time
+   * after tracing back 2 * tracebackLength steps, about 5 * taps.size() is usual. Up to 4 generators
+   * with taps of 2 to 16 bits are supported.
+   */
+  static void Decode(const std::vector<BitArray> &taps, const BitSpan &bits, BitArray &result, bool flush = true, size_t tracebackLength = 0);
 
-  // We move forward by 112 bytes each time b/c it's 2 sets of 7 bytes.
-  size_t i(0);
-  for (; len > 112; len -= 112, i += 14) {
-    // We deal with 8 bytes at a time but we drop the last byte, so we need
-    // the SSE2 register to have first 8 bytes, Plus 1 byte of overlap.
-    tmp[1] = *(uint64_t *)&p_packedBits_A[i];
-    tmp[0] = *(uint64_t *)&p_packedBits_A[i + 7];
-    // Things look good here.
-    __m128i a_bitVec = _mm_loadu_si128((__m128i const *)&tmp);
+  /**
+   * Same as above with soft symbols, positive for a 1 and negative for a 0 with the magnitude as the
+   * confidence. Zero is an erasure, e.g. for punctured bits.
+   */
+  static void Decode(const std::vector<BitArray> &taps, const int8_t *symbols, size_t numSymbols, BitArray &result, bool flush = true,
+                     size_t tracebackLength = 0);
 
-    // Shift both right so it is aligned to zero position
-    a_bitVec = _mm_srli_epi64(a_bitVec, pb_a._pos);
+  /**
+   * The number of bits Decode writes for numSymbols encoded bits or symbols.
+   */
+  static size_t DecodedSize(const std::vector<BitArray> &taps, size_t numSymbols, bool flush = true);
 
-    // Load the next
-    tmp[1] = *(uint64_t *)&p_packedBits_B[i];
-    tmp[0] = *(uint64_t *)&p_packedBits_B[i + 7];
-    __m128i b_bitVec = _mm_loadu_si128((__m128i const *)&tmp);
+  /**
+   * Packs n bytes, bools, soft symbols or characters into bits pos to pos + n - 1 of dest, one bit
+   * per element: set for a nonzero byte, a true bool, a positive symbol or a '1' character. Other
+   * characters read as 0, unlike the string constructor which skips them.
+   */
+  static void PackBytes(const uint8_t *bytes, size_t n, BitArray &dest, size_t pos = 0);
+  static void PackBools(const bool *bools, size_t n, BitArray &dest, size_t pos = 0);
+  static void PackSymbols(const int8_t *symbols, size_t n, BitArray &dest, size_t pos = 0);
+  static void PackText(const char *text, size_t n, BitArray &dest, size_t pos = 0);
 
-    // Shift so it is also aligned
-    b_bitVec = _mm_srli_epi64(b_bitVec, pb_b._pos);
+  /**
+   * Unpacks bits into bits.size() bytes of 0 or 1, bools, or symbols of magnitude for a 1 and
+   * -magnitude for a 0 as Decode takes them.
+   */
+  static void UnpackBytes(const BitSpan &bits, uint8_t *bytes);
+  static void UnpackBools(const BitSpan &bits, bool *bools);
+  static void UnpackSymbols(const BitSpan &bits, int8_t *symbols, int8_t magnitude = 127);
 
-    // bit wise and them
-    a_bitVec = _mm_and_si128(a_bitVec, b_bitVec);
+  /**
+   * Transposes bits, a rows x cols bit matrix stored row after row, into the cols x rows matrix
+   * starting at bit pos of result, so that bit r * cols + c goes to bit c * rows + r. Works on
+   * 64 x 64 tiles transposed in registers.
+   */
+  static void Transpose(const BitSpan &bits, size_t rows, size_t cols, BitArray &result, size_t pos = 0);
 
-    // Pull out the bits for all but the last byte.
-    a_bitVec = _mm_slli_epi64(a_bitVec, 8);
-    _mm_storeu_si128((__m128i *)&tmp, a_bitVec);
-    // _mm_maskmoveu_si128 (a_bitVec, mask, (char*)&tmp); // TODO: I cant get
-    // this to work, is it faster than shifts and store?
-    accum += countBits(tmp[1]) + countBits(tmp[0]);
-  }
+private:
+  /**
+   * Returns the w-th 64-bit word of the array, bits at or beyond size() read as zero.
+   */
+  uint64_t loadWord(size_t w) const;
 
-  uint64_t first_seven_mask = 0x00FFFFFFFFFFFFFF;
+  /**
+   * Writes the w-th 64-bit word of the array, bits at or beyond end are left untouched.
+   */
+  void storeWord(size_t w, uint64_t value, size_t end);
 
-  uint8_t *a_ptr = &pb_a._byte;
-  uint8_t *b_ptr = &pb_b._byte;
+  /**
+   * The DotProd implementations. The default and SSE2 ones popcount 7 bytes of every word, the
+   * AVX2 one with a Harley-Seal carry-save adder and the AVX-512 one using VPOPCNTDQ read whole
+   * 64-bit words funnel shifted by the bit positions, which must be below 8.
+   */
+  static uint64_t DotProdDefault(const uint8_t *a, unsigned posA, const uint8_t *b, unsigned posB, size_t len);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("sse2"))) 
+  static uint64_t DotProdSse2(const uint8_t *a, unsigned posA, const uint8_t *b, unsigned posB, size_t len);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("avx2"))) 
+  static uint64_t DotProdHarleySeal(const uint8_t *a, unsigned posA, const uint8_t *b, unsigned posB, size_t len);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f,avx512vpopcntdq"))) 
+  static uint64_t DotProdVpopcnt(const uint8_t *a, unsigned posA, const uint8_t *b, unsigned posB, size_t len);
+#endif
 
-  // Now we just have to take care of the last, potentially 112 bits.
-  // This is just like how we do the non-SSE case.
-  for (; len != 0; len -= (7 * 8), i += 7) {
-    uint64_t a_64t = (*(uint64_t *)&a_ptr[i]);
-    a_64t = (a_64t >> pb_a._pos);
+  /**
+   * Hamming distances of the pattern, patternWords words with the bits past its end cleared in
+   * mask, against the bits starting at each of the 64 * numWords offsets of words, which holds
+   * numWords + patternWords words. Each pattern word is compared against a broadcast input word
+   * funnel shifted by a different amount in every lane, so one instruction handles 4 or 8 offsets.
+   * The AVX2 version popcounts with a nibble lookup, the AVX-512 one with VPOPCNTDQ.
+   */
+  static void CorrelateBlock(const uint64_t *pattern, const uint64_t *mask, size_t patternWords, const uint64_t *words, size_t numWords, uint16_t *distances);
+  static void CorrelateBlockDefault(const uint64_t *pattern, const uint64_t *mask, size_t patternWords, const uint64_t *words, size_t numWords, uint16_t *distances);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("avx2"))) 
+  static void CorrelateNibbles(const uint64_t *pattern, const uint64_t *mask, size_t patternWords, const uint64_t *words, size_t numWords, uint16_t *distances);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f,avx512vpopcntdq"))) 
+  static void CorrelateVpopcnt(const uint64_t *pattern, const uint64_t *mask, size_t patternWords, const uint64_t *words, size_t numWords, uint16_t *distances);
+#endif
 
-    uint64_t b_64t = (*(uint64_t *)&b_ptr[i]);
-    b_64t = (b_64t >> pb_b._pos);
+  static void CorrelateRun(const BitArray &pattern, const BitSpan &bits, uint16_t *agreements, size_t maxDistance, std::vector<size_t> *pMatches);
 
-    if (len < 7 * 8) {
-      a_64t = (a_64t << (64 - len));
-      b_64t = (b_64t << (64 - len));
-      accum += countBits(a_64t & b_64t);
-      break;
-    }
+  /**
+   * Scanning for set bits reads the bytes at base as words, the 7 bytes after a span being readable.
+   * FindWord returns the first of words [begin, end) that is not flip, end when they all are, and
+   * FindLastWord one past the last such word, begin when they all are.
+   */
+  static size_t FindWord(const uint8_t *base, size_t begin, size_t end, uint64_t flip);
+  static size_t FindLastWord(const uint8_t *base, size_t begin, size_t end, uint64_t flip);
+  static size_t FindWordDefault(const uint8_t *base, size_t begin, size_t end, uint64_t flip);
+  static size_t FindLastWordDefault(const uint8_t *base, size_t begin, size_t end, uint64_t flip);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("sse2"))) 
+  static size_t FindWordSse2(const uint8_t *base, size_t begin, size_t end, uint64_t flip);
+  __attribute__((target("sse2"))) 
+  static size_t FindLastWordSse2(const uint8_t *base, size_t begin, size_t end, uint64_t flip);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("avx2"))) 
+  static size_t FindWordAvx2(const uint8_t *base, size_t begin, size_t end, uint64_t flip);
+  __attribute__((target("avx2"))) 
+  static size_t FindLastWordAvx2(const uint8_t *base, size_t begin, size_t end, uint64_t flip);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f"))) 
+  static size_t FindWordAvx512(const uint8_t *base, size_t begin, size_t end, uint64_t flip);
+  __attribute__((target("avx512f"))) 
+  static size_t FindLastWordAvx512(const uint8_t *base, size_t begin, size_t end, uint64_t flip);
+#endif
 
-    accum += countBits(first_seven_mask & a_64t & b_64t);
-  }
-  return accum;
-}
+  /**
+   * The first bit equal to value at or after from, or the last before before, as FindNext and
+   * FindPrev return them.
+   */
+  static size_t FindFrom(const BitSpan &bits, size_t from, bool value);
+  static size_t FindBefore(const BitSpan &bits, size_t before, bool value);
 
-/**
- * Performs a convolution operation on bits using taps and stores it into result. If flush is true
- * zeros will be pushed into the taps at the end resulting in a total output size of taps.size() +
- * bits.size() - 1. The memory of the registers can optionally be initialized with the initial fill
- * and the final fill will be returned in initialFill.
- */
-__attribute__((target("default"))) 
-void BitArray::Convolve(const BitArray &taps, const BitArray &bits, BitArray &result, bool flush, uint32_t *pInitialFill) {
-  size_t resultSize = flush ? (taps.size() + bits.size() - 1) : (bits.size());
-  uint32_t initialFill = pInitialFill ? *pInitialFill : 0;
+  /**
+   * Writes the positions of the set bits of words [begin, end) of base, from bit 64 * begin, to
+   * out and returns how many. out has room for 16 more than 64 per word.
+   */
+  static size_t DecodeWords(const uint8_t *base, size_t begin, size_t end, uint32_t *out);
+  static size_t DecodeWordsDefault(const uint8_t *base, size_t begin, size_t end, uint32_t *out);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("bmi,popcnt"))) 
+  static size_t DecodeWordsBmi(const uint8_t *base, size_t begin, size_t end, uint32_t *out);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f,popcnt"))) 
+  static size_t DecodeWordsCompress(const uint8_t *base, size_t begin, size_t end, uint32_t *out);
+#endif
 
-  if (result.size() < (resultSize))
-    throw std::runtime_error("Results of the convolution must be at least large enough to hold the result");
+  template <class T> static void PositionsOf(const BitSpan &bits, std::vector<T> &positions);
 
-  if (taps.size() > 32) // TODO: Remove this restriction in the future.
-    throw std::runtime_error("Taps greater than 32 bits are currently not supported.");
+  /**
+   * A BitExpr is evaluated a block of words at a time: each operand is loaded into a buffer,
+   * shifted into line with the result by BitExprLoad, the buffers are combined by BitExprApply and
+   * the result is shifted into line with the destination by BitExprShift. BitExprShift writes
+   * out[i] = (v[i] << shift) | (v[i - 1] >> (64 - shift)) with carry as v[-1], shift must not be
+   * zero. A default version and SSE2, AVX2 and AVX-512 versions.
+   */
+  static void BitExprLoad(const uint64_t *words, unsigned shift, uint64_t *out, size_t numWords);
+  static void BitExprLoadDefault(const uint64_t *words, unsigned shift, uint64_t *out, size_t numWords);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("sse2"))) 
+  static void BitExprLoadSse2(const uint64_t *words, unsigned shift, uint64_t *out, size_t numWords);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("avx2"))) 
+  static void BitExprLoadAvx2(const uint64_t *words, unsigned shift, uint64_t *out, size_t numWords);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f"))) 
+  static void BitExprLoadAvx512(const uint64_t *words, unsigned shift, uint64_t *out, size_t numWords);
+#endif
 
-  uint64_t tapsReg = *(uint64_t *)taps.data();  // Never changes or are shifted, these are the taps.
-  uint32_t *p_bits32 = (uint32_t *)bits.data(); // Points to the next 32-bit chunk to copy into the bitsReg
-  uint64_t bitsReg = (uint64_t(p_bits32[0]) << (taps.size())) |
-                     initialFill; // Holds the current 64-bits from the input bits, is shifted down until there is room to hold more.
-  ++p_bits32;
+  static void BitExprApply(int op, uint64_t *a, const uint64_t *b, size_t numWords);
+  static void BitExprApplyDefault(int op, uint64_t *a, const uint64_t *b, size_t numWords);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("sse2"))) 
+  static void BitExprApplySse2(int op, uint64_t *a, const uint64_t *b, size_t numWords);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("avx2"))) 
+  static void BitExprApplyAvx2(int op, uint64_t *a, const uint64_t *b, size_t numWords);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f"))) 
+  static void BitExprApplyAvx512(int op, uint64_t *a, const uint64_t *b, size_t numWords);
+#endif
 
-  size_t ii(0);
-  while (ii < (bits.size() - 31)) {   // Work through all the bits until we cannot load anymore 32-bit chunks into the register.
-    for (size_t i = 0; i < 32; ++i) { // Shift the bits over, do the AND, then load more!
-      bitsReg >>= 1;
-      result[ii++] = countBits(tapsReg & bitsReg) & 0x01; // mod 2
-    }
-    bitsReg |= (uint64_t(*(p_bits32++)) << taps.size());
+  static void BitExprShift(const uint64_t *v, uint64_t carry, unsigned shift, uint64_t *out, size_t numWords);
+  static void BitExprShiftDefault(const uint64_t *v, uint64_t carry, unsigned shift, uint64_t *out, size_t numWords);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("sse2"))) 
+  static void BitExprShiftSse2(const uint64_t *v, uint64_t carry, unsigned shift, uint64_t *out, size_t numWords);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("avx2"))) 
+  static void BitExprShiftAvx2(const uint64_t *v, uint64_t carry, unsigned shift, uint64_t *out, size_t numWords);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f"))) 
+  static void BitExprShiftAvx512(const uint64_t *v, uint64_t carry, unsigned shift, uint64_t *out, size_t numWords);
+#endif
+
+  static void BitExprEval(const BitExpr &expr, uint8_t *base, size_t begin);
+
+  /**
+   * PackBlock sets bit i of word w when byte 64 * w + i of src is of the kind: nonzero, positive as
+   * an int8_t, a '1', or a '0' or '1'. UnpackBlock writes the byte one for every set bit and zero for
+   * every clear one. A default version and SSE2, AVX2 and AVX-512 versions, which compare and
+   * movemask 16 or 32 bytes at a time, or blend whole words with byte masks.
+   */
+  enum PackKind { PACK_NONZERO, PACK_POSITIVE, PACK_ONE, PACK_DIGIT };
+
+  static void PackBlock(const uint8_t *src, size_t numWords, int kind, uint64_t *words);
+  static void PackBlockDefault(const uint8_t *src, size_t numWords, int kind, uint64_t *words);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("sse2"))) 
+  static void PackBlockSse2(const uint8_t *src, size_t numWords, int kind, uint64_t *words);
+#endif
+
+  static void UnpackBlock(const uint64_t *words, size_t numWords, uint8_t zero, uint8_t one, uint8_t *out);
+  static void UnpackBlockDefault(const uint64_t *words, size_t numWords, uint8_t zero, uint8_t one, uint8_t *out);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("sse2"))) 
+  static void UnpackBlockSse2(const uint64_t *words, size_t numWords, uint8_t zero, uint8_t one, uint8_t *out);
+#endif
+
+  /**
+   * The AVX2 and AVX-512 versions, the latter needing AVX512BW.
+   */
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("avx2"))) 
+  static void PackMovemask(const uint8_t *src, size_t numWords, int kind, uint64_t *words);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f,avx512bw"))) 
+  static void PackMasks(const uint8_t *src, size_t numWords, int kind, uint64_t *words);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("avx2"))) 
+  static void UnpackShuffle(const uint64_t *words, size_t numWords, uint8_t zero, uint8_t one, uint8_t *out);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f,avx512bw"))) 
+  static void UnpackMasks(const uint64_t *words, size_t numWords, uint8_t zero, uint8_t one, uint8_t *out);
+#endif
+
+  /**
+   * Every kind but PACK_POSITIVE matches a byte x when (x | orBits) == equal, inverted for PACK_NONZERO.
+   */
+  static void PackMatch(int kind, uint8_t &orBits, uint8_t &equal, bool &invert);
+  static void PackRun(const uint8_t *src, size_t n, int kind, BitArray &dest, size_t pos);
+  static void UnpackRun(const BitSpan &bits, uint8_t zero, uint8_t one, uint8_t *out);
+
+  /**
+   * Copies len bits starting at bit srcPos of src to bit dstPos of dst, like memmove. Each
+   * destination word is read from the source through a BitExprLoad funnel shift, so the bits are
+   * shifted only once whatever the two offsets are.
+   */
+  static void CopyBits(const uint8_t *src, size_t srcPos, uint8_t *dst, size_t dstPos, size_t len);
+
+  /**
+   * Transposes the 64 x 64 bit matrix of 64 words in place, bit c of word r going to bit r of word
+   * c, in six stages swapping ever smaller blocks. The SSE2 and AVX2 versions run each stage on 2
+   * and 4 words at a time, the AVX-512 one runs the first three on 8 words at a time and the last
+   * three within words, after a VBMI byte permute has gathered each 8 x 8 block into a word.
+   */
+  static void Transpose64(uint64_t *m);
+  static void Transpose64Default(uint64_t *m);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("sse2"))) 
+  static void Transpose64Sse2(uint64_t *m);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("avx2"))) 
+  static void Transpose64Avx2(uint64_t *m);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f,avx512vbmi"))) 
+  static void Transpose64Vbmi(uint64_t *m);
+#endif
+
+  /**
+   * Writes numBits bits of words to out starting at bit pos, leaving the bits around them untouched.
+   */
+  static void DepositWords(const uint64_t *words, size_t numBits, uint64_t *out, size_t pos);
+
+  /**
+   * Runs task(0) to task(numTasks - 1) on numTasks threads, the last on the calling thread.
+   */
+  static void ParallelFor(size_t numTasks, const std::function<void(size_t)> &task);
+
+  /**
+   * The convolution is computed as a GF(2) polynomial multiplication producing 64 output bits at a
+   * time, with a default bit-sliced version, a PCLMULQDQ carry-less multiply version and an AVX-512
+   * VPCLMULQDQ version doing 8 output words at a time. Arguments are checked by the callers.
+   *
+   * The taps are held as the reversed polynomial split into 64-bit words and the register as the
+   * same number of words of input preceding bit 0 of bits, so longer taps cost one more multiply
+   * per output word for each extra word of taps. ConvolveBlock produces numWords output words from
+   * x, reading back to x[1 - polyWords], carry holds the high half of the previous product.
+   */
+  static void ConvolveBlock(const uint64_t *poly, size_t polyWords, const uint64_t *x, uint64_t *y, size_t numWords, uint64_t &carry);
+  static void ConvolveBlockDefault(const uint64_t *poly, size_t polyWords, const uint64_t *x, uint64_t *y, size_t numWords, uint64_t &carry);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("pclmul"))) 
+  static void ConvolveBlockPclmul(const uint64_t *poly, size_t polyWords, const uint64_t *x, uint64_t *y, size_t numWords, uint64_t &carry);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f,vpclmulqdq"))) 
+  static void ConvolveBlockVpclmul(const uint64_t *poly, size_t polyWords, const uint64_t *x, uint64_t *y, size_t numWords, uint64_t &carry);
+#endif
+
+  /**
+   * Helpers shared by Convolve and Encode.
+   */
+  static void ConvolveWords(const std::vector<uint64_t> &poly, const std::vector<uint64_t> &reg, const BitSpan &bits, uint64_t *out, size_t resultSize);
+  static void ConvolveThreads(const Parallel &policy, const std::vector<uint64_t> &poly, const std::vector<uint64_t> &reg, const BitSpan &bits, uint64_t *out,
+                              size_t resultSize);
+  static void ConvolveAdvance(std::vector<uint64_t> &reg, const BitSpan &bits, size_t resultSize);
+  static std::vector<uint64_t> ConvolvePoly(const BitArray &taps);
+  static std::vector<uint64_t> ConvolveFillToRegister(const BitArray &fill, size_t numTaps);
+  static void ConvolveRegisterToFill(const std::vector<uint64_t> &reg, BitArray &fill, size_t numTaps);
+  static uint64_t ConvolveStreamWord(const std::vector<uint64_t> &reg, const BitSpan &bits, ptrdiff_t w);
+  static void ConvolveSoftProduct(const std::vector<uint64_t> &poly, const std::vector<uint64_t> &reg, const BitSpan &bits, ptrdiff_t w, uint64_t &lo, uint64_t &hi);
+
+  /**
+   * Convolve with the taps as template arguments. ConvolveTaps holds them as the reversed
+   * polynomial like ConvolvePoly and ConvolveTerms is its product with a word, the XOR over the set
+   * bits s of x[w] << s and x[w - 1] >> (64 - s) with the shifts as immediates. Without the carry
+   * of ConvolveBlock no output word depends on another, so ConvolveFixedBlock writes numWords words
+   * from x, reading x[-1], 2, 4 or 8 at a time in the SSE2, AVX2 and AVX-512 versions, picked by
+   * the tier selected for "fixedconvolve".
+   */
+  template <int... Taps> struct ConvolveTaps;
+  template <uint64_t Poly> struct ConvolveTerms;
+  template <uint64_t Poly> static void ConvolveFixedWords(uint64_t reg, const BitSpan &bits, uint64_t *out, size_t resultSize);
+  template <uint64_t Poly> static void ConvolveFixedBlock(const uint64_t *x, uint64_t *y, size_t numWords);
+  template <uint64_t Poly> static void ConvolveFixedBlockDefault(const uint64_t *x, uint64_t *y, size_t numWords);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  template <uint64_t Poly> __attribute__((target("sse2"))) static void ConvolveFixedBlockSse2(const uint64_t *x, uint64_t *y, size_t numWords);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  template <uint64_t Poly> __attribute__((target("avx2"))) static void ConvolveFixedBlockAvx2(const uint64_t *x, uint64_t *y, size_t numWords);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  template <uint64_t Poly> __attribute__((target("avx512f"))) static void ConvolveFixedBlockAvx512(const uint64_t *x, uint64_t *y, size_t numWords);
+#endif
+
+  /**
+   * Where the bits of each stream land when n streams are interleaved, 64 bits of each stream
+   * making n interleaved words, and which interleaved bits survive puncturing.
+   */
+  struct EncodeMasks {
+    size_t streams;                // The number of streams, n
+    size_t limit;                  // The number of interleaved bits
+    std::vector<uint64_t> deposit; // Bits of interleaved word k taken from stream j are at deposit[k * n + j]
+    std::vector<size_t> shift;     // and start at bit shift[k * n + j] of the stream word.
+    std::vector<uint64_t> keep;    // Kept bits of the interleaved words, repeating, empty when not punctured.
+    std::vector<size_t> keepCount; // The number of bits set in each keep word.
+  };
+
+  /**
+   * The position of an interleaved Encode, carried from block to block.
+   */
+  struct EncodeState {
+    size_t word;      // The next interleaved word
+    size_t phase;     // Index of its keep mask
+    size_t outWord;   // The next result word to write
+    uint64_t acc;     // Output bits not yet written
+    size_t accBits;   // and how many there are.
+  };
+
+  /**
+   * Interleaves and punctures numWords words of each stream, stream j starting at y[j * stride],
+   * appending to result. A default version and a BMI2 version using PDEP/PEXT.
+   */
+  static void EncodeInterleave(const uint64_t *y, size_t stride, size_t numWords, const EncodeMasks &masks, EncodeState &state, BitArray &result);
+  static void EncodeInterleaveDefault(const uint64_t *y, size_t stride, size_t numWords, const EncodeMasks &masks, EncodeState &state, BitArray &result);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("bmi2"))) 
+  static void EncodeInterleaveBmi2(const uint64_t *y, size_t stride, size_t numWords, const EncodeMasks &masks, EncodeState &state, BitArray &result);
+#endif
+
+  static void EncodeCheck(const std::vector<BitArray> &taps, const std::vector<BitArray> &puncture);
+  static EncodeMasks EncodeBuildMasks(size_t streams, const std::vector<BitArray> &puncture, size_t limit);
+  static void EncodeRun(const std::vector<BitArray> &taps, const BitSpan &bits, size_t resultSize, BitArray *pFill, std::vector<BitArray> *pResults,
+                        BitArray *pResult, const EncodeMasks *pMasks);
+
+  /**
+   * The trellis of a rate 1/n code. State s holds the previous taps.size() - 1 input bits, the oldest
+   * in bit 0, and input u moves it to (s >> 1) | (u << (taps.size() - 2)), so new states t and
+   * t + states / 2 both come from old states 2t and 2t + 1.
+   */
+  struct ViterbiTrellis {
+    size_t streams;              // The number of generators, n
+    size_t numTaps;              // The constraint length
+    size_t states;               // 2^(numTaps - 1)
+    std::vector<uint8_t> codes;  // The encoded bits for the register s | (u << (numTaps - 1))
+    std::vector<int16_t> masks;  // -1 where generator j outputs a 1 going from old state 2t + p with input u, at ((p * 2 + u) * n + j) * states / 2 + t
+    bool butterfly;              // Every generator has its first and last taps set, so flipping p or u flips every encoded bit
+  };
+
+  /**
+   * Runs the add-compare-select over numSteps steps of n symbols, leaving one bit per new state in
+   * decisions, set when the odd old state was picked, and the path metrics in metrics. The metrics
+   * are renormalized every 8 steps counted by step. A default version, and SSE2 and AVX2 versions
+   * working on 8 and 16 states at a time.
+   */
+  static void ViterbiSteps(const ViterbiTrellis &trellis, const int8_t *symbols, size_t numSteps, std::vector<int16_t> &metrics, uint64_t *decisions, size_t &step);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("sse2"))) 
+  static void ViterbiStepsSse2(const ViterbiTrellis &trellis, const int8_t *symbols, size_t numSteps, std::vector<int16_t> &metrics, uint64_t *decisions, size_t &step);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("avx2"))) 
+  static void ViterbiStepsAvx2(const ViterbiTrellis &trellis, const int8_t *symbols, size_t numSteps, std::vector<int16_t> &metrics, uint64_t *decisions, size_t &step);
+#endif
+
+  static void ViterbiStepsScalar(const ViterbiTrellis &trellis, const int8_t *symbols, size_t numSteps, std::vector<int16_t> &metrics, uint64_t *decisions,
+                                 size_t &step);
+  static ViterbiTrellis ViterbiBuildTrellis(const std::vector<BitArray> &taps);
+  static size_t ViterbiTraceback(const ViterbiTrellis &trellis, const std::vector<uint64_t> &decisions, size_t ringRows, size_t end, size_t begin, size_t state,
+                                 BitArray &result);
+
+  size_t _size;                                           // Size in bits
+  std::vector<uint8_t, CacheLineAllocator<uint8_t> > _data; // The underlying container holding the bits
+};
+
+/**
+ * A read only view of len bits starting at any bit of memory the caller owns, e.g. a received
+ * frame in a DMA buffer, which can be passed to DotProd, Correlate, Search, Convolve, Encode and
+ * Decode, or used in a BitExpr, without copying it into a BitArray. Like the padding of a
+ * BitArray the kernels may read, but never use, up to 7 bytes past the last byte of the view, so
+ * that memory must be readable. A BitArray converts to a view of all of its bits.
+ */
+class BitSpan {
+  friend class BitArray;
+  friend class BitExpr;
+  friend class BitMatrix;
+  friend class BitRecord;
+  friend class Convolver;
+  friend class Crc;
+  friend class Interleaver;
+  friend class Lfsr;
+  friend class MappedBitArray;
+  friend class SparseBitMatrix;
+
+public:
+  /**
+   * The len bits starting at bit offset of data, bit i being bit i % 8 of byte i / 8.
+   */
+  BitSpan(const void *data, size_t offset, size_t len);
+
+  /**
+   * All of the bits of an array.
+   */
+  BitSpan(const BitArray &bits);
+
+  /**
+   * The len bits starting at a ProxyBit.
+   */
+  BitSpan(const ProxyBit &start, size_t len);
+
+  /**
+   * Returns the size, in bits, of the view.
+   */
+  size_t size() const;
+
+  /**
+   * The byte holding the first bit and the position, below 8, of the first bit within it.
+   */
+  const uint8_t *data() const;
+  size_t offset() const;
+
+  /**
+   * Reads a bit of the view.
+   */
+  bool operator[](size_t i) const;
+
+private:
+  /**
+   * Returns the w-th 64-bit word of the view, bits at or beyond size() read as zero.
+   */
+  uint64_t loadWord(size_t w) const;
+
+  /**
+   * The words of the view when it starts on a byte so they can be read in place, otherwise NULL.
+   */
+  const uint64_t *words() const;
+
+  const uint8_t *_base; // The byte holding the first bit
+  size_t _offset;       // Position of the first bit within it
+  size_t _size;         // Size in bits
+};
+
+/**
+ * An array of N bits, N fixed at compile time, held inline rather than on the heap, for taps, sync
+ * words and other small arrays that are made often or kept in large numbers. The storage is whole
+ * 64-bit words including the 7 bytes of padding the kernels may read, which stay zero. It converts
+ * to a BitSpan to be passed wherever an input BitArray can.
+ */
+template <size_t N> class FixedBitArray {
+public:
+  /**
+   * All zeros, or the bits of a string of '0' and '1' like BitArray, which must hold N of them.
+   */
+  FixedBitArray();
+  explicit FixedBitArray(const std::string &s);
+
+  /**
+   * Returns the size, in bits, of the array.
+   */
+  static constexpr size_t size();
+
+  /**
+   * The bytes of the array, 8-byte aligned.
+   */
+  const uint8_t *data() const;
+  uint8_t *data();
+
+  /**
+   * Reads or writes a bit of the array.
+   */
+  ProxyBit operator[](size_t i);
+  bool operator[](size_t i) const;
+
+  /**
+   * A view of all of the bits.
+   */
+  operator BitSpan() const;
+
+private:
+  uint64_t _words[((N + 7) / 8 + 7 + 7) / 8];
+};
+
+/**
+ * An expression of BitArrays built by the &, |, ^, ~, << and >> operators which is only evaluated
+ * when it is assigned to a BitArray or a range of one. The evaluation is fused, every operand is
+ * read once and the result written once a block at a time without temporary arrays, except that a
+ * shifted subexpression such as (a ^ b) << 3 is evaluated when it is shifted. Operands are
+ * referenced and not copied so they must outlive the expression. Binary operands must be the
+ * same size.
+ */
+class BitExpr {
+  friend class BitArray;
+  friend class BitMatrix;
+  friend BitExpr operator&(const BitExpr &a, const BitExpr &b);
+  friend BitExpr operator|(const BitExpr &a, const BitExpr &b);
+  friend BitExpr operator^(const BitExpr &a, const BitExpr &b);
+  friend BitExpr operator~(const BitExpr &a);
+  friend BitExpr operator<<(const BitExpr &a, size_t n);
+  friend BitExpr operator>>(const BitExpr &a, size_t n);
+
+public:
+  /**
+   * A whole array as an operand.
+   */
+  BitExpr(const BitArray &bits);
+
+  /**
+   * A view as an operand.
+   */
+  BitExpr(const BitSpan &bits);
+
+  /**
+   * Returns the size, in bits, of the result.
+   */
+  size_t size() const;
+
+private:
+  enum Op { LEAF, AND, OR, XOR, NOT };
+
+  struct Node {
+    Op op;
+    const uint8_t *base; // Leaves read bit start + i of base as bit i,
+    ptrdiff_t start;     // bits outside of [begin, end) read as zero.
+    ptrdiff_t begin;
+    ptrdiff_t end;
+  };
+
+  BitExpr(const uint8_t *base, size_t begin, size_t len);
+  static BitExpr Combine(Op op, const BitExpr &a, const BitExpr &b);
+  BitExpr Shift(size_t n, bool left) const;
+
+  size_t _size;                                   // Size in bits
+  std::vector<Node> _nodes;                       // The expression in postfix order
+  std::vector<std::shared_ptr<BitArray> > _owned; // Shifted subexpressions, already evaluated
+};
+
+/**
+ * A rank/select index over a BitArray taking about 3.2% more space. Each 2048 bit block has one
+ * 64-bit entry, the low 32 bits hold the number of set bits before the block within its 65536 bit
+ * superblock and the next 30 bits the counts of its first three 512 bit sub-blocks, so Rank reads
+ * a superblock count, one entry and at most 8 words of the array. Select binary searches the
+ * superblocks and then the 32 blocks of one superblock before counting words.
+ *
+ * The index refers to the array, which must outlive it. When bits change Update recounts the
+ * superblocks holding them, and when the array is resized Rebuild recounts everything.
+ */
+class RankSelect {
+public:
+  RankSelect(const BitArray &bits);
+
+  /**
+   * The number of set bits before bit i, i can be up to bits.size().
+   */
+  __attribute__((target("default"))) 
+  size_t Rank(size_t i) const;
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("popcnt"))) 
+  size_t Rank(size_t i) const;
+#endif
+
+  /**
+   * The position of the set bit with k set bits before it, bits.size() when there is no such bit.
+   * The BMI2 version finds the bit within a word with PDEP.
+   */
+  __attribute__((target("default"))) 
+  size_t Select(size_t k) const;
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("popcnt,bmi2"))) 
+  size_t Select(size_t k) const;
+#endif
+
+  /**
+   * The number of set bits in the array.
+   */
+  size_t Count() const;
+
+  /**
+   * Recounts after bits begin to end of the array have been modified.
+   */
+  void Update(size_t begin, size_t end);
+
+  /**
+   * Recounts the whole array, needed once it has been resized.
+   */
+  void Rebuild();
+
+private:
+  /**
+   * Fills the entries of the blocks of up to one superblock of words and returns its count.
+   */
+  __attribute__((target("default"))) 
+  static uint64_t CountBlocks(const uint64_t *words, size_t numWords, uint64_t *blocks);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("popcnt"))) 
+  static uint64_t CountBlocks(const uint64_t *words, size_t numWords, uint64_t *blocks);
+#endif
+
+  size_t SelectSubBlock(size_t &k) const;
+
+  const BitArray &_bits;
+  std::vector<uint64_t> _superblocks; // Set bits before each superblock followed by the total
+  std::vector<uint64_t> _blocks;      // One entry per block
+};
+
+/**
+ * Convolves a stream arriving in chunks of any number of bits, keeping the register between them,
+ * so that pushing the chunks of a stream produces the same output as one Convolve over all of it
+ * with flush false, and Flush then adds the output of the flushed zeros. Everything needed is
+ * allocated up front, a push only loads its chunk into a buffer a block of words at a time and
+ * writes the output, so small packets are cheap.
+ */
+class Convolver {
+public:
+  /**
+   * A convolver with a register of zeros, or loaded from the first taps.size() bits of fill, as for
+   * BitArray::Convolve.
+   */
+  Convolver(const BitArray &taps);
+  Convolver(const BitArray &taps, const BitArray &fill);
+
+  /**
+   * Pushes bits through the register and writes their bits.size() output bits to result starting
+   * at bit pos. Returns the bit after the last one written, so that the chunks of a stream can be
+   * written one after the other into one buffer.
+   */
+  size_t Push(const BitSpan &bits, BitArray &result, size_t pos = 0);
+
+  /**
+   * Same as above writing the output to a buffer kept by the convolver, which is only reallocated
+   * when a chunk is larger than any before it. The view is valid until the next push.
+   */
+  BitSpan Push(const BitSpan &bits);
+
+  /**
+   * Pushes taps.size() - 1 zeros, writing the end of the output of the stream. Reset or SetFill
+   * start a new stream.
+   */
+  size_t Flush(BitArray &result, size_t pos = 0);
+  BitSpan Flush();
+
+  /**
+   * The fill as in BitArray::Convolve, the last taps.size() bits pushed with the oldest in bit 0.
+   */
+  void GetFill(BitArray &fill) const;
+  void SetFill(const BitArray &fill);
+
+  /**
+   * Clears the register.
+   */
+  void Reset();
+
+private:
+  static const size_t BlockWords = 256;
+
+  void Run(const BitSpan &bits, BitArray &result, size_t pos);
+
+  size_t _numTaps;
+  std::vector<uint64_t> _poly; // The taps as for BitArray::ConvolveBlock
+  std::vector<uint64_t> _reg;  // and the input preceding the next chunk.
+  std::vector<uint64_t> _x;    // A block of input after the _poly.size() words preceding it
+  std::vector<uint64_t> _y;    // and its output, the first word unused.
+  BitArray _zeros;             // What Flush pushes
+  BitArray _buffer;            // The output of pushes without a result
+};
+
+/**
+ * A linear feedback shift register, the feedback counterpart of BitArray::Convolve, for PRBS test
+ * sequences and scramblers. The taps are the generator polynomial as for Convolve, highest power
+ * first, e.g. BitArray("11000001") for x^7 + x^6 + 1, and the last tap, for the current bit, must be
+ * set. Registers of 1 to 64 bits, 2 to 65 taps, are supported.
+ *
+ * The register produces 64 bits at a time with two carry-less multiplications, one for what the
+ * register feeds into the next word and one by the impulse response of the feedback, and jumps
+ * ahead n bits in O(log n) by computing x^n modulo the feedback polynomial. Generate, Apply and Jump
+ * step the register through its own sequence, Scramble feeds the scrambled output back into it.
+ */
+class Lfsr {
+  friend class Dispatch;
+
+public:
+  /**
+   * A register of ones, the usual PRBS seed, or loaded from the first taps.size() bits of fill, the
+   * last bits of the sequence with the oldest in bit 0 as for BitArray::Convolve.
+   */
+  Lfsr(const BitArray &taps);
+  Lfsr(const BitArray &taps, const BitArray &fill);
+
+  /**
+   * The taps of the ITU-T O.150 PRBS of order 7, 9, 11, 15, 20, 23 or 31, e.g. x^31 + x^28 + 1.
+   */
+  static BitArray Prbs(unsigned order);
+
+  /**
+   * Writes the next n bits of the sequence to result starting at bit pos. Returns the bit after the
+   * last one written, so that the sequence can be written in pieces one after the other.
+   */
+  size_t Generate(size_t n, BitArray &result, size_t pos = 0);
+
+  /**
+   * Same as above with the bits split over the threads of policy, each starting from a copy of the
+   * register jumped ahead to its segment. The result and the register afterwards are identical to
+   * the serial ones.
+   */
+  size_t Generate(const BitArray::Parallel &policy, size_t n, BitArray &result, size_t pos = 0);
+
+  /**
+   * Additive scrambling, writes bits XORed with the next bits.size() bits of the sequence to result
+   * starting at bit pos. Applying the same sequence again descrambles.
+   */
+  size_t Apply(const BitSpan &bits, BitArray &result, size_t pos = 0);
+
+  /**
+   * Multiplicative, self-synchronizing, scrambling, each output bit is the input bit XORed with the
+   * feedback of the previous output bits. A Convolver, or BitArray::Convolve, with the same taps
+   * and fill descrambles.
+   */
+  size_t Scramble(const BitSpan &bits, BitArray &result, size_t pos = 0);
+
+  /**
+   * Steps the register n bits through its sequence, as Generate would, in O(log n).
+   */
+  void Jump(uint64_t n);
+
+  /**
+   * The fill as in BitArray::Convolve, the last taps.size() bits of the register with the oldest in
+   * bit 0.
+   */
+  void GetFill(BitArray &fill) const;
+  void SetFill(const BitArray &fill);
+
+private:
+  static const size_t BlockWords = 256;
+
+  /**
+   * Runs numWords words of x, or zeros when x is NULL, through the register reg, the last degree
+   * bits with the newest on top, writing the output words to y.
+   */
+  static void FeedbackBlock(const uint64_t *poly, size_t degree, uint64_t impulse, const uint64_t *x, uint64_t *y, size_t numWords, uint64_t reg);
+  static void FeedbackBlockDefault(const uint64_t *poly, size_t degree, uint64_t impulse, const uint64_t *x, uint64_t *y, size_t numWords, uint64_t reg);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("pclmul"))) 
+  static void FeedbackBlockPclmul(const uint64_t *poly, size_t degree, uint64_t impulse, const uint64_t *x, uint64_t *y, size_t numWords, uint64_t reg);
+#endif
+
+  /**
+   * a * b modulo the characteristic polynomial, all of degree below degree.
+   */
+  __attribute__((target("default"))) 
+  static uint64_t MulMod(uint64_t a, uint64_t b, unsigned __int128 charPoly, size_t degree);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("pclmul"))) 
+  static uint64_t MulMod(uint64_t a, uint64_t b, unsigned __int128 charPoly, size_t degree);
+#endif
+
+  size_t Run(const BitSpan *bits, size_t n, bool feedback, BitArray &result, size_t pos);
+  uint64_t Register() const;
+
+  size_t _degree;
+  std::vector<uint64_t> _poly;  // The taps as for BitArray::ConvolveBlock
+  unsigned __int128 _charPoly;  // and as the characteristic polynomial, bit i for x^i.
+  uint64_t _impulse;            // The first 64 bits of the impulse response of the feedback
+  unsigned __int128 _history;   // The last 128 bits of the register, the newest on top
+  std::vector<uint64_t> _x;     // A block of input
+  std::vector<uint64_t> _y;     // and of output.
+};
+
+/**
+ * A CRC of 1 to 64 bits over any bit range. The bits are the message in index order, the first as
+ * the highest power, as a serial CRC over the transmitted stream. The poly is in the normal form
+ * without its top bit and init is the initial normal register. With reflect the register is
+ * reported reflected, as CRCs of bytes sent least significant bit first such as CRC-32 do, then
+ * XORed with xorOut, so the CRC of the bytes stored in data() is the catalogue value. The CRCs
+ * not reflected have their catalogue value for bytes stored most significant bit first, as the
+ * string constructor reads "00110001".
+ *
+ * Whole words are folded 512 bits at a time with carry-less multiplications, and otherwise, and at
+ * the end, go through slicing-by-8 tables, the last bits of a range not filling a byte one at a
+ * time.
+ */
+class Crc {
+  friend class Dispatch;
+
+public:
+  Crc(unsigned width, uint64_t poly, uint64_t init = 0, bool reflect = false, uint64_t xorOut = 0);
+
+  /**
+   * Common CRCs: CRC-32 as in Ethernet, CRC-32C, CRC-16/CCITT-FALSE with init 0xFFFF, and the 3GPP
+   * CRC-24A of LTE and NR.
+   */
+  static Crc Crc32();
+  static Crc Crc32C();
+  static Crc Crc16Ccitt();
+  static Crc Crc24Lte();
+
+  unsigned Width() const;
+
+  /**
+   * The CRC of the len bits starting at a ProxyBit, as DotProd takes them, or of a view.
+   */
+  uint64_t Compute(const ProxyBit &start, size_t len) const;
+  uint64_t Compute(const BitSpan &bits) const;
+
+  /**
+   * Appends the CRC of frame to it in transmission order, the reflected CRCs least significant bit
+   * first and the others most significant bit first. The CRC of the frame with its CRC is then a
+   * constant, zero when init and xorOut are.
+   */
+  void Append(BitArray &frame) const;
+
+private:
+  /**
+   * Runs numWords words of bits through the reflected register reg and returns it.
+   */
+  static uint64_t Words(const uint64_t *tables, const uint64_t *folds, const BitSpan &bits, size_t numWords, uint64_t reg);
+  static uint64_t WordsDefault(const uint64_t *tables, const uint64_t *folds, const BitSpan &bits, size_t numWords, uint64_t reg);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("pclmul"))) 
+  static uint64_t WordsPclmul(const uint64_t *tables, const uint64_t *folds, const BitSpan &bits, size_t numWords, uint64_t reg);
+#endif
+
+  unsigned _width;
+  uint64_t _poly;   // Reflected
+  uint64_t _init;   // Reflected
+  bool _reflect;
+  uint64_t _xorOut;
+  std::vector<uint64_t> _tables; // 8 tables of 256 for slicing-by-8
+  std::vector<uint64_t> _folds;  // Pairs of folding constants for 512, 384, 256 and 128 bits
+};
+
+/**
+ * A bit interleaver over frames of a fixed size and its inverse. The block interleaver writes the
+ * frame into a rows x cols matrix row by row and reads it column by column, a bit matrix transpose.
+ * Any other pattern is given as a permutation, precomputed both ways and applied with gathers of
+ * 8 or 16 bits at a time on AVX2 and AVX-512.
+ */
+class Interleaver {
+  friend class Dispatch;
+  friend class SparseBitMatrix;
+
+public:
+  /**
+   * A block interleaver of rows x cols bits.
+   */
+  Interleaver(size_t rows, size_t cols);
+
+  /**
+   * An interleaver sending bit permutation[j] of the frame to bit j.
+   */
+  Interleaver(const std::vector<size_t> &permutation);
+
+  /**
+   * The frame size in bits.
+   */
+  size_t size() const;
+
+  /**
+   * Interleaves or deinterleaves a frame of size() bits into result starting at bit pos.
+   */
+  void Interleave(const BitSpan &bits, BitArray &result, size_t pos = 0) const;
+  void Deinterleave(const BitSpan &bits, BitArray &result, size_t pos = 0) const;
+
+private:
+  static const size_t BlockWords = 256;
+
+  /**
+   * Gathers the bits at positions, plus offset, of base into the words of out, the last one zero
+   * padded.
+   */
+  static void Gather(const uint32_t *positions, size_t n, const uint8_t *base, size_t offset, uint64_t *out);
+  static void GatherDefault(const uint32_t *positions, size_t n, const uint8_t *base, size_t offset, uint64_t *out);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("avx2"))) 
+  static void GatherAvx2(const uint32_t *positions, size_t n, const uint8_t *base, size_t offset, uint64_t *out);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f"))) 
+  static void GatherAvx512(const uint32_t *positions, size_t n, const uint8_t *base, size_t offset, uint64_t *out);
+#endif
+
+  void Permute(const std::vector<uint32_t> &positions, const BitSpan &bits, BitArray &result, size_t pos) const;
+
+  size_t _rows;
+  size_t _cols;
+  std::vector<uint32_t> _forward; // The permutation, empty for a block interleaver,
+  std::vector<uint32_t> _inverse; // and its inverse.
+};
+
+/**
+ * A matrix of bits, for scoring every row of one matrix of fingerprints against every row of
+ * another by the popcount of their AND, the dot product, or of their XOR, the Hamming distance, and
+ * for linear algebra over GF(2): parity check and generator matrix products, Method of Four
+ * Russians matrix products and Gaussian elimination. Each row starts on a 64-byte line and is
+ * padded with zeros to whole lines, and the number of rows to a multiple of 4, so the kernels work
+ * on aligned vectors and 4 x 4 tiles of rows.
+ */
+class BitMatrix {
+  friend class Dispatch;
+
+public:
+  enum Metric { AND_POPCOUNT, XOR_POPCOUNT };
+
+  /**
+   * The score of row of the first matrix against ref of the second.
+   */
+  struct Match {
+    size_t row;
+    size_t ref;
+    uint32_t score;
+  };
+
+  /**
+   * A rows x cols matrix of zeros, or of the rows given, which must all be the same size.
+   */
+  BitMatrix(size_t rows, size_t cols);
+  explicit BitMatrix(const std::vector<BitArray> &rows);
+
+  size_t rows() const;
+  size_t cols() const;
+
+  /**
+   * The bits from the start of one row to the next, cols rounded up to a multiple of 512.
+   */
+  size_t stride() const;
+
+  /**
+   * Reads or writes the bit at row r, column c.
+   */
+  ProxyBit operator()(size_t r, size_t c);
+  bool operator()(size_t r, size_t c) const;
+
+  /**
+   * A row as a view, and setting one from cols bits.
+   */
+  BitSpan Row(size_t r) const;
+  void SetRow(size_t r, const BitSpan &bits);
+
+  /**
+   * The score of every row of a against every row of b, a.rows() x b.rows() of them, row major.
+   * The matrices must have the same number of columns. Work is split over the threads of policy
+   * by rows of a, once a.rows() x b.rows() x cols reaches its size.
+   */
+  static std::vector<uint32_t> Scores(const BitMatrix &a, const BitMatrix &b, Metric metric, const BitArray::Parallel &policy = BitArray::Parallel(1));
+
+  /**
+   * For each row of a the k rows of b scoring best, the highest AND or lowest XOR popcount, best
+   * first with ties going to the lower ref, min(k, b.rows()) per row of a. Only those are kept,
+   * never the whole score matrix.
+   */
+  static std::vector<Match> TopK(const BitMatrix &a, const BitMatrix &b, Metric metric, size_t k, const BitArray::Parallel &policy = BitArray::Parallel(1));
+
+  /**
+   * Every pair scoring at least threshold by AND popcount, or at most threshold by XOR popcount,
+   * ordered by row and then ref.
+   */
+  static std::vector<Match> Threshold(const BitMatrix &a, const BitMatrix &b, Metric metric, uint32_t threshold,
+                                      const BitArray::Parallel &policy = BitArray::Parallel(1));
+
+  /**
+   * Products over GF(2), written to result starting at bit pos. m x, of rows() bits, is the parity
+   * of each row's AND with x, e.g. the syndrome of a codeword under a parity check matrix. x m, of
+   * cols() bits, is the XOR of the rows picked by x, e.g. the codeword of a message under a
+   * generator matrix.
+   */
+  static void Multiply(const BitMatrix &m, const BitSpan &x, BitArray &result, size_t pos = 0);
+  static void Multiply(const BitSpan &x, const BitMatrix &m, BitArray &result, size_t pos = 0);
+
+  /**
+   * The product a b over GF(2), by the Method of Four Russians: the XORs of every combination of 8
+   * rows of b are tabled, and each row of a takes the one its byte picks. Encoding or checking many
+   * frames at once is a product with the frames as rows.
+   */
+  static BitMatrix Multiply(const BitMatrix &a, const BitMatrix &b);
+
+  BitMatrix Transposed() const;
+
+  /**
+   * Gaussian elimination over GF(2), in place, to reduced row echelon form. Returns the rank, the
+   * first rank rows being the nonzero ones.
+   */
+  size_t Eliminate();
+  size_t Rank() const;
+
+  /**
+   * A systematic generator matrix for the code with parity check matrix h, its n - rank(h) rows
+   * spanning the codewords c with h c = 0. Parity bits are taken from the last columns that are
+   * independent, so where the last rows of h columns are, as for LDPC codes with a dual diagonal
+   * or otherwise invertible parity part, G = [I | P] and the message is the start of the codeword.
+   */
+  static BitMatrix Generator(const BitMatrix &h);
+
+private:
+  // The output tile, rows of a by rows of b, and the words of a row, scored at a time. A tile's
+  // rows of a stay in L1 and its rows of b in L2 while the kernel passes over them.
+  static const size_t TileRows = 32, TileRefs = 128, TileWords = 128;
+
+  /**
+   * The popcount GEMM. ScoreTile adds the AND popcounts of words [0, numWords) of aRows rows of a
+   * with bRows rows of b, rows strideWords apart, to dots[i * ldDots + j]. aRows and bRows are
+   * multiples of 4 and numWords of 8. It is register tiled, each word of 4 rows of a being
+   * combined with 4 rows of b, or 2 in the AVX2 version, before the next is loaded. XOR popcounts
+   * come from the AND ones and the popcounts of the rows.
+   */
+  static void ScoreTile(const uint64_t *a, size_t aRows, const uint64_t *b, size_t bRows, size_t strideWords, size_t numWords, uint32_t *dots, size_t ldDots);
+  static void ScoreTileDefault(const uint64_t *a, size_t aRows, const uint64_t *b, size_t bRows, size_t strideWords, size_t numWords, uint32_t *dots,
+                               size_t ldDots);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("popcnt"))) 
+  static void ScoreTilePopcnt(const uint64_t *a, size_t aRows, const uint64_t *b, size_t bRows, size_t strideWords, size_t numWords, uint32_t *dots,
+                              size_t ldDots);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("avx2"))) 
+  static void ScoreTileAvx2(const uint64_t *a, size_t aRows, const uint64_t *b, size_t bRows, size_t strideWords, size_t numWords, uint32_t *dots,
+                            size_t ldDots);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f,avx512vpopcntdq"))) 
+  static void ScoreTileVpopcnt(const uint64_t *a, size_t aRows, const uint64_t *b, size_t bRows, size_t strideWords, size_t numWords, uint32_t *dots,
+                               size_t ldDots);
+#endif
+
+  /**
+   * Scores tiles of TileRows x TileRefs, each thread taking a range of rows of a, and passes each
+   * to sink with the thread, its first row and ref, its size and the AND popcounts, TileRefs
+   * apart.
+   */
+  typedef std::function<void(size_t thread, size_t row, size_t ref, size_t numRows, size_t numRefs, const uint32_t *dots)> TileSink;
+  static size_t ScoreTiles(const BitMatrix &a, const BitMatrix &b, const BitArray::Parallel &policy, const TileSink &sink);
+
+  /**
+   * The GF(2) matrix-vector kernel. Sets bit i of parities to the parity of the AND of words
+   * [0, numWords) of row i of m with x, for numRows rows strideWords apart. numRows is a multiple
+   * of 4 and numWords of 8, and parities is zeroed by the caller. 4 rows are XOR accumulated
+   * per load of x and the parity is taken once per row.
+   */
+  static void ParityRows(const uint64_t *m, size_t numRows, size_t strideWords, const uint64_t *x, size_t numWords, uint64_t *parities);
+  static void ParityRowsDefault(const uint64_t *m, size_t numRows, size_t strideWords, const uint64_t *x, size_t numWords, uint64_t *parities);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("sse2"))) 
+  static void ParityRowsSse2(const uint64_t *m, size_t numRows, size_t strideWords, const uint64_t *x, size_t numWords, uint64_t *parities);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("avx2"))) 
+  static void ParityRowsAvx2(const uint64_t *m, size_t numRows, size_t strideWords, const uint64_t *x, size_t numWords, uint64_t *parities);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f"))) 
+  static void ParityRowsAvx512(const uint64_t *m, size_t numRows, size_t strideWords, const uint64_t *x, size_t numWords, uint64_t *parities);
+#endif
+
+  // The words of b tabled at a time by the Method of Four Russians, 256 x 32 words being 64 KB.
+  static const size_t TableWords = 32;
+
+  /**
+   * Eliminates columns from first to last, or last to first, and fills pivots with the column of
+   * each nonzero row.
+   */
+  size_t Eliminate(bool fromLast, std::vector<size_t> &pivots);
+
+  uint64_t *RowWords(size_t r);
+  const uint64_t *RowWords(size_t r) const;
+
+  /**
+   * The popcount of each row, and a score from the AND popcount and those of the two rows.
+   */
+  std::vector<uint32_t> RowCounts() const;
+  static uint32_t Score(Metric metric, uint32_t dot, uint32_t countA, uint32_t countB);
+
+  size_t _rows;
+  size_t _cols;
+  size_t _stride;
+  BitArray _bits; // The rows, rounded up to a multiple of 4, _stride bits apart
+};
+
+/**
+ * A sparse GF(2) matrix, e.g. an LDPC parity check matrix, holding the columns of the ones of each
+ * row. Products gather the bits of x they read with the interleaver's gathers and take the parity
+ * of each row's run from a running XOR, so they cost a bit per one of the matrix.
+ */
+class SparseBitMatrix {
+public:
+  /**
+   * A matrix of cols columns with a row per entry of rows, listing the columns of its ones.
+   */
+  SparseBitMatrix(size_t cols, const std::vector<std::vector<size_t> > &rows);
+
+  size_t rows() const;
+  size_t cols() const;
+
+  /**
+   * The number of ones.
+   */
+  size_t size() const;
+
+  /**
+   * The product m x over GF(2), of rows() bits, written to result starting at bit pos.
+   */
+  static void Multiply(const SparseBitMatrix &m, const BitSpan &x, BitArray &result, size_t pos = 0);
+
+private:
+  size_t _cols;
+  std::vector<uint32_t> _columns; // The columns of the ones, a row after the other,
+  std::vector<size_t> _starts;    // and where each row starts in them, and the last ends.
+};
+
+/**
+ * A compressed bit array for large sparse or run heavy bitmaps, split like a roaring bitmap into
+ * chunks of 65536 bits each held in whichever container is smallest: the sorted positions of its
+ * set bits, a plain bitmap, or its runs of set bits. Chunks without set bits take no space.
+ * Counting, AND, OR, XOR and intersection counts work chunk by chunk on the containers, merging
+ * positions and runs and only expanding to a bitmap when the other side is one.
+ */
+class CompressedBitArray {
+public:
+  /**
+   * size zeros, or a compressed copy of bits.
+   */
+  explicit CompressedBitArray(size_t size = 0);
+  explicit CompressedBitArray(const BitSpan &bits);
+
+  size_t size() const;
+
+  /**
+   * The number of set bits, and the bytes the array takes.
+   */
+  size_t Count() const;
+  size_t Bytes() const;
+
+  bool operator[](size_t i) const;
+
+  BitArray Decompress() const;
+
+  /**
+   * The number of bits set in both, a compressed array or a compressed one and a BitSpan of the
+   * same size. Only the chunks of a with set bits are read.
+   */
+  static uint64_t DotProd(const CompressedBitArray &a, const CompressedBitArray &b);
+  static uint64_t DotProd(const CompressedBitArray &a, const BitSpan &b);
+
+  /**
+   * Combine arrays of the same size.
+   */
+  friend CompressedBitArray operator&(const CompressedBitArray &a, const CompressedBitArray &b);
+  friend CompressedBitArray operator|(const CompressedBitArray &a, const CompressedBitArray &b);
+  friend CompressedBitArray operator^(const CompressedBitArray &a, const CompressedBitArray &b);
+
+private:
+  enum Container { ARRAY, BITMAP, RUN };
+  enum Op { AND, OR, XOR };
+  static const size_t ChunkBits = 65536, ChunkWords = 1024, MaxArray = 4096;
+
+  struct Chunk {
+    uint32_t key;                 // The chunk index
+    Container type;               //
+    uint32_t count;               // Set bits
+    std::vector<uint16_t> values; // The positions of an ARRAY, or the first and last bit of each run of a RUN
+    std::vector<uint64_t> words;  // A BITMAP
+  };
+
+  /**
+   * A chunk in its smallest container, from its words or from the bounds of its runs, the start
+   * and one past the end of each.
+   */
+  static bool Encode(const uint64_t *words, Chunk &chunk);
+  static bool Encode(const std::vector<uint32_t> &bounds, Chunk &chunk);
+
+  /**
+   * A chunk expanded to ChunkWords words, or an ARRAY or RUN one to the bounds of its runs.
+   */
+  static void Words(const Chunk &chunk, uint64_t *words);
+  static void Bounds(const Chunk &chunk, std::vector<uint32_t> &bounds);
+
+  static bool Combine(const Chunk &a, const Chunk &b, Op op, Chunk &result);
+  static uint64_t Intersect(const Chunk &a, const Chunk &b);
+  static CompressedBitArray Combine(const CompressedBitArray &a, const CompressedBitArray &b, Op op);
+
+  size_t _size;
+  std::vector<Chunk> _chunks; // The chunks with set bits, by key
+};
+
+/**
+ * A binary format for arrays, to pass them between processes and keep them on disk. A record is a
+ * 64 byte header followed by the bytes of the bits, zero padded to a multiple of 64 bytes and by at
+ * least the 7 bytes of a BitArray, so that records can follow one another in a stream or buffer
+ * and the bits of each stay as aligned as the buffer. The header fields are little endian:
+ *
+ *    0  "BITARRAY"                      20  the CRC-32C of the bits, 4 bytes
+ *    8  the size in bits, 8 bytes       24  the record size in bytes, header included, 8 bytes
+ *   16  the version, 1, 2 bytes         32  zeros
+ *   18  the word size, 8                60  the CRC-32C of bytes 0 to 59, 4 bytes
+ *   19  the byte order of the words, 1 for little endian
+ *
+ * Load copies a record into a BitArray. View checks one in place and returns a BitSpan of its bits
+ * without copying them, valid for as long as the buffer is. Checking the bits against their CRC
+ * reads them once more and can be skipped when the transport already checks them.
+ */
+class BitRecord {
+  friend class MappedBitArray;
+
+public:
+  static const size_t HeaderSize = 64;
+
+  /**
+   * The size in bytes of the record of bits.
+   */
+  static size_t Size(const BitSpan &bits);
+
+  /**
+   * Writes the record of bits to a buffer of at least Size(bits) bytes, returning the bytes
+   * written, or to a stream.
+   */
+  static size_t Save(const BitSpan &bits, void *buffer);
+  static void Save(std::ostream &out, const BitSpan &bits);
+
+  /**
+   * Reads the record at the start of a buffer of bytes, setting used to its size, or the next
+   * record of a stream. Throws if the record is cut short, its header is not valid or, with verify,
+   * the bits do not match their CRC.
+   */
+  static BitArray Load(const void *buffer, size_t bytes, size_t *used = NULL, bool verify = true);
+  static BitArray Load(std::istream &in, bool verify = true);
+
+  /**
+   * The bits of the record at the start of a buffer in place, checked like Load, or of every record
+   * of a buffer such as a log file read or mapped whole. The views point into the buffer and are
+   * only valid while it is.
+   */
+  static BitSpan View(const void *buffer, size_t bytes, size_t *used = NULL, bool verify = true);
+  static std::vector<BitSpan> Views(const void *buffer, size_t bytes, bool verify = true);
+
+private:
+  static const uint16_t Version = 1;
+
+  /**
+   * Fills in the header of the record of bits, and the size of the record of size bits.
+   */
+  static void Header(const BitSpan &bits, uint8_t *header);
+  static size_t RecordSize(size_t size);
+
+  /**
+   * The size of the record whose header starts a buffer of bytes, 0 if the header is not valid or
+   * the record does not fit.
+   */
+  static size_t Parse(const uint8_t *header, size_t bytes);
+
+  static uint32_t Checksum(const BitSpan &bits);
+  static void Store(uint8_t *bytes, uint64_t value, size_t numBytes);
+  static uint64_t Fetch(const uint8_t *bytes, size_t numBytes);
+};
+
+/**
+ * Bits held in a file and memory mapped rather than read, so that opening is immediate and arrays
+ * larger than memory can be used, paged in as the kernels reach them. It converts to a BitSpan and
+ * can be passed wherever one can. The file is a BitRecord, as Save writes, whose bits are not
+ * checked against their CRC on opening, or a log of several of which the array is the first. Files
+ * saved before BitRecord, with only "BITARRAY" and the size in the header, open as well.
+ *
+ * READ_ONLY maps the file read only and shares its pages with every process reading it.
+ * COPY_ON_WRITE allows bits to be changed, modified pages are private and never written back.
+ */
+class MappedBitArray {
+public:
+  enum Mode { READ_ONLY, COPY_ON_WRITE };
+
+  /**
+   * How the bits will be read, passed on to madvise. DONTNEED lets the pages go, with
+   * COPY_ON_WRITE along with any changes made to them.
+   */
+  enum Advice { NORMAL, SEQUENTIAL, RANDOM, WILLNEED, DONTNEED };
+
+  MappedBitArray(const std::string &path, Mode mode = READ_ONLY, Advice advice = NORMAL);
+  ~MappedBitArray();
+
+  /**
+   * Writes bits to path in the format opened by the constructor.
+   */
+  static void Save(const std::string &path, const BitSpan &bits);
+
+  /**
+   * Returns the size, in bits, of the array.
+   */
+  size_t size() const;
+
+  /**
+   * The bytes of the bits, 64-byte aligned. They can only be written to with COPY_ON_WRITE.
+   */
+  const uint8_t *data() const;
+  uint8_t *data();
+
+  /**
+   * A proxy to a bit, which can only be set with COPY_ON_WRITE, and reading a bit.
+   */
+  ProxyBit operator[](size_t i);
+  bool operator[](size_t i) const;
+
+  /**
+   * All of the bits as a view.
+   */
+  operator BitSpan() const;
+
+  /**
+   * Advises the kernel how bits begin to end will be read, e.g. WILLNEED on the next block to
+   * start reading it from disk while the current one is processed.
+   */
+  void Advise(Advice advice, size_t begin, size_t end);
+
+  /**
+   * The bits of every record of the file, for a log of BitRecord::Save calls. The views point into
+   * the mapping and are only valid while this MappedBitArray is.
+   */
+  std::vector<BitSpan> Records(bool verify = true) const;
+
+private:
+  MappedBitArray(const MappedBitArray &);
+  MappedBitArray &operator=(const MappedBitArray &);
+
+  static const size_t HeaderSize = 64;
+
+  Mode _mode;
+  size_t _size;     // Size in bits
+  uint8_t *_map;    // The mapped file, header first
+  size_t _mapSize;  // and its size in bytes.
+};
+
+// Private constructor
+ProxyBit::ProxyBit(uint8_t &byte, size_t pos) : _byte(byte), _pos(pos) {}
+
+ProxyBit::~ProxyBit() {}
+
+ProxyBit::operator bool() const { return _byte & (1 << _pos); }
+
+void ProxyBit::operator=(bool b) const { _byte = b ? _byte | (1 << _pos) : _byte & ~(1 << _pos); }
+
+ProxyBit &ProxyBit::operator=(const ProxyBit &other) {
+  *this = bool(other);
+  return *this;
+}
+
+// Very lazy, extra 7 bytes of zeros so I do not have to do extra work at the tail end.
+BitArray::BitArray(size_t len) : _size(len), _data((_size + 7) / 8 + 7) {}
+
+BitArray::BitArray() : _size(0), _data(0) {}
+
+// One pass, a block of characters at a time packed for their 1s and for their digits. The 1s of
+// words holding other characters are compacted to leave those out.
+BitArray::BitArray(const std::string &s) : _size(0), _data((s.size() + 7) / 8 + 7) {
+  const size_t blockWords = 256;
+  uint64_t ones[blockWords], digits[blockWords];
+  const uint8_t *text = (const uint8_t *)s.data();
+  for (size_t i = 0; i < s.size(); i += blockWords * 64) {
+    size_t n = std::min(blockWords * 64, s.size() - i), numFull = n / 64;
+    PackBlock(text + i, numFull, PACK_ONE, ones);
+    PackBlock(text + i, numFull, PACK_DIGIT, digits);
+    if (n % 64) {
+      uint8_t tail[64] = {0};
+      std::copy(text + i + numFull * 64, text + i + n, tail);
+      PackBlock(tail, 1, PACK_ONE, &ones[numFull]);
+      PackBlock(tail, 1, PACK_DIGIT, &digits[numFull]);
+    }
+
+    size_t w(0);
+    while (w < numFull && digits[w] == ~uint64_t(0))
+      ++w;
+    DepositWords(ones, w * 64, (uint64_t *)_data.data(), _size);
+    _size += w * 64;
+    for (; w * 64 < n; ++w) {
+      size_t count = std::min(size_t(64), n - w * 64);
+      if (digits[w] != (count < 64 ? (uint64_t(1) << count) - 1 : ~uint64_t(0))) {
+        uint64_t packed(0);
+        for (count = 0; digits[w]; digits[w] &= digits[w] - 1, ++count)
+          packed |= ((ones[w] >> __builtin_ctzll(digits[w])) & 1) << count;
+        ones[w] = packed;
+      }
+      DepositWords(&ones[w], count, (uint64_t *)_data.data(), _size);
+      _size += count;
+    }
+  }
+  _data.resize((_size + 7) / 8 + 7);
+}
+
+size_t BitArray::size() const { return _size; }
+
+/**
+ * Pass through to the vector _data both const and non-const versions
+ */
+const uint8_t *BitArray::data() const { return _data.data(); }
+
+uint8_t *BitArray::data() { return _data.data(); }
+
+ProxyBit BitArray::operator[](size_t i) {
+  assert(i < _size);
+  return ProxyBit(_data[i / 8], (i & 7));
+}
+
+bool BitArray::operator[](size_t i) const {
+  assert(i < _size);
+  return (_data[i / 8] >> (i & 7)) & 0x01;
+}
+
+void BitArray::Resize(size_t len) {
+  size_t numBytes = (len + 7) / 8 + 7;
+  if (len < _size) {
+    // The bits past the new end become padding, which must be zero.
+    std::fill(_data.begin() + (len + 7) / 8, _data.begin() + std::min(numBytes, _data.size()), 0);
+    if (len % 8)
+      _data[len / 8] &= (1 << (len % 8)) - 1;
+  }
+  _data.resize(numBytes);
+  _size = len;
+}
+
+void BitArray::Reserve(size_t len) { _data.reserve((len + 7) / 8 + 7); }
+
+void BitArray::Append(const BitSpan &bits) {
+  // Growing may move a view of this array.
+  if (bits._base >= data() && bits._base < data() + _data.size()) {
+    Append(BitSpan(BitArray(BitExpr(bits))));
+    return;
+  }
+  size_t pos = _size;
+  Resize(_size + bits.size());
+  CopyBits(bits._base, bits._offset, data(), pos, bits.size());
+}
+
+void BitArray::Append(bool bit) {
+  Resize(_size + 1);
+  (*this)[_size - 1] = bit;
+}
+
+BitArray BitArray::Slice(size_t begin, size_t len) const {
+  if (begin > _size || _size - begin < len)
+    throw std::runtime_error("The slice must lie within the array");
+  BitArray bits(len);
+  CopyBits(data(), begin, bits.data(), 0, len);
+  return bits;
+}
+
+BitArray BitArray::Concat(const std::vector<BitSpan> &parts) {
+  size_t size(0);
+  for (size_t k = 0; k < parts.size(); ++k)
+    size += parts[k].size();
+  BitArray bits(size);
+  for (size_t k = 0, pos = 0; k < parts.size(); pos += parts[k++].size())
+    CopyBits(parts[k]._base, parts[k]._offset, bits.data(), pos, parts[k].size());
+  return bits;
+}
+
+void BitArray::Copy(const BitSpan &src, BitArray &dest, size_t pos) {
+  if (pos > dest.size() || dest.size() - pos < src.size())
+    throw std::runtime_error("The destination must be large enough to hold the copied bits");
+  CopyBits(src._base, src._offset, dest.data(), pos, src.size());
+}
+
+uint64_t BitArray::DotProd(const ProxyBit &pb_a, const ProxyBit &pb_b, size_t len) {
+  return Dispatch::Get<decltype(&DotProdDefault)>(Dispatch::DOTPROD)(&pb_a._byte, pb_a._pos, &pb_b._byte, pb_b._pos, len);
+}
+
+uint64_t BitArray::DotProdDefault(const uint8_t *a, unsigned posA, const uint8_t *b, unsigned posB, size_t len) {
+  uint64_t accum(0);
+  uint64_t first_seven_mask = 0x00FFFFFFFFFFFFFF;
+
+  const uint8_t *a_ptr = a;
+  const uint8_t *b_ptr = b;
+
+  for (size_t i = 0; len != 0; len -= (7 * 8), i += 7) {
+    uint64_t a_64t = (*(const uint64_t *)&a_ptr[i]);
+    a_64t = (a_64t >> posA);
+
+    uint64_t b_64t = (*(const uint64_t *)&b_ptr[i]);
+    b_64t = (b_64t >> posB);
+
+    if (len < 7 * 8) {
+      a_64t = (a_64t << (64 - len));
+      b_64t = (b_64t << (64 - len));
+      accum += countBits(a_64t & b_64t);
+      break;
+    }
+
+    accum += countBits(first_seven_mask & a_64t & b_64t);
+  }
+
+  return accum;
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("sse2"))) 
+uint64_t BitArray::DotProdSse2(const uint8_t *a, unsigned posA, const uint8_t *b, unsigned posB, size_t len) {
+  uint64_t accum(0);
+  uint64_t tmp[2];
+
+  // Even with SIMD we still deal with 64-bit integers at a time (for now).
+  // We load all we can (2 for SSE2, 4 for AVX etc.) of the first BitArray
+  // into the register then bit shift left to align it with the proxy bit in
+  // question, do the same with the second BitArray do our and operator; shift
+  // right 8 to get rid of the last byte (this is b/c the left shift may have
+  // brought 0-7 zero bits in which are not valid), then finally popcount both
+  const char *p_packedBits_A = (const char *)a;
+  const char *p_packedBits_B = (const char *)b;
+
+  // We move forward by 112 bytes each time b/c it's 2 sets of 7 bytes.
+  size_t i(0);
+  for (; len > 112; len -= 112, i += 14) {
+    // We deal with 8 bytes at a time but we drop the last byte, so we need
+    // the SSE2 register to have first 8 bytes, Plus 1 byte of overlap.
+    tmp[1] = *(const uint64_t *)&p_packedBits_A[i];
+    tmp[0] = *(const uint64_t *)&p_packedBits_A[i + 7];
+    // Things look good here.
+    __m128i a_bitVec = _mm_loadu_si128((__m128i const *)&tmp);
+
+    // Shift both right so it is aligned to zero position
+    a_bitVec = _mm_srli_epi64(a_bitVec, posA);
+
+    // Load the next
+    tmp[1] = *(const uint64_t *)&p_packedBits_B[i];
+    tmp[0] = *(const uint64_t *)&p_packedBits_B[i + 7];
+    __m128i b_bitVec = _mm_loadu_si128((__m128i const *)&tmp);
+
+    // Shift so it is also aligned
+    b_bitVec = _mm_srli_epi64(b_bitVec, posB);
+
+    // bit wise and them
+    a_bitVec = _mm_and_si128(a_bitVec, b_bitVec);
+
+    // Pull out the bits for all but the last byte.
+    a_bitVec = _mm_slli_epi64(a_bitVec, 8);
+    _mm_storeu_si128((__m128i *)&tmp, a_bitVec);
+    // _mm_maskmoveu_si128 (a_bitVec, mask, (char*)&tmp); // TODO: I cant get
+    // this to work, is it faster than shifts and store?
+    accum += countBits(tmp[1]) + countBits(tmp[0]);
+  }
+
+  uint64_t first_seven_mask = 0x00FFFFFFFFFFFFFF;
+
+  const uint8_t *a_ptr = a;
+  const uint8_t *b_ptr = b;
+
+  // Now we just have to take care of the last, potentially 112 bits.
+  // This is just like how we do the non-SSE case.
+  for (; len != 0; len -= (7 * 8), i += 7) {
+    uint64_t a_64t = (*(const uint64_t *)&a_ptr[i]);
+    a_64t = (a_64t >> posA);
+
+    uint64_t b_64t = (*(const uint64_t *)&b_ptr[i]);
+    b_64t = (b_64t >> posB);
+
+    if (len < 7 * 8) {
+      a_64t = (a_64t << (64 - len));
+      b_64t = (b_64t << (64 - len));
+      accum += countBits(a_64t & b_64t);
+      break;
+    }
+
+    accum += countBits(first_seven_mask & a_64t & b_64t);
+  }
+  return accum;
+}
+#endif
+
+// Reads 64 bits starting at bit pos of base, bits outside of [begin, end) read as zero and their bytes are not touched.
+inline uint64_t extractRange(const uint8_t *base, ptrdiff_t pos, ptrdiff_t begin, ptrdiff_t end) {
+  ptrdiff_t lo = std::max(pos, begin), hi = std::min(pos + 64, end);
+  if (lo >= hi)
+    return 0;
+  const uint64_t *words = (const uint64_t *)(base + lo / 64 * 8);
+  size_t shift = lo % 64, len = hi - lo;
+  uint64_t value = words[0] >> shift;
+  if (shift && (lo / 64 + 1) * 64 < hi)
+    value |= words[1] << (64 - shift);
+  if (len < 64)
+    value &= (uint64_t(1) << len) - 1;
+  return value << (lo - pos);
+}
+
+// 256 bits starting at bit pos of p, the next word is only read when there is something to shift in.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+inline __m256i loadBits256(const uint8_t *p, unsigned pos) {
+  __m256i lo = _mm256_loadu_si256((__m256i const *)p);
+  if (pos == 0)
+    return lo;
+  __m256i hi = _mm256_loadu_si256((__m256i const *)(p + 8));
+  return _mm256_or_si256(_mm256_srl_epi64(lo, _mm_cvtsi32_si128(pos)), _mm256_sll_epi64(hi, _mm_cvtsi32_si128(64 - pos)));
+}
+#endif
+
+// Per 64-bit lane popcount looking up each nibble with PSHUFB.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+inline __m256i countBits256(__m256i v) {
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i nibbles = _mm256_set1_epi8(0x0F);
+  __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, nibbles));
+  __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibbles));
+  return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+#endif
+
+// Carry-save adder, h and l receive the high and low bits of the sum of a, b and c.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+inline void addBits256(__m256i &h, __m256i &l, __m256i a, __m256i b, __m256i c) {
+  __m256i u = _mm256_xor_si256(a, b);
+  h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+  l = _mm256_xor_si256(u, c);
+}
+#endif
+
+// Words i to i + 3 of the AND of the two ranges.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+inline __m256i andBits256(const uint8_t *a, unsigned posA, const uint8_t *b, unsigned posB, size_t i) {
+  return _mm256_and_si256(loadBits256(a + i * 8, posA), loadBits256(b + i * 8, posB));
+}
+#endif
+
+// Sixteen vectors at a time are summed bit-sliced into ones, twos, fours and eights, only the carries
+// out into sixteens are popcounted.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+uint64_t BitArray::DotProdHarleySeal(const uint8_t *a, unsigned posA, const uint8_t *b, unsigned posB, size_t len) {
+  __m256i total = _mm256_setzero_si256(), ones = total, twos = total, fours = total, eights = total;
+  __m256i sixteens, twosA, twosB, foursA, foursB, eightsA, eightsB;
+  size_t numWords = len / 64, i(0);
+  for (; i + 64 <= numWords; i += 64) {
+    addBits256(twosA, ones, ones, andBits256(a, posA, b, posB, i), andBits256(a, posA, b, posB, i + 4));
+    addBits256(twosB, ones, ones, andBits256(a, posA, b, posB, i + 8), andBits256(a, posA, b, posB, i + 12));
+    addBits256(foursA, twos, twos, twosA, twosB);
+    addBits256(twosA, ones, ones, andBits256(a, posA, b, posB, i + 16), andBits256(a, posA, b, posB, i + 20));
+    addBits256(twosB, ones, ones, andBits256(a, posA, b, posB, i + 24), andBits256(a, posA, b, posB, i + 28));
+    addBits256(foursB, twos, twos, twosA, twosB);
+    addBits256(eightsA, fours, fours, foursA, foursB);
+    addBits256(twosA, ones, ones, andBits256(a, posA, b, posB, i + 32), andBits256(a, posA, b, posB, i + 36));
+    addBits256(twosB, ones, ones, andBits256(a, posA, b, posB, i + 40), andBits256(a, posA, b, posB, i + 44));
+    addBits256(foursA, twos, twos, twosA, twosB);
+    addBits256(twosA, ones, ones, andBits256(a, posA, b, posB, i + 48), andBits256(a, posA, b, posB, i + 52));
+    addBits256(twosB, ones, ones, andBits256(a, posA, b, posB, i + 56), andBits256(a, posA, b, posB, i + 60));
+    addBits256(foursB, twos, twos, twosA, twosB);
+    addBits256(eightsB, fours, fours, foursA, foursB);
+    addBits256(sixteens, eights, eights, eightsA, eightsB);
+    total = _mm256_add_epi64(total, countBits256(sixteens));
+  }
+  total = _mm256_slli_epi64(total, 4);
+  total = _mm256_add_epi64(total, _mm256_slli_epi64(countBits256(eights), 3));
+  total = _mm256_add_epi64(total, _mm256_slli_epi64(countBits256(fours), 2));
+  total = _mm256_add_epi64(total, _mm256_slli_epi64(countBits256(twos), 1));
+  total = _mm256_add_epi64(total, countBits256(ones));
+  for (; i + 4 <= numWords; i += 4)
+    total = _mm256_add_epi64(total, countBits256(andBits256(a, posA, b, posB, i)));
+
+  uint64_t sums[4];
+  _mm256_storeu_si256((__m256i *)sums, total);
+  uint64_t accum = sums[0] + sums[1] + sums[2] + sums[3];
+  for (; i * 64 < len; ++i)
+    accum += countBits(extractRange(a, posA + 64 * i, posA, posA + len) & extractRange(b, posB + 64 * i, posB, posB + len));
+  return accum;
+}
+#endif
+
+// 512 bits starting at bit pos of p as loadBits256.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+__attribute__((target("avx512f"))) 
+inline __m512i loadBits512(const uint8_t *p, unsigned pos) {
+  __m512i lo = _mm512_loadu_si512(p);
+  if (pos == 0)
+    return lo;
+  __m512i hi = _mm512_loadu_si512(p + 8);
+  return _mm512_or_si512(_mm512_maskz_srlv_epi64(0xFF, lo, _mm512_set1_epi64(pos)), _mm512_maskz_sllv_epi64(0xFF, hi, _mm512_set1_epi64(64 - pos)));
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) 
+uint64_t BitArray::DotProdVpopcnt(const uint8_t *a, unsigned posA, const uint8_t *b, unsigned posB, size_t len) {
+  __m512i total0 = _mm512_setzero_si512(), total1 = total0;
+  size_t numWords = len / 64, i(0);
+  for (; i + 16 <= numWords; i += 16) {
+    total0 = _mm512_add_epi64(total0, _mm512_popcnt_epi64(_mm512_and_si512(loadBits512(a + i * 8, posA), loadBits512(b + i * 8, posB))));
+    total1 = _mm512_add_epi64(total1, _mm512_popcnt_epi64(_mm512_and_si512(loadBits512(a + i * 8 + 64, posA), loadBits512(b + i * 8 + 64, posB))));
+  }
+  for (; i + 8 <= numWords; i += 8)
+    total0 = _mm512_add_epi64(total0, _mm512_popcnt_epi64(_mm512_and_si512(loadBits512(a + i * 8, posA), loadBits512(b + i * 8, posB))));
+
+  uint64_t sums[8], accum(0);
+  _mm512_storeu_si512(sums, _mm512_add_epi64(total0, total1));
+  for (size_t lane = 0; lane < 8; ++lane)
+    accum += sums[lane];
+  for (; i * 64 < len; ++i)
+    accum += countBits(extractRange(a, posA + 64 * i, posA, posA + len) & extractRange(b, posB + 64 * i, posB, posB + len));
+  return accum;
+}
+#endif
+
+uint64_t BitArray::loadWord(size_t w) const {
+  if ((w + 1) * 64 <= _size)
+    return *(const uint64_t *)&_data[w * 8];
+  if (w * 64 >= _size)
+    return 0;
+  return *(const uint64_t *)&_data[w * 8] & ((uint64_t(1) << (_size % 64)) - 1);
+}
+
+void BitArray::storeWord(size_t w, uint64_t value, size_t end) {
+  uint64_t *p_word = (uint64_t *)&_data[w * 8];
+  if ((w + 1) * 64 <= end)
+    *p_word = value;
+  else {
+    uint64_t mask = (uint64_t(1) << (end % 64)) - 1;
+    *p_word = (*p_word & ~mask) | (value & mask);
+  }
+}
+
+uint64_t BitArray::DotProd(const BitSpan &a, const BitSpan &b) {
+  if (a.size() != b.size())
+    throw std::runtime_error("BitSpan operands must be the same size.");
+  return Dispatch::Get<decltype(&DotProdDefault)>(Dispatch::DOTPROD)(a._base, unsigned(a._offset), b._base, unsigned(b._offset), a.size());
+}
+
+// Each thread sums whole 512 bit lines, DotProd only reads through the ProxyBits.
+uint64_t BitArray::DotProd(const Parallel &policy, const BitSpan &a, const BitSpan &b) {
+  if (a.size() != b.size())
+    throw std::runtime_error("BitSpan operands must be the same size.");
+  size_t numThreads = policy.Threads(a.size()), numLines = (a.size() + 511) / 512;
+  // Operands below the policy's threshold cost what the serial DotProd does.
+  if (numThreads == 1)
+    return DotProd(a, b);
+  std::vector<uint64_t> sums(numThreads);
+  ParallelFor(numThreads, [&](size_t k) {
+    size_t begin = numLines * k / numThreads * 512, end = std::min(a.size(), numLines * (k + 1) / numThreads * 512);
+    if (begin < end)
+      sums[k] = DotProd(ProxyBit(const_cast<uint8_t &>(a._base[(a._offset + begin) / 8]), (a._offset + begin) % 8),
+                        ProxyBit(const_cast<uint8_t &>(b._base[(b._offset + begin) / 8]), (b._offset + begin) % 8), end - begin);
+  });
+  uint64_t accum(0);
+  for (size_t k = 0; k < numThreads; ++k)
+    accum += sums[k];
+  return accum;
+}
+
+BitArray::Parallel::Parallel(size_t threads, size_t minBits) : threads(threads), minBits(minBits) {}
+
+// At least one line of 512 bits per thread.
+size_t BitArray::Parallel::Threads(size_t numBits) const {
+  if (numBits < minBits)
+    return 1;
+  size_t numThreads = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+  return std::max(size_t(1), std::min(numThreads, (numBits + 511) / 512));
+}
+
+void BitArray::ParallelFor(size_t numTasks, const std::function<void(size_t)> &task) {
+  std::vector<std::thread> workers;
+  for (size_t k = 0; k + 1 < numTasks; ++k)
+    workers.push_back(std::thread(task, k));
+  task(numTasks - 1);
+  for (size_t k = 0; k < workers.size(); ++k)
+    workers[k].join();
+}
+
+BitSpan::BitSpan(const void *data, size_t offset, size_t len) : _base((const uint8_t *)data + offset / 8), _offset(offset % 8), _size(len) {}
+
+BitSpan::BitSpan(const BitArray &bits) : _base(bits.data()), _offset(0), _size(bits.size()) {}
+
+BitSpan::BitSpan(const ProxyBit &start, size_t len) : _base(&start._byte), _offset(start._pos), _size(len) {}
+
+size_t BitSpan::size() const { return _size; }
+
+const uint8_t *BitSpan::data() const { return _base; }
+
+size_t BitSpan::offset() const { return _offset; }
+
+bool BitSpan::operator[](size_t i) const {
+  assert(i < _size);
+  return (_base[(_offset + i) / 8] >> ((_offset + i) & 7)) & 0x01;
+}
+
+// Past the first word the next byte only needs to be read when the word still holds bits of the view.
+uint64_t BitSpan::loadWord(size_t w) const {
+  if (w * 64 >= _size)
+    return 0;
+  uint64_t word = *(const uint64_t *)&_base[w * 8] >> _offset;
+  if (_offset && w * 64 + 64 - _offset < _size)
+    word |= uint64_t(_base[w * 8 + 8]) << (64 - _offset);
+  if ((w + 1) * 64 > _size)
+    word &= (uint64_t(1) << (_size % 64)) - 1;
+  return word;
+}
+
+const uint64_t *BitSpan::words() const { return _offset ? NULL : (const uint64_t *)_base; }
+
+template <size_t N> FixedBitArray<N>::FixedBitArray() : _words() {}
+
+template <size_t N> FixedBitArray<N>::FixedBitArray(const std::string &s) : _words() {
+  size_t i(0);
+  for (size_t k = 0; k < s.size(); ++k)
+    if (s[k] == '0' || s[k] == '1') {
+      if (i == N)
+        throw std::runtime_error("The string holds more bits than the array");
+      _words[i / 64] |= uint64_t(s[k] == '1') << (i % 64);
+      ++i;
+    }
+  if (i != N)
+    throw std::runtime_error("The string holds fewer bits than the array");
+}
+
+template <size_t N> constexpr size_t FixedBitArray<N>::size() { return N; }
+
+template <size_t N> const uint8_t *FixedBitArray<N>::data() const { return (const uint8_t *)_words; }
+
+template <size_t N> uint8_t *FixedBitArray<N>::data() { return (uint8_t *)_words; }
+
+template <size_t N> ProxyBit FixedBitArray<N>::operator[](size_t i) {
+  assert(i < N);
+  return ProxyBit(data()[i / 8], (i & 7));
+}
+
+template <size_t N> bool FixedBitArray<N>::operator[](size_t i) const {
+  assert(i < N);
+  return (_words[i / 64] >> (i % 64)) & 0x01;
+}
+
+template <size_t N> FixedBitArray<N>::operator BitSpan() const { return BitSpan(_words, 0, N); }
+
+BitExpr::BitExpr(const BitArray &bits) : _size(bits.size()) {
+  Node leaf = {LEAF, bits.data(), 0, 0, ptrdiff_t(bits.size())};
+  _nodes.push_back(leaf);
+}
+
+BitExpr::BitExpr(const BitSpan &bits) : _size(bits.size()) {
+  Node leaf = {LEAF, bits._base, ptrdiff_t(bits._offset), ptrdiff_t(bits._offset), ptrdiff_t(bits._offset + bits._size)};
+  _nodes.push_back(leaf);
+}
+
+BitExpr::BitExpr(const uint8_t *base, size_t begin, size_t len) : _size(len) {
+  Node leaf = {LEAF, base, ptrdiff_t(begin), ptrdiff_t(begin), ptrdiff_t(begin + len)};
+  _nodes.push_back(leaf);
+}
+
+size_t BitExpr::size() const { return _size; }
+
+BitExpr BitExpr::Combine(Op op, const BitExpr &a, const BitExpr &b) {
+  if (a._size != b._size)
+    throw std::runtime_error("BitArray operands must be the same size.");
+  BitExpr expr(a);
+  expr._nodes.insert(expr._nodes.end(), b._nodes.begin(), b._nodes.end());
+  expr._owned.insert(expr._owned.end(), b._owned.begin(), b._owned.end());
+  Node node = {op, NULL, 0, 0, 0};
+  expr._nodes.push_back(node);
+  return expr;
+}
+
+// A shifted leaf just reads its bits from another position, anything else is evaluated first.
+BitExpr BitExpr::Shift(size_t n, bool left) const {
+  BitExpr expr(*this);
+  if (_nodes.size() > 1) {
+    std::shared_ptr<BitArray> bits(new BitArray(*this));
+    expr = BitExpr(*bits);
+    expr._owned.push_back(bits);
+  }
+  n = std::min(n, _size);
+  expr._nodes[0].start += left ? -ptrdiff_t(n) : ptrdiff_t(n);
+  return expr;
+}
+
+inline BitExpr operator&(const BitExpr &a, const BitExpr &b) { return BitExpr::Combine(BitExpr::AND, a, b); }
+
+inline BitExpr operator|(const BitExpr &a, const BitExpr &b) { return BitExpr::Combine(BitExpr::OR, a, b); }
+
+inline BitExpr operator^(const BitExpr &a, const BitExpr &b) { return BitExpr::Combine(BitExpr::XOR, a, b); }
+
+inline BitExpr operator~(const BitExpr &a) {
+  BitExpr expr(a);
+  BitExpr::Node node = {BitExpr::NOT, NULL, 0, 0, 0};
+  expr._nodes.push_back(node);
+  return expr;
+}
+
+inline BitExpr operator<<(const BitExpr &a, size_t n) { return a.Shift(n, true); }
+
+inline BitExpr operator>>(const BitExpr &a, size_t n) { return a.Shift(n, false); }
+
+BitArray::BitArray(const BitExpr &expr) : _size(expr.size()), _data((_size + 7) / 8 + 7) { BitExprEval(expr, data(), 0); }
+
+BitArray &BitArray::operator=(const BitExpr &expr) {
+  if (expr.size() == _size)
+    BitExprEval(expr, data(), 0);
+  else {
+    BitArray bits(expr);
+    std::swap(_size, bits._size);
+    _data.swap(bits._data);
+  }
+  return *this;
+}
+
+BitArray &BitArray::operator&=(const BitExpr &expr) {
+  BitExprEval(*this & expr, data(), 0);
+  return *this;
+}
+
+BitArray &BitArray::operator|=(const BitExpr &expr) {
+  BitExprEval(*this | expr, data(), 0);
+  return *this;
+}
+
+BitArray &BitArray::operator^=(const BitExpr &expr) {
+  BitExprEval(*this ^ expr, data(), 0);
+  return *this;
+}
+
+BitArray &BitArray::operator<<=(size_t n) {
+  BitExprEval(*this << n, data(), 0);
+  return *this;
+}
+
+BitArray &BitArray::operator>>=(size_t n) {
+  BitExprEval(*this >> n, data(), 0);
+  return *this;
+}
+
+BitExpr BitArray::Range(const ProxyBit &start, size_t len) { return BitExpr(&start._byte, start._pos, len); }
+
+void BitArray::Assign(const ProxyBit &start, const BitExpr &expr) { BitExprEval(expr, &start._byte, start._pos); }
+
+// Writes bits [lo, hi) of word leaving the rest untouched.
+inline void depositRange(uint64_t *word, uint64_t value, size_t lo, size_t hi) {
+  uint64_t mask = (hi < 64 ? (uint64_t(1) << hi) - 1 : ~uint64_t(0)) & ~((uint64_t(1) << lo) - 1);
+  *word = (*word & ~mask) | (value & mask);
+}
+
+void BitArray::BitExprEval(const BitExpr &expr, uint8_t *base, size_t begin) {
+  size_t len = expr.size();
+  if (len == 0)
+    return;
+
+  // An operand overlapping the destination at another offset would be overwritten before it is read, so the result goes through a copy.
+  intptr_t dst = intptr_t(base) * 8 + begin;
+  for (size_t k = 0; k < expr._nodes.size(); ++k) {
+    const BitExpr::Node &node = expr._nodes[k];
+    intptr_t src = intptr_t(node.base) * 8;
+    if (node.op == BitExpr::LEAF && src + node.begin < dst + intptr_t(len) && dst < src + node.end && src + node.start != dst) {
+      BitArray bits(expr);
+      BitExprEval(BitExpr(bits), base, begin);
+      return;
+    }
+  }
+
+  const size_t blockWords = 256;
+  size_t numWords = (len + 63) / 64, depth(0), maxDepth(0);
+  for (size_t k = 0; k < expr._nodes.size(); ++k) {
+    BitExpr::Op op = expr._nodes[k].op;
+    depth = op == BitExpr::LEAF ? depth + 1 : op == BitExpr::NOT ? depth : depth - 1;
+    maxDepth = std::max(maxDepth, depth);
+  }
+  std::vector<uint64_t> stack(maxDepth * blockWords), out(blockWords);
+  unsigned shift = begin % 64;
+  uint64_t *dstWords = (uint64_t *)(base + begin / 64 * 8);
+  size_t end = shift + len; // The bits of dstWords being written
+  uint64_t carry(0);
+
+  for (size_t w0 = 0; w0 < numWords; w0 += blockWords) {
+    size_t n = std::min(blockWords, numWords - w0), top(0);
+    for (size_t k = 0; k < expr._nodes.size(); ++k) {
+      const BitExpr::Node &node = expr._nodes[k];
+      if (node.op == BitExpr::LEAF) {
+        uint64_t *p = &stack[top++ * blockWords];
+        // Words a to b lie inside [begin, end) and go through the kernel, the edges are read one at a time.
+        ptrdiff_t first = node.begin - node.start, last = node.end - node.start - 64;
+        size_t a = std::max(first <= 0 ? 0 : size_t(first + 63) / 64, w0);
+        size_t b = std::min(last < 0 ? 0 : size_t(last) / 64 + 1, w0 + n);
+        if (a >= b)
+          a = b = w0 + n;
+        for (size_t w = w0; w < a; ++w)
+          p[w - w0] = extractRange(node.base, node.start + 64 * ptrdiff_t(w), node.begin, node.end);
+        if (a < b) {
+          ptrdiff_t pos = node.start + 64 * ptrdiff_t(a);
+          BitExprLoad((const uint64_t *)(node.base + pos / 64 * 8), pos % 64, p + a - w0, b - a);
+        }
+        for (size_t w = b; w < w0 + n; ++w)
+          p[w - w0] = extractRange(node.base, node.start + 64 * ptrdiff_t(w), node.begin, node.end);
+      } else if (node.op == BitExpr::NOT)
+        BitExprApply(node.op, &stack[(top - 1) * blockWords], NULL, n);
+      else {
+        --top;
+        BitExprApply(node.op, &stack[(top - 1) * blockWords], &stack[top * blockWords], n);
+      }
+    }
+
+    const uint64_t *v = &stack[0];
+    if (shift) {
+      BitExprShift(v, carry, shift, &out[0], n);
+      carry = v[n - 1];
+      v = &out[0];
+    }
+
+    // Whole words are copied, the first and last only have the bits being written replaced.
+    size_t i = (w0 == 0 && shift) ? 1 : 0, full = std::min(w0 + n, end / 64);
+    if (i)
+      depositRange(dstWords, v[0], shift, std::min<size_t>(end, 64));
+    if (w0 + i < full)
+      std::copy(v + i, v + full - w0, dstWords + w0 + i);
+    for (size_t w = std::max(full, w0 + i); w < w0 + n; ++w)
+      depositRange(dstWords + w, v[w - w0], 0, end - 64 * w);
+  }
+  if (end > 64 * numWords)
+    depositRange(dstWords + numWords, carry >> (64 - shift), 0, end - 64 * numWords);
+}
+
+/**
+ * Destination word j, counted from the one holding bit dstPos, takes source bits from
+ * srcPos - shift + 64 * j. The partial first and last words are read before anything is written and
+ * deposited last, the whole words in between are loaded a block at a time, straight into the
+ * destination unless the two overlap. Then they go through a buffer, the blocks running backwards
+ * when the destination lies after the source.
+ */
+void BitArray::CopyBits(const uint8_t *src, size_t srcPos, uint8_t *dst, size_t dstPos, size_t len) {
+  if (len == 0)
+    return;
+  uint64_t *dstWords = (uint64_t *)(dst + dstPos / 64 * 8);
+  size_t shift = dstPos % 64, end = shift + len, first = shift ? 1 : 0, last = end / 64;
+  ptrdiff_t from = ptrdiff_t(srcPos) - ptrdiff_t(shift), begin = srcPos, stop = srcPos + len;
+  uint64_t head = extractRange(src, from, begin, stop), tail = extractRange(src, from + 64 * ptrdiff_t(last), begin, stop);
+
+  if (first < last) {
+    intptr_t srcBit = intptr_t(src) * 8 + ptrdiff_t(srcPos), dstBit = intptr_t(dst) * 8 + ptrdiff_t(dstPos);
+    bool overlap = srcBit < dstBit + intptr_t(len) && dstBit < srcBit + intptr_t(len);
+    const size_t blockWords = 256;
+    uint64_t buffer[blockWords];
+    size_t numBlocks = (last - first + blockWords - 1) / blockWords;
+    for (size_t k = 0; k < numBlocks; ++k) {
+      size_t block = overlap && dstBit > srcBit ? numBlocks - 1 - k : k;
+      size_t w = first + block * blockWords, n = std::min(blockWords, last - w);
+      ptrdiff_t pos = from + 64 * ptrdiff_t(w);
+      BitExprLoad((const uint64_t *)(src + pos / 64 * 8), unsigned(pos % 64), overlap ? buffer : dstWords + w, n);
+      if (overlap)
+        std::copy(buffer, buffer + n, dstWords + w);
+    }
+  }
+
+  if (first)
+    depositRange(dstWords, head, shift, std::min(end, size_t(64)));
+  if (end % 64 && last >= first)
+    depositRange(dstWords + last, tail, 0, end % 64);
+}
+
+namespace {
+// The columns kept by each stage of Transpose64, those with the bit of the block size clear.
+const uint64_t transposeMasks[6] = {0x00000000FFFFFFFFULL, 0x0000FFFF0000FFFFULL, 0x00FF00FF00FF00FFULL,
+                                    0x0F0F0F0F0F0F0F0FULL, 0x3333333333333333ULL, 0x5555555555555555ULL};
+
+// The 64 bits starting at bit pos of base, reading the byte after them only when it holds some.
+inline uint64_t loadBits(const uint8_t *base, size_t pos) {
+  const uint8_t *p = base + pos / 8;
+  size_t shift = pos % 8;
+  return shift ? (*(const uint64_t *)p >> shift) | (uint64_t(p[8]) << (64 - shift)) : *(const uint64_t *)p;
+}
+
+// Writes 64 bits starting at bit pos of base, leaving the bits around them untouched.
+inline void storeBits(uint8_t *base, size_t pos, uint64_t value) {
+  uint8_t *p = base + pos / 8;
+  size_t shift = pos % 8;
+  if (shift == 0) {
+    *(uint64_t *)p = value;
+    return;
+  }
+  uint8_t low = uint8_t((1 << shift) - 1);
+  *(uint64_t *)p = (*(uint64_t *)p & low) | (value << shift);
+  p[8] = uint8_t((p[8] & ~low) | (value >> (64 - shift)));
+}
+} // namespace
+
+/**
+ * Each 64 x 64 tile of the matrix is loaded a row at a time, transposed and stored a column at a
+ * time, whole rows and columns with single unaligned loads and stores. The tiles go down the rows
+ * first so that the columns are written out in order.
+ */
+void BitArray::Transpose(const BitSpan &bits, size_t rows, size_t cols, BitArray &result, size_t pos) {
+  if (cols && rows > bits.size() / cols)
+    throw std::runtime_error("The matrix must fit in the bits");
+  if (pos > result.size() || result.size() - pos < rows * cols)
+    throw std::runtime_error("Results of the transpose must be at least large enough to hold the result");
+  uint64_t tile[64];
+  uint64_t *out = (uint64_t *)result.data();
+  for (size_t c0 = 0; c0 < cols; c0 += 64)
+    for (size_t r0 = 0; r0 < rows; r0 += 64) {
+      size_t numRows = std::min(size_t(64), rows - r0), numCols = std::min(size_t(64), cols - c0);
+      for (size_t r = 0; r < 64; ++r) {
+        size_t start = bits._offset + (r0 + r) * cols + c0;
+        if (r >= numRows)
+          tile[r] = 0;
+        else
+          tile[r] = numCols == 64 ? loadBits(bits._base, start) : extractRange(bits._base, start, start, start + numCols);
+      }
+      Transpose64(tile);
+      for (size_t c = 0; c < numCols; ++c)
+        if (numRows == 64)
+          storeBits(result.data(), pos + (c0 + c) * rows + r0, tile[c]);
+        else
+          DepositWords(&tile[c], numRows, out, pos + (c0 + c) * rows + r0);
+    }
+}
+
+void BitArray::Transpose64(uint64_t *m) { Dispatch::Get<decltype(&Transpose64Default)>(Dispatch::TRANSPOSE)(m); }
+
+void BitArray::Transpose64Default(uint64_t *m) {
+  for (size_t s = 0, j = 32; s < 6; ++s, j /= 2)
+    for (size_t k = 0; k < 64; k = (k + j + 1) & ~j) {
+      uint64_t t = ((m[k] >> j) ^ m[k + j]) & transposeMasks[s];
+      m[k + j] ^= t;
+      m[k] ^= t << j;
+    }
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("sse2"))) 
+void BitArray::Transpose64Sse2(uint64_t *m) {
+  __m128i *v = (__m128i *)m;
+  for (size_t s = 0, j = 32; s < 5; ++s, j /= 2) {
+    __m128i mask = _mm_set1_epi64x(transposeMasks[s]), shift = _mm_cvtsi32_si128(int(j));
+    for (size_t k = 0; k < 32; k = (k + j / 2 + 1) & ~(j / 2)) {
+      __m128i a = _mm_loadu_si128(&v[k]), b = _mm_loadu_si128(&v[k + j / 2]);
+      __m128i t = _mm_and_si128(_mm_xor_si128(_mm_srl_epi64(a, shift), b), mask);
+      _mm_storeu_si128(&v[k + j / 2], _mm_xor_si128(b, t));
+      _mm_storeu_si128(&v[k], _mm_xor_si128(a, _mm_sll_epi64(t, shift)));
+    }
+  }
+  // The last stage pairs the two words of each vector.
+  __m128i mask = _mm_set1_epi64x(transposeMasks[5]);
+  for (size_t k = 0; k < 32; k += 2) {
+    __m128i v0 = _mm_loadu_si128(&v[k]), v1 = _mm_loadu_si128(&v[k + 1]);
+    __m128i a = _mm_unpacklo_epi64(v0, v1), b = _mm_unpackhi_epi64(v0, v1);
+    __m128i t = _mm_and_si128(_mm_xor_si128(_mm_srli_epi64(a, 1), b), mask);
+    b = _mm_xor_si128(b, t);
+    a = _mm_xor_si128(a, _mm_slli_epi64(t, 1));
+    _mm_storeu_si128(&v[k], _mm_unpacklo_epi64(a, b));
+    _mm_storeu_si128(&v[k + 1], _mm_unpackhi_epi64(a, b));
+  }
+}
+#endif
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+void BitArray::Transpose64Avx2(uint64_t *m) {
+  __m256i *v = (__m256i *)m;
+  for (size_t s = 0, j = 32; s < 4; ++s, j /= 2) {
+    __m256i mask = _mm256_set1_epi64x(transposeMasks[s]);
+    __m128i shift = _mm_cvtsi32_si128(int(j));
+    for (size_t k = 0; k < 16; k = (k + j / 4 + 1) & ~(j / 4)) {
+      __m256i a = _mm256_loadu_si256(&v[k]), b = _mm256_loadu_si256(&v[k + j / 4]);
+      __m256i t = _mm256_and_si256(_mm256_xor_si256(_mm256_srl_epi64(a, shift), b), mask);
+      _mm256_storeu_si256(&v[k + j / 4], _mm256_xor_si256(b, t));
+      _mm256_storeu_si256(&v[k], _mm256_xor_si256(a, _mm256_sll_epi64(t, shift)));
+    }
+  }
+  // The last two stages pair words within each two vectors, rearranged so that the pairs line up.
+  __m256i mask2 = _mm256_set1_epi64x(transposeMasks[4]), mask1 = _mm256_set1_epi64x(transposeMasks[5]);
+  for (size_t k = 0; k < 16; k += 2) {
+    __m256i v0 = _mm256_loadu_si256(&v[k]), v1 = _mm256_loadu_si256(&v[k + 1]);
+    __m256i a = _mm256_permute2x128_si256(v0, v1, 0x20), b = _mm256_permute2x128_si256(v0, v1, 0x31);
+    __m256i t = _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi64(a, 2), b), mask2);
+    b = _mm256_xor_si256(b, t);
+    a = _mm256_xor_si256(a, _mm256_slli_epi64(t, 2));
+    v0 = _mm256_permute2x128_si256(a, b, 0x20);
+    v1 = _mm256_permute2x128_si256(a, b, 0x31);
+    a = _mm256_unpacklo_epi64(v0, v1);
+    b = _mm256_unpackhi_epi64(v0, v1);
+    t = _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi64(a, 1), b), mask1);
+    b = _mm256_xor_si256(b, t);
+    a = _mm256_xor_si256(a, _mm256_slli_epi64(t, 1));
+    _mm256_storeu_si256(&v[k], _mm256_unpacklo_epi64(a, b));
+    _mm256_storeu_si256(&v[k + 1], _mm256_unpackhi_epi64(a, b));
+  }
+}
+#endif
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+__attribute__((target("avx512f,avx512vbmi"))) 
+void BitArray::Transpose64Vbmi(uint64_t *m) {
+  __m512i v[8];
+  for (size_t k = 0; k < 8; ++k)
+    v[k] = _mm512_loadu_si512(&m[8 * k]);
+  for (size_t s = 0, j = 32; s < 3; ++s, j /= 2) {
+    __m512i mask = _mm512_set1_epi64(int64_t(transposeMasks[s]));
+    __m128i shift = _mm_cvtsi32_si128(int(j));
+    for (size_t k = 0; k < 8; k = (k + j / 8 + 1) & ~(j / 8)) {
+      __m512i t = _mm512_and_si512(_mm512_xor_si512(_mm512_maskz_srl_epi64(0xFF, v[k], shift), v[k + j / 8]), mask);
+      v[k + j / 8] = _mm512_xor_si512(v[k + j / 8], t);
+      v[k] = _mm512_xor_si512(v[k], _mm512_maskz_sll_epi64(0xFF, t, shift));
+    }
+  }
+  // The last three stages transpose the 8 x 8 blocks within each vector. Gathering byte b of its eight
+  // words into word b puts each block in one word, transposed there and scattered back the same way.
+  const __m512i bytes = _mm512_set_epi64(0x3F372F271F170F07LL, 0x3E362E261E160E06LL, 0x3D352D251D150D05LL, 0x3C342C241C140C04LL,
+                                         0x3B332B231B130B03LL, 0x3A322A221A120A02LL, 0x3931292119110901LL, 0x3830282018100800LL);
+  const __m512i mask7 = _mm512_set1_epi64(0x00AA00AA00AA00AALL), mask14 = _mm512_set1_epi64(0x0000CCCC0000CCCCLL),
+                mask28 = _mm512_set1_epi64(0x00000000F0F0F0F0LL);
+  for (size_t k = 0; k < 8; ++k) {
+    __m512i x = _mm512_maskz_permutexvar_epi8(~0ULL, bytes, v[k]);
+    __m512i t = _mm512_and_si512(_mm512_xor_si512(x, _mm512_maskz_srli_epi64(0xFF, x, 7)), mask7);
+    x = _mm512_xor_si512(x, _mm512_xor_si512(t, _mm512_maskz_slli_epi64(0xFF, t, 7)));
+    t = _mm512_and_si512(_mm512_xor_si512(x, _mm512_maskz_srli_epi64(0xFF, x, 14)), mask14);
+    x = _mm512_xor_si512(x, _mm512_xor_si512(t, _mm512_maskz_slli_epi64(0xFF, t, 14)));
+    t = _mm512_and_si512(_mm512_xor_si512(x, _mm512_maskz_srli_epi64(0xFF, x, 28)), mask28);
+    x = _mm512_xor_si512(x, _mm512_xor_si512(t, _mm512_maskz_slli_epi64(0xFF, t, 28)));
+    _mm512_storeu_si512(&m[8 * k], _mm512_maskz_permutexvar_epi8(~0ULL, bytes, x));
+  }
+}
+#endif
+
+void BitArray::DepositWords(const uint64_t *words, size_t numBits, uint64_t *out, size_t pos) {
+  size_t shift = pos % 64;
+  out += pos / 64;
+  for (size_t w = 0; w * 64 < numBits; ++w) {
+    size_t len = std::min(size_t(64), numBits - w * 64);
+    depositRange(&out[w], words[w] << shift, shift, std::min(size_t(64), shift + len));
+    if (shift + len > 64)
+      depositRange(&out[w + 1], words[w] >> (64 - shift), 0, shift + len - 64);
+  }
+}
+
+void BitArray::PackBytes(const uint8_t *bytes, size_t n, BitArray &dest, size_t pos) { PackRun(bytes, n, PACK_NONZERO, dest, pos); }
+
+void BitArray::PackBools(const bool *bools, size_t n, BitArray &dest, size_t pos) { PackRun((const uint8_t *)bools, n, PACK_NONZERO, dest, pos); }
+
+void BitArray::PackSymbols(const int8_t *symbols, size_t n, BitArray &dest, size_t pos) { PackRun((const uint8_t *)symbols, n, PACK_POSITIVE, dest, pos); }
+
+void BitArray::PackText(const char *text, size_t n, BitArray &dest, size_t pos) { PackRun((const uint8_t *)text, n, PACK_ONE, dest, pos); }
+
+void BitArray::UnpackBytes(const BitSpan &bits, uint8_t *bytes) { UnpackRun(bits, 0, 1, bytes); }
+
+void BitArray::UnpackBools(const BitSpan &bits, bool *bools) { UnpackRun(bits, 0, 1, (uint8_t *)bools); }
+
+void BitArray::UnpackSymbols(const BitSpan &bits, int8_t *symbols, int8_t magnitude) { UnpackRun(bits, uint8_t(-magnitude), uint8_t(magnitude), (uint8_t *)symbols); }
+
+void BitArray::PackMatch(int kind, uint8_t &orBits, uint8_t &equal, bool &invert) {
+  orBits = kind == PACK_DIGIT ? 1 : 0;
+  equal = kind == PACK_NONZERO ? 0 : '1';
+  invert = kind == PACK_NONZERO;
+}
+
+// Packs a block of words at a time, the last partial word from a copy padded with zeros.
+void BitArray::PackRun(const uint8_t *src, size_t n, int kind, BitArray &dest, size_t pos) {
+  if (pos > dest.size() || dest.size() - pos < n)
+    throw std::runtime_error("The destination must be large enough to hold the packed bits");
+  const size_t blockWords = 256;
+  uint64_t words[blockWords];
+  for (size_t w0 = 0; w0 * 64 < n; w0 += blockWords) {
+    size_t numBits = std::min(blockWords * 64, n - w0 * 64), numFull = numBits / 64;
+    PackBlock(src + w0 * 64, numFull, kind, words);
+    if (numBits % 64) {
+      uint8_t tail[64] = {0};
+      std::copy(src + w0 * 64 + numFull * 64, src + w0 * 64 + numBits, tail);
+      PackBlock(tail, 1, kind, &words[numFull]);
+    }
+    DepositWords(words, numBits, (uint64_t *)dest.data(), pos + w0 * 64);
+  }
+}
+
+void BitArray::UnpackRun(const BitSpan &bits, uint8_t zero, uint8_t one, uint8_t *out) {
+  const size_t blockWords = 256;
+  uint64_t words[blockWords];
+  for (size_t w0 = 0; w0 * 64 < bits.size(); w0 += blockWords) {
+    size_t numBits = std::min(blockWords * 64, bits.size() - w0 * 64), numFull = numBits / 64;
+    BitExprLoad((const uint64_t *)bits._base + w0, unsigned(bits._offset), words, numFull);
+    UnpackBlock(words, numFull, zero, one, out + w0 * 64);
+    if (numBits % 64) {
+      uint8_t tail[64];
+      words[numFull] = bits.loadWord(w0 + numFull);
+      UnpackBlock(&words[numFull], 1, zero, one, tail);
+      std::copy(tail, tail + numBits % 64, out + w0 * 64 + numFull * 64);
+    }
+  }
+}
+
+void BitArray::PackBlock(const uint8_t *src, size_t numWords, int kind, uint64_t *words) {
+  Dispatch::Get<decltype(&PackBlockDefault)>(Dispatch::PACK)(src, numWords, kind, words);
+}
+
+void BitArray::PackBlockDefault(const uint8_t *src, size_t numWords, int kind, uint64_t *words) {
+  uint8_t orBits, equal;
+  bool invert;
+  PackMatch(kind, orBits, equal, invert);
+  for (size_t w = 0; w < numWords; ++w, src += 64) {
+    uint64_t word(0);
+    for (size_t i = 0; i < 64; ++i)
+      word |= uint64_t(kind == PACK_POSITIVE ? int8_t(src[i]) > 0 : ((src[i] | orBits) == equal) != invert) << i;
+    words[w] = word;
+  }
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("sse2"))) 
+void BitArray::PackBlockSse2(const uint8_t *src, size_t numWords, int kind, uint64_t *words) {
+  uint8_t orBits, equal;
+  bool invert;
+  PackMatch(kind, orBits, equal, invert);
+  __m128i orVec = _mm_set1_epi8(orBits), equalVec = _mm_set1_epi8(equal), zero = _mm_setzero_si128();
+  uint64_t flip = invert ? ~uint64_t(0) : 0;
+  for (size_t w = 0; w < numWords; ++w, src += 64) {
+    uint64_t word(0);
+    for (size_t i = 0; i < 64; i += 16) {
+      __m128i x = _mm_loadu_si128((__m128i const *)&src[i]);
+      __m128i match = kind == PACK_POSITIVE ? _mm_cmpgt_epi8(x, zero) : _mm_cmpeq_epi8(_mm_or_si128(x, orVec), equalVec);
+      word |= uint64_t(unsigned(_mm_movemask_epi8(match))) << i;
+    }
+    words[w] = word ^ flip;
+  }
+}
+#endif
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+void BitArray::PackMovemask(const uint8_t *src, size_t numWords, int kind, uint64_t *words) {
+  uint8_t orBits, equal;
+  bool invert;
+  PackMatch(kind, orBits, equal, invert);
+  __m256i orVec = _mm256_set1_epi8(orBits), equalVec = _mm256_set1_epi8(equal), zero = _mm256_setzero_si256();
+  uint64_t flip = invert ? ~uint64_t(0) : 0;
+  for (size_t w = 0; w < numWords; ++w, src += 64) {
+    __m256i lo = _mm256_loadu_si256((__m256i const *)src), hi = _mm256_loadu_si256((__m256i const *)&src[32]);
+    if (kind == PACK_POSITIVE) {
+      lo = _mm256_cmpgt_epi8(lo, zero);
+      hi = _mm256_cmpgt_epi8(hi, zero);
+    } else {
+      lo = _mm256_cmpeq_epi8(_mm256_or_si256(lo, orVec), equalVec);
+      hi = _mm256_cmpeq_epi8(_mm256_or_si256(hi, orVec), equalVec);
+    }
+    words[w] = (uint64_t(unsigned(_mm256_movemask_epi8(lo))) | (uint64_t(unsigned(_mm256_movemask_epi8(hi))) << 32)) ^ flip;
+  }
+}
+#endif
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+__attribute__((target("avx512f,avx512bw"))) 
+void BitArray::PackMasks(const uint8_t *src, size_t numWords, int kind, uint64_t *words) {
+  uint8_t orBits, equal;
+  bool invert;
+  PackMatch(kind, orBits, equal, invert);
+  __m512i orVec = _mm512_set1_epi8(orBits), equalVec = _mm512_set1_epi8(equal), zero = _mm512_setzero_si512();
+  uint64_t flip = invert ? ~uint64_t(0) : 0;
+  for (size_t w = 0; w < numWords; ++w, src += 64) {
+    __m512i x = _mm512_loadu_si512(src);
+    words[w] = kind == PACK_POSITIVE ? _mm512_cmpgt_epi8_mask(x, zero) : _mm512_cmpeq_epi8_mask(_mm512_or_si512(x, orVec), equalVec) ^ flip;
+  }
+}
+#endif
+
+void BitArray::UnpackBlock(const uint64_t *words, size_t numWords, uint8_t zero, uint8_t one, uint8_t *out) {
+  Dispatch::Get<decltype(&UnpackBlockDefault)>(Dispatch::UNPACK)(words, numWords, zero, one, out);
+}
+
+void BitArray::UnpackBlockDefault(const uint64_t *words, size_t numWords, uint8_t zero, uint8_t one, uint8_t *out) {
+  for (size_t w = 0; w < numWords; ++w, out += 64)
+    for (size_t i = 0; i < 64; ++i)
+      out[i] = (words[w] >> i) & 1 ? one : zero;
+}
+
+// Each byte of a 16 bit chunk is spread over 8 bytes, which are tested against their bit.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("sse2"))) 
+void BitArray::UnpackBlockSse2(const uint64_t *words, size_t numWords, uint8_t zero, uint8_t one, uint8_t *out) {
+  __m128i bitMask = _mm_set1_epi64x(0x8040201008040201), zeroVec = _mm_set1_epi8(zero), diff = _mm_set1_epi8(zero ^ one);
+  for (size_t w = 0; w < numWords; ++w)
+    for (size_t i = 0; i < 64; i += 16, out += 16) {
+      __m128i x = _mm_cvtsi32_si128(int((words[w] >> i) & 0xFFFF));
+      x = _mm_unpacklo_epi8(x, x);
+      x = _mm_unpacklo_epi16(x, x);
+      x = _mm_unpacklo_epi32(x, x);
+      __m128i set = _mm_cmpeq_epi8(_mm_and_si128(x, bitMask), bitMask);
+      _mm_storeu_si128((__m128i *)out, _mm_xor_si128(zeroVec, _mm_and_si128(set, diff)));
+    }
+}
+#endif
+
+// The four bytes of a 32 bit chunk are each spread over 8 bytes, which are tested against their bit.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+void BitArray::UnpackShuffle(const uint64_t *words, size_t numWords, uint8_t zero, uint8_t one, uint8_t *out) {
+  const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+  __m256i bitMask = _mm256_set1_epi64x(0x8040201008040201), zeroVec = _mm256_set1_epi8(zero), oneVec = _mm256_set1_epi8(one);
+  for (size_t w = 0; w < numWords; ++w)
+    for (size_t i = 0; i < 64; i += 32, out += 32) {
+      __m256i x = _mm256_shuffle_epi8(_mm256_set1_epi32(int(words[w] >> i)), spread);
+      __m256i set = _mm256_cmpeq_epi8(_mm256_and_si256(x, bitMask), bitMask);
+      _mm256_storeu_si256((__m256i *)out, _mm256_blendv_epi8(zeroVec, oneVec, set));
+    }
+}
+#endif
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+__attribute__((target("avx512f,avx512bw"))) 
+void BitArray::UnpackMasks(const uint64_t *words, size_t numWords, uint8_t zero, uint8_t one, uint8_t *out) {
+  __m512i zeroVec = _mm512_set1_epi8(zero), oneVec = _mm512_set1_epi8(one);
+  for (size_t w = 0; w < numWords; ++w, out += 64)
+    _mm512_storeu_si512(out, _mm512_mask_blend_epi8(words[w], zeroVec, oneVec));
+}
+#endif
+
+void BitArray::BitExprLoad(const uint64_t *words, unsigned shift, uint64_t *out, size_t numWords) {
+  Dispatch::Get<decltype(&BitExprLoadDefault)>(Dispatch::BITEXPR, 0)(words, shift, out, numWords);
+}
+
+void BitArray::BitExprLoadDefault(const uint64_t *words, unsigned shift, uint64_t *out, size_t numWords) {
+  for (size_t i = 0; i < numWords; ++i)
+    out[i] = shift ? (words[i] >> shift) | (words[i + 1] << (64 - shift)) : words[i];
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("sse2"))) 
+void BitArray::BitExprLoadSse2(const uint64_t *words, unsigned shift, uint64_t *out, size_t numWords) {
+  __m128i right = _mm_cvtsi32_si128(shift), left = _mm_cvtsi32_si128(64 - shift);
+  size_t i(0);
+  if (shift == 0)
+    for (; i + 2 <= numWords; i += 2)
+      _mm_storeu_si128((__m128i *)&out[i], _mm_loadu_si128((__m128i const *)&words[i]));
+  else
+    for (; i + 2 <= numWords; i += 2) {
+      __m128i lo = _mm_loadu_si128((__m128i const *)&words[i]);
+      __m128i hi = _mm_loadu_si128((__m128i const *)&words[i + 1]);
+      _mm_storeu_si128((__m128i *)&out[i], _mm_or_si128(_mm_srl_epi64(lo, right), _mm_sll_epi64(hi, left)));
+    }
+  for (; i < numWords; ++i)
+    out[i] = shift ? (words[i] >> shift) | (words[i + 1] << (64 - shift)) : words[i];
+}
+#endif
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+void BitArray::BitExprLoadAvx2(const uint64_t *words, unsigned shift, uint64_t *out, size_t numWords) {
+  __m128i right = _mm_cvtsi32_si128(shift), left = _mm_cvtsi32_si128(64 - shift);
+  size_t i(0);
+  if (shift == 0)
+    for (; i + 4 <= numWords; i += 4)
+      _mm256_storeu_si256((__m256i *)&out[i], _mm256_loadu_si256((__m256i const *)&words[i]));
+  else
+    for (; i + 4 <= numWords; i += 4) {
+      __m256i lo = _mm256_loadu_si256((__m256i const *)&words[i]);
+      __m256i hi = _mm256_loadu_si256((__m256i const *)&words[i + 1]);
+      _mm256_storeu_si256((__m256i *)&out[i], _mm256_or_si256(_mm256_srl_epi64(lo, right), _mm256_sll_epi64(hi, left)));
+    }
+  for (; i < numWords; ++i)
+    out[i] = shift ? (words[i] >> shift) | (words[i + 1] << (64 - shift)) : words[i];
+}
+#endif
+
+// The zero masked shifts avoid a spurious uninitialized warning from GCC 12 about the unmasked ones.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+__attribute__((target("avx512f"))) 
+void BitArray::BitExprLoadAvx512(const uint64_t *words, unsigned shift, uint64_t *out, size_t numWords) {
+  __m512i right = _mm512_set1_epi64(shift), left = _mm512_set1_epi64(64 - shift);
+  size_t i(0);
+  if (shift == 0)
+    for (; i + 8 <= numWords; i += 8)
+      _mm512_storeu_si512(&out[i], _mm512_loadu_si512(&words[i]));
+  else
+    for (; i + 8 <= numWords; i += 8) {
+      __m512i lo = _mm512_loadu_si512(&words[i]);
+      __m512i hi = _mm512_loadu_si512(&words[i + 1]);
+      _mm512_storeu_si512(&out[i], _mm512_or_si512(_mm512_maskz_srlv_epi64(0xFF, lo, right), _mm512_maskz_sllv_epi64(0xFF, hi, left)));
+    }
+  for (; i < numWords; ++i)
+    out[i] = shift ? (words[i] >> shift) | (words[i + 1] << (64 - shift)) : words[i];
+}
+#endif
+
+void BitArray::BitExprApply(int op, uint64_t *a, const uint64_t *b, size_t numWords) {
+  Dispatch::Get<decltype(&BitExprApplyDefault)>(Dispatch::BITEXPR, 1)(op, a, b, numWords);
+}
+
+// NOT is done as an XOR with all ones, b is not read.
+void BitArray::BitExprApplyDefault(int op, uint64_t *a, const uint64_t *b, size_t numWords) {
+  for (size_t i = 0; i < numWords; ++i) {
+    uint64_t y = op == BitExpr::NOT ? ~uint64_t(0) : b[i];
+    a[i] = op == BitExpr::AND ? a[i] & y : op == BitExpr::OR ? a[i] | y : a[i] ^ y;
+  }
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("sse2"))) 
+void BitArray::BitExprApplySse2(int op, uint64_t *a, const uint64_t *b, size_t numWords) {
+  size_t i(0);
+  for (; i + 2 <= numWords; i += 2) {
+    __m128i x = _mm_loadu_si128((__m128i const *)&a[i]);
+    __m128i y = op == BitExpr::NOT ? _mm_set1_epi32(-1) : _mm_loadu_si128((__m128i const *)&b[i]);
+    x = op == BitExpr::AND ? _mm_and_si128(x, y) : op == BitExpr::OR ? _mm_or_si128(x, y) : _mm_xor_si128(x, y);
+    _mm_storeu_si128((__m128i *)&a[i], x);
+  }
+  for (; i < numWords; ++i) {
+    uint64_t y = op == BitExpr::NOT ? ~uint64_t(0) : b[i];
+    a[i] = op == BitExpr::AND ? a[i] & y : op == BitExpr::OR ? a[i] | y : a[i] ^ y;
+  }
+}
+#endif
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+void BitArray::BitExprApplyAvx2(int op, uint64_t *a, const uint64_t *b, size_t numWords) {
+  size_t i(0);
+  for (; i + 4 <= numWords; i += 4) {
+    __m256i x = _mm256_loadu_si256((__m256i const *)&a[i]);
+    __m256i y = op == BitExpr::NOT ? _mm256_set1_epi32(-1) : _mm256_loadu_si256((__m256i const *)&b[i]);
+    x = op == BitExpr::AND ? _mm256_and_si256(x, y) : op == BitExpr::OR ? _mm256_or_si256(x, y) : _mm256_xor_si256(x, y);
+    _mm256_storeu_si256((__m256i *)&a[i], x);
+  }
+  for (; i < numWords; ++i) {
+    uint64_t y = op == BitExpr::NOT ? ~uint64_t(0) : b[i];
+    a[i] = op == BitExpr::AND ? a[i] & y : op == BitExpr::OR ? a[i] | y : a[i] ^ y;
+  }
+}
+#endif
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+__attribute__((target("avx512f"))) 
+void BitArray::BitExprApplyAvx512(int op, uint64_t *a, const uint64_t *b, size_t numWords) {
+  size_t i(0);
+  for (; i + 8 <= numWords; i += 8) {
+    __m512i x = _mm512_loadu_si512(&a[i]);
+    __m512i y = op == BitExpr::NOT ? _mm512_set1_epi32(-1) : _mm512_loadu_si512(&b[i]);
+    x = op == BitExpr::AND ? _mm512_and_si512(x, y) : op == BitExpr::OR ? _mm512_or_si512(x, y) : _mm512_xor_si512(x, y);
+    _mm512_storeu_si512(&a[i], x);
+  }
+  for (; i < numWords; ++i) {
+    uint64_t y = op == BitExpr::NOT ? ~uint64_t(0) : b[i];
+    a[i] = op == BitExpr::AND ? a[i] & y : op == BitExpr::OR ? a[i] | y : a[i] ^ y;
+  }
+}
+#endif
+
+void BitArray::BitExprShift(const uint64_t *v, uint64_t carry, unsigned shift, uint64_t *out, size_t numWords) {
+  Dispatch::Get<decltype(&BitExprShiftDefault)>(Dispatch::BITEXPR, 2)(v, carry, shift, out, numWords);
+}
+
+void BitArray::BitExprShiftDefault(const uint64_t *v, uint64_t carry, unsigned shift, uint64_t *out, size_t numWords) {
+  out[0] = (v[0] << shift) | (carry >> (64 - shift));
+  for (size_t i = 1; i < numWords; ++i)
+    out[i] = (v[i] << shift) | (v[i - 1] >> (64 - shift));
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("sse2"))) 
+void BitArray::BitExprShiftSse2(const uint64_t *v, uint64_t carry, unsigned shift, uint64_t *out, size_t numWords) {
+  __m128i left = _mm_cvtsi32_si128(shift), right = _mm_cvtsi32_si128(64 - shift);
+  out[0] = (v[0] << shift) | (carry >> (64 - shift));
+  size_t i(1);
+  for (; i + 2 <= numWords; i += 2) {
+    __m128i cur = _mm_loadu_si128((__m128i const *)&v[i]);
+    __m128i prev = _mm_loadu_si128((__m128i const *)&v[i - 1]);
+    _mm_storeu_si128((__m128i *)&out[i], _mm_or_si128(_mm_sll_epi64(cur, left), _mm_srl_epi64(prev, right)));
+  }
+  for (; i < numWords; ++i)
+    out[i] = (v[i] << shift) | (v[i - 1] >> (64 - shift));
+}
+#endif
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+void BitArray::BitExprShiftAvx2(const uint64_t *v, uint64_t carry, unsigned shift, uint64_t *out, size_t numWords) {
+  __m128i left = _mm_cvtsi32_si128(shift), right = _mm_cvtsi32_si128(64 - shift);
+  out[0] = (v[0] << shift) | (carry >> (64 - shift));
+  size_t i(1);
+  for (; i + 4 <= numWords; i += 4) {
+    __m256i cur = _mm256_loadu_si256((__m256i const *)&v[i]);
+    __m256i prev = _mm256_loadu_si256((__m256i const *)&v[i - 1]);
+    _mm256_storeu_si256((__m256i *)&out[i], _mm256_or_si256(_mm256_sll_epi64(cur, left), _mm256_srl_epi64(prev, right)));
+  }
+  for (; i < numWords; ++i)
+    out[i] = (v[i] << shift) | (v[i - 1] >> (64 - shift));
+}
+#endif
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+__attribute__((target("avx512f"))) 
+void BitArray::BitExprShiftAvx512(const uint64_t *v, uint64_t carry, unsigned shift, uint64_t *out, size_t numWords) {
+  __m512i left = _mm512_set1_epi64(shift), right = _mm512_set1_epi64(64 - shift);
+  out[0] = (v[0] << shift) | (carry >> (64 - shift));
+  size_t i(1);
+  for (; i + 8 <= numWords; i += 8) {
+    __m512i cur = _mm512_loadu_si512(&v[i]);
+    __m512i prev = _mm512_loadu_si512(&v[i - 1]);
+    _mm512_storeu_si512(&out[i], _mm512_or_si512(_mm512_maskz_sllv_epi64(0xFF, cur, left), _mm512_maskz_srlv_epi64(0xFF, prev, right)));
+  }
+  for (; i < numWords; ++i)
+    out[i] = (v[i] << shift) | (v[i - 1] >> (64 - shift));
+}
+#endif
+
+// Reads 64 bits starting at bit pos of words, bits past the last word read as zero.
+inline uint64_t extractWord(const uint64_t *words, size_t numWords, size_t pos) {
+  size_t w = pos / 64, shift = pos % 64;
+  uint64_t lo = w < numWords ? words[w] : 0;
+  uint64_t hi = w + 1 < numWords ? words[w + 1] : 0;
+  return shift ? (lo >> shift) | (hi << (64 - shift)) : lo;
+}
+
+void BitArray::Correlate(const BitArray &pattern, const BitSpan &bits, std::vector<uint16_t> &agreements) {
+  agreements.resize(bits.size() >= pattern.size() ? bits.size() - pattern.size() + 1 : 0);
+  CorrelateRun(pattern, bits, agreements.data(), 0, NULL);
+}
+
+std::vector<size_t> BitArray::Search(const BitArray &pattern, const BitSpan &bits, size_t maxDistance) {
+  std::vector<size_t> matches;
+  CorrelateRun(pattern, bits, NULL, maxDistance, &matches);
+  return matches;
+}
+
+// The offsets are done 16384 at a time from a copy of the input words they need, zero past the end.
+void BitArray::CorrelateRun(const BitArray &pattern, const BitSpan &bits, uint16_t *agreements, size_t maxDistance, std::vector<size_t> *pMatches) {
+  if (pattern.size() == 0 || pattern.size() > 65535)
+    throw std::runtime_error("Correlate patterns must be 1 to 65535 bits.");
+  if (bits.size() < pattern.size())
+    return;
+
+  size_t numOffsets = bits.size() - pattern.size() + 1, patternWords = (pattern.size() + 63) / 64;
+  std::vector<uint64_t> patternBits(patternWords), mask(patternWords, ~uint64_t(0));
+  for (size_t w = 0; w < patternWords; ++w)
+    patternBits[w] = pattern.loadWord(w);
+  if (pattern.size() % 64)
+    mask.back() = (uint64_t(1) << (pattern.size() % 64)) - 1;
+
+  const size_t blockWords = 256;
+  std::vector<uint64_t> words(blockWords + patternWords);
+  std::vector<uint16_t> distances(blockWords * 64);
+  for (size_t w0 = 0; w0 * 64 < numOffsets; w0 += blockWords) {
+    size_t numWords = std::min(blockWords, (numOffsets + 63) / 64 - w0);
+    for (size_t w = 0; w < numWords + patternWords; ++w)
+      words[w] = bits.loadWord(w0 + w);
+    CorrelateBlock(patternBits.data(), mask.data(), patternWords, words.data(), numWords, distances.data());
+
+    size_t count = std::min(numWords * 64, numOffsets - w0 * 64);
+    if (agreements)
+      for (size_t i = 0; i < count; ++i)
+        agreements[w0 * 64 + i] = uint16_t(pattern.size() - distances[i]);
+    if (pMatches)
+      for (size_t i = 0; i < count; ++i)
+        if (distances[i] <= maxDistance)
+          pMatches->push_back(w0 * 64 + i);
+  }
+}
+
+void BitArray::CorrelateBlock(const uint64_t *pattern, const uint64_t *mask, size_t patternWords, const uint64_t *words, size_t numWords,
+                              uint16_t *distances) {
+  Dispatch::Get<decltype(&CorrelateBlockDefault)>(Dispatch::CORRELATE)(pattern, mask, patternWords, words, numWords, distances);
+}
+
+void BitArray::CorrelateBlockDefault(const uint64_t *pattern, const uint64_t *mask, size_t patternWords, const uint64_t *words, size_t numWords,
+                                     uint16_t *distances) {
+  for (size_t offset = 0; offset < numWords * 64; ++offset) {
+    size_t distance(0);
+    for (size_t w = 0; w < patternWords; ++w)
+      distance += countBits((extractWord(words, numWords + patternWords, offset + w * 64) ^ pattern[w]) & mask[w]);
+    distances[offset] = uint16_t(distance);
+  }
+}
+
+// The 64 offsets of a word are done 16 at a time, lane j of vector v being offset r + 4 * v + j.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+void BitArray::CorrelateNibbles(const uint64_t *pattern, const uint64_t *mask, size_t patternWords, const uint64_t *words, size_t numWords,
+                                uint16_t *distances) {
+  const __m256i lanes = _mm256_setr_epi64x(0, 1, 2, 3), sixtyFour = _mm256_set1_epi64x(64);
+  for (size_t q = 0; q < numWords; ++q)
+    for (size_t r = 0; r < 64; r += 16) {
+      __m256i right[4], left[4], total[4];
+      for (size_t v = 0; v < 4; ++v) {
+        right[v] = _mm256_add_epi64(lanes, _mm256_set1_epi64x(r + 4 * v));
+        left[v] = _mm256_sub_epi64(sixtyFour, right[v]);
+        total[v] = _mm256_setzero_si256();
+      }
+      for (size_t w = 0; w < patternWords; ++w) {
+        __m256i lo = _mm256_set1_epi64x(words[q + w]), hi = _mm256_set1_epi64x(words[q + w + 1]);
+        __m256i bits = _mm256_set1_epi64x(pattern[w]), keep = _mm256_set1_epi64x(mask[w]);
+        for (size_t v = 0; v < 4; ++v) {
+          __m256i window = _mm256_or_si256(_mm256_srlv_epi64(lo, right[v]), _mm256_sllv_epi64(hi, left[v]));
+          total[v] = _mm256_add_epi64(total[v], countBits256(_mm256_and_si256(_mm256_xor_si256(window, bits), keep)));
+        }
+      }
+      uint64_t sums[16];
+      for (size_t v = 0; v < 4; ++v)
+        _mm256_storeu_si256((__m256i *)&sums[4 * v], total[v]);
+      for (size_t i = 0; i < 16; ++i)
+        distances[q * 64 + r + i] = uint16_t(sums[i]);
+    }
+}
+#endif
+
+// All 64 offsets of a word are held in 8 vectors, lane j of vector v being offset 8 * v + j.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+__attribute__((target("avx512f,avx512vpopcntdq"))) 
+void BitArray::CorrelateVpopcnt(const uint64_t *pattern, const uint64_t *mask, size_t patternWords, const uint64_t *words, size_t numWords,
+                                uint16_t *distances) {
+  __m512i right[8], left[8];
+  for (size_t v = 0; v < 8; ++v) {
+    right[v] = _mm512_add_epi64(_mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7), _mm512_set1_epi64(8 * v));
+    left[v] = _mm512_sub_epi64(_mm512_set1_epi64(64), right[v]);
+  }
+  for (size_t q = 0; q < numWords; ++q) {
+    __m512i total[8];
+    for (size_t v = 0; v < 8; ++v)
+      total[v] = _mm512_setzero_si512();
+    for (size_t w = 0; w < patternWords; ++w) {
+      __m512i lo = _mm512_set1_epi64(words[q + w]), hi = _mm512_set1_epi64(words[q + w + 1]);
+      __m512i bits = _mm512_set1_epi64(pattern[w]), keep = _mm512_set1_epi64(mask[w]);
+      for (size_t v = 0; v < 8; ++v) {
+        __m512i window = _mm512_or_si512(_mm512_maskz_srlv_epi64(0xFF, lo, right[v]), _mm512_maskz_sllv_epi64(0xFF, hi, left[v]));
+        total[v] = _mm512_add_epi64(total[v], _mm512_popcnt_epi64(_mm512_and_si512(_mm512_xor_si512(window, bits), keep)));
+      }
+    }
+    for (size_t v = 0; v < 8; ++v)
+      _mm_storeu_si128((__m128i *)&distances[q * 64 + 8 * v], _mm512_maskz_cvtepi64_epi16(0xFF, total[v]));
+  }
+}
+#endif
+
+size_t BitArray::FindFirst(const BitSpan &bits, bool value) { return FindFrom(bits, 0, value); }
+
+size_t BitArray::FindNext(const BitSpan &bits, size_t pos, bool value) { return pos < bits.size() ? FindFrom(bits, pos + 1, value) : bits.size(); }
+
+size_t BitArray::FindPrev(const BitSpan &bits, size_t pos, bool value) { return FindBefore(bits, std::min(pos, bits.size()), value); }
+
+// Bits are counted from the start of _base, the span's word w being bits [64 * w, 64 * w + 64). Whole
+// words inside the span are skipped by FindWord, the first and last are masked to the span.
+size_t BitArray::FindFrom(const BitSpan &bits, size_t from, bool value) {
+  if (from >= bits._size)
+    return bits._size;
+  const uint64_t *words = (const uint64_t *)bits._base;
+  uint64_t flip = value ? 0 : ~uint64_t(0);
+  size_t end = bits._offset + bits._size, pos = bits._offset + from, w = pos / 64;
+  uint64_t x = (words[w] ^ flip) & (~uint64_t(0) << (pos % 64));
+  while (!x && 64 * (w + 1) < end) {
+    w = FindWord(bits._base, w + 1, end / 64, flip);
+    if (64 * w >= end)
+      return bits._size;
+    x = words[w] ^ flip;
+  }
+  if (end - 64 * w < 64)
+    x &= (uint64_t(1) << (end - 64 * w)) - 1;
+  return x ? 64 * w + __builtin_ctzll(x) - bits._offset : bits._size;
+}
+
+// Word 0 is the only one the span can start inside, as _offset is below 8.
+size_t BitArray::FindBefore(const BitSpan &bits, size_t before, bool value) {
+  if (before == 0)
+    return bits._size;
+  const uint64_t *words = (const uint64_t *)bits._base;
+  uint64_t flip = value ? 0 : ~uint64_t(0);
+  size_t pos = bits._offset + before - 1, w = pos / 64;
+  uint64_t x = (words[w] ^ flip) & (~uint64_t(0) >> (63 - pos % 64));
+  while (!x && w > 0) {
+    w = FindLastWord(bits._base, 1, w, flip) - 1;
+    x = words[w] ^ flip;
+  }
+  if (w == 0)
+    x &= ~uint64_t(0) << bits._offset;
+  return x ? 64 * w + 63 - __builtin_clzll(x) - bits._offset : bits._size;
+}
+
+void BitArray::Positions(const BitSpan &bits, std::vector<uint32_t> &positions) {
+  if (bits.size() > (size_t(1) << 32))
+    throw std::runtime_error("Positions of 32 bits take arrays of up to 2^32 bits");
+  PositionsOf(bits, positions);
+}
+
+void BitArray::Positions(const BitSpan &bits, std::vector<uint64_t> &positions) { PositionsOf(bits, positions); }
+
+// Decoded a block of words at a time, from the next word with a set bit, positions before the span in
+// its first word and after it in its last being dropped.
+template <class T> void BitArray::PositionsOf(const BitSpan &bits, std::vector<T> &positions) {
+  const size_t blockWords = 64;
+  positions.clear();
+  if (bits._size == 0)
+    return;
+  size_t begin = bits._offset, end = begin + bits._size, numWords = (end + 63) / 64;
+  std::vector<uint32_t> block(blockWords * 64 + 16);
+  for (size_t w = FindWord(bits._base, 0, numWords, 0); w < numWords; w = FindWord(bits._base, w, numWords, 0)) {
+    size_t last = std::min(w + blockWords, numWords);
+    const uint32_t *first = block.data(), *stop = block.data() + DecodeWords(bits._base, w, last, block.data());
+    if (w == 0)
+      first = std::lower_bound(first, stop, uint32_t(begin));
+    if (last == numWords)
+      stop = std::lower_bound(first, stop, uint32_t(end - 64 * w));
+    size_t n = positions.size();
+    positions.resize(n + (stop - first));
+    for (size_t i = 0; first + i < stop; ++i)
+      positions[n + i] = T(64 * w - begin + first[i]);
+    w = last;
+  }
+}
+
+size_t BitArray::FindWord(const uint8_t *base, size_t begin, size_t end, uint64_t flip) {
+  return Dispatch::Get<decltype(&FindWordDefault)>(Dispatch::FIND, 0)(base, begin, end, flip);
+}
+
+size_t BitArray::FindLastWord(const uint8_t *base, size_t begin, size_t end, uint64_t flip) {
+  return Dispatch::Get<decltype(&FindWordDefault)>(Dispatch::FIND, 1)(base, begin, end, flip);
+}
+
+size_t BitArray::FindWordDefault(const uint8_t *base, size_t begin, size_t end, uint64_t flip) {
+  const uint64_t *words = (const uint64_t *)base;
+  while (begin < end && words[begin] == flip)
+    ++begin;
+  return begin;
+}
+
+size_t BitArray::FindLastWordDefault(const uint8_t *base, size_t begin, size_t end, uint64_t flip) {
+  const uint64_t *words = (const uint64_t *)base;
+  while (end > begin && words[end - 1] == flip)
+    --end;
+  return end;
+}
+
+// 8 words are ORed together and compared with zero per branch, the words of a hit found one by one.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("sse2"))) 
+size_t BitArray::FindWordSse2(const uint8_t *base, size_t begin, size_t end, uint64_t flip) {
+  const __m128i *v = (const __m128i *)base;
+  __m128i f = _mm_set1_epi64x(flip), zero = _mm_setzero_si128();
+  for (; begin + 8 <= end; begin += 8) {
+    const __m128i *p = (const __m128i *)((const uint64_t *)v + begin);
+    __m128i x = _mm_or_si128(_mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p), f), _mm_xor_si128(_mm_loadu_si128(p + 1), f)),
+                             _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p + 2), f), _mm_xor_si128(_mm_loadu_si128(p + 3), f)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) != 0xFFFF)
+      break;
+  }
+  return FindWordDefault(base, begin, end, flip);
+}
+
+__attribute__((target("sse2"))) 
+size_t BitArray::FindLastWordSse2(const uint8_t *base, size_t begin, size_t end, uint64_t flip) {
+  __m128i f = _mm_set1_epi64x(flip), zero = _mm_setzero_si128();
+  for (; end >= begin + 8; end -= 8) {
+    const __m128i *p = (const __m128i *)((const uint64_t *)base + end - 8);
+    __m128i x = _mm_or_si128(_mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p), f), _mm_xor_si128(_mm_loadu_si128(p + 1), f)),
+                             _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p + 2), f), _mm_xor_si128(_mm_loadu_si128(p + 3), f)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) != 0xFFFF)
+      break;
+  }
+  return FindLastWordDefault(base, begin, end, flip);
+}
+#endif
+
+// 16 words per branch, a bit per word from the compares.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+size_t BitArray::FindWordAvx2(const uint8_t *base, size_t begin, size_t end, uint64_t flip) {
+  __m256i f = _mm256_set1_epi64x(flip);
+  for (; begin + 16 <= end; begin += 16) {
+    const __m256i *p = (const __m256i *)((const uint64_t *)base + begin);
+    unsigned same = 0;
+    for (size_t k = 0; k < 4; ++k)
+      same |= unsigned(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_loadu_si256(p + k), f)))) << (4 * k);
+    if (same != 0xFFFF)
+      return begin + __builtin_ctz(~same);
+  }
+  return FindWordDefault(base, begin, end, flip);
+}
+
+__attribute__((target("avx2"))) 
+size_t BitArray::FindLastWordAvx2(const uint8_t *base, size_t begin, size_t end, uint64_t flip) {
+  __m256i f = _mm256_set1_epi64x(flip);
+  for (; end >= begin + 16; end -= 16) {
+    const __m256i *p = (const __m256i *)((const uint64_t *)base + end - 16);
+    unsigned same = 0;
+    for (size_t k = 0; k < 4; ++k)
+      same |= unsigned(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_loadu_si256(p + k), f)))) << (4 * k);
+    if (same != 0xFFFF)
+      return end - 16 + 32 - __builtin_clz(~same & 0xFFFF);
+  }
+  return FindLastWordDefault(base, begin, end, flip);
+}
+#endif
+
+// 32 words per branch, a mask bit per word.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+__attribute__((target("avx512f"))) 
+size_t BitArray::FindWordAvx512(const uint8_t *base, size_t begin, size_t end, uint64_t flip) {
+  __m512i f = _mm512_set1_epi64(flip);
+  for (; begin + 32 <= end; begin += 32) {
+    const uint64_t *p = (const uint64_t *)base + begin;
+    uint32_t differ = 0;
+    for (size_t k = 0; k < 4; ++k)
+      differ |= uint32_t(_mm512_cmpneq_epi64_mask(_mm512_loadu_si512(p + 8 * k), f)) << (8 * k);
+    if (differ)
+      return begin + __builtin_ctz(differ);
+  }
+  return FindWordDefault(base, begin, end, flip);
+}
+
+__attribute__((target("avx512f"))) 
+size_t BitArray::FindLastWordAvx512(const uint8_t *base, size_t begin, size_t end, uint64_t flip) {
+  __m512i f = _mm512_set1_epi64(flip);
+  for (; end >= begin + 32; end -= 32) {
+    const uint64_t *p = (const uint64_t *)base + end - 32;
+    uint32_t differ = 0;
+    for (size_t k = 0; k < 4; ++k)
+      differ |= uint32_t(_mm512_cmpneq_epi64_mask(_mm512_loadu_si512(p + 8 * k), f)) << (8 * k);
+    if (differ)
+      return end - 32 + 32 - __builtin_clz(differ);
+  }
+  return FindLastWordDefault(base, begin, end, flip);
+}
+#endif
+
+size_t BitArray::DecodeWords(const uint8_t *base, size_t begin, size_t end, uint32_t *out) {
+  return Dispatch::Get<decltype(&DecodeWordsDefault)>(Dispatch::POSITIONS)(base, begin, end, out);
+}
+
+size_t BitArray::DecodeWordsDefault(const uint8_t *base, size_t begin, size_t end, uint32_t *out) {
+  const uint64_t *words = (const uint64_t *)base;
+  size_t n(0);
+  for (size_t w = begin; w < end; ++w)
+    for (uint64_t x = words[w]; x; x &= x - 1)
+      out[n++] = uint32_t(64 * (w - begin) + __builtin_ctzll(x));
+  return n;
+}
+
+// Writes the bits 4 at a time whether or not there are 4 left, trading stores past the count for
+// branches that follow the number of bits rather than each one.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("bmi,popcnt"))) 
+size_t BitArray::DecodeWordsBmi(const uint8_t *base, size_t begin, size_t end, uint32_t *out) {
+  const uint64_t *words = (const uint64_t *)base;
+  size_t n(0);
+  for (size_t w = begin; w < end; ++w) {
+    uint64_t x = words[w];
+    uint32_t pos = uint32_t(64 * (w - begin));
+    size_t count = size_t(_mm_popcnt_u64(x));
+    for (size_t k = 0; k < count; k += 4) {
+      out[n + k] = pos + uint32_t(_tzcnt_u64(x));
+      x = _blsr_u64(x);
+      out[n + k + 1] = pos + uint32_t(_tzcnt_u64(x));
+      x = _blsr_u64(x);
+      out[n + k + 2] = pos + uint32_t(_tzcnt_u64(x));
+      x = _blsr_u64(x);
+      out[n + k + 3] = pos + uint32_t(_tzcnt_u64(x));
+      x = _blsr_u64(x);
+    }
+    n += count;
+  }
+  return n;
+}
+#endif
+
+// Zero words are skipped 8 at a time, and each 16 bits of the others compress their positions into a
+// vector, stored whole and advanced by their count.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+__attribute__((target("avx512f,popcnt"))) 
+size_t BitArray::DecodeWordsCompress(const uint8_t *base, size_t begin, size_t end, uint32_t *out) {
+  const uint64_t *words = (const uint64_t *)base;
+  const __m512i lanes = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0), step = _mm512_set1_epi32(16);
+  size_t n(0);
+  for (size_t w0 = begin; w0 < end; w0 += 8) {
+    unsigned nonzero = end - w0 >= 8 ? _mm512_test_epi64_mask(_mm512_loadu_si512(&words[w0]), _mm512_set1_epi64(-1)) : (1u << (end - w0)) - 1;
+    for (; nonzero; nonzero &= nonzero - 1) {
+      size_t w = w0 + __builtin_ctz(nonzero);
+      uint64_t x = words[w];
+      __m512i pos = _mm512_add_epi32(lanes, _mm512_set1_epi32(int(64 * (w - begin))));
+      for (size_t k = 0; k < 4; ++k, x >>= 16, pos = _mm512_add_epi32(pos, step)) {
+        __mmask16 mask = __mmask16(x);
+        _mm512_storeu_si512(out + n, _mm512_maskz_compress_epi32(mask, pos));
+        n += size_t(_mm_popcnt_u32(mask));
+      }
+    }
+  }
+  return n;
+}
+#endif
+
+// The taps reversed, so that output bit i is the GF(2) product of this polynomial and the input at bit i.
+std::vector<uint64_t> BitArray::ConvolvePoly(const BitArray &taps) {
+  std::vector<uint64_t> poly((taps.size() + 63) / 64);
+  for (size_t i = 0; i < taps.size(); ++i) {
+    size_t j = taps.size() - 1 - i;
+    poly[j / 64] |= uint64_t(taps[i]) << (j % 64);
+  }
+  return poly;
+}
+
+// The fill is the last numTaps bits of the register.
+std::vector<uint64_t> BitArray::ConvolveFillToRegister(const BitArray &fill, size_t numTaps) {
+  std::vector<uint64_t> reg((numTaps + 63) / 64);
+  size_t offset = 64 * reg.size() - numTaps;
+  for (size_t k = 0; k * 64 < numTaps; ++k) {
+    uint64_t fillWord = fill.loadWord(k);
+    if ((k + 1) * 64 > numTaps)
+      fillWord &= (uint64_t(1) << (numTaps % 64)) - 1;
+    size_t w = (offset + k * 64) / 64, shift = (offset + k * 64) % 64;
+    reg[w] |= fillWord << shift;
+    if (shift && w + 1 < reg.size())
+      reg[w + 1] |= fillWord >> (64 - shift);
+  }
+  return reg;
+}
+
+void BitArray::ConvolveRegisterToFill(const std::vector<uint64_t> &reg, BitArray &fill, size_t numTaps) {
+  size_t offset = 64 * reg.size() - numTaps;
+  for (size_t k = 0; k * 64 < numTaps; ++k)
+    fill.storeWord(k, extractWord(reg.data(), reg.size(), offset + k * 64), numTaps);
+}
+
+// Word w of the input, negative words come from the register.
+uint64_t BitArray::ConvolveStreamWord(const std::vector<uint64_t> &reg, const BitSpan &bits, ptrdiff_t w) {
+  return w < 0 ? reg[reg.size() + w] : bits.loadWord(w);
+}
+
+// The product of the taps and input words w - poly.size() + 1 through w without any hardware help.
+void BitArray::ConvolveSoftProduct(const std::vector<uint64_t> &poly, const std::vector<uint64_t> &reg, const BitSpan &bits, ptrdiff_t w, uint64_t &lo,
+                                   uint64_t &hi) {
+  lo = hi = 0;
+  for (size_t m = 0; m < poly.size(); ++m) {
+    uint64_t x = ConvolveStreamWord(reg, bits, w - ptrdiff_t(m));
+    for (uint64_t p = poly[m]; p; p &= p - 1) {
+      int s = __builtin_ctzll(p);
+      lo ^= x << s;
+      hi ^= (x >> 1) >> (63 - s);
+    }
+  }
+}
+
+// Advances reg, the input preceding bits, to be the input preceding bit resultSize.
+void BitArray::ConvolveAdvance(std::vector<uint64_t> &reg, const BitSpan &bits, size_t resultSize) {
+  std::vector<uint64_t> finalReg(reg.size());
+  ptrdiff_t start = ptrdiff_t(resultSize) - ptrdiff_t(64 * reg.size()); // First bit of the final register, relative to bits
+  ptrdiff_t w = (start >= 0 ? start : start - 63) / 64, shift = start - 64 * w;
+  for (size_t k = 0; k < finalReg.size(); ++k, ++w) {
+    uint64_t lo = ConvolveStreamWord(reg, bits, w);
+    finalReg[k] = shift ? (lo >> shift) | (ConvolveStreamWord(reg, bits, w + 1) << (64 - shift)) : lo;
+  }
+  reg.swap(finalReg);
+}
+
+// Runs the convolution, the first and last words go through the register and the flushed zeros without hardware help.
+void BitArray::ConvolveWords(const std::vector<uint64_t> &poly, const std::vector<uint64_t> &reg, const BitSpan &bits, uint64_t *out, size_t resultSize) {
+  size_t fullWords = std::min(bits.size(), resultSize) / 64;
+  uint64_t lo, hi, carry;
+  ConvolveSoftProduct(poly, reg, bits, -1, lo, carry);
+
+  // The first words reach back into the register.
+  size_t w(0);
+  for (; w + 1 < poly.size() && w * 64 < resultSize; ++w) {
+    ConvolveSoftProduct(poly, reg, bits, w, lo, hi);
+    depositRange(&out[w], lo ^ carry, 0, std::min(size_t(64), resultSize - w * 64));
+    carry = hi;
+  }
+
+  // Whole words of input and output, read in place unless the input starts within a byte. Then
+  // blocks of it are shifted by BitExprLoad into a buffer after the poly.size() - 1 words preceding them.
+  if (w < fullWords && bits.words()) {
+    ConvolveBlock(poly.data(), poly.size(), bits.words() + w, out + w, fullWords - w, carry);
+    w = fullWords;
+  } else if (w < fullWords) {
+    const size_t blockWords = 256, history = poly.size() - 1;
+    std::vector<uint64_t> x(history + blockWords);
+    for (size_t k = 0; k < history; ++k)
+      x[k] = ConvolveStreamWord(reg, bits, ptrdiff_t(w + k) - ptrdiff_t(history));
+    for (size_t numWords; w < fullWords; w += numWords) {
+      numWords = std::min(blockWords, fullWords - w);
+      BitExprLoad((const uint64_t *)bits._base + w, unsigned(bits._offset), &x[history], numWords);
+      ConvolveBlock(poly.data(), poly.size(), &x[history], out + w, numWords, carry);
+      std::copy(x.begin() + numWords, x.begin() + numWords + history, x.begin());
+    }
+  }
+
+  // The tail, partial input words and the flushed zeros.
+  for (; w * 64 < resultSize; ++w) {
+    ConvolveSoftProduct(poly, reg, bits, w, lo, hi);
+    depositRange(&out[w], lo ^ carry, 0, std::min(size_t(64), resultSize - w * 64));
+    carry = hi;
+  }
+}
+
+// Each thread convolves whole cache lines of the result, with the input words before them as its register.
+void BitArray::ConvolveThreads(const Parallel &policy, const std::vector<uint64_t> &poly, const std::vector<uint64_t> &reg, const BitSpan &bits, uint64_t *out,
+                               size_t resultSize) {
+  size_t numThreads = policy.Threads(resultSize), numLines = (resultSize + 511) / 512;
+  ParallelFor(numThreads, [&](size_t k) {
+    size_t begin = numLines * k / numThreads * 512, end = std::min(resultSize, numLines * (k + 1) / numThreads * 512);
+    std::vector<uint64_t> segmentReg(reg.size());
+    for (size_t i = 0; i < reg.size(); ++i)
+      segmentReg[i] = ConvolveStreamWord(reg, bits, ptrdiff_t(begin / 64 + i) - ptrdiff_t(reg.size()));
+    size_t first = std::min(begin, bits.size()), last = std::min(end, bits.size());
+    ConvolveWords(poly, segmentReg, BitSpan(bits._base, bits._offset + first, last - first), out + begin / 64, end - begin);
+  });
+}
+
+/**
+ * Performs a convolution operation on bits using taps and stores it into result. If flush is true
+ * zeros will be pushed into the taps at the end resulting in a total output size of taps.size() +
+ * bits.size() - 1. The memory of the registers can optionally be initialized with the initial fill
+ * and the final fill will be returned in initialFill.
+ */
+void BitArray::Convolve(const BitArray &taps, const BitSpan &bits, BitArray &result, bool flush, uint32_t *pInitialFill) {
+  Convolve(Parallel(1), taps, bits, result, flush, pInitialFill);
+}
+
+void BitArray::Convolve(const BitArray &taps, const BitSpan &bits, BitArray &result, bool flush, BitArray &fill) {
+  Convolve(Parallel(1), taps, bits, result, flush, fill);
+}
+
+void BitArray::Convolve(const Parallel &policy, const BitArray &taps, const BitSpan &bits, BitArray &result, bool flush, uint32_t *pInitialFill) {
+  if (taps.size() == 0)
+    throw std::runtime_error("Taps must hold at least one bit");
+
+  if (pInitialFill && taps.size() > 32)
+    throw std::runtime_error("Taps greater than 32 bits need a BitArray fill.");
+
+  size_t resultSize = flush ? (taps.size() + bits.size() - 1) : (bits.size());
+  if (result.size() < (resultSize))
+    throw std::runtime_error("Results of the convolution must be at least large enough to hold the result");
+
+  std::vector<uint64_t> reg((taps.size() + 63) / 64);
+  if (pInitialFill)
+    reg[0] = uint64_t(*pInitialFill & ((uint64_t(1) << taps.size()) - 1)) << (64 - taps.size());
+
+  ConvolveThreads(policy, ConvolvePoly(taps), reg, bits, (uint64_t *)result.data(), resultSize);
+
+  if (pInitialFill) {
+    ConvolveAdvance(reg, bits, resultSize);
+    *pInitialFill = uint32_t(reg[0] >> (64 - taps.size()));
+  }
+}
+
+void BitArray::Convolve(const Parallel &policy, const BitArray &taps, const BitSpan &bits, BitArray &result, bool flush, BitArray &fill) {
+  if (taps.size() == 0)
+    throw std::runtime_error("Taps must hold at least one bit");
+
+  if (fill.size() < taps.size())
+    throw std::runtime_error("The fill must be at least as large as the taps");
+
+  size_t resultSize = flush ? (taps.size() + bits.size() - 1) : (bits.size());
+  if (result.size() < (resultSize))
+    throw std::runtime_error("Results of the convolution must be at least large enough to hold the result");
+
+  std::vector<uint64_t> reg = ConvolveFillToRegister(fill, taps.size());
+  ConvolveThreads(policy, ConvolvePoly(taps), reg, bits, (uint64_t *)result.data(), resultSize);
+  ConvolveAdvance(reg, bits, resultSize);
+  ConvolveRegisterToFill(reg, fill, taps.size());
+}
+
+template <int... Taps> void BitArray::Convolve(const BitSpan &bits, BitArray &result, bool flush, uint32_t *pInitialFill) {
+  const size_t numTaps = ConvolveTaps<Taps...>::size;
+  static_assert(numTaps >= 1 && numTaps <= 64, "Fixed taps must be 1 to 64 bits, longer ones can be given in a BitArray");
+
+  if (pInitialFill && numTaps > 32)
+    throw std::runtime_error("Taps greater than 32 bits need a BitArray fill.");
+
+  size_t resultSize = flush ? (numTaps + bits.size() - 1) : (bits.size());
+  if (result.size() < (resultSize))
+    throw std::runtime_error("Results of the convolution must be at least large enough to hold the result");
+
+  uint64_t reg = pInitialFill ? uint64_t(*pInitialFill & (~uint64_t(0) >> (64 - numTaps))) << (64 - numTaps) : 0;
+  ConvolveFixedWords<ConvolveTaps<Taps...>::poly>(reg, bits, (uint64_t *)result.data(), resultSize);
+
+  if (pInitialFill) {
+    std::vector<uint64_t> finalReg(1, reg);
+    ConvolveAdvance(finalReg, bits, resultSize);
+    *pInitialFill = uint32_t(finalReg[0] >> (64 - numTaps));
+  }
+}
+
+template <> struct BitArray::ConvolveTaps<> {
+  static const size_t size = 0;
+  static const uint64_t poly = 0;
+};
+
+// The first tap is the highest power, as in ConvolvePoly.
+template <int Tap, int... Rest> struct BitArray::ConvolveTaps<Tap, Rest...> {
+  static_assert(Tap == 0 || Tap == 1, "Taps are bits, 0 or 1");
+  static const size_t size = 1 + sizeof...(Rest);
+  static const uint64_t poly = ConvolveTaps<Rest...>::poly | (uint64_t(Tap) << (sizeof...(Rest) % 64));
+};
+
+// One term per set bit of Poly, lowest first, each shifting by immediates.
+template <uint64_t Poly> struct BitArray::ConvolveTerms {
+  enum { s = __builtin_ctzll(Poly) };
+  typedef ConvolveTerms<Poly & (Poly - 1)> Rest;
+
+  static uint64_t Word(uint64_t x, uint64_t prev) { return (x << s) ^ ((prev >> 1) >> (63 - s)) ^ Rest::Word(x, prev); }
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("sse2"))) static __m128i Sse2(__m128i x, __m128i prev) {
+    return _mm_xor_si128(_mm_xor_si128(_mm_slli_epi64(x, s), _mm_srli_epi64(prev, 64 - s)), Rest::Sse2(x, prev));
+  }
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("avx2"))) static __m256i Avx2(__m256i x, __m256i prev) {
+    return _mm256_xor_si256(_mm256_xor_si256(_mm256_slli_epi64(x, s), _mm256_srli_epi64(prev, 64 - s)), Rest::Avx2(x, prev));
+  }
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f"))) static __m512i Avx512(__m512i x, __m512i prev) {
+    return _mm512_ternarylogic_epi64(_mm512_maskz_slli_epi64(0xFF, x, s), _mm512_maskz_srli_epi64(0xFF, prev, 64 - s), Rest::Avx512(x, prev), 0x96);
+  }
+#endif
+};
+
+template <> struct BitArray::ConvolveTerms<0> {
+  static uint64_t Word(uint64_t, uint64_t) { return 0; }
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  __attribute__((target("sse2"))) static __m128i Sse2(__m128i, __m128i) { return _mm_setzero_si128(); }
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  __attribute__((target("avx2"))) static __m256i Avx2(__m256i, __m256i) { return _mm256_setzero_si256(); }
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  __attribute__((target("avx512f"))) static __m512i Avx512(__m512i, __m512i) { return _mm512_setzero_si512(); }
+#endif
+};
+
+// As ConvolveWords with a one word register, x[-1] of the first word.
+template <uint64_t Poly> void BitArray::ConvolveFixedWords(uint64_t reg, const BitSpan &bits, uint64_t *out, size_t resultSize) {
+  size_t fullWords = std::min(bits.size(), resultSize) / 64, w(0);
+  uint64_t prev = reg;
+
+  // Whole words of input and output, read in place unless the input starts within a byte. Then
+  // blocks of it are shifted by BitExprLoad into a buffer after the word preceding them.
+  if (fullWords && bits.words()) {
+    out[0] = ConvolveTerms<Poly>::Word(bits.words()[0], reg);
+    ConvolveFixedBlock<Poly>(bits.words() + 1, out + 1, fullWords - 1);
+    w = fullWords;
+    prev = bits.words()[w - 1];
+  } else if (fullWords) {
+    const size_t blockWords = 256;
+    uint64_t x[1 + blockWords];
+    x[0] = reg;
+    for (size_t numWords; w < fullWords; w += numWords) {
+      numWords = std::min(blockWords, fullWords - w);
+      BitExprLoad((const uint64_t *)bits._base + w, unsigned(bits._offset), &x[1], numWords);
+      ConvolveFixedBlock<Poly>(&x[1], out + w, numWords);
+      x[0] = x[numWords];
+    }
+    prev = x[0];
+  }
+
+  // The tail, partial input words and the flushed zeros.
+  for (; w * 64 < resultSize; ++w) {
+    uint64_t x = bits.loadWord(w);
+    depositRange(&out[w], ConvolveTerms<Poly>::Word(x, prev), 0, std::min(size_t(64), resultSize - w * 64));
+    prev = x;
+  }
+}
+
+template <uint64_t Poly> void BitArray::ConvolveFixedBlock(const uint64_t *x, uint64_t *y, size_t numWords) {
+  switch (Dispatch::Isa(Dispatch::FIXEDCONVOLVE)) {
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  case BITARRAY_ISA_AVX512:
+    return ConvolveFixedBlockAvx512<Poly>(x, y, numWords);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  case BITARRAY_ISA_AVX2:
+    return ConvolveFixedBlockAvx2<Poly>(x, y, numWords);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  case BITARRAY_ISA_SSE2:
+    return ConvolveFixedBlockSse2<Poly>(x, y, numWords);
+#endif
+  default:
+    return ConvolveFixedBlockDefault<Poly>(x, y, numWords);
+  }
+}
+
+template <uint64_t Poly> void BitArray::ConvolveFixedBlockDefault(const uint64_t *x, uint64_t *y, size_t numWords) {
+  for (size_t w = 0; w < numWords; ++w)
+    y[w] = ConvolveTerms<Poly>::Word(x[w], x[ptrdiff_t(w) - 1]);
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+// The vector versions take the words before each vector from the previous one, loading them from
+// x[w - 1] would straddle a cache line every few vectors.
+template <uint64_t Poly> __attribute__((target("sse2"))) 
+void BitArray::ConvolveFixedBlockSse2(const uint64_t *x, uint64_t *y, size_t numWords) {
+  size_t w = 0;
+  __m128i last = _mm_set1_epi64x(int64_t(x[-1]));
+  for (; w + 2 <= numWords; w += 2) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&x[w]);
+    __m128i prev = _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(last), _mm_castsi128_pd(v), 1));
+    _mm_storeu_si128((__m128i *)&y[w], ConvolveTerms<Poly>::Sse2(v, prev));
+    last = v;
+  }
+  ConvolveFixedBlockDefault<Poly>(x + w, y + w, numWords - w);
+}
+#endif
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+template <uint64_t Poly> __attribute__((target("avx2"))) 
+void BitArray::ConvolveFixedBlockAvx2(const uint64_t *x, uint64_t *y, size_t numWords) {
+  size_t w = 0;
+  __m256i last = _mm256_set1_epi64x(int64_t(x[-1]));
+  for (; w + 4 <= numWords; w += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)&x[w]);
+    __m256i prev = _mm256_alignr_epi8(v, _mm256_permute2x128_si256(last, v, 0x21), 8);
+    _mm256_storeu_si256((__m256i *)&y[w], ConvolveTerms<Poly>::Avx2(v, prev));
+    last = v;
+  }
+  ConvolveFixedBlockDefault<Poly>(x + w, y + w, numWords - w);
+}
+#endif
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+template <uint64_t Poly> __attribute__((target("avx512f"))) 
+void BitArray::ConvolveFixedBlockAvx512(const uint64_t *x, uint64_t *y, size_t numWords) {
+  size_t w = 0;
+  __m512i last = _mm512_set1_epi64(int64_t(x[-1]));
+  for (; w + 8 <= numWords; w += 8) {
+    __m512i v = _mm512_loadu_si512(&x[w]);
+    _mm512_storeu_si512(&y[w], ConvolveTerms<Poly>::Avx512(v, _mm512_maskz_alignr_epi64(0xFF, v, last, 7)));
+    last = v;
+  }
+  ConvolveFixedBlockDefault<Poly>(x + w, y + w, numWords - w);
+}
+#endif
+
+void BitArray::ConvolveBlock(const uint64_t *poly, size_t polyWords, const uint64_t *x, uint64_t *y, size_t numWords, uint64_t &carry) {
+  Dispatch::Get<decltype(&ConvolveBlockDefault)>(Dispatch::CONVOLVE)(poly, polyWords, x, y, numWords, carry);
+}
+
+void BitArray::ConvolveBlockDefault(const uint64_t *poly, size_t polyWords, const uint64_t *x, uint64_t *y, size_t numWords, uint64_t &carry) {
+  // Every set tap XORs in a copy of the input word shifted up by its position, spilling into the next word.
+  for (size_t w = 0; w < numWords; ++w) {
+    uint64_t lo(0), hi(0);
+    for (size_t m = 0; m < polyWords; ++m) {
+      uint64_t xm = x[ptrdiff_t(w) - ptrdiff_t(m)];
+      for (uint64_t p = poly[m]; p; p &= p - 1) {
+        int s = __builtin_ctzll(p);
+        lo ^= xm << s;
+        hi ^= (xm >> 1) >> (63 - s);
+      }
+    }
+    y[w] = lo ^ carry;
+    carry = hi;
+  }
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("pclmul"))) 
+void BitArray::ConvolveBlockPclmul(const uint64_t *poly, size_t polyWords, const uint64_t *x, uint64_t *y, size_t numWords, uint64_t &carry) {
+  // Output word w is the low half of the product ending at input word w XOR the high half of the one ending at w - 1.
+  if (polyWords == 1) {
+    __m128i poly128 = _mm_cvtsi64_si128(poly[0]);
+    for (size_t w = 0; w < numWords; ++w) {
+      __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi64_si128(x[w]), poly128, 0x00);
+      y[w] = _mm_cvtsi128_si64(prod) ^ carry;
+      carry = _mm_cvtsi128_si64(_mm_unpackhi_epi64(prod, prod));
+    }
+    return;
+  }
+
+  for (size_t w = 0; w < numWords; ++w) {
+    __m128i prod = _mm_setzero_si128();
+    for (size_t m = 0; m < polyWords; ++m)
+      prod = _mm_xor_si128(prod, _mm_clmulepi64_si128(_mm_cvtsi64_si128(x[ptrdiff_t(w) - ptrdiff_t(m)]), _mm_cvtsi64_si128(poly[m]), 0x00));
+    y[w] = _mm_cvtsi128_si64(prod) ^ carry;
+    carry = _mm_cvtsi128_si64(_mm_unpackhi_epi64(prod, prod));
+  }
+}
+#endif
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+__attribute__((target("avx512f,vpclmulqdq"))) 
+void BitArray::ConvolveBlockVpclmul(const uint64_t *poly, size_t polyWords, const uint64_t *x, uint64_t *y, size_t numWords, uint64_t &carry) {
+  // Eight output words at a time, the even and odd input words multiplied in separate halves of each
+  // 128-bit lane. The high halves are shifted up a word, the last one carried into the next eight.
+  __m512i prevHi = _mm512_set1_epi64(int64_t(carry));
+  size_t w = 0;
+  for (; w + 8 <= numWords; w += 8) {
+    __m512i even = _mm512_setzero_si512(), odd = _mm512_setzero_si512();
+    for (size_t m = 0; m < polyWords; ++m) {
+      __m512i xs = _mm512_loadu_si512(&x[ptrdiff_t(w) - ptrdiff_t(m)]), p = _mm512_set1_epi64(int64_t(poly[m]));
+      even = _mm512_xor_si512(even, _mm512_clmulepi64_epi128(xs, p, 0x00));
+      odd = _mm512_xor_si512(odd, _mm512_clmulepi64_epi128(xs, p, 0x01));
+    }
+    __m512i lo = _mm512_maskz_unpacklo_epi64(0xFF, even, odd), hi = _mm512_maskz_unpackhi_epi64(0xFF, even, odd);
+    _mm512_storeu_si512(&y[w], _mm512_xor_si512(lo, _mm512_maskz_alignr_epi64(0xFF, hi, prevHi, 7)));
+    prevHi = hi;
+  }
+  carry = uint64_t(_mm256_extract_epi64(_mm512_maskz_extracti64x4_epi64(0xF, prevHi, 1), 3));
+  if (w < numWords)
+    ConvolveBlockPclmul(poly, polyWords, x + w, y + w, numWords - w, carry);
+}
+#endif
+
+// Software versions of the BMI2 PDEP and PEXT instructions.
+inline uint64_t depositBits(uint64_t src, uint64_t mask) {
+  uint64_t res(0);
+  for (; mask; mask &= mask - 1, src >>= 1)
+    if (src & 0x01)
+      res |= mask & (~mask + 1);
+  return res;
+}
+
+inline uint64_t extractBits(uint64_t src, uint64_t mask) {
+  uint64_t res(0);
+  for (uint64_t bit = 1; mask; mask &= mask - 1, bit <<= 1)
+    if (src & mask & (~mask + 1))
+      res |= bit;
+  return res;
+}
+
+void BitArray::EncodeCheck(const std::vector<BitArray> &taps, const std::vector<BitArray> &puncture) {
+  if (taps.empty() || taps[0].size() == 0)
+    throw std::runtime_error("Encoding needs at least one generator of at least one bit");
+
+  for (size_t j = 1; j < taps.size(); ++j)
+    if (taps[j].size() != taps[0].size())
+      throw std::runtime_error("All of the generators must be the same size");
+
+  if (puncture.empty())
+    return;
+
+  if (puncture.size() != taps.size())
+    throw std::runtime_error("The puncture pattern must have one row per generator");
+
+  for (size_t j = 0; j < puncture.size(); ++j)
+    if (puncture[j].size() == 0 || puncture[j].size() != puncture[0].size())
+      throw std::runtime_error("The puncture pattern rows must all be the same, non-zero, size");
+}
+
+size_t BitArray::EncodedSize(const std::vector<BitArray> &taps, size_t len, bool flush, const std::vector<BitArray> &puncture) {
+  EncodeCheck(taps, puncture);
+  size_t streamSize = flush ? (taps[0].size() + len - 1) : len;
+  if (puncture.empty())
+    return streamSize * taps.size();
+
+  size_t period = puncture[0].size(), size(0);
+  for (size_t j = 0; j < puncture.size(); ++j)
+    for (size_t i = 0; i < period; ++i)
+      if (puncture[j][i])
+        size += streamSize / period + (i < streamSize % period);
+  return size;
+}
+
+BitArray::EncodeMasks BitArray::EncodeBuildMasks(size_t streams, const std::vector<BitArray> &puncture, size_t limit) {
+  EncodeMasks masks;
+  masks.streams = streams;
+  masks.limit = limit;
+  masks.deposit.resize(streams * streams);
+  masks.shift.resize(streams * streams);
+
+  // Interleaved word k holds bits 64k through 64k + 63, bit p coming from bit p / n of stream p % n.
+  for (size_t k = 0; k < streams; ++k)
+    for (size_t p = 64 * k; p < 64 * (k + 1); ++p) {
+      size_t i = p / streams, j = p % streams;
+      if (masks.deposit[k * streams + j] == 0)
+        masks.shift[k * streams + j] = i;
+      masks.deposit[k * streams + j] |= uint64_t(1) << (p % 64);
+    }
+
+  if (puncture.empty())
+    return masks;
+
+  // The pattern repeats every n * period interleaved bits, which is a whole number of words after lcm(64, n * period) bits.
+  size_t period = streams * puncture[0].size(), gcd(64);
+  for (size_t r = period; r;) {
+    size_t t = gcd % r;
+    gcd = r;
+    r = t;
+  }
+  size_t words = period / gcd;
+  masks.keep.resize(words);
+  masks.keepCount.resize(words);
+  for (size_t p = 0; p < 64 * words; ++p) {
+    size_t i = p / streams, j = p % streams;
+    if (puncture[j][i % puncture[j].size()]) {
+      masks.keep[p / 64] |= uint64_t(1) << (p % 64);
+      ++masks.keepCount[p / 64];
+    }
+  }
+  return masks;
+}
+
+/**
+ * Reads bits in blocks, convolving each block with every generator while it is in cache and then
+ * either storing the streams into results or interleaving them into result.
+ */
+void BitArray::EncodeRun(const std::vector<BitArray> &taps, const BitSpan &bits, size_t resultSize, BitArray *pFill, std::vector<BitArray> *pResults,
+                         BitArray *pResult, const EncodeMasks *pMasks) {
+  const size_t blockWords = 64;
+  size_t streams = taps.size(), numTaps = taps[0].size(), polyWords = (numTaps + 63) / 64;
+
+  std::vector<uint64_t> reg = pFill ? ConvolveFillToRegister(*pFill, numTaps) : std::vector<uint64_t>(polyWords);
+  std::vector<std::vector<uint64_t> > polys(streams);
+  std::vector<uint64_t> carries(streams);
+  for (size_t j = 0; j < streams; ++j) {
+    uint64_t lo;
+    polys[j] = ConvolvePoly(taps[j]);
+    ConvolveSoftProduct(polys[j], reg, bits, -1, lo, carries[j]);
+  }
+
+  // The input block is preceded by the polyWords - 1 words before it.
+  std::vector<uint64_t> x(polyWords - 1 + blockWords), y(streams * blockWords);
+  std::copy(reg.begin() + 1, reg.end(), x.begin());
+
+  EncodeState state = {0, 0, 0, 0, 0};
+  size_t resultWords = (resultSize + 63) / 64, fullWords = bits.size() / 64;
+  for (size_t w0 = 0; w0 < resultWords; w0 += blockWords) {
+    size_t numWords = std::min(blockWords, resultWords - w0), numFull = w0 < fullWords ? std::min(numWords, fullWords - w0) : 0;
+    BitExprLoad((const uint64_t *)bits._base + w0, unsigned(bits._offset), &x[polyWords - 1], numFull);
+    for (size_t w = numFull; w < numWords; ++w)
+      x[polyWords - 1 + w] = bits.loadWord(w0 + w);
+
+    for (size_t j = 0; j < streams; ++j) {
+      ConvolveBlock(polys[j].data(), polyWords, &x[polyWords - 1], &y[j * blockWords], numWords, carries[j]);
+      if (w0 + numWords == resultWords && resultSize % 64)
+        y[j * blockWords + numWords - 1] &= (uint64_t(1) << (resultSize % 64)) - 1;
+    }
+
+    if (pResults) {
+      for (size_t j = 0; j < streams; ++j)
+        for (size_t w = 0; w < numWords; ++w)
+          (*pResults)[j].storeWord(w0 + w, y[j * blockWords + w], resultSize);
+    } else
+      EncodeInterleave(y.data(), blockWords, numWords, *pMasks, state, *pResult);
+
+    std::copy(x.begin() + numWords, x.begin() + numWords + polyWords - 1, x.begin());
+  }
+
+  if (state.accBits)
+    pResult->storeWord(state.outWord, state.acc, state.outWord * 64 + state.accBits);
+
+  if (pFill) {
+    ConvolveAdvance(reg, bits, resultSize);
+    ConvolveRegisterToFill(reg, *pFill, numTaps);
+  }
+}
+
+void BitArray::Encode(const std::vector<BitArray> &taps, const BitSpan &bits, std::vector<BitArray> &results, bool flush, BitArray *pFill) {
+  EncodeCheck(taps, std::vector<BitArray>());
+  if (pFill && pFill->size() < taps[0].size())
+    throw std::runtime_error("The fill must be at least as large as the taps");
+
+  size_t resultSize = flush ? (taps[0].size() + bits.size() - 1) : (bits.size());
+  if (results.size() != taps.size())
+    throw std::runtime_error("There must be one result per generator");
+  for (size_t j = 0; j < results.size(); ++j)
+    if (results[j].size() < resultSize)
+      throw std::runtime_error("Results of the convolution must be at least large enough to hold the result");
+
+  EncodeRun(taps, bits, resultSize, pFill, &results, NULL, NULL);
+}
+
+size_t BitArray::Encode(const std::vector<BitArray> &taps, const BitSpan &bits, BitArray &result, bool flush, BitArray *pFill,
+                        const std::vector<BitArray> &puncture) {
+  size_t encodedSize = EncodedSize(taps, bits.size(), flush, puncture);
+  if (pFill && pFill->size() < taps[0].size())
+    throw std::runtime_error("The fill must be at least as large as the taps");
+  if (result.size() < encodedSize)
+    throw std::runtime_error("The result must be at least large enough to hold the encoded bits");
+
+  size_t resultSize = flush ? (taps[0].size() + bits.size() - 1) : (bits.size());
+  EncodeMasks masks = EncodeBuildMasks(taps.size(), puncture, resultSize * taps.size());
+  EncodeRun(taps, bits, resultSize, pFill, NULL, &result, &masks);
+  return encodedSize;
+}
+
+void BitArray::EncodeInterleave(const uint64_t *y, size_t stride, size_t numWords, const EncodeMasks &masks, EncodeState &state, BitArray &result) {
+  Dispatch::Get<decltype(&EncodeInterleaveDefault)>(Dispatch::ENCODE)(y, stride, numWords, masks, state, result);
+}
+
+void BitArray::EncodeInterleaveDefault(const uint64_t *y, size_t stride, size_t numWords, const EncodeMasks &masks, EncodeState &state, BitArray &result) {
+  size_t n = masks.streams;
+  uint64_t *p_result64 = (uint64_t *)result.data();
+  for (size_t w = 0; w < numWords; ++w)
+    for (size_t k = 0; k < n && state.word * 64 < masks.limit; ++k, ++state.word) {
+      uint64_t out(0);
+      for (size_t j = 0; j < n; ++j)
+        out |= depositBits(y[j * stride + w] >> masks.shift[k * n + j], masks.deposit[k * n + j]);
+
+      size_t count = std::min(size_t(64), masks.limit - state.word * 64);
+      if (!masks.keep.empty()) {
+        uint64_t keep = masks.keep[state.phase];
+        count = masks.keepCount[state.phase];
+        if (++state.phase == masks.keep.size())
+          state.phase = 0;
+        if ((state.word + 1) * 64 > masks.limit) {
+          keep &= (uint64_t(1) << (masks.limit % 64)) - 1;
+          count = countBits(keep);
+        }
+        out = extractBits(out, keep);
+      }
+
+      if (count == 0)
+        continue;
+      state.acc |= out << state.accBits;
+      if (state.accBits + count >= 64) {
+        p_result64[state.outWord++] = state.acc;
+        state.acc = state.accBits ? out >> (64 - state.accBits) : 0;
+        state.accBits = state.accBits + count - 64;
+      } else
+        state.accBits += count;
+    }
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("bmi2"))) 
+void BitArray::EncodeInterleaveBmi2(const uint64_t *y, size_t stride, size_t numWords, const EncodeMasks &masks, EncodeState &state, BitArray &result) {
+  size_t n = masks.streams;
+  uint64_t *p_result64 = (uint64_t *)result.data();
+  for (size_t w = 0; w < numWords; ++w)
+    for (size_t k = 0; k < n && state.word * 64 < masks.limit; ++k, ++state.word) {
+      uint64_t out(0);
+      for (size_t j = 0; j < n; ++j)
+        out |= _pdep_u64(y[j * stride + w] >> masks.shift[k * n + j], masks.deposit[k * n + j]);
+
+      size_t count = std::min(size_t(64), masks.limit - state.word * 64);
+      if (!masks.keep.empty()) {
+        uint64_t keep = masks.keep[state.phase];
+        count = masks.keepCount[state.phase];
+        if (++state.phase == masks.keep.size())
+          state.phase = 0;
+        if ((state.word + 1) * 64 > masks.limit) {
+          keep &= (uint64_t(1) << (masks.limit % 64)) - 1;
+          count = countBits(keep);
+        }
+        out = _pext_u64(out, keep);
+      }
+
+      if (count == 0)
+        continue;
+      state.acc |= out << state.accBits;
+      if (state.accBits + count >= 64) {
+        p_result64[state.outWord++] = state.acc;
+        state.acc = state.accBits ? out >> (64 - state.accBits) : 0;
+        state.accBits = state.accBits + count - 64;
+      } else
+        state.accBits += count;
+    }
+}
+#endif
+BitArray::ViterbiTrellis BitArray::ViterbiBuildTrellis(const std::vector<BitArray> &taps) {
+  EncodeCheck(taps, std::vector<BitArray>());
+  if (taps.size() > 4 || taps[0].size() < 2 || taps[0].size() > 16)
+    throw std::runtime_error("Decoding supports up to 4 generators with taps of 2 to 16 bits");
+
+  ViterbiTrellis trellis;
+  trellis.streams = taps.size();
+  trellis.numTaps = taps[0].size();
+  trellis.states = size_t(1) << (trellis.numTaps - 1);
+  trellis.codes.resize(2 * trellis.states);
+  trellis.butterfly = true;
+  for (size_t j = 0; j < trellis.streams; ++j) {
+    uint64_t tapsReg = taps[j].loadWord(0);
+    trellis.butterfly = trellis.butterfly && taps[j][0] && taps[j][trellis.numTaps - 1];
+    for (size_t r = 0; r < trellis.codes.size(); ++r)
+      trellis.codes[r] |= (countBits(tapsReg & r) & 0x01) << j;
+  }
+
+  size_t half = trellis.states / 2, n = trellis.streams;
+  trellis.masks.resize(4 * n * half);
+  for (size_t p = 0; p < 2; ++p)
+    for (size_t u = 0; u < 2; ++u)
+      for (size_t j = 0; j < n; ++j)
+        for (size_t t = 0; t < half; ++t)
+          trellis.masks[((p * 2 + u) * n + j) * half + t] = -((trellis.codes[(2 * t + p) | (u << (trellis.numTaps - 1))] >> j) & 0x01);
+  return trellis;
+}
+
+/**
+ * Traces back from state after step end - 1 down to step begin, writing the decoded bits before
+ * result.size() and returning the state before step begin. Decision rows are kept in a ring of
+ * ringRows rows, or all of them when ringRows is zero.
+ */
+size_t BitArray::ViterbiTraceback(const ViterbiTrellis &trellis, const std::vector<uint64_t> &decisions, size_t ringRows, size_t end, size_t begin,
+                                  size_t state, BitArray &result) {
+  size_t rowWords = (trellis.states + 63) / 64;
+  for (size_t i = end; i-- > begin;) {
+    const uint64_t *row = &decisions[(ringRows ? i % ringRows : i) * rowWords];
+    if (i < result.size())
+      result[i] = (state >> (trellis.numTaps - 2)) & 0x01;
+    state = ((state << 1) & (trellis.states - 1)) | ((row[state / 64] >> (state % 64)) & 0x01);
+  }
+  return state;
+}
+
+size_t BitArray::DecodedSize(const std::vector<BitArray> &taps, size_t numSymbols, bool flush) {
+  EncodeCheck(taps, std::vector<BitArray>());
+  size_t steps = numSymbols / taps.size();
+  if (!flush)
+    return steps;
+  return steps >= taps[0].size() - 1 ? steps - (taps[0].size() - 1) : 0;
+}
+
+void BitArray::Decode(const std::vector<BitArray> &taps, const BitSpan &bits, BitArray &result, bool flush, size_t tracebackLength) {
+  std::vector<int8_t> symbols(bits.size());
+  UnpackSymbols(bits, symbols.data());
+  Decode(taps, symbols.data(), symbols.size(), result, flush, tracebackLength);
+}
+
+void BitArray::Decode(const std::vector<BitArray> &taps, const int8_t *symbols, size_t numSymbols, BitArray &result, bool flush, size_t tracebackLength) {
+  ViterbiTrellis trellis = ViterbiBuildTrellis(taps);
+  if (numSymbols % trellis.streams)
+    throw std::runtime_error("The number of symbols must be a multiple of the number of generators");
+
+  size_t steps = numSymbols / trellis.streams, decodedSize = DecodedSize(taps, numSymbols, flush);
+  if (flush && steps < trellis.numTaps - 1)
+    throw std::runtime_error("A flushed input must hold at least the flushed bits");
+  if (result.size() < decodedSize)
+    throw std::runtime_error("The result must be at least large enough to hold the decoded bits");
+
+  // Only the zero state is possible at the start, the others start far enough behind to never win.
+  std::vector<int16_t> metrics(trellis.states, int16_t(2 * (trellis.numTaps - 1) * 127 * trellis.streams + 1));
+  metrics[0] = 0;
+
+  // Bits past the decoded ones are written to a throwaway array, they are left alone in result.
+  BitArray decoded(decodedSize);
+  size_t rowWords = (trellis.states + 63) / 64, ringRows = 2 * tracebackLength, step(0), begin(0);
+  std::vector<uint64_t> decisions((tracebackLength ? ringRows : steps) * rowWords);
+
+  if (!tracebackLength)
+    ViterbiSteps(trellis, symbols, steps, metrics, decisions.data(), step);
+  else {
+    // Steps are run tracebackLength at a time, once 2 * tracebackLength are held the oldest half is decided.
+    for (size_t i = 0; i < steps; i += tracebackLength) {
+      size_t numSteps = std::min(tracebackLength, steps - i);
+      ViterbiSteps(trellis, symbols + i * trellis.streams, numSteps, metrics, &decisions[(i % ringRows) * rowWords], step);
+      if (i + numSteps - begin == ringRows) {
+        size_t best = std::min_element(metrics.begin(), metrics.end()) - metrics.begin();
+        size_t state = ViterbiTraceback(trellis, decisions, ringRows, i + numSteps, begin + tracebackLength, best, decoded);
+        ViterbiTraceback(trellis, decisions, ringRows, begin + tracebackLength, begin, state, decoded);
+        begin += tracebackLength;
+      }
+    }
+  }
+
+  size_t state = flush ? 0 : std::min_element(metrics.begin(), metrics.end()) - metrics.begin();
+  ViterbiTraceback(trellis, decisions, tracebackLength ? ringRows : 0, steps, begin, state, decoded);
+
+  for (size_t w = 0; w * 64 < decodedSize; ++w)
+    result.storeWord(w, decoded.loadWord(w), decodedSize);
+}
+
+void BitArray::ViterbiSteps(const ViterbiTrellis &trellis, const int8_t *symbols, size_t numSteps, std::vector<int16_t> &metrics, uint64_t *decisions,
+                            size_t &step) {
+  Dispatch::Get<decltype(&ViterbiStepsScalar)>(Dispatch::VITERBI)(trellis, symbols, numSteps, metrics, decisions, step);
+}
+
+// The add-compare-select one state at a time, also used by the SIMD versions when there are too few states to fill a register.
+void BitArray::ViterbiStepsScalar(const ViterbiTrellis &trellis, const int8_t *symbols, size_t numSteps, std::vector<int16_t> &metrics, uint64_t *decisions,
+                                  size_t &step) {
+  size_t n = trellis.streams, half = trellis.states / 2, rowWords = (trellis.states + 63) / 64, uShift = trellis.numTaps - 1;
+  std::vector<int16_t> newMetrics(trellis.states);
+  int16_t branch[16];
+
+  for (size_t i = 0; i < numSteps; ++i, symbols += n, decisions += rowWords) {
+    // The branch metric for every possible set of encoded bits, lower is better.
+    for (size_t c = 0; c < (size_t(1) << n); ++c) {
+      branch[c] = 0;
+      for (size_t j = 0; j < n; ++j)
+        branch[c] += ((c >> j) & 0x01) ? -symbols[j] : symbols[j];
+    }
+
+    std::fill(decisions, decisions + rowWords, 0);
+    for (size_t u = 0; u < 2; ++u)
+      for (size_t t = 0; t < half; ++t) {
+        int16_t m0 = metrics[2 * t] + branch[trellis.codes[(2 * t) | (u << uShift)]];
+        int16_t m1 = metrics[2 * t + 1] + branch[trellis.codes[(2 * t + 1) | (u << uShift)]];
+        size_t newState = t + u * half;
+        newMetrics[newState] = m0 > m1 ? m1 : m0;
+        decisions[newState / 64] |= uint64_t(m0 > m1) << (newState % 64);
+      }
+
+    if (++step % 8 == 0) {
+      int16_t base = newMetrics[0];
+      for (size_t t = 0; t < trellis.states; ++t)
+        newMetrics[t] -= base;
+    }
+    metrics.swap(newMetrics);
+  }
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("sse2"))) 
+void BitArray::ViterbiStepsSse2(const ViterbiTrellis &trellis, const int8_t *symbols, size_t numSteps, std::vector<int16_t> &metrics, uint64_t *decisions,
+                                size_t &step) {
+  size_t n = trellis.streams, half = trellis.states / 2, rowWords = (trellis.states + 63) / 64;
+  if (half < 8) // Too few states to fill a register.
+    return ViterbiStepsScalar(trellis, symbols, numSteps, metrics, decisions, step);
+
+  std::vector<int16_t> newMetrics(trellis.states);
+  const int16_t *masks = trellis.masks.data();
+  bool butterfly = trellis.butterfly;
+  __m128i symbols128[4];
+  for (size_t i = 0; i < numSteps; ++i, symbols += n, decisions += rowWords) {
+    for (size_t j = 0; j < n; ++j)
+      symbols128[j] = _mm_set1_epi16(symbols[j]);
+
+    for (size_t t = 0; t < half; t += 8) {
+      // Split the old metrics of states 2t through 2t + 15 into the even and odd states.
+      __m128i a = _mm_loadu_si128((__m128i const *)&metrics[2 * t]);
+      __m128i b = _mm_loadu_si128((__m128i const *)&metrics[2 * t + 8]);
+      __m128i even = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+      __m128i odd = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+
+      // The branch metric is the sum of the symbols, negated where a 1 is expected. For a butterfly
+      // the metrics for the odd old states and for a 1 input are the negated ones of the even states.
+      __m128i m0[2] = {even, even}, m1[2] = {odd, odd};
+      for (size_t u = 0; u < (butterfly ? 1 : 2); ++u)
+        for (size_t j = 0; j < n; ++j) {
+          __m128i c0 = _mm_loadu_si128((__m128i const *)&masks[((0 * 2 + u) * n + j) * half + t]);
+          m0[u] = _mm_add_epi16(m0[u], _mm_sub_epi16(_mm_xor_si128(symbols128[j], c0), c0));
+          if (!butterfly) {
+            __m128i c1 = _mm_loadu_si128((__m128i const *)&masks[((1 * 2 + u) * n + j) * half + t]);
+            m1[u] = _mm_add_epi16(m1[u], _mm_sub_epi16(_mm_xor_si128(symbols128[j], c1), c1));
+          }
+        }
+      if (butterfly) {
+        __m128i branch = _mm_sub_epi16(m0[0], even);
+        m1[0] = _mm_sub_epi16(odd, branch);
+        m0[1] = _mm_sub_epi16(even, branch);
+        m1[1] = _mm_add_epi16(odd, branch);
+      }
+
+      for (size_t u = 0; u < 2; ++u) {
+        __m128i decision = _mm_cmpgt_epi16(m0[u], m1[u]);
+        _mm_storeu_si128((__m128i *)&newMetrics[t + u * half], _mm_min_epi16(m0[u], m1[u]));
+        ((uint8_t *)decisions)[(t + u * half) / 8] = uint8_t(_mm_movemask_epi8(_mm_packs_epi16(decision, decision)));
+      }
+    }
+
+    if (++step % 8 == 0) {
+      __m128i base = _mm_set1_epi16(newMetrics[0]);
+      for (size_t t = 0; t < trellis.states; t += 8)
+        _mm_storeu_si128((__m128i *)&newMetrics[t], _mm_sub_epi16(_mm_loadu_si128((__m128i const *)&newMetrics[t]), base));
+    }
+    metrics.swap(newMetrics);
+  }
+}
+#endif
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+void BitArray::ViterbiStepsAvx2(const ViterbiTrellis &trellis, const int8_t *symbols, size_t numSteps, std::vector<int16_t> &metrics, uint64_t *decisions,
+                                size_t &step) {
+  size_t n = trellis.streams, half = trellis.states / 2, rowWords = (trellis.states + 63) / 64;
+  if (half < 16) // Too few states to fill a register.
+    return ViterbiStepsScalar(trellis, symbols, numSteps, metrics, decisions, step);
+
+  std::vector<int16_t> newMetrics(trellis.states);
+  const int16_t *masks = trellis.masks.data();
+  bool butterfly = trellis.butterfly;
+  __m256i symbols256[4];
+  for (size_t i = 0; i < numSteps; ++i, symbols += n, decisions += rowWords) {
+    for (size_t j = 0; j < n; ++j)
+      symbols256[j] = _mm256_set1_epi16(symbols[j]);
+
+    for (size_t t = 0; t < half; t += 16) {
+      // Split the old metrics of states 2t through 2t + 31 into the even and odd states, the packs work within 128-bit lanes.
+      __m256i a = _mm256_loadu_si256((__m256i const *)&metrics[2 * t]);
+      __m256i b = _mm256_loadu_si256((__m256i const *)&metrics[2 * t + 16]);
+      __m256i even = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16), _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16));
+      __m256i odd = _mm256_packs_epi32(_mm256_srai_epi32(a, 16), _mm256_srai_epi32(b, 16));
+      even = _mm256_permute4x64_epi64(even, 0xD8);
+      odd = _mm256_permute4x64_epi64(odd, 0xD8);
+
+      // The branch metric is the sum of the symbols, negated where a 1 is expected. For a butterfly
+      // the metrics for the odd old states and for a 1 input are the negated ones of the even states.
+      __m256i m0[2] = {even, even}, m1[2] = {odd, odd};
+      for (size_t u = 0; u < (butterfly ? 1 : 2); ++u)
+        for (size_t j = 0; j < n; ++j) {
+          __m256i c0 = _mm256_loadu_si256((__m256i const *)&masks[((0 * 2 + u) * n + j) * half + t]);
+          m0[u] = _mm256_add_epi16(m0[u], _mm256_sub_epi16(_mm256_xor_si256(symbols256[j], c0), c0));
+          if (!butterfly) {
+            __m256i c1 = _mm256_loadu_si256((__m256i const *)&masks[((1 * 2 + u) * n + j) * half + t]);
+            m1[u] = _mm256_add_epi16(m1[u], _mm256_sub_epi16(_mm256_xor_si256(symbols256[j], c1), c1));
+          }
+        }
+      if (butterfly) {
+        __m256i branch = _mm256_sub_epi16(m0[0], even);
+        m1[0] = _mm256_sub_epi16(odd, branch);
+        m0[1] = _mm256_sub_epi16(even, branch);
+        m1[1] = _mm256_add_epi16(odd, branch);
+      }
+
+      for (size_t u = 0; u < 2; ++u) {
+        __m256i decision = _mm256_cmpgt_epi16(m0[u], m1[u]);
+        _mm256_storeu_si256((__m256i *)&newMetrics[t + u * half], _mm256_min_epi16(m0[u], m1[u]));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_packs_epi16(decision, decision));
+        *(uint16_t *)&((uint8_t *)decisions)[(t + u * half) / 8] = uint16_t((mask & 0xFF) | ((mask >> 8) & 0xFF00));
+      }
+    }
+
+    if (++step % 8 == 0) {
+      __m256i base = _mm256_set1_epi16(newMetrics[0]);
+      for (size_t t = 0; t < trellis.states; t += 16)
+        _mm256_storeu_si256((__m256i *)&newMetrics[t], _mm256_sub_epi16(_mm256_loadu_si256((__m256i const *)&newMetrics[t]), base));
+    }
+    metrics.swap(newMetrics);
+  }
+}
+#endif
+
+RankSelect::RankSelect(const BitArray &bits) : _bits(bits) { Rebuild(); }
+
+size_t RankSelect::Count() const { return _superblocks.back(); }
+
+void RankSelect::Rebuild() {
+  size_t numWords = (_bits.size() + 63) / 64;
+  _superblocks.assign((numWords + 1023) / 1024 + 1, 0);
+  _blocks.assign((numWords + 31) / 32, 0);
+  Update(0, _bits.size());
+}
+
+void RankSelect::Update(size_t begin, size_t end) {
+  if (begin > end || end > _bits.size() || _superblocks.size() != (_bits.size() + 65535) / 65536 + 1)
+    throw std::runtime_error("Update range is outside of the indexed bits, Rebuild after resizing.");
+  if (begin == end)
+    return;
+
+  // The counts of the superblocks after the modified ones all move by the same amount.
+  const uint64_t *words = (const uint64_t *)_bits.data();
+  size_t numWords = (_bits.size() + 63) / 64, first = begin / 65536, last = (end - 1) / 65536;
+  uint64_t delta(0);
+  for (size_t s = first; s <= last; ++s) {
+    uint64_t count = CountBlocks(words + s * 1024, std::min<size_t>(1024, numWords - s * 1024), &_blocks[s * 32]);
+    uint64_t old = _superblocks[s + 1];
+    _superblocks[s + 1] = _superblocks[s] + count;
+    delta = _superblocks[s + 1] - old;
+  }
+  for (size_t s = last + 2; s < _superblocks.size(); ++s)
+    _superblocks[s] += delta;
+}
+
+__attribute__((target("default"))) 
+uint64_t RankSelect::CountBlocks(const uint64_t *words, size_t numWords, uint64_t *blocks) {
+  uint64_t total(0);
+  for (size_t b = 0; b * 32 < numWords; ++b) {
+    uint64_t entry = total;
+    for (size_t sub = 0; sub < 4; ++sub) {
+      uint64_t count(0);
+      for (size_t w = b * 32 + sub * 8; w < std::min(numWords, b * 32 + sub * 8 + 8); ++w)
+        count += countBits(words[w]);
+      if (sub < 3)
+        entry |= count << (32 + 10 * sub);
+      total += count;
+    }
+    blocks[b] = entry;
+  }
+  return total;
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("popcnt"))) 
+uint64_t RankSelect::CountBlocks(const uint64_t *words, size_t numWords, uint64_t *blocks) {
+  uint64_t total(0);
+  for (size_t b = 0; b * 32 < numWords; ++b) {
+    uint64_t entry = total;
+    for (size_t sub = 0; sub < 4; ++sub) {
+      uint64_t count(0);
+      for (size_t w = b * 32 + sub * 8; w < std::min(numWords, b * 32 + sub * 8 + 8); ++w)
+        count += countBits(words[w]);
+      if (sub < 3)
+        entry |= count << (32 + 10 * sub);
+      total += count;
+    }
+    blocks[b] = entry;
+  }
+  return total;
+}
+#endif
+
+__attribute__((target("default"))) 
+size_t RankSelect::Rank(size_t i) const {
+  assert(i <= _bits.size());
+  if (i == _bits.size())
+    return Count();
+  const uint64_t *words = (const uint64_t *)_bits.data();
+  uint64_t entry = _blocks[i / 2048];
+  size_t rank = _superblocks[i / 65536] + uint32_t(entry);
+  for (size_t sub = 0; sub < i / 512 % 4; ++sub)
+    rank += (entry >> (32 + 10 * sub)) & 0x3FF;
+  for (size_t w = i / 512 * 8; w < i / 64; ++w)
+    rank += countBits(words[w]);
+  return rank + countBits(words[i / 64] & ((uint64_t(1) << (i % 64)) - 1));
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("popcnt"))) 
+size_t RankSelect::Rank(size_t i) const {
+  assert(i <= _bits.size());
+  if (i == _bits.size())
+    return Count();
+  const uint64_t *words = (const uint64_t *)_bits.data();
+  uint64_t entry = _blocks[i / 2048];
+  size_t rank = _superblocks[i / 65536] + uint32_t(entry);
+  for (size_t sub = 0; sub < i / 512 % 4; ++sub)
+    rank += (entry >> (32 + 10 * sub)) & 0x3FF;
+  for (size_t w = i / 512 * 8; w < i / 64; ++w)
+    rank += countBits(words[w]);
+  return rank + countBits(words[i / 64] & ((uint64_t(1) << (i % 64)) - 1));
+}
+#endif
+
+// Finds the sub-block holding the set bit with k set bits before it, returning its first word with k
+// reduced to the set bits before the bit within the sub-block.
+size_t RankSelect::SelectSubBlock(size_t &k) const {
+  // Both searches step without branching, random queries would mispredict about every other step.
+  size_t s(0);
+  for (size_t n = _superblocks.size() - 1; n > 1; n -= n / 2)
+    s = _superblocks[s + n / 2] <= k ? s + n / 2 : s;
+  k -= _superblocks[s];
+  size_t b = s * 32;
+  // The entries of a superblock span 4 cache lines, fetched together rather than one per step.
+  for (size_t line = b; line < std::min(b + 32, _blocks.size()); line += 8)
+    __builtin_prefetch(&_blocks[line]);
+  for (size_t n = std::min<size_t>(32, _blocks.size() - b); n > 1; n -= n / 2)
+    b = uint32_t(_blocks[b + n / 2]) <= k ? b + n / 2 : b;
+  uint64_t entry = _blocks[b];
+  k -= uint32_t(entry);
+  size_t sub(0);
+  for (; sub < 3; ++sub) {
+    size_t count = (entry >> (32 + 10 * sub)) & 0x3FF;
+    if (k < count)
+      break;
+    k -= count;
+  }
+  return b * 32 + sub * 8;
+}
+
+// The position of the set bit of x with k set bits below it, narrowing down by halves.
+inline size_t selectBit(uint64_t x, size_t k) {
+  size_t pos(0);
+  for (size_t width = 32; width >= 8; width /= 2) {
+    size_t count = countBits(x & ((uint64_t(1) << width) - 1));
+    if (k >= count) {
+      k -= count;
+      x >>= width;
+      pos += width;
+    }
+  }
+  for (; k; --k)
+    x &= x - 1;
+  return pos + __builtin_ctzll(x);
+}
+
+__attribute__((target("default"))) 
+size_t RankSelect::Select(size_t k) const {
+  if (k >= Count())
+    return _bits.size();
+  const uint64_t *words = (const uint64_t *)_bits.data();
+  for (size_t w = SelectSubBlock(k);; ++w) {
+    size_t count = countBits(words[w]);
+    if (k < count)
+      return w * 64 + selectBit(words[w], k);
+    k -= count;
+  }
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("popcnt,bmi2"))) 
+size_t RankSelect::Select(size_t k) const {
+  if (k >= Count())
+    return _bits.size();
+  const uint64_t *words = (const uint64_t *)_bits.data();
+  for (size_t w = SelectSubBlock(k);; ++w) {
+    size_t count = countBits(words[w]);
+    if (k < count)
+      return w * 64 + __builtin_ctzll(_pdep_u64(uint64_t(1) << k, words[w]));
+    k -= count;
+  }
+}
+#endif
+
+Convolver::Convolver(const BitArray &taps)
+    : _numTaps(taps.size()), _poly(BitArray::ConvolvePoly(taps)), _reg(_poly.size()), _x(_poly.size() + BlockWords), _y(BlockWords + 1),
+      _zeros(taps.size() ? taps.size() - 1 : 0) {
+  if (taps.size() == 0)
+    throw std::runtime_error("Taps must hold at least one bit");
+}
+
+Convolver::Convolver(const BitArray &taps, const BitArray &fill) : Convolver(taps) { SetFill(fill); }
+
+size_t Convolver::Push(const BitSpan &bits, BitArray &result, size_t pos) {
+  if (pos > result.size() || result.size() - pos < bits.size())
+    throw std::runtime_error("Results of the convolution must be at least large enough to hold the result");
+  Run(bits, result, pos);
+  return pos + bits.size();
+}
+
+BitSpan Convolver::Push(const BitSpan &bits) {
+  if (_buffer.size() < bits.size())
+    _buffer = BitArray(bits.size());
+  Run(bits, _buffer, 0);
+  return BitSpan(_buffer.data(), 0, bits.size());
+}
+
+size_t Convolver::Flush(BitArray &result, size_t pos) { return Push(_zeros, result, pos); }
+
+BitSpan Convolver::Flush() { return Push(_zeros); }
+
+void Convolver::GetFill(BitArray &fill) const {
+  if (fill.size() < _numTaps)
+    throw std::runtime_error("The fill must be at least as large as the taps");
+  BitArray::ConvolveRegisterToFill(_reg, fill, _numTaps);
+}
+
+void Convolver::SetFill(const BitArray &fill) {
+  if (fill.size() < _numTaps)
+    throw std::runtime_error("The fill must be at least as large as the taps");
+  _reg = BitArray::ConvolveFillToRegister(fill, _numTaps);
+}
+
+void Convolver::Reset() { std::fill(_reg.begin(), _reg.end(), 0); }
+
+/**
+ * Each block of input goes into _x after the words preceding it and is convolved starting one word
+ * early, so that the carry into its first output word is computed rather than kept. The output is
+ * deposited at any bit position and the words preceding the next block are moved to the front.
+ */
+void Convolver::Run(const BitSpan &bits, BitArray &result, size_t pos) {
+  size_t polyWords = _poly.size(), fullWords = bits.size() / 64;
+  uint64_t *out = (uint64_t *)result.data();
+  std::copy(_reg.begin(), _reg.end(), _x.begin());
+  for (size_t w0 = 0; w0 * 64 < bits.size(); w0 += BlockWords) {
+    size_t numWords = std::min(size_t(BlockWords), (bits.size() + 63) / 64 - w0), numFull = w0 < fullWords ? std::min(numWords, fullWords - w0) : 0;
+    BitArray::BitExprLoad((const uint64_t *)bits._base + w0, unsigned(bits._offset), &_x[polyWords], numFull);
+    for (size_t w = numFull; w < numWords; ++w)
+      _x[polyWords + w] = bits.loadWord(w0 + w);
+
+    uint64_t carry(0);
+    BitArray::ConvolveBlock(_poly.data(), polyWords, &_x[polyWords - 1], _y.data(), numWords + 1, carry);
+
+    size_t numBits = std::min(numWords * 64, bits.size() - w0 * 64);
+    BitArray::DepositWords(&_y[1], numBits, out, pos + w0 * 64);
+
+    if (numBits == numWords * 64)
+      std::copy(_x.begin() + numWords, _x.begin() + numWords + polyWords, _x.begin());
+    else
+      for (size_t k = 0; k < polyWords; ++k)
+        _x[k] = extractWord(_x.data(), polyWords + numWords, numBits + 64 * k);
+  }
+  std::copy(_x.begin(), _x.begin() + polyWords, _reg.begin());
+}
+
+Lfsr::Lfsr(const BitArray &taps)
+    : _degree(taps.size() - 1), _poly(BitArray::ConvolvePoly(taps)), _charPoly(0), _impulse(0), _history(~(unsigned __int128)0), _x(BlockWords),
+      _y(BlockWords) {
+  if (taps.size() < 2 || taps.size() > 65)
+    throw std::runtime_error("Feedback taps must hold 2 to 65 bits");
+  if (!taps[taps.size() - 1])
+    throw std::runtime_error("The last feedback tap must be set");
+  for (size_t i = 0; i < taps.size(); ++i)
+    _charPoly |= (unsigned __int128)taps[i] << i;
+  // The impulse response h = 1 / poly, from poly * h = 1.
+  for (size_t k = 0; k < 64; ++k) {
+    uint64_t bit = k == 0;
+    for (size_t j = 1; j <= std::min(k, _degree); ++j)
+      bit ^= (_poly[j / 64] >> (j % 64)) & (_impulse >> (k - j)) & 1;
+    _impulse |= bit << k;
+  }
+}
+
+Lfsr::Lfsr(const BitArray &taps, const BitArray &fill) : Lfsr(taps) { SetFill(fill); }
+
+BitArray Lfsr::Prbs(unsigned order) {
+  switch (order) {
+  case 7:
+    return BitArray("11000001");
+  case 9:
+    return BitArray("1000010001");
+  case 11:
+    return BitArray("101000000001");
+  case 15:
+    return BitArray("1100000000000001");
+  case 20:
+    return BitArray("100000000000000010001");
+  case 23:
+    return BitArray("100001000000000000000001");
+  case 31:
+    return BitArray("10010000000000000000000000000001");
+  }
+  throw std::runtime_error("PRBS orders 7, 9, 11, 15, 20, 23 and 31 are supported");
+}
+
+size_t Lfsr::Generate(size_t n, BitArray &result, size_t pos) { return Run(NULL, n, false, result, pos); }
+
+size_t Lfsr::Generate(const BitArray::Parallel &policy, size_t n, BitArray &result, size_t pos) {
+  if (pos > result.size() || result.size() - pos < n)
+    throw std::runtime_error("Results of the register must be at least large enough to hold the result");
+  size_t numThreads = policy.Threads(n);
+  if (numThreads == 1)
+    return Generate(n, result, pos);
+
+  // The segments start on 512 bit lines of the result, so that no two threads write to the same cache line.
+  std::vector<size_t> bounds(numThreads + 1, pos + n);
+  bounds[0] = pos;
+  for (size_t k = 1; k < numThreads; ++k)
+    bounds[k] = std::min(pos + n, (pos + k * (n / numThreads) + 511) / 512 * 512);
+  BitArray::ParallelFor(numThreads, [&](size_t k) {
+    Lfsr segment(*this);
+    segment.Jump(bounds[k] - pos);
+    segment.Run(NULL, bounds[k + 1] - bounds[k], false, result, bounds[k]);
+  });
+  Jump(n);
+  return pos + n;
+}
+
+size_t Lfsr::Apply(const BitSpan &bits, BitArray &result, size_t pos) { return Run(&bits, bits.size(), false, result, pos); }
+
+size_t Lfsr::Scramble(const BitSpan &bits, BitArray &result, size_t pos) { return Run(&bits, bits.size(), true, result, pos); }
+
+/**
+ * With the sequence s starting at the oldest bit of the register, s[n + i] is the sum of s[i + j]
+ * over the terms x^j of x^n modulo the characteristic polynomial, for which the register and the
+ * next word of the sequence are enough.
+ */
+void Lfsr::Jump(uint64_t n) {
+  if (n == 0)
+    return;
+  uint64_t power = 1;
+  for (int b = 63 - __builtin_clzll((n - 1) | 1); b >= 0; --b) {
+    power = MulMod(power, power, _charPoly, _degree);
+    if (((n - 1) >> b) & 1)
+      power = MulMod(power, 2, _charPoly, _degree);
+  }
+
+  uint64_t reg = Register(), next;
+  FeedbackBlock(_poly.data(), _degree, _impulse, NULL, &next, 1, reg);
+  unsigned __int128 window = reg | (unsigned __int128)next << _degree, fill = 0;
+  for (size_t i = 0; i <= _degree; ++i)
+    fill |= (unsigned __int128)__builtin_parityll(power & uint64_t(window >> i)) << i;
+  _history = fill << (127 - _degree);
+}
+
+void Lfsr::GetFill(BitArray &fill) const {
+  if (fill.size() < _degree + 1)
+    throw std::runtime_error("The fill must be at least as large as the taps");
+  unsigned __int128 bits = _history >> (127 - _degree);
+  fill.storeWord(0, uint64_t(bits), _degree + 1);
+  if (_degree == 64)
+    fill.storeWord(1, uint64_t(bits >> 64), _degree + 1);
+}
+
+void Lfsr::SetFill(const BitArray &fill) {
+  if (fill.size() < _degree + 1)
+    throw std::runtime_error("The fill must be at least as large as the taps");
+  unsigned __int128 bits = fill.loadWord(0) | (unsigned __int128)(_degree == 64 ? fill.loadWord(1) & 1 : 0) << 64;
+  _history = bits << (127 - _degree);
+}
+
+// The last _degree bits of the register, the newest on top.
+uint64_t Lfsr::Register() const { return uint64_t(_history >> (128 - _degree)); }
+
+/**
+ * Each block of input is loaded into _x and run through the register, the register words are
+ * shifted into _history, and for Apply the input is XORed in before the output is deposited at any
+ * bit position.
+ */
+size_t Lfsr::Run(const BitSpan *bits, size_t n, bool feedback, BitArray &result, size_t pos) {
+  if (pos > result.size() || result.size() - pos < n)
+    throw std::runtime_error("Results of the register must be at least large enough to hold the result");
+  for (size_t w0 = 0; w0 * 64 < n; w0 += BlockWords) {
+    size_t numWords = std::min(size_t(BlockWords), (n + 63) / 64 - w0), numBits = std::min(64 * numWords, n - 64 * w0);
+    if (bits)
+      for (size_t k = 0; k < numWords; ++k)
+        _x[k] = bits->loadWord(w0 + k);
+    FeedbackBlock(_poly.data(), _degree, _impulse, feedback ? _x.data() : NULL, _y.data(), numWords, Register());
+    for (size_t k = 0; k < numWords; ++k) {
+      size_t m = std::min(size_t(64), numBits - 64 * k);
+      uint64_t word = m < 64 ? _y[k] & ((uint64_t(1) << m) - 1) : _y[k];
+      _history = m < 64 ? (_history >> m) | (unsigned __int128)word << (128 - m) : (_history >> 64) | (unsigned __int128)word << 64;
+      if (bits && !feedback)
+        _y[k] ^= _x[k];
+    }
+    BitArray::DepositWords(_y.data(), numBits, (uint64_t *)result.data(), pos + 64 * w0);
+  }
+  return pos + n;
+}
+
+void Lfsr::FeedbackBlock(const uint64_t *poly, size_t degree, uint64_t impulse, const uint64_t *x, uint64_t *y, size_t numWords, uint64_t reg) {
+  Dispatch::Get<decltype(&FeedbackBlockDefault)>(Dispatch::LFSR)(poly, degree, impulse, x, y, numWords, reg);
+}
+
+/**
+ * With poly * y = x + c, where c holds the terms of the feedback reaching back into the register,
+ * c = (poly * reg) >> degree and y = (x + c) * impulse, both truncated to a word, which the
+ * default version multiplies out a bit at a time.
+ */
+void Lfsr::FeedbackBlockDefault(const uint64_t *poly, size_t degree, uint64_t impulse, const uint64_t *x, uint64_t *y, size_t numWords, uint64_t reg) {
+  for (size_t w = 0; w < numWords; ++w) {
+    unsigned __int128 product = degree == 64 && (poly[1] & 1) ? (unsigned __int128)reg << 64 : 0;
+    uint64_t u = x ? x[w] : 0;
+    for (size_t j = 0; j < 64; ++j)
+      if ((poly[0] >> j) & 1)
+        product ^= (unsigned __int128)reg << j;
+    u ^= uint64_t(product >> degree);
+    uint64_t out = 0;
+    for (size_t j = 0; j < 64; ++j)
+      if ((impulse >> j) & 1)
+        out ^= u << j;
+    y[w] = out;
+    reg = degree == 64 ? out : out >> (64 - degree);
+  }
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("pclmul"))) 
+void Lfsr::FeedbackBlockPclmul(const uint64_t *poly, size_t degree, uint64_t impulse, const uint64_t *x, uint64_t *y, size_t numWords, uint64_t reg) {
+  __m128i poly128 = _mm_cvtsi64_si128(poly[0]), impulse128 = _mm_cvtsi64_si128(impulse);
+  bool top = degree == 64 && (poly[1] & 1);
+  for (size_t w = 0; w < numWords; ++w) {
+    __m128i product = _mm_clmulepi64_si128(poly128, _mm_cvtsi64_si128(reg), 0x00);
+    uint64_t lo = _mm_cvtsi128_si64(product), hi = _mm_cvtsi128_si64(_mm_unpackhi_epi64(product, product));
+    uint64_t c = degree == 64 ? hi ^ (top ? reg : 0) : (lo >> degree) | (hi << (64 - degree));
+    uint64_t u = (x ? x[w] : 0) ^ c;
+    uint64_t out = _mm_cvtsi128_si64(_mm_clmulepi64_si128(_mm_cvtsi64_si128(u), impulse128, 0x00));
+    y[w] = out;
+    reg = degree == 64 ? out : out >> (64 - degree);
+  }
+}
+#endif
+
+__attribute__((target("default"))) 
+uint64_t Lfsr::MulMod(uint64_t a, uint64_t b, unsigned __int128 charPoly, size_t degree) {
+  unsigned __int128 product = 0;
+  for (size_t j = 0; j < 64; ++j)
+    if ((b >> j) & 1)
+      product ^= (unsigned __int128)a << j;
+  for (size_t j = 2 * degree; j-- > degree;)
+    if ((product >> j) & 1)
+      product ^= charPoly << (j - degree);
+  return uint64_t(product);
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("pclmul"))) 
+uint64_t Lfsr::MulMod(uint64_t a, uint64_t b, unsigned __int128 charPoly, size_t degree) {
+  __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi64_si128(a), _mm_cvtsi64_si128(b), 0x00);
+  unsigned __int128 product = (unsigned __int128)(uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(prod, prod)) << 64 | (uint64_t)_mm_cvtsi128_si64(prod);
+  for (size_t j = 2 * degree; j-- > degree;)
+    if ((product >> j) & 1)
+      product ^= charPoly << (j - degree);
+  return uint64_t(product);
+}
+#endif
+
+namespace {
+// The low width bits of value in reverse order.
+inline uint64_t reflectBits(uint64_t value, unsigned width) {
+  uint64_t reflected = 0;
+  for (unsigned i = 0; i < width; ++i)
+    reflected |= ((value >> i) & 1) << (width - 1 - i);
+  return reflected;
+}
+
+// One word through slicing-by-8 tables of a reflected register.
+inline uint64_t crcTableWord(const uint64_t *tables, uint64_t reg, uint64_t word) {
+  uint64_t x = reg ^ word, r = 0;
+  for (size_t k = 0; k < 8; ++k)
+    r ^= tables[(7 - k) * 256 + ((x >> (8 * k)) & 0xFF)];
+  return r;
+}
+
+// A reflected 128 bit lane carried over the bits its constants were computed for.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("pclmul"))) 
+inline __m128i crcFold(__m128i x, __m128i k) { return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)); }
+#endif
+} // namespace
+
+/**
+ * Internally the register is reflected and 64 bits wide, the polynomial multiplied by x^(64 - width),
+ * so that any width works the same and the CRC is in the low width bits. The folding constants are
+ * x^(d + 63) and x^(d - 1) modulo the 64 bit polynomial for a fold over d bits, the - 1 because the
+ * carry-less product of two reflected words is one bit short of the reflected 128 bit product.
+ */
+Crc::Crc(unsigned width, uint64_t poly, uint64_t init, bool reflect, uint64_t xorOut)
+    : _width(width), _poly(0), _init(0), _reflect(reflect), _xorOut(xorOut), _tables(8 * 256), _folds(8) {
+  if (width == 0 || width > 64)
+    throw std::runtime_error("CRCs of 1 to 64 bits are supported");
+  _poly = reflectBits(poly, width);
+  _init = reflectBits(init, width);
+  for (size_t b = 0; b < 256; ++b) {
+    uint64_t r = b;
+    for (size_t i = 0; i < 8; ++i)
+      r = (r >> 1) ^ (r & 1 ? _poly : 0);
+    _tables[b] = r;
+  }
+  for (size_t k = 1; k < 8; ++k)
+    for (size_t b = 0; b < 256; ++b)
+      _tables[k * 256 + b] = (_tables[(k - 1) * 256 + b] >> 8) ^ _tables[_tables[(k - 1) * 256 + b] & 0xFF];
+
+  uint64_t normal = width == 64 ? poly : poly << (64 - width);
+  for (size_t k = 0; k < 4; ++k) {
+    size_t distance = 512 - 128 * k, powers[2] = {distance + 63, distance - 1};
+    for (size_t j = 0; j < 2; ++j) {
+      uint64_t v = 1;
+      for (size_t n = 0; n < powers[j]; ++n)
+        v = (v << 1) ^ (v >> 63 ? normal : 0);
+      _folds[2 * k + j] = reflectBits(v, 64);
+    }
+  }
+}
+
+Crc Crc::Crc32() { return Crc(32, 0x04C11DB7, 0xFFFFFFFF, true, 0xFFFFFFFF); }
+
+Crc Crc::Crc32C() { return Crc(32, 0x1EDC6F41, 0xFFFFFFFF, true, 0xFFFFFFFF); }
+
+Crc Crc::Crc16Ccitt() { return Crc(16, 0x1021, 0xFFFF); }
+
+Crc Crc::Crc24Lte() { return Crc(24, 0x864CFB); }
+
+unsigned Crc::Width() const { return _width; }
+
+uint64_t Crc::Compute(const ProxyBit &start, size_t len) const { return Compute(BitSpan(start, len)); }
+
+uint64_t Crc::Compute(const BitSpan &bits) const {
+  size_t numWords = bits.size() / 64;
+  uint64_t reg = Words(_tables.data(), _folds.data(), bits, numWords, _init);
+  size_t numBits = bits.size() % 64;
+  uint64_t tail = bits.loadWord(numWords);
+  for (size_t i = 0; i + 8 <= numBits; i += 8) {
+    reg ^= (tail >> i) & 0xFF;
+    reg = (reg >> 8) ^ _tables[reg & 0xFF];
+  }
+  for (size_t i = numBits / 8 * 8; i < numBits; ++i) {
+    reg ^= (tail >> i) & 1;
+    reg = (reg >> 1) ^ (reg & 1 ? _poly : 0);
+  }
+  uint64_t mask = _width == 64 ? ~uint64_t(0) : (uint64_t(1) << _width) - 1;
+  return ((_reflect ? reg : reflectBits(reg, _width)) ^ _xorOut) & mask;
+}
+
+void Crc::Append(BitArray &frame) const {
+  uint64_t crc = Compute(frame);
+  size_t pos = frame.size();
+  frame.Resize(pos + _width);
+  for (size_t i = 0; i < _width; ++i)
+    frame[pos + i] = (crc >> (_reflect ? i : _width - 1 - i)) & 1;
+}
+
+uint64_t Crc::Words(const uint64_t *tables, const uint64_t *folds, const BitSpan &bits, size_t numWords, uint64_t reg) {
+  return Dispatch::Get<decltype(&WordsDefault)>(Dispatch::CRC)(tables, folds, bits, numWords, reg);
+}
+
+uint64_t Crc::WordsDefault(const uint64_t *tables, const uint64_t *, const BitSpan &bits, size_t numWords, uint64_t reg) {
+  for (size_t w = 0; w < numWords; ++w)
+    reg = crcTableWord(tables, reg, bits.loadWord(w));
+  return reg;
+}
+
+/**
+ * Four 128 bit lanes each fold over the 512 bits ahead, the register XORed into the first word, then
+ * fold into the last lane. What is left, the remaining words and the lane itself as a message
+ * following a zero register, goes through the tables.
+ */
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("pclmul"))) 
+uint64_t Crc::WordsPclmul(const uint64_t *tables, const uint64_t *folds, const BitSpan &bits, size_t numWords, uint64_t reg) {
+  if (numWords < 16) {
+    for (size_t w = 0; w < numWords; ++w)
+      reg = crcTableWord(tables, reg, bits.loadWord(w));
+    return reg;
+  }
+  // Two words of a view at a bit offset, shifted down from the words straddling them. The byte after
+  // them still holds bits of the view, so the 7 bytes of padding cover the load.
+  const uint64_t *words = (const uint64_t *)bits._base;
+  __m128i down = _mm_cvtsi32_si128(bits._offset), up = _mm_cvtsi32_si128(64 - bits._offset);
+  auto load = [&](size_t w) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)(words + w));
+    if (bits._offset == 0)
+      return lo;
+    return _mm_or_si128(_mm_srl_epi64(lo, down), _mm_sll_epi64(_mm_loadu_si128((const __m128i *)(words + w + 1)), up));
+  };
+
+  __m128i lanes[4];
+  for (size_t k = 0; k < 4; ++k)
+    lanes[k] = load(2 * k);
+  lanes[0] = _mm_xor_si128(lanes[0], _mm_cvtsi64_si128(reg));
+  __m128i k512 = _mm_loadu_si128((const __m128i *)folds);
+  size_t w = 8;
+  for (; w + 8 <= numWords; w += 8)
+    for (size_t k = 0; k < 4; ++k)
+      lanes[k] = _mm_xor_si128(crcFold(lanes[k], k512), load(w + 2 * k));
+
+  __m128i x = lanes[3];
+  for (size_t k = 0; k < 3; ++k)
+    x = _mm_xor_si128(x, crcFold(lanes[k], _mm_loadu_si128((const __m128i *)(folds + 2 * (k + 1)))));
+  __m128i k128 = _mm_loadu_si128((const __m128i *)(folds + 6));
+  for (; w + 2 <= numWords; w += 2)
+    x = _mm_xor_si128(crcFold(x, k128), load(w));
+
+  reg = crcTableWord(tables, 0, _mm_cvtsi128_si64(x));
+  reg = crcTableWord(tables, reg, _mm_cvtsi128_si64(_mm_unpackhi_epi64(x, x)));
+  for (; w < numWords; ++w)
+    reg = crcTableWord(tables, reg, bits.loadWord(w));
+  return reg;
+}
+#endif
+
+Interleaver::Interleaver(size_t rows, size_t cols) : _rows(rows), _cols(cols) {}
+
+Interleaver::Interleaver(const std::vector<size_t> &permutation) : _rows(permutation.size()), _cols(1), _forward(permutation.size()), _inverse(permutation.size()) {
+  if (permutation.size() > UINT32_MAX)
+    throw std::runtime_error("Permutations of up to 2^32 - 1 bits are supported");
+  std::vector<bool> seen(permutation.size());
+  for (size_t j = 0; j < permutation.size(); ++j) {
+    if (permutation[j] >= permutation.size() || seen[permutation[j]])
+      throw std::runtime_error("The interleaver must be a permutation");
+    seen[permutation[j]] = true;
+    _forward[j] = uint32_t(permutation[j]);
+    _inverse[permutation[j]] = uint32_t(j);
   }
+}
+
+size_t Interleaver::size() const { return _rows * _cols; }
+
+void Interleaver::Interleave(const BitSpan &bits, BitArray &result, size_t pos) const {
+  if (bits.size() != size())
+    throw std::runtime_error("The frame must be the size of the interleaver");
+  if (_forward.empty())
+    BitArray::Transpose(bits, _rows, _cols, result, pos);
+  else
+    Permute(_forward, bits, result, pos);
+}
+
+void Interleaver::Deinterleave(const BitSpan &bits, BitArray &result, size_t pos) const {
+  if (bits.size() != size())
+    throw std::runtime_error("The frame must be the size of the interleaver");
+  if (_forward.empty())
+    BitArray::Transpose(bits, _cols, _rows, result, pos);
+  else
+    Permute(_inverse, bits, result, pos);
+}
 
-  for (; resultSize != ii; ++ii) {
-    bitsReg >>= 1;
-    result[ii] = countBits(tapsReg & bitsReg) & 0x01; // mod 2
+// Gathers a block of words at a time onto the stack and deposits it at any bit position.
+void Interleaver::Permute(const std::vector<uint32_t> &positions, const BitSpan &bits, BitArray &result, size_t pos) const {
+  if (pos > result.size() || result.size() - pos < size())
+    throw std::runtime_error("Results of the interleaver must be at least large enough to hold the result");
+  uint64_t words[BlockWords];
+  for (size_t j = 0; j < positions.size(); j += 64 * BlockWords) {
+    size_t n = std::min(64 * BlockWords, positions.size() - j);
+    Gather(&positions[j], n, bits._base, bits._offset, words);
+    BitArray::DepositWords(words, n, (uint64_t *)result.data(), pos + j);
   }
+}
 
-  if (pInitialFill)
-    *pInitialFill = (uint32_t)bitsReg;
+void Interleaver::Gather(const uint32_t *positions, size_t n, const uint8_t *base, size_t offset, uint64_t *out) {
+  Dispatch::Get<decltype(&GatherDefault)>(Dispatch::INTERLEAVE)(positions, n, base, offset, out);
 }
 
-__attribute__((target("sse2"))) 
-void BitArray::Convolve(const BitArray &taps, const BitArray &bits, BitArray &result, bool flush, uint32_t *pInitialFill) {
-  uint64_t tapsRegTmp[2], bitsRegTmp[2], resTmp[2];
+void Interleaver::GatherDefault(const uint32_t *positions, size_t n, const uint8_t *base, size_t offset, uint64_t *out) {
+  for (size_t w = 0; w * 64 < n; ++w) {
+    uint64_t word = 0;
+    for (size_t k = 0; k < 64 && w * 64 + k < n; ++k) {
+      size_t p = positions[w * 64 + k] + offset;
+      word |= uint64_t((base[p / 8] >> (p % 8)) & 1) << k;
+    }
+    out[w] = word;
+  }
+}
 
-  size_t resultSize = flush ? (taps.size() + bits.size() - 1) : (bits.size());
-  uint32_t initialFill = pInitialFill ? *pInitialFill : 0;
+/**
+ * Gathers the 4 bytes at each of 8 bit positions and compares them with the bit they should hold,
+ * a movemask then giving 8 bits of the output.
+ */
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+void Interleaver::GatherAvx2(const uint32_t *positions, size_t n, const uint8_t *base, size_t offset, uint64_t *out) {
+  __m256i off = _mm256_set1_epi32(int(offset)), seven = _mm256_set1_epi32(7), one = _mm256_set1_epi32(1);
+  size_t k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m256i p = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)&positions[k]), off);
+    __m256i bytes = _mm256_i32gather_epi32((const int *)base, _mm256_srli_epi32(p, 3), 1);
+    __m256i bit = _mm256_sllv_epi32(one, _mm256_and_si256(p, seven));
+    __m256i set = _mm256_cmpeq_epi32(_mm256_and_si256(bytes, bit), bit);
+    ((uint8_t *)out)[k / 8] = uint8_t(_mm256_movemask_ps(_mm256_castsi256_ps(set)));
+  }
+  if (k < n) {
+    uint8_t last = 0;
+    for (size_t i = k; i < n; ++i) {
+      size_t p = positions[i] + offset;
+      last |= ((base[p / 8] >> (p % 8)) & 1) << (i - k);
+    }
+    ((uint8_t *)out)[k / 8] = last;
+    k += 8;
+  }
+  for (; k % 64; k += 8)
+    ((uint8_t *)out)[k / 8] = 0;
+}
+#endif
 
-  if (result.size() < (resultSize))
-    throw std::runtime_error("Results of the convolution must be at least large enough to hold the result");
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+__attribute__((target("avx512f"))) 
+void Interleaver::GatherAvx512(const uint32_t *positions, size_t n, const uint8_t *base, size_t offset, uint64_t *out) {
+  __m512i off = _mm512_set1_epi32(int(offset)), seven = _mm512_set1_epi32(7), one = _mm512_set1_epi32(1);
+  size_t k = 0;
+  for (; k + 16 <= n; k += 16) {
+    __m512i p = _mm512_maskz_add_epi32(0xFFFF, _mm512_maskz_loadu_epi32(0xFFFF, &positions[k]), off);
+    __m512i bytes = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xFFFF, _mm512_maskz_srli_epi32(0xFFFF, p, 3), base, 1);
+    __m512i bit = _mm512_maskz_sllv_epi32(0xFFFF, one, _mm512_maskz_and_epi32(0xFFFF, p, seven));
+    ((uint16_t *)out)[k / 16] = _mm512_test_epi32_mask(bytes, bit);
+  }
+  if (k < n) {
+    uint16_t last = 0;
+    for (size_t i = k; i < n; ++i) {
+      size_t p = positions[i] + offset;
+      last |= ((base[p / 8] >> (p % 8)) & 1) << (i - k);
+    }
+    ((uint16_t *)out)[k / 16] = last;
+    k += 16;
+  }
+  for (; k % 64; k += 16)
+    ((uint16_t *)out)[k / 16] = 0;
+}
+#endif
+
+BitMatrix::BitMatrix(size_t rows, size_t cols) : _rows(rows), _cols(cols), _stride((cols + 511) / 512 * 512), _bits((rows + 3) / 4 * 4 * _stride) {}
+
+BitMatrix::BitMatrix(const std::vector<BitArray> &rows) : BitMatrix(rows.size(), rows.empty() ? 0 : rows[0].size()) {
+  for (size_t r = 0; r < rows.size(); ++r)
+    SetRow(r, rows[r]);
+}
+
+size_t BitMatrix::rows() const { return _rows; }
+
+size_t BitMatrix::cols() const { return _cols; }
+
+size_t BitMatrix::stride() const { return _stride; }
+
+ProxyBit BitMatrix::operator()(size_t r, size_t c) {
+  assert(r < _rows && c < _cols);
+  return _bits[r * _stride + c];
+}
+
+bool BitMatrix::operator()(size_t r, size_t c) const {
+  assert(r < _rows && c < _cols);
+  return _bits[r * _stride + c];
+}
+
+BitSpan BitMatrix::Row(size_t r) const {
+  assert(r < _rows);
+  return BitSpan(_bits.data(), r * _stride, _cols);
+}
+
+void BitMatrix::SetRow(size_t r, const BitSpan &bits) {
+  if (r >= _rows)
+    throw std::runtime_error("The row is outside of the matrix");
+  if (bits.size() != _cols)
+    throw std::runtime_error("Rows must have as many bits as the matrix has columns");
+  BitArray::Copy(bits, _bits, r * _stride);
+}
+
+std::vector<uint32_t> BitMatrix::RowCounts() const {
+  std::vector<uint32_t> counts(_rows);
+  const uint64_t *words = (const uint64_t *)_bits.data();
+  for (size_t r = 0; r < _rows; ++r)
+    for (size_t w = 0; w < _stride / 64; ++w)
+      counts[r] += uint32_t(countBits(words[r * _stride / 64 + w]));
+  return counts;
+}
+
+uint32_t BitMatrix::Score(Metric metric, uint32_t dot, uint32_t countA, uint32_t countB) { return metric == AND_POPCOUNT ? dot : countA + countB - 2 * dot; }
+
+// Returns the number of threads, the sink being called with thread below it.
+size_t BitMatrix::ScoreTiles(const BitMatrix &a, const BitMatrix &b, const BitArray::Parallel &policy, const TileSink &sink) {
+  if (a._cols != b._cols)
+    throw std::runtime_error("The matrices must have the same number of columns");
+  size_t numTiles = (a._rows + TileRows - 1) / TileRows, strideWords = a._stride / 64;
+  if (numTiles == 0 || b._rows == 0)
+    return 0;
+
+  size_t numThreads = std::min(numTiles, policy.Threads(a._rows * b._rows * a._cols));
+  const uint64_t *aWords = (const uint64_t *)a._bits.data(), *bWords = (const uint64_t *)b._bits.data();
+  BitArray::ParallelFor(numThreads, [&](size_t k) {
+    std::vector<uint32_t> dots(TileRows * TileRefs);
+    for (size_t tile = numTiles * k / numThreads; tile < numTiles * (k + 1) / numThreads; ++tile) {
+      size_t row = tile * TileRows, numRows = std::min(size_t(TileRows), a._rows - row);
+      for (size_t ref = 0; ref < b._rows; ref += TileRefs) {
+        size_t numRefs = std::min(size_t(TileRefs), b._rows - ref);
+        std::fill(dots.begin(), dots.end(), 0);
+        for (size_t w = 0; w < strideWords; w += TileWords)
+          ScoreTile(aWords + row * strideWords + w, (numRows + 3) / 4 * 4, bWords + ref * strideWords + w, (numRefs + 3) / 4 * 4, strideWords,
+                    std::min(size_t(TileWords), strideWords - w), dots.data(), TileRefs);
+        sink(k, row, ref, numRows, numRefs, dots.data());
+      }
+    }
+  });
+  return numThreads;
+}
 
-  if (taps.size() > 32) // TODO: Remove this restriction in the future.
-    throw std::runtime_error("Taps greater than 32 bits are currently not supported.");
+std::vector<uint32_t> BitMatrix::Scores(const BitMatrix &a, const BitMatrix &b, Metric metric, const BitArray::Parallel &policy) {
+  std::vector<uint32_t> scores(a._rows * b._rows), countsA = a.RowCounts(), countsB = b.RowCounts();
+  ScoreTiles(a, b, policy, [&](size_t, size_t row, size_t ref, size_t numRows, size_t numRefs, const uint32_t *dots) {
+    for (size_t i = 0; i < numRows; ++i)
+      for (size_t j = 0; j < numRefs; ++j)
+        scores[(row + i) * b._rows + ref + j] = Score(metric, dots[i * TileRefs + j], countsA[row + i], countsB[ref + j]);
+  });
+  return scores;
+}
 
-  tapsRegTmp[0] = *(uint64_t *)taps.data(); // Never changes or are shifted, these are the taps.
-  tapsRegTmp[1] = *(uint64_t *)taps.data();
-  __m128i tapsReg128 = _mm_loadu_si128((__m128i const *)&tapsRegTmp);
+// A heap per row of a holding its best k so far, the worst of them on top.
+std::vector<BitMatrix::Match> BitMatrix::TopK(const BitMatrix &a, const BitMatrix &b, Metric metric, size_t k, const BitArray::Parallel &policy) {
+  std::vector<uint32_t> countsA = a.RowCounts(), countsB = b.RowCounts();
+  std::vector<std::vector<Match> > heaps(a._rows);
+  auto better = [metric](const Match &x, const Match &y) {
+    if (x.score != y.score)
+      return metric == AND_POPCOUNT ? x.score > y.score : x.score < y.score;
+    return x.ref < y.ref;
+  };
+  ScoreTiles(a, b, policy, [&](size_t, size_t row, size_t ref, size_t numRows, size_t numRefs, const uint32_t *dots) {
+    for (size_t i = 0; i < numRows; ++i) {
+      std::vector<Match> &heap = heaps[row + i];
+      for (size_t j = 0; j < numRefs; ++j) {
+        Match match = {row + i, ref + j, Score(metric, dots[i * TileRefs + j], countsA[row + i], countsB[ref + j])};
+        if (heap.size() < k) {
+          heap.push_back(match);
+          std::push_heap(heap.begin(), heap.end(), better);
+        } else if (k && better(match, heap.front())) {
+          std::pop_heap(heap.begin(), heap.end(), better);
+          heap.back() = match;
+          std::push_heap(heap.begin(), heap.end(), better);
+        }
+      }
+    }
+  });
 
-  uint32_t *p_bits32 = (uint32_t *)bits.data(); // Points to the next 32-bit chunk to copy into the bitsReg
+  std::vector<Match> matches;
+  for (size_t r = 0; r < a._rows; ++r) {
+    std::sort_heap(heaps[r].begin(), heaps[r].end(), better);
+    matches.insert(matches.end(), heaps[r].begin(), heaps[r].end());
+  }
+  return matches;
+}
 
-  // We do the first 64 bits seperate so that we can handle the initial fill
-  bitsRegTmp[0] = (uint64_t(p_bits32[0]) << (taps.size())) |
-                  initialFill; // Holds the current 64-bits from the input bits, is shifted down until there is room to hold more.
-  bitsRegTmp[1] = (uint64_t(p_bits32[1]) << (taps.size())) | (p_bits32[0] >> (32 - taps.size()));
-  __m128i bitsReg128 = _mm_loadu_si128((__m128i const *)&bitsRegTmp);
-  p_bits32 += 2; // Move along the pointer
+std::vector<BitMatrix::Match> BitMatrix::Threshold(const BitMatrix &a, const BitMatrix &b, Metric metric, uint32_t threshold, const BitArray::Parallel &policy) {
+  std::vector<uint32_t> countsA = a.RowCounts(), countsB = b.RowCounts();
+  std::vector<std::vector<Match> > found(policy.Threads(a._rows * b._rows * a._cols));
+  ScoreTiles(a, b, policy, [&](size_t thread, size_t row, size_t ref, size_t numRows, size_t numRefs, const uint32_t *dots) {
+    for (size_t i = 0; i < numRows; ++i)
+      for (size_t j = 0; j < numRefs; ++j) {
+        Match match = {row + i, ref + j, Score(metric, dots[i * TileRefs + j], countsA[row + i], countsB[ref + j])};
+        if (metric == AND_POPCOUNT ? match.score >= threshold : match.score <= threshold)
+          found[thread].push_back(match);
+      }
+  });
 
-  // TODO: Check to make sure that the results should be >= 64 bits.
-  for (size_t i = 0; i < 32; ++i) { // Shift the bits over, do the AND
-    bitsReg128 = _mm_srli_epi64(bitsReg128, 1);
-    // print128(bitsReg128);
-    __m128i res = _mm_and_si128(tapsReg128, bitsReg128);
-    _mm_storeu_si128((__m128i *)&resTmp, res);
-    result[i] = countBits(resTmp[0]) & 0x01; // mod 2
-    result[i + 32] = countBits(resTmp[1]) & 0x01;
+  // Each thread has a range of rows, but goes through the refs of a tile of rows at a time.
+  std::vector<Match> matches;
+  for (size_t k = 0; k < found.size(); ++k) {
+    std::sort(found[k].begin(), found[k].end(), [](const Match &x, const Match &y) { return x.row != y.row ? x.row < y.row : x.ref < y.ref; });
+    matches.insert(matches.end(), found[k].begin(), found[k].end());
   }
+  return matches;
+}
+
+void BitMatrix::ScoreTile(const uint64_t *a, size_t aRows, const uint64_t *b, size_t bRows, size_t strideWords, size_t numWords, uint32_t *dots, size_t ldDots) {
+  Dispatch::Get<decltype(&ScoreTileDefault)>(Dispatch::SCORE)(a, aRows, b, bRows, strideWords, numWords, dots, ldDots);
+}
+
+void BitMatrix::ScoreTileDefault(const uint64_t *a, size_t aRows, const uint64_t *b, size_t bRows, size_t strideWords, size_t numWords, uint32_t *dots,
+                                 size_t ldDots) {
+  for (size_t i = 0; i < aRows; i += 4)
+    for (size_t j = 0; j < bRows; j += 4) {
+      uint64_t sums[4][4] = {{0}};
+      for (size_t w = 0; w < numWords; ++w)
+        for (size_t r = 0; r < 4; ++r) {
+          uint64_t x = a[(i + r) * strideWords + w];
+          for (size_t c = 0; c < 4; ++c)
+            sums[r][c] += countBits(x & b[(j + c) * strideWords + w]);
+        }
+      for (size_t r = 0; r < 4; ++r)
+        for (size_t c = 0; c < 4; ++c)
+          dots[(i + r) * ldDots + j + c] += uint32_t(sums[r][c]);
+    }
+}
 
-  size_t ii(64);
-  for (; ii < bits.size() - 63; ii += 64, p_bits32 += 2) { // Work through all the bits until we cannot load anymore 32-bit chunks into the registers.
-    bitsRegTmp[0] = (uint64_t(p_bits32[0]) << (taps.size())) |
-                    (p_bits32[-1] >> (32 - taps.size())); // Holds the current 64-bits from the input bits, is shifted down until there is room to hold more.
-    bitsRegTmp[1] = (uint64_t(p_bits32[1]) << (taps.size())) | (p_bits32[0] >> (32 - taps.size()));
-    bitsReg128 = _mm_loadu_si128((__m128i const *)&bitsRegTmp);
-    for (size_t i = 0; i < 32; ++i) { // Shift the bits over, do the AND, then load more!
-      bitsReg128 = _mm_srli_epi64(bitsReg128, 1);
-      __m128i res = _mm_and_si128(tapsReg128, bitsReg128);
-      _mm_storeu_si128((__m128i *)&resTmp, res);
-      result[ii + i] = countBits(resTmp[0]) & 0x01; // mod 2
-      result[ii + i + 32] = countBits(resTmp[1]) & 0x01;
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("popcnt"))) 
+void BitMatrix::ScoreTilePopcnt(const uint64_t *a, size_t aRows, const uint64_t *b, size_t bRows, size_t strideWords, size_t numWords, uint32_t *dots,
+                                size_t ldDots) {
+  for (size_t i = 0; i < aRows; i += 4)
+    for (size_t j = 0; j < bRows; j += 4) {
+      uint64_t sums[4][4] = {{0}};
+      for (size_t w = 0; w < numWords; ++w) {
+        uint64_t x[4], y[4];
+        for (size_t r = 0; r < 4; ++r) {
+          x[r] = a[(i + r) * strideWords + w];
+          y[r] = b[(j + r) * strideWords + w];
+        }
+        for (size_t r = 0; r < 4; ++r)
+          for (size_t c = 0; c < 4; ++c)
+            sums[r][c] += _mm_popcnt_u64(x[r] & y[c]);
+      }
+      for (size_t r = 0; r < 4; ++r)
+        for (size_t c = 0; c < 4; ++c)
+          dots[(i + r) * ldDots + j + c] += uint32_t(sums[r][c]);
+    }
+}
+#endif
+
+// 4 x 2 rows, the popcounts of the 8 vectors looking up nibbles and summed per 64-bit lane.
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+__attribute__((target("avx2"))) 
+void BitMatrix::ScoreTileAvx2(const uint64_t *a, size_t aRows, const uint64_t *b, size_t bRows, size_t strideWords, size_t numWords, uint32_t *dots,
+                              size_t ldDots) {
+  for (size_t i = 0; i < aRows; i += 4)
+    for (size_t j = 0; j < bRows; j += 2) {
+      __m256i sums[4][2];
+      for (size_t r = 0; r < 4; ++r)
+        sums[r][0] = sums[r][1] = _mm256_setzero_si256();
+      for (size_t w = 0; w < numWords; w += 4) {
+        __m256i y0 = _mm256_load_si256((const __m256i *)&b[j * strideWords + w]), y1 = _mm256_load_si256((const __m256i *)&b[(j + 1) * strideWords + w]);
+        for (size_t r = 0; r < 4; ++r) {
+          __m256i x = _mm256_load_si256((const __m256i *)&a[(i + r) * strideWords + w]);
+          sums[r][0] = _mm256_add_epi64(sums[r][0], countBits256(_mm256_and_si256(x, y0)));
+          sums[r][1] = _mm256_add_epi64(sums[r][1], countBits256(_mm256_and_si256(x, y1)));
+        }
+      }
+      for (size_t r = 0; r < 4; ++r)
+        for (size_t c = 0; c < 2; ++c) {
+          uint64_t lanes[4];
+          _mm256_storeu_si256((__m256i *)lanes, sums[r][c]);
+          dots[(i + r) * ldDots + j + c] += uint32_t(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+        }
+    }
+}
+#endif
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+__attribute__((target("avx512f,avx512vpopcntdq"))) 
+void BitMatrix::ScoreTileVpopcnt(const uint64_t *a, size_t aRows, const uint64_t *b, size_t bRows, size_t strideWords, size_t numWords, uint32_t *dots,
+                                 size_t ldDots) {
+  for (size_t i = 0; i < aRows; i += 4)
+    for (size_t j = 0; j < bRows; j += 4) {
+      __m512i sums[4][4];
+      for (size_t r = 0; r < 4; ++r)
+        for (size_t c = 0; c < 4; ++c)
+          sums[r][c] = _mm512_setzero_si512();
+      for (size_t w = 0; w < numWords; w += 8) {
+        __m512i y[4];
+        for (size_t c = 0; c < 4; ++c)
+          y[c] = _mm512_load_si512(&b[(j + c) * strideWords + w]);
+        for (size_t r = 0; r < 4; ++r) {
+          __m512i x = _mm512_load_si512(&a[(i + r) * strideWords + w]);
+          for (size_t c = 0; c < 4; ++c)
+            sums[r][c] = _mm512_add_epi64(sums[r][c], _mm512_popcnt_epi64(_mm512_and_si512(x, y[c])));
+        }
+      }
+      for (size_t r = 0; r < 4; ++r)
+        for (size_t c = 0; c < 4; ++c) {
+          uint64_t lanes[8];
+          _mm512_storeu_si512(lanes, sums[r][c]);
+          dots[(i + r) * ldDots + j + c] += uint32_t(lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7]);
+        }
+    }
+}
+#endif
+
+uint64_t *BitMatrix::RowWords(size_t r) { return (uint64_t *)_bits.data() + r * (_stride / 64); }
+
+const uint64_t *BitMatrix::RowWords(size_t r) const { return (const uint64_t *)_bits.data() + r * (_stride / 64); }
+
+void BitMatrix::Multiply(const BitMatrix &m, const BitSpan &x, BitArray &result, size_t pos) {
+  if (x.size() != m._cols)
+    throw std::runtime_error("The vector must have as many bits as the matrix has columns");
+  if (pos > result.size() || result.size() - pos < m._rows)
+    throw std::runtime_error("Results of the product must be at least large enough to hold the result");
+  BitArray aligned(m._stride), parities((m._rows + 3) / 4 * 4);
+  BitArray::Copy(x, aligned, 0);
+  ParityRows(m.RowWords(0), parities.size(), m._stride / 64, (const uint64_t *)aligned.data(), m._stride / 64, (uint64_t *)parities.data());
+  BitArray::Copy(BitSpan(parities.data(), 0, m._rows), result, pos);
+}
+
+void BitMatrix::Multiply(const BitSpan &x, const BitMatrix &m, BitArray &result, size_t pos) {
+  if (x.size() != m._rows)
+    throw std::runtime_error("The vector must have as many bits as the matrix has rows");
+  if (pos > result.size() || result.size() - pos < m._cols)
+    throw std::runtime_error("Results of the product must be at least large enough to hold the result");
+  auto apply = Dispatch::Get<decltype(&BitArray::BitExprApplyDefault)>(Dispatch::BITEXPR, 1);
+  BitArray sum(m._stride);
+  for (size_t w = 0; w < (m._rows + 63) / 64; ++w)
+    for (uint64_t word = x.loadWord(w); word; word &= word - 1)
+      apply(BitExpr::XOR, (uint64_t *)sum.data(), m.RowWords(w * 64 + __builtin_ctzll(word)), m._stride / 64);
+  BitArray::Copy(BitSpan(sum.data(), 0, m._cols), result, pos);
+}
+
+// Column blocks of b are tabled in turn, so the table and the rows of c it is added to stay in cache.
+BitMatrix BitMatrix::Multiply(const BitMatrix &a, const BitMatrix &b) {
+  if (a._cols != b._rows)
+    throw std::runtime_error("The first matrix must have as many columns as the second has rows");
+  auto apply = Dispatch::Get<decltype(&BitArray::BitExprApplyDefault)>(Dispatch::BITEXPR, 1);
+  BitMatrix c(a._rows, b._cols);
+  size_t strideWords = b._stride / 64;
+  std::vector<uint64_t> table(256 * TableWords);
+  for (size_t w = 0; w < strideWords; w += TableWords) {
+    size_t numWords = std::min(size_t(TableWords), strideWords - w);
+    for (size_t k = 0; k < b._rows; k += 8) {
+      // Entry i is entry i without its lowest bit, plus the row of b that bit picks.
+      for (size_t i = 1; i < 256; ++i) {
+        uint64_t *entry = &table[i * TableWords];
+        size_t row = k + __builtin_ctz(unsigned(i));
+        memcpy(entry, &table[(i & (i - 1)) * TableWords], numWords * 8);
+        if (row < b._rows)
+          apply(BitExpr::XOR, entry, b.RowWords(row) + w, numWords);
+      }
+      for (size_t r = 0; r < a._rows; ++r) {
+        uint8_t byte = a._bits.data()[r * (a._stride / 8) + k / 8];
+        if (byte)
+          apply(BitExpr::XOR, c.RowWords(r) + w, &table[byte * TableWords], numWords);
+      }
     }
   }
+  return c;
+}
+
+BitMatrix BitMatrix::Transposed() const {
+  BitMatrix t(_cols, _rows);
+  uint64_t tile[64];
+  for (size_t r0 = 0; r0 < _rows; r0 += 64)
+    for (size_t c0 = 0; c0 < _cols; c0 += 64) {
+      for (size_t r = 0; r < 64; ++r)
+        tile[r] = r0 + r < _rows ? RowWords(r0 + r)[c0 / 64] : 0;
+      BitArray::Transpose64(tile);
+      for (size_t c = 0; c < 64 && c0 + c < _cols; ++c)
+        t.RowWords(c0 + c)[r0 / 64] = tile[c];
+    }
+  return t;
+}
 
-  // Now we just do the non-SSE version
-  uint64_t tapsReg = *(uint64_t *)taps.data(); // Never changes or are shifted, these are the taps.
-  uint64_t bitsReg = (uint64_t(p_bits32[0]) << (taps.size())) | (p_bits32[-1] >> (32 - taps.size()));
-  for (; ii < resultSize; ii += 32, p_bits32++) {
-    bitsReg = (uint64_t(p_bits32[0]) << (taps.size())) | (p_bits32[-1] >> (32 - taps.size()));
-    for (size_t i = 0; i < 32; ++i) {
-      if ((ii + i) == resultSize)
-        break;
-      bitsReg >>= 1;
-      result[ii + i] = countBits(tapsReg & bitsReg) & 0x01; // mod 2
+size_t BitMatrix::Eliminate() {
+  std::vector<size_t> pivots;
+  return Eliminate(false, pivots);
+}
+
+size_t BitMatrix::Rank() const { return BitMatrix(*this).Eliminate(); }
+
+size_t BitMatrix::Eliminate(bool fromLast, std::vector<size_t> &pivots) {
+  auto apply = Dispatch::Get<decltype(&BitArray::BitExprApplyDefault)>(Dispatch::BITEXPR, 1);
+  size_t strideWords = _stride / 64, rank(0);
+  std::vector<uint64_t> pivot(strideWords);
+  pivots.clear();
+  for (size_t j = 0; j < _cols && rank < _rows; ++j) {
+    size_t col = fromLast ? _cols - 1 - j : j, word = col / 64, r = rank;
+    uint64_t bit = uint64_t(1) << (col % 64);
+    while (r < _rows && !(RowWords(r)[word] & bit))
+      ++r;
+    if (r == _rows)
+      continue;
+
+    // Going from the first column, the pivot row is zero before its word.
+    size_t first = fromLast ? 0 : word;
+    if (r != rank) {
+      memcpy(pivot.data(), RowWords(r) + first, (strideWords - first) * 8);
+      memcpy(RowWords(r) + first, RowWords(rank) + first, (strideWords - first) * 8);
+      memcpy(RowWords(rank) + first, pivot.data(), (strideWords - first) * 8);
     }
+    for (size_t i = 0; i < _rows; ++i)
+      if (i != rank && (RowWords(i)[word] & bit))
+        apply(BitExpr::XOR, RowWords(i) + first, RowWords(rank) + first, strideWords - first);
+    pivots.push_back(col);
+    ++rank;
   }
+  return rank;
+}
 
-  if (pInitialFill) {
-    *pInitialFill = (uint32_t)bitsReg;
+// Row i of the eliminated h reads c[pivots[i]] = the sum of the c[j] of the free columns j it holds.
+BitMatrix BitMatrix::Generator(const BitMatrix &h) {
+  BitMatrix reduced(h);
+  std::vector<size_t> pivots;
+  size_t rank = reduced.Eliminate(true, pivots);
+  std::vector<bool> parity(h._cols);
+  for (size_t i = 0; i < rank; ++i)
+    parity[pivots[i]] = true;
+  std::vector<size_t> message(h._cols);
+  size_t k(0);
+  for (size_t j = 0; j < h._cols; ++j)
+    if (!parity[j])
+      message[j] = k++;
+
+  BitMatrix g(k, h._cols);
+  for (size_t j = 0; j < h._cols; ++j)
+    if (!parity[j])
+      g(message[j], j) = true;
+  for (size_t i = 0; i < rank; ++i) {
+    const uint64_t *row = reduced.RowWords(i);
+    for (size_t w = 0; w < h._stride / 64; ++w)
+      for (uint64_t word = row[w]; word; word &= word - 1) {
+        size_t j = w * 64 + __builtin_ctzll(word);
+        if (j != pivots[i])
+          g(message[j], pivots[i]) = true;
+      }
+  }
+  return g;
+}
+
+void BitMatrix::ParityRows(const uint64_t *m, size_t numRows, size_t strideWords, const uint64_t *x, size_t numWords, uint64_t *parities) {
+  Dispatch::Get<decltype(&ParityRowsDefault)>(Dispatch::GF2MULTIPLY)(m, numRows, strideWords, x, numWords, parities);
+}
+
+void BitMatrix::ParityRowsDefault(const uint64_t *m, size_t numRows, size_t strideWords, const uint64_t *x, size_t numWords, uint64_t *parities) {
+  for (size_t i = 0; i < numRows; i += 4) {
+    uint64_t sums[4] = {0};
+    for (size_t w = 0; w < numWords; ++w)
+      for (size_t r = 0; r < 4; ++r)
+        sums[r] ^= m[(i + r) * strideWords + w] & x[w];
+    for (size_t r = 0; r < 4; ++r)
+      parities[(i + r) / 64] |= uint64_t(countBits(sums[r]) & 1) << ((i + r) % 64);
+  }
+}
+
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+__attribute__((target("sse2"))) 
+void BitMatrix::ParityRowsSse2(const uint64_t *m, size_t numRows, size_t strideWords, const uint64_t *x, size_t numWords, uint64_t *parities) {
+  for (size_t i = 0; i < numRows; i += 4) {
+    __m128i sums[4];
+    for (size_t r = 0; r < 4; ++r)
+      sums[r] = _mm_setzero_si128();
+    for (size_t w = 0; w < numWords; w += 2) {
+      __m128i y = _mm_load_si128((const __m128i *)&x[w]);
+      for (size_t r = 0; r < 4; ++r)
+        sums[r] = _mm_xor_si128(sums[r], _mm_and_si128(y, _mm_load_si128((const __m128i *)&m[(i + r) * strideWords + w])));
+    }
+    for (size_t r = 0; r < 4; ++r) {
+      uint64_t sum = uint64_t(_mm_cvtsi128_si64(_mm_xor_si128(sums[r], _mm_unpackhi_epi64(sums[r], sums[r]))));
+      parities[(i + r) / 64] |= uint64_t(countBits(sum) & 1) << ((i + r) % 64);
+    }
   }
 }
+#endif
 
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
 __attribute__((target("avx2"))) 
-void BitArray::Convolve(const BitArray &taps, const BitArray &bits, BitArray &result, bool flush, uint32_t *pInitialFill) {
-  uint64_t tapsRegTmp[4], bitsRegTmp[4], resTmp[4];
+void BitMatrix::ParityRowsAvx2(const uint64_t *m, size_t numRows, size_t strideWords, const uint64_t *x, size_t numWords, uint64_t *parities) {
+  for (size_t i = 0; i < numRows; i += 4) {
+    __m256i sums[4];
+    for (size_t r = 0; r < 4; ++r)
+      sums[r] = _mm256_setzero_si256();
+    for (size_t w = 0; w < numWords; w += 4) {
+      __m256i y = _mm256_load_si256((const __m256i *)&x[w]);
+      for (size_t r = 0; r < 4; ++r)
+        sums[r] = _mm256_xor_si256(sums[r], _mm256_and_si256(y, _mm256_load_si256((const __m256i *)&m[(i + r) * strideWords + w])));
+    }
+    for (size_t r = 0; r < 4; ++r) {
+      __m128i half = _mm_xor_si128(_mm256_castsi256_si128(sums[r]), _mm256_extracti128_si256(sums[r], 1));
+      uint64_t sum = uint64_t(_mm_cvtsi128_si64(_mm_xor_si128(half, _mm_unpackhi_epi64(half, half))));
+      parities[(i + r) / 64] |= uint64_t(countBits(sum) & 1) << ((i + r) % 64);
+    }
+  }
+}
+#endif
 
-  size_t resultSize = flush ? (taps.size() + bits.size() - 1) : (bits.size());
-  uint32_t initialFill = pInitialFill ? *pInitialFill : 0;
+// Each step is a single ternary logic op, 0x78 being a ^ (b & c).
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+__attribute__((target("avx512f"))) 
+void BitMatrix::ParityRowsAvx512(const uint64_t *m, size_t numRows, size_t strideWords, const uint64_t *x, size_t numWords, uint64_t *parities) {
+  for (size_t i = 0; i < numRows; i += 4) {
+    __m512i sums[4];
+    for (size_t r = 0; r < 4; ++r)
+      sums[r] = _mm512_setzero_si512();
+    for (size_t w = 0; w < numWords; w += 8) {
+      __m512i y = _mm512_load_si512(&x[w]);
+      for (size_t r = 0; r < 4; ++r)
+        sums[r] = _mm512_ternarylogic_epi64(sums[r], y, _mm512_load_si512(&m[(i + r) * strideWords + w]), 0x78);
+    }
+    for (size_t r = 0; r < 4; ++r) {
+      uint64_t lanes[8];
+      _mm512_storeu_si512(lanes, sums[r]);
+      uint64_t sum = lanes[0] ^ lanes[1] ^ lanes[2] ^ lanes[3] ^ lanes[4] ^ lanes[5] ^ lanes[6] ^ lanes[7];
+      parities[(i + r) / 64] |= uint64_t(countBits(sum) & 1) << ((i + r) % 64);
+    }
+  }
+}
+#endif
 
-  if (result.size() < (resultSize))
-    throw std::runtime_error("Results of the convolution must be at least large enough to hold the result");
+SparseBitMatrix::SparseBitMatrix(size_t cols, const std::vector<std::vector<size_t> > &rows) : _cols(cols), _starts(1) {
+  if (cols > UINT32_MAX)
+    throw std::runtime_error("Matrices of up to 2^32 - 1 columns are supported");
+  for (const std::vector<size_t> &row : rows) {
+    for (size_t col : row) {
+      if (col >= cols)
+        throw std::runtime_error("The column is outside of the matrix");
+      _columns.push_back(uint32_t(col));
+    }
+    _starts.push_back(_columns.size());
+  }
+}
+
+size_t SparseBitMatrix::rows() const { return _starts.size() - 1; }
+
+size_t SparseBitMatrix::cols() const { return _cols; }
+
+size_t SparseBitMatrix::size() const { return _columns.size(); }
+
+// After the running XOR, bit j of the gathered bits is the parity of bits [0, j], so a row's parity
+// is that at its last bit XOR that before its first.
+void SparseBitMatrix::Multiply(const SparseBitMatrix &m, const BitSpan &x, BitArray &result, size_t pos) {
+  if (x.size() != m._cols)
+    throw std::runtime_error("The vector must have as many bits as the matrix has columns");
+  if (pos > result.size() || result.size() - pos < m.rows())
+    throw std::runtime_error("Results of the product must be at least large enough to hold the result");
+  std::vector<uint64_t> gathered((m._columns.size() + 63) / 64 + 1);
+  Interleaver::Gather(m._columns.data(), m._columns.size(), x._base, x._offset, gathered.data());
+  uint64_t carry(0);
+  for (uint64_t &word : gathered) {
+    for (unsigned shift = 1; shift < 64; shift *= 2)
+      word ^= word << shift;
+    word ^= carry;
+    carry = uint64_t(0) - (word >> 63);
+  }
 
-  if (taps.size() > 32) // TODO: Remove this restriction in the future.
-    throw std::runtime_error("Taps greater than 32 bits are currently not supported.");
+  BitArray parities(m.rows());
+  uint64_t *words = (uint64_t *)parities.data();
+  auto prefix = [&](size_t j) { return j ? (gathered[(j - 1) / 64] >> ((j - 1) % 64)) & 1 : 0; };
+  for (size_t i = 0; i < m.rows(); ++i)
+    words[i / 64] |= (prefix(m._starts[i + 1]) ^ prefix(m._starts[i])) << (i % 64);
+  BitArray::Copy(parities, result, pos);
+}
+
+CompressedBitArray::CompressedBitArray(size_t size) : _size(size) {}
+
+// Runs of empty chunks are skipped by FindNext.
+CompressedBitArray::CompressedBitArray(const BitSpan &bits) : _size(bits.size()) {
+  BitArray words(ChunkBits);
+  for (size_t i = BitArray::FindFirst(bits); i < bits.size(); i = BitArray::FindNext(bits, i)) {
+    size_t start = i / ChunkBits * ChunkBits, len = std::min(size_t(ChunkBits), bits.size() - start);
+    if (len < ChunkBits)
+      memset(words.data(), 0, ChunkBits / 8);
+    BitArray::Copy(BitSpan(bits.data(), bits.offset() + start, len), words, 0);
+    Chunk chunk;
+    chunk.key = uint32_t(start / ChunkBits);
+    Encode((const uint64_t *)words.data(), chunk);
+    _chunks.push_back(chunk);
+    i = start + len - 1;
+  }
+}
+
+size_t CompressedBitArray::size() const { return _size; }
+
+size_t CompressedBitArray::Count() const {
+  size_t count(0);
+  for (const Chunk &chunk : _chunks)
+    count += chunk.count;
+  return count;
+}
+
+size_t CompressedBitArray::Bytes() const {
+  size_t bytes = sizeof(*this) + _chunks.capacity() * sizeof(Chunk);
+  for (const Chunk &chunk : _chunks)
+    bytes += chunk.values.capacity() * sizeof(uint16_t) + chunk.words.capacity() * sizeof(uint64_t);
+  return bytes;
+}
+
+bool CompressedBitArray::operator[](size_t i) const {
+  assert(i < _size);
+  Chunk key;
+  key.key = uint32_t(i / ChunkBits);
+  auto chunk = std::lower_bound(_chunks.begin(), _chunks.end(), key, [](const Chunk &x, const Chunk &y) { return x.key < y.key; });
+  if (chunk == _chunks.end() || chunk->key != key.key)
+    return false;
+  uint16_t bit = uint16_t(i % ChunkBits);
+  if (chunk->type == BITMAP)
+    return (chunk->words[bit / 64] >> (bit % 64)) & 1;
+  if (chunk->type == ARRAY)
+    return std::binary_search(chunk->values.begin(), chunk->values.end(), bit);
+  size_t lo(0), hi(chunk->values.size() / 2);
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (chunk->values[2 * mid + 1] < bit)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < chunk->values.size() / 2 && chunk->values[2 * lo] <= bit;
+}
+
+BitArray CompressedBitArray::Decompress() const {
+  BitArray bits(_size);
+  uint64_t words[ChunkWords];
+  for (const Chunk &chunk : _chunks) {
+    size_t start = size_t(chunk.key) * ChunkBits;
+    Words(chunk, words);
+    memcpy(bits.data() + start / 8, words, std::min(size_t(ChunkBits), _size - start + 7) / 8);
+  }
+  return bits;
+}
 
-  tapsRegTmp[0] = *(uint64_t *)taps.data(); // Never changes or are shifted, these are the taps.
-  tapsRegTmp[1] = *(uint64_t *)taps.data();
-  tapsRegTmp[2] = *(uint64_t *)taps.data();
-  tapsRegTmp[3] = *(uint64_t *)taps.data();
+uint64_t CompressedBitArray::DotProd(const CompressedBitArray &a, const CompressedBitArray &b) {
+  if (a._size != b._size)
+    throw std::runtime_error("Compressed arrays must be the same size");
+  uint64_t count(0);
+  for (size_t i = 0, j = 0; i < a._chunks.size() && j < b._chunks.size();)
+    if (a._chunks[i].key < b._chunks[j].key)
+      ++i;
+    else if (a._chunks[i].key > b._chunks[j].key)
+      ++j;
+    else
+      count += Intersect(a._chunks[i++], b._chunks[j++]);
+  return count;
+}
 
-  __m256i tapsReg256 = _mm256_loadu_si256((__m256i const *)&tapsRegTmp);
+uint64_t CompressedBitArray::DotProd(const CompressedBitArray &a, const BitSpan &b) {
+  if (a._size != b.size())
+    throw std::runtime_error("The compressed array and the bits must be the same size");
+  uint64_t count(0);
+  std::vector<uint64_t> words(ChunkWords);
+  for (const Chunk &chunk : a._chunks) {
+    size_t start = size_t(chunk.key) * ChunkBits;
+    if (chunk.type == ARRAY) {
+      for (uint16_t v : chunk.values)
+        count += b[start + v];
+      continue;
+    }
+    if (chunk.type == RUN)
+      Words(chunk, words.data());
+    size_t len = std::min(size_t(ChunkBits), a._size - start);
+    count += BitArray::DotProd(BitSpan(chunk.type == BITMAP ? chunk.words.data() : words.data(), 0, len), BitSpan(b.data(), b.offset() + start, len));
+  }
+  return count;
+}
 
-  uint32_t *p_bits32 = (uint32_t *)bits.data(); // Points to the next 32-bit chunk to copy into the bitsReg
+CompressedBitArray operator&(const CompressedBitArray &a, const CompressedBitArray &b) { return CompressedBitArray::Combine(a, b, CompressedBitArray::AND); }
 
-  // We do the first 64 bits seperate so that we can handle the initial fill
-  // Holds the current 64-bits from the input bits, is shifted down until there is room to hold more.
-  bitsRegTmp[0] = (uint64_t(p_bits32[0]) << (taps.size())) | initialFill;
-  bitsRegTmp[1] = (uint64_t(p_bits32[1]) << (taps.size())) | (p_bits32[0] >> (32 - taps.size()));
-  bitsRegTmp[2] = (uint64_t(p_bits32[2]) << (taps.size())) | (p_bits32[1] >> (32 - taps.size()));
-  bitsRegTmp[3] = (uint64_t(p_bits32[3]) << (taps.size())) | (p_bits32[2] >> (32 - taps.size()));
+CompressedBitArray operator|(const CompressedBitArray &a, const CompressedBitArray &b) { return CompressedBitArray::Combine(a, b, CompressedBitArray::OR); }
 
-  __m256i bitsReg256 = _mm256_loadu_si256((__m256i const *)&bitsRegTmp);
-  p_bits32 += 4; // Move along the pointer
+CompressedBitArray operator^(const CompressedBitArray &a, const CompressedBitArray &b) { return CompressedBitArray::Combine(a, b, CompressedBitArray::XOR); }
 
-  // TODO: Check to make sure that the results should be >= 64 bits.
-  for (size_t i = 0; i < 32; ++i) { // Shift the bits over, do the AND
-    bitsReg256 = _mm256_srli_epi64(bitsReg256, 1);
-    __m256i res = _mm256_and_si256(tapsReg256, bitsReg256);
-    _mm256_storeu_si256((__m256i *)&resTmp, res);
-    result[i] = countBits(resTmp[0]) & 0x01; // mod 2
-    result[i + 32] = countBits(resTmp[1]) & 0x01;
-    result[i + 64] = countBits(resTmp[2]) & 0x01;
-    result[i + 96] = countBits(resTmp[3]) & 0x01;
+// Chunks of one array alone are copied, except for AND.
+CompressedBitArray CompressedBitArray::Combine(const CompressedBitArray &a, const CompressedBitArray &b, Op op) {
+  if (a._size != b._size)
+    throw std::runtime_error("Compressed arrays must be the same size");
+  CompressedBitArray result(a._size);
+  size_t i(0), j(0);
+  while (i < a._chunks.size() || j < b._chunks.size()) {
+    if (j == b._chunks.size() || (i < a._chunks.size() && a._chunks[i].key < b._chunks[j].key)) {
+      if (op != AND)
+        result._chunks.push_back(a._chunks[i]);
+      ++i;
+    } else if (i == a._chunks.size() || b._chunks[j].key < a._chunks[i].key) {
+      if (op != AND)
+        result._chunks.push_back(b._chunks[j]);
+      ++j;
+    } else {
+      Chunk chunk;
+      chunk.key = a._chunks[i].key;
+      if (Combine(a._chunks[i++], b._chunks[j++], op, chunk))
+        result._chunks.push_back(chunk);
+    }
   }
+  return result;
+}
 
-  size_t ii(128);
-  for (; ii < bits.size() - 127; ii += 128, p_bits32 += 4) { // Work through all the bits until we cannot load anymore 32-bit chunks into the registers.
-    bitsRegTmp[0] = (uint64_t(p_bits32[0]) << (taps.size())) |
-                    (p_bits32[-1] >> (32 - taps.size())); // Holds the current 64-bits from the input bits, is shifted down until there is room to hold more.
-    bitsRegTmp[1] = (uint64_t(p_bits32[1]) << (taps.size())) | (p_bits32[0] >> (32 - taps.size()));
-    bitsRegTmp[2] = (uint64_t(p_bits32[2]) << (taps.size())) | (p_bits32[1] >> (32 - taps.size()));
-    bitsRegTmp[3] = (uint64_t(p_bits32[3]) << (taps.size())) | (p_bits32[2] >> (32 - taps.size()));
+// Positions and runs are merged as the bounds of runs, a sweep over both sets of bounds toggling
+// whether each side is set. A bitmap on either side makes it a word at a time, but for an ARRAY
+// AND a BITMAP, which keeps the positions whose bits are set.
+bool CompressedBitArray::Combine(const Chunk &a, const Chunk &b, Op op, Chunk &result) {
+  if (a.type == BITMAP || b.type == BITMAP) {
+    if (op == AND && (a.type == ARRAY || b.type == ARRAY)) {
+      const Chunk &array = a.type == ARRAY ? a : b, &bitmap = a.type == ARRAY ? b : a;
+      result.type = ARRAY;
+      for (uint16_t v : array.values)
+        if ((bitmap.words[v / 64] >> (v % 64)) & 1)
+          result.values.push_back(v);
+      result.count = uint32_t(result.values.size());
+      return result.count > 0;
+    }
+    uint64_t x[ChunkWords], y[ChunkWords];
+    Words(a, x);
+    Words(b, y);
+    for (size_t w = 0; w < ChunkWords; ++w)
+      x[w] = op == AND ? x[w] & y[w] : op == OR ? x[w] | y[w] : x[w] ^ y[w];
+    return Encode(x, result);
+  }
 
-    bitsReg256 = _mm256_loadu_si256((__m256i const *)&bitsRegTmp);
-    for (size_t i = 0; i < 32; ++i) { // Shift the bits over, do the AND, then load more!
-      bitsReg256 = _mm256_srli_epi64(bitsReg256, 1);
-      __m256i res = _mm256_and_si256(tapsReg256, bitsReg256);
-      _mm256_storeu_si256((__m256i *)&resTmp, res);
-      result[ii + i] = countBits(resTmp[0]) & 0x01; // mod 2
-      result[ii + i + 32] = countBits(resTmp[1]) & 0x01;
-      result[ii + i + 64] = countBits(resTmp[2]) & 0x01;
-      result[ii + i + 96] = countBits(resTmp[3]) & 0x01;
+  std::vector<uint32_t> boundsA, boundsB, bounds;
+  Bounds(a, boundsA);
+  Bounds(b, boundsB);
+  bool inA(false), inB(false), in(false);
+  for (size_t i = 0, j = 0; i < boundsA.size() || j < boundsB.size();) {
+    uint32_t pos = std::min(i < boundsA.size() ? boundsA[i] : UINT32_MAX, j < boundsB.size() ? boundsB[j] : UINT32_MAX);
+    if (i < boundsA.size() && boundsA[i] == pos) {
+      inA = !inA;
+      ++i;
+    }
+    if (j < boundsB.size() && boundsB[j] == pos) {
+      inB = !inB;
+      ++j;
+    }
+    bool set = op == AND ? inA && inB : op == OR ? inA || inB : inA != inB;
+    if (set != in) {
+      bounds.push_back(pos);
+      in = set;
     }
   }
+  return Encode(bounds, result);
+}
 
-  // Now we just do the non-SSE version
-  uint64_t tapsReg = *(uint64_t *)taps.data(); // Never changes or are shifted, these are the taps.
-  uint64_t bitsReg = (uint64_t(p_bits32[0]) << (taps.size())) | (p_bits32[-1] >> (32 - taps.size()));
-  for (; ii < resultSize; ii += 32, p_bits32++) {
-    bitsReg = (uint64_t(p_bits32[0]) << (taps.size())) | (p_bits32[-1] >> (32 - taps.size()));
-    for (size_t i = 0; i < 32; ++i) {
-      if ((ii + i) == resultSize)
-        break;
-      bitsReg >>= 1;
-      result[ii + i] = countBits(tapsReg & bitsReg) & 0x01; // mod 2
+uint64_t CompressedBitArray::Intersect(const Chunk &a, const Chunk &b) {
+  uint64_t count(0);
+  if (a.type == BITMAP || b.type == BITMAP) {
+    const Chunk &bitmap = a.type == BITMAP ? a : b, &other = a.type == BITMAP ? b : a;
+    if (other.type == ARRAY) {
+      for (uint16_t v : other.values)
+        count += (bitmap.words[v / 64] >> (v % 64)) & 1;
+      return count;
     }
+    uint64_t x[ChunkWords];
+    Words(other, x);
+    return BitArray::DotProd(BitSpan(x, 0, ChunkBits), BitSpan(bitmap.words.data(), 0, ChunkBits));
   }
 
-  if (pInitialFill) {
-    *pInitialFill = (uint32_t)bitsReg;
+  // The overlap of each pair of runs, advancing past whichever ends first.
+  std::vector<uint32_t> boundsA, boundsB;
+  Bounds(a, boundsA);
+  Bounds(b, boundsB);
+  for (size_t i = 0, j = 0; i < boundsA.size() && j < boundsB.size();) {
+    uint32_t begin = std::max(boundsA[i], boundsB[j]), end = std::min(boundsA[i + 1], boundsB[j + 1]);
+    if (begin < end)
+      count += end - begin;
+    if (boundsA[i + 1] < boundsB[j + 1])
+      i += 2;
+    else
+      j += 2;
+  }
+  return count;
+}
+
+// A run of set bits starts at each set bit whose lower neighbour is clear and ends at each whose
+// upper one is. Arrays take 2 bytes a bit, runs 4 bytes a run and bitmaps 8 KB.
+bool CompressedBitArray::Encode(const uint64_t *words, Chunk &chunk) {
+  size_t count(0), runs(0);
+  for (size_t w = 0; w < ChunkWords; ++w) {
+    uint64_t below = (words[w] << 1) | (w ? words[w - 1] >> 63 : 0);
+    count += size_t(countBits(words[w]));
+    runs += size_t(countBits(words[w] & ~below));
+  }
+  chunk.count = uint32_t(count);
+  chunk.values.clear();
+  chunk.words.clear();
+  if (4 * runs < 2 * count && 4 * runs < ChunkBits / 8) {
+    // The k-th start and the k-th end are the first and last bits of the k-th run.
+    chunk.type = RUN;
+    chunk.values.resize(2 * runs);
+    size_t starts(0), ends(1);
+    for (size_t w = 0; w < ChunkWords; ++w) {
+      uint64_t below = (words[w] << 1) | (w ? words[w - 1] >> 63 : 0), above = (words[w] >> 1) | (w + 1 < ChunkWords ? words[w + 1] << 63 : 0);
+      for (uint64_t x = words[w] & ~below; x; x &= x - 1, starts += 2)
+        chunk.values[starts] = uint16_t(w * 64 + __builtin_ctzll(x));
+      for (uint64_t x = words[w] & ~above; x; x &= x - 1, ends += 2)
+        chunk.values[ends] = uint16_t(w * 64 + __builtin_ctzll(x));
+    }
+  } else if (count <= MaxArray) {
+    chunk.type = ARRAY;
+    std::vector<uint32_t> positions(count + 16);
+    positions.resize(BitArray::DecodeWords((const uint8_t *)words, 0, ChunkWords, positions.data()));
+    chunk.values.assign(positions.begin(), positions.end());
+  } else {
+    chunk.type = BITMAP;
+    chunk.words.assign(words, words + ChunkWords);
+  }
+  return count > 0;
+}
+
+bool CompressedBitArray::Encode(const std::vector<uint32_t> &bounds, Chunk &chunk) {
+  size_t count(0), runs = bounds.size() / 2;
+  for (size_t i = 0; i < bounds.size(); i += 2)
+    count += bounds[i + 1] - bounds[i];
+  chunk.count = uint32_t(count);
+  chunk.values.clear();
+  chunk.words.clear();
+  if (4 * runs < 2 * count && 4 * runs < ChunkBits / 8) {
+    chunk.type = RUN;
+    for (size_t i = 0; i < bounds.size(); i += 2) {
+      chunk.values.push_back(uint16_t(bounds[i]));
+      chunk.values.push_back(uint16_t(bounds[i + 1] - 1));
+    }
+  } else if (count <= MaxArray) {
+    chunk.type = ARRAY;
+    for (size_t i = 0; i < bounds.size(); i += 2)
+      for (uint32_t v = bounds[i]; v < bounds[i + 1]; ++v)
+        chunk.values.push_back(uint16_t(v));
+  } else {
+    chunk.type = RUN;
+    chunk.values.resize(bounds.size());
+    for (size_t i = 0; i < bounds.size(); i += 2) {
+      chunk.values[i] = uint16_t(bounds[i]);
+      chunk.values[i + 1] = uint16_t(bounds[i + 1] - 1);
+    }
+    uint64_t words[ChunkWords];
+    Words(chunk, words);
+    chunk.type = BITMAP;
+    chunk.values.clear();
+    chunk.words.assign(words, words + ChunkWords);
+  }
+  return count > 0;
+}
+
+void CompressedBitArray::Words(const Chunk &chunk, uint64_t *words) {
+  if (chunk.type == BITMAP) {
+    memcpy(words, chunk.words.data(), ChunkWords * 8);
+    return;
+  }
+  memset(words, 0, ChunkWords * 8);
+  if (chunk.type == ARRAY) {
+    for (uint16_t v : chunk.values)
+      words[v / 64] |= uint64_t(1) << (v % 64);
+    return;
+  }
+  for (size_t i = 0; i < chunk.values.size(); i += 2) {
+    size_t first = chunk.values[i], last = chunk.values[i + 1];
+    for (size_t w = first / 64; w <= last / 64; ++w)
+      depositRange(&words[w], ~uint64_t(0), w == first / 64 ? first % 64 : 0, w == last / 64 ? last % 64 + 1 : 64);
+  }
+}
+
+void CompressedBitArray::Bounds(const Chunk &chunk, std::vector<uint32_t> &bounds) {
+  bounds.clear();
+  if (chunk.type == RUN)
+    for (size_t i = 0; i < chunk.values.size(); i += 2) {
+      bounds.push_back(chunk.values[i]);
+      bounds.push_back(uint32_t(chunk.values[i + 1]) + 1);
+    }
+  else
+    for (uint16_t v : chunk.values)
+      if (!bounds.empty() && bounds.back() == v)
+        ++bounds.back();
+      else {
+        bounds.push_back(v);
+        bounds.push_back(uint32_t(v) + 1);
+      }
+}
+
+size_t BitRecord::Size(const BitSpan &bits) { return RecordSize(bits.size()); }
+
+size_t BitRecord::Save(const BitSpan &bits, void *buffer) {
+  uint8_t *out = (uint8_t *)buffer + HeaderSize;
+  size_t numBytes = Size(bits) - HeaderSize, numFull = bits.size() / 64;
+  if (bits.offset() == 0) {
+    memcpy(out, bits.data(), numFull * 8);
+  } else {
+    for (size_t w = 0; w < numFull; ++w) {
+      uint64_t word = bits.loadWord(w);
+      memcpy(out + 8 * w, &word, 8);
+    }
+  }
+  // The last bits and the padding.
+  memset(out + numFull * 8, 0, numBytes - numFull * 8);
+  uint64_t last = bits.loadWord(numFull);
+  memcpy(out + numFull * 8, &last, 8);
+  Header(bits, (uint8_t *)buffer);
+  return HeaderSize + numBytes;
+}
+
+void BitRecord::Save(std::ostream &out, const BitSpan &bits) {
+  uint8_t header[HeaderSize];
+  Header(bits, header);
+  out.write((const char *)header, HeaderSize);
+
+  // Bits starting on a byte are written in place, others a block of words at a time.
+  size_t numFull = bits.size() / 64;
+  if (bits.offset() == 0) {
+    out.write((const char *)bits.data(), numFull * 8);
+  } else {
+    std::vector<uint64_t> words(4096);
+    for (size_t w0 = 0; w0 < numFull; w0 += words.size()) {
+      size_t count = std::min(words.size(), numFull - w0);
+      for (size_t w = 0; w < count; ++w)
+        words[w] = bits.loadWord(w0 + w);
+      out.write((const char *)words.data(), count * 8);
+    }
+  }
+  uint64_t tail[16] = {bits.loadWord(numFull)};
+  out.write((const char *)tail, Size(bits) - HeaderSize - numFull * 8);
+  if (!out)
+    throw std::runtime_error("Cannot write a BitRecord");
+}
+
+BitArray BitRecord::Load(const void *buffer, size_t bytes, size_t *used, bool verify) {
+  BitSpan view = View(buffer, bytes, used, verify);
+  BitArray bits(view.size());
+  memcpy(bits.data(), view.data(), (view.size() + 7) / 8);
+  if (view.size() % 8)
+    bits.data()[view.size() / 8] &= (1 << (view.size() % 8)) - 1;
+  return bits;
+}
+
+BitArray BitRecord::Load(std::istream &in, bool verify) {
+  uint8_t header[HeaderSize];
+  in.read((char *)header, HeaderSize);
+  size_t recordBytes = in.gcount() == std::streamsize(HeaderSize) ? Parse(header, size_t(-1)) : 0;
+  if (!recordBytes)
+    throw std::runtime_error("The stream does not hold a BitRecord");
+
+  size_t size = Fetch(header + 8, 8), numBytes = (size + 7) / 8;
+  BitArray bits(size);
+  in.read((char *)bits.data(), numBytes);
+  if (size % 8)
+    bits.data()[size / 8] &= (1 << (size % 8)) - 1;
+  in.ignore(recordBytes - HeaderSize - numBytes);
+  if (!in)
+    throw std::runtime_error("The BitRecord is cut short");
+  if (verify && Checksum(bits) != Fetch(header + 20, 4))
+    throw std::runtime_error("The bits of the BitRecord do not match their CRC");
+  return bits;
+}
+
+BitSpan BitRecord::View(const void *buffer, size_t bytes, size_t *used, bool verify) {
+  const uint8_t *record = (const uint8_t *)buffer;
+  size_t recordBytes = Parse(record, bytes);
+  if (!recordBytes)
+    throw std::runtime_error("The buffer does not hold a BitRecord");
+  BitSpan bits(record + HeaderSize, 0, Fetch(record + 8, 8));
+  if (verify && Checksum(bits) != Fetch(record + 20, 4))
+    throw std::runtime_error("The bits of the BitRecord do not match their CRC");
+  if (used)
+    *used = recordBytes;
+  return bits;
+}
+
+std::vector<BitSpan> BitRecord::Views(const void *buffer, size_t bytes, bool verify) {
+  std::vector<BitSpan> views;
+  for (size_t pos = 0, used = 0; pos < bytes; pos += used)
+    views.push_back(View((const uint8_t *)buffer + pos, bytes - pos, &used, verify));
+  return views;
+}
+
+size_t BitRecord::RecordSize(size_t size) { return HeaderSize + ((size + 7) / 8 + 7 + 63) / 64 * 64; }
+
+void BitRecord::Header(const BitSpan &bits, uint8_t *header) {
+  memset(header, 0, HeaderSize);
+  memcpy(header, "BITARRAY", 8);
+  Store(header + 8, bits.size(), 8);
+  Store(header + 16, Version, 2);
+  header[18] = 8;
+  header[19] = 1;
+  Store(header + 20, Checksum(bits), 4);
+  Store(header + 24, Size(bits), 8);
+  Store(header + 60, Checksum(BitSpan(header, 0, 8 * 60)), 4);
+}
+
+size_t BitRecord::Parse(const uint8_t *header, size_t bytes) {
+  if (bytes < HeaderSize || memcmp(header, "BITARRAY", 8) != 0 || Fetch(header + 16, 2) != Version || header[18] != 8 || header[19] != 1 ||
+      Fetch(header + 60, 4) != Checksum(BitSpan(header, 0, 8 * 60)))
+    return 0;
+  // The size must fit in the record, with its padding, before the record size is worked out from
+  // it, as (size + 7) / 8 wraps around for sizes near 2^64. A stream has no bound of its own.
+  uint64_t size = Fetch(header + 8, 8), recordBytes = Fetch(header + 24, 8);
+  if (recordBytes > bytes || recordBytes < HeaderSize + 8 || size / 8 + (size % 8 != 0) > recordBytes - HeaderSize - 7 ||
+      recordBytes != RecordSize(size))
+    return 0;
+  return recordBytes;
+}
+
+uint32_t BitRecord::Checksum(const BitSpan &bits) {
+  static const Crc crc = Crc::Crc32C();
+  return uint32_t(crc.Compute(bits));
+}
+
+void BitRecord::Store(uint8_t *bytes, uint64_t value, size_t numBytes) {
+  for (size_t i = 0; i < numBytes; ++i)
+    bytes[i] = uint8_t(value >> (8 * i));
+}
+
+uint64_t BitRecord::Fetch(const uint8_t *bytes, size_t numBytes) {
+  uint64_t value(0);
+  for (size_t i = 0; i < numBytes; ++i)
+    value |= uint64_t(bytes[i]) << (8 * i);
+  return value;
+}
+
+MappedBitArray::MappedBitArray(const std::string &path, Mode mode, Advice advice) : _mode(mode), _size(0), _map(NULL), _mapSize(0) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+  struct stat info;
+  if (fstat(fd, &info) == 0 && size_t(info.st_size) >= HeaderSize) {
+    _mapSize = info.st_size;
+    void *map = mmap(NULL, _mapSize, mode == READ_ONLY ? PROT_READ : PROT_READ | PROT_WRITE, mode == READ_ONLY ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    _map = map == MAP_FAILED ? NULL : (uint8_t *)map;
+  }
+  close(fd);
+  if (!_map)
+    throw std::runtime_error("Cannot map " + path);
+
+  // Files saved before BitRecord have a version of 0.
+  uint64_t size = BitRecord::Fetch(_map + 8, 8);
+  bool valid = BitRecord::Fetch(_map + 16, 2) == 0 ? memcmp(_map, "BITARRAY", 8) == 0 : BitRecord::Parse(_map, _mapSize) != 0;
+  if (!valid || size > (_mapSize - HeaderSize) * 8 || HeaderSize + (size + 7) / 8 + 7 > _mapSize) {
+    munmap(_map, _mapSize);
+    throw std::runtime_error(path + " does not hold a BitArray.");
+  }
+  _size = size;
+  Advise(advice, 0, _size);
+}
+
+MappedBitArray::~MappedBitArray() { munmap(_map, _mapSize); }
+
+void MappedBitArray::Save(const std::string &path, const BitSpan &bits) {
+  FILE *file = fopen(path.c_str(), "wb");
+  if (!file)
+    throw std::runtime_error("Cannot create " + path + ": " + strerror(errno));
+
+  uint8_t header[HeaderSize];
+  BitRecord::Header(bits, header);
+  bool ok = fwrite(header, 1, HeaderSize, file) == HeaderSize;
+
+  // A block of words at a time, the bytes past the last bit are the zero padding.
+  std::vector<uint64_t> words(4096);
+  size_t numBytes = BitRecord::Size(bits) - HeaderSize;
+  for (size_t w0 = 0; ok && w0 * 8 < numBytes; w0 += words.size()) {
+    for (size_t w = 0; w < words.size(); ++w)
+      words[w] = bits.loadWord(w0 + w);
+    size_t count = std::min(words.size() * 8, numBytes - w0 * 8);
+    ok = fwrite(words.data(), 1, count, file) == count;
+  }
+  if (fclose(file) != 0 || !ok)
+    throw std::runtime_error("Cannot write " + path);
+}
+
+size_t MappedBitArray::size() const { return _size; }
+
+const uint8_t *MappedBitArray::data() const { return _map + HeaderSize; }
+
+uint8_t *MappedBitArray::data() { return _map + HeaderSize; }
+
+ProxyBit MappedBitArray::operator[](size_t i) {
+  assert(i < _size && _mode == COPY_ON_WRITE);
+  return ProxyBit(data()[i / 8], (i & 7));
+}
+
+bool MappedBitArray::operator[](size_t i) const {
+  assert(i < _size);
+  return (data()[i / 8] >> (i & 7)) & 0x01;
+}
+
+MappedBitArray::operator BitSpan() const { return BitSpan(data(), 0, _size); }
+
+std::vector<BitSpan> MappedBitArray::Records(bool verify) const { return BitRecord::Views(_map, _mapSize, verify); }
+
+void MappedBitArray::Advise(Advice advice, size_t begin, size_t end) {
+  const int advices[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED, MADV_DONTNEED};
+  if (begin >= end)
+    return;
+  // madvise works on whole pages.
+  size_t pageSize = sysconf(_SC_PAGESIZE), first = (HeaderSize + begin / 8) / pageSize * pageSize, last = std::min(_mapSize, HeaderSize + (end + 7) / 8);
+  madvise(_map + first, last - first, advices[advice]);
+}
+
+/**
+ * Every implementation compiled in is registered, with whether the CPU has what it needs, and each
+ * kernel starts out on the widest supported one.
+ */
+Dispatch::Dispatch() {
+  __builtin_cpu_init();
+  Add(DOTPROD, "default", BITARRAY_ISA_DEFAULT, true, &BitArray::DotProdDefault);
+  Add(CORRELATE, "default", BITARRAY_ISA_DEFAULT, true, &BitArray::CorrelateBlockDefault);
+  Add(CONVOLVE, "default", BITARRAY_ISA_DEFAULT, true, &BitArray::ConvolveBlockDefault);
+  Add(ENCODE, "default", BITARRAY_ISA_DEFAULT, true, &BitArray::EncodeInterleaveDefault);
+  Add(VITERBI, "default", BITARRAY_ISA_DEFAULT, true, &BitArray::ViterbiStepsScalar);
+  Add(BITEXPR, "default", BITARRAY_ISA_DEFAULT, true, Function(&BitArray::BitExprLoadDefault), Function(&BitArray::BitExprApplyDefault),
+      Function(&BitArray::BitExprShiftDefault));
+  Add(PACK, "default", BITARRAY_ISA_DEFAULT, true, &BitArray::PackBlockDefault);
+  Add(UNPACK, "default", BITARRAY_ISA_DEFAULT, true, &BitArray::UnpackBlockDefault);
+  Add(TRANSPOSE, "default", BITARRAY_ISA_DEFAULT, true, &BitArray::Transpose64Default);
+  Add(CRC, "default", BITARRAY_ISA_DEFAULT, true, &Crc::WordsDefault);
+  Add(LFSR, "default", BITARRAY_ISA_DEFAULT, true, &Lfsr::FeedbackBlockDefault);
+  Add(INTERLEAVE, "default", BITARRAY_ISA_DEFAULT, true, &Interleaver::GatherDefault);
+  Add(FIXEDCONVOLVE, "default", BITARRAY_ISA_DEFAULT, true, Function());
+  Add(SCORE, "default", BITARRAY_ISA_DEFAULT, true, &BitMatrix::ScoreTileDefault);
+  Add(GF2MULTIPLY, "default", BITARRAY_ISA_DEFAULT, true, &BitMatrix::ParityRowsDefault);
+  Add(FIND, "default", BITARRAY_ISA_DEFAULT, true, &BitArray::FindWordDefault, &BitArray::FindLastWordDefault);
+  Add(POSITIONS, "default", BITARRAY_ISA_DEFAULT, true, &BitArray::DecodeWordsDefault);
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_SSE2
+  bool sse2 = __builtin_cpu_supports("sse2"), pclmul = __builtin_cpu_supports("pclmul");
+  Add(DOTPROD, "sse2", BITARRAY_ISA_SSE2, sse2, &BitArray::DotProdSse2);
+  Add(CONVOLVE, "pclmul", BITARRAY_ISA_SSE2, pclmul, &BitArray::ConvolveBlockPclmul);
+  Add(VITERBI, "sse2", BITARRAY_ISA_SSE2, sse2, &BitArray::ViterbiStepsSse2);
+  Add(BITEXPR, "sse2", BITARRAY_ISA_SSE2, sse2, Function(&BitArray::BitExprLoadSse2), Function(&BitArray::BitExprApplySse2),
+      Function(&BitArray::BitExprShiftSse2));
+  Add(PACK, "sse2", BITARRAY_ISA_SSE2, sse2, &BitArray::PackBlockSse2);
+  Add(UNPACK, "sse2", BITARRAY_ISA_SSE2, sse2, &BitArray::UnpackBlockSse2);
+  Add(TRANSPOSE, "sse2", BITARRAY_ISA_SSE2, sse2, &BitArray::Transpose64Sse2);
+  Add(CRC, "pclmul", BITARRAY_ISA_SSE2, pclmul, &Crc::WordsPclmul);
+  Add(LFSR, "pclmul", BITARRAY_ISA_SSE2, pclmul, &Lfsr::FeedbackBlockPclmul);
+  Add(FIXEDCONVOLVE, "sse2", BITARRAY_ISA_SSE2, sse2, Function());
+  Add(SCORE, "popcnt", BITARRAY_ISA_SSE2, __builtin_cpu_supports("popcnt"), &BitMatrix::ScoreTilePopcnt);
+  Add(GF2MULTIPLY, "sse2", BITARRAY_ISA_SSE2, sse2, &BitMatrix::ParityRowsSse2);
+  Add(FIND, "sse2", BITARRAY_ISA_SSE2, sse2, &BitArray::FindWordSse2, &BitArray::FindLastWordSse2);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  bool avx2 = __builtin_cpu_supports("avx2");
+  Add(DOTPROD, "avx2", BITARRAY_ISA_AVX2, avx2, &BitArray::DotProdHarleySeal);
+  Add(CORRELATE, "avx2", BITARRAY_ISA_AVX2, avx2, &BitArray::CorrelateNibbles);
+  Add(ENCODE, "bmi2", BITARRAY_ISA_AVX2, __builtin_cpu_supports("bmi2"), &BitArray::EncodeInterleaveBmi2);
+  Add(VITERBI, "avx2", BITARRAY_ISA_AVX2, avx2, &BitArray::ViterbiStepsAvx2);
+  Add(BITEXPR, "avx2", BITARRAY_ISA_AVX2, avx2, Function(&BitArray::BitExprLoadAvx2), Function(&BitArray::BitExprApplyAvx2),
+      Function(&BitArray::BitExprShiftAvx2));
+  Add(PACK, "avx2", BITARRAY_ISA_AVX2, avx2, &BitArray::PackMovemask);
+  Add(UNPACK, "avx2", BITARRAY_ISA_AVX2, avx2, &BitArray::UnpackShuffle);
+  Add(TRANSPOSE, "avx2", BITARRAY_ISA_AVX2, avx2, &BitArray::Transpose64Avx2);
+  Add(INTERLEAVE, "avx2", BITARRAY_ISA_AVX2, avx2, &Interleaver::GatherAvx2);
+  Add(FIXEDCONVOLVE, "avx2", BITARRAY_ISA_AVX2, avx2, Function());
+  Add(SCORE, "avx2", BITARRAY_ISA_AVX2, avx2, &BitMatrix::ScoreTileAvx2);
+  Add(GF2MULTIPLY, "avx2", BITARRAY_ISA_AVX2, avx2, &BitMatrix::ParityRowsAvx2);
+  Add(FIND, "avx2", BITARRAY_ISA_AVX2, avx2, &BitArray::FindWordAvx2, &BitArray::FindLastWordAvx2);
+  Add(POSITIONS, "bmi", BITARRAY_ISA_AVX2, __builtin_cpu_supports("bmi") && __builtin_cpu_supports("popcnt"), &BitArray::DecodeWordsBmi);
+#endif
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX512
+  bool avx512 = __builtin_cpu_supports("avx512f"), bw = avx512 && __builtin_cpu_supports("avx512bw");
+  bool vpopcnt = avx512 && __builtin_cpu_supports("avx512vpopcntdq");
+  Add(DOTPROD, "avx512", BITARRAY_ISA_AVX512, vpopcnt, &BitArray::DotProdVpopcnt);
+  Add(CORRELATE, "avx512", BITARRAY_ISA_AVX512, vpopcnt, &BitArray::CorrelateVpopcnt);
+  Add(CONVOLVE, "avx512", BITARRAY_ISA_AVX512, avx512 && __builtin_cpu_supports("vpclmulqdq"), &BitArray::ConvolveBlockVpclmul);
+  Add(BITEXPR, "avx512", BITARRAY_ISA_AVX512, avx512, Function(&BitArray::BitExprLoadAvx512), Function(&BitArray::BitExprApplyAvx512),
+      Function(&BitArray::BitExprShiftAvx512));
+  Add(PACK, "avx512", BITARRAY_ISA_AVX512, bw, &BitArray::PackMasks);
+  Add(UNPACK, "avx512", BITARRAY_ISA_AVX512, bw, &BitArray::UnpackMasks);
+  Add(TRANSPOSE, "avx512", BITARRAY_ISA_AVX512, avx512 && __builtin_cpu_supports("avx512vbmi"), &BitArray::Transpose64Vbmi);
+  Add(INTERLEAVE, "avx512", BITARRAY_ISA_AVX512, avx512, &Interleaver::GatherAvx512);
+  Add(FIXEDCONVOLVE, "avx512", BITARRAY_ISA_AVX512, avx512, Function());
+  Add(SCORE, "avx512", BITARRAY_ISA_AVX512, vpopcnt, &BitMatrix::ScoreTileVpopcnt);
+  Add(GF2MULTIPLY, "avx512", BITARRAY_ISA_AVX512, avx512, &BitMatrix::ParityRowsAvx512);
+  Add(FIND, "avx512", BITARRAY_ISA_AVX512, avx512, &BitArray::FindWordAvx512, &BitArray::FindLastWordAvx512);
+  Add(POSITIONS, "avx512", BITARRAY_ISA_AVX512, avx512, &BitArray::DecodeWordsCompress);
+#endif
+  for (size_t k = 0; k < NUM_KERNELS; ++k)
+    Pick(k, BITARRAY_ISA_AVX512);
+  const char *spec = getenv("BITARRAY_DISPATCH");
+  if (spec)
+    Apply(spec, false);
+}
+
+Dispatch &Dispatch::Instance() {
+  static Dispatch dispatch;
+  return dispatch;
+}
+
+template <class F> void Dispatch::Add(Kernel kernel, const char *name, int isa, bool supported, F f0, F f1, F f2) {
+  Implementation implementation = {name, isa, supported, {Function(f0), Function(f1), Function(f2)}};
+  _implementations[kernel].push_back(implementation);
+}
+
+// The widest supported implementation at or below isa, the default one is always supported.
+void Dispatch::Pick(size_t kernel, int isa) {
+  for (size_t i = 0; i < _implementations[kernel].size(); ++i)
+    if (_implementations[kernel][i].supported && _implementations[kernel][i].isa <= isa)
+      _selected[kernel] = &_implementations[kernel][i];
+}
+
+const char *const dispatchKernelNames[] = {"dotprod",     "correlate", "convolve",  "encode", "viterbi",    "bitexpr",       "pack",
+                                           "unpack",      "transpose", "crc",       "lfsr",   "interleave", "fixedconvolve", "score",
+                                           "gf2multiply", "find",      "positions"};
+
+size_t Dispatch::Find(const std::string &kernel) {
+  for (size_t k = 0; k < NUM_KERNELS; ++k)
+    if (kernel == dispatchKernelNames[k])
+      return k;
+  throw std::runtime_error("Unknown kernel " + kernel);
+}
+
+int Dispatch::Tier(const std::string &implementation) {
+  const char *names[] = {"default", "sse2", "popcnt", "pclmul", "avx2", "bmi", "bmi2", "avx512", "auto"};
+  const int tiers[] = {BITARRAY_ISA_DEFAULT, BITARRAY_ISA_SSE2, BITARRAY_ISA_SSE2,   BITARRAY_ISA_SSE2,  BITARRAY_ISA_AVX2,
+                       BITARRAY_ISA_AVX2,    BITARRAY_ISA_AVX2, BITARRAY_ISA_AVX512, BITARRAY_ISA_AVX512};
+  for (size_t i = 0; i < 9; ++i)
+    if (implementation == names[i])
+      return tiers[i];
+  throw std::runtime_error("Unknown implementation " + implementation);
+}
+
+// A strict Apply throws at the first entry it cannot parse, otherwise such entries are skipped.
+void Dispatch::Apply(const std::string &spec, bool strict) {
+  for (size_t begin = 0; begin <= spec.size();) {
+    size_t end = std::min(spec.find(',', begin), spec.size());
+    std::string entry = spec.substr(begin, end - begin);
+    begin = end + 1;
+    entry.erase(std::remove(entry.begin(), entry.end(), ' '), entry.end());
+    if (entry.empty())
+      continue;
+    try {
+      size_t equals = entry.find('=');
+      if (equals == std::string::npos)
+        throw std::runtime_error("Expected kernel=implementation, not " + entry);
+      std::string kernel = entry.substr(0, equals);
+      int isa = Tier(entry.substr(equals + 1));
+      if (kernel == "*")
+        for (size_t k = 0; k < NUM_KERNELS; ++k)
+          Pick(k, isa);
+      else
+        Pick(Find(kernel), isa);
+    } catch (const std::runtime_error &) {
+      if (strict)
+        throw;
+    }
   }
 }
+
+std::vector<std::string> Dispatch::Kernels() { return std::vector<std::string>(dispatchKernelNames, dispatchKernelNames + NUM_KERNELS); }
+
+std::vector<std::string> Dispatch::Implementations(const std::string &kernel) {
+  const std::vector<Implementation> &implementations = Instance()._implementations[Find(kernel)];
+  std::vector<std::string> names;
+  for (size_t i = 0; i < implementations.size(); ++i)
+    if (implementations[i].supported)
+      names.push_back(implementations[i].name);
+  return names;
+}
+
+std::string Dispatch::Selected(const std::string &kernel) { return Instance()._selected[Find(kernel)]->name; }
+
+void Dispatch::Select(const std::string &kernel, const std::string &implementation) { Instance().Apply(kernel + "=" + implementation, true); }
+
+void Dispatch::Configure(const std::string &spec) { Instance().Apply(spec, true); }
 #endif
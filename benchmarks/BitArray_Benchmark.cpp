@@ -3,6 +3,7 @@
 #include "picobench.hpp"
 #include <chrono>
 #include <iostream>
+#include <sstream>
 
 using namespace std::chrono;
 
@@ -66,9 +67,1042 @@ static void dotprod_bitarray(picobench::state &s) {
     testArray2[i] = rand() % 2;
   }
   uint64_t my_value(0);
+  auto t1 = high_resolution_clock::now();
   for (auto _ : s) {
     my_value = BitArray::DotProd(testArray1[start_a], testArray2[start_b], num);
   }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  std::cout << "dotprod_bitarray: " << 2 * num / 8 * double(s.iterations()) / seconds / 1e9 << " GB/s" << std::endl;
   s.set_result(my_value);
 }
 PICOBENCH(dotprod_bitarray);
+
+PICOBENCH_SUITE("Convolve bit at a time vs word parallel");
+
+// The original shift register that produces one output bit per step through ProxyBit.
+static void convolve_bit_at_a_time(picobench::state &s) {
+  BitArray taps("1011011101111011111");
+  BitArray input(1024 * 1024 * 100);
+  BitArray output(taps.size() + input.size() - 1);
+  srand(7);
+  for (size_t i = 0; i < input.size(); ++i)
+    input[i] = rand() % 2;
+
+  uint64_t tapsReg = *(uint64_t *)taps.data();
+  for (auto _ : s) {
+    uint32_t *p_bits32 = (uint32_t *)input.data();
+    uint64_t bitsReg = uint64_t(*(p_bits32++)) << taps.size();
+    size_t ii(0);
+    while (ii < (input.size() - 31)) {
+      for (size_t i = 0; i < 32; ++i) {
+        bitsReg >>= 1;
+        output[ii++] = countBits(tapsReg & bitsReg) & 0x01;
+      }
+      bitsReg |= (uint64_t(*(p_bits32++)) << taps.size());
+    }
+    for (; output.size() != ii; ++ii) {
+      bitsReg >>= 1;
+      output[ii] = countBits(tapsReg & bitsReg) & 0x01;
+    }
+  }
+  s.set_result(output.data()[output.size() / 16]);
+}
+PICOBENCH(convolve_bit_at_a_time);
+
+static void convolve_bitarray(picobench::state &s) {
+  BitArray taps("1011011101111011111");
+  BitArray input(1024 * 1024 * 100);
+  BitArray output(taps.size() + input.size() - 1);
+  srand(7);
+  for (size_t i = 0; i < input.size(); ++i)
+    input[i] = rand() % 2;
+
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    BitArray::Convolve(taps, input, output);
+  }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  std::cout << "convolve_bitarray: " << input.size() * double(s.iterations()) / seconds / 1e9 << " Gbit/s" << std::endl;
+  s.set_result(output.data()[output.size() / 16]);
+}
+PICOBENCH(convolve_bitarray);
+
+PICOBENCH_SUITE("Convolve long taps vs DotProd per bit");
+
+static void convolve_long_taps(picobench::state &s, size_t numTaps, bool useDotProd) {
+  BitArray taps(numTaps);
+  BitArray input(1024 * 1024 * 4);
+  BitArray output(taps.size() + input.size() - 1);
+  srand(7);
+  for (size_t i = 0; i < taps.size(); ++i)
+    taps[i] = rand() % 2;
+  for (size_t i = 0; i < input.size(); ++i)
+    input[i] = rand() % 2;
+
+  for (auto _ : s) {
+    if (useDotProd) {
+      for (size_t i = 0; i < output.size(); ++i) {
+        size_t inputIdx = ((i < taps.size()) ? 0 : i - taps.size() + 1);
+        size_t tapsIdx = ((i < taps.size()) ? (taps.size() - i - 1) : 0);
+        size_t len = ((i < taps.size()) ? (i + 1) : taps.size());
+        if (inputIdx + len > input.size())
+          len = input.size() - inputIdx;
+        output[i] = BitArray::DotProd(taps[tapsIdx], input[inputIdx], len) % 2;
+      }
+    } else
+      BitArray::Convolve(taps, input, output);
+  }
+  s.set_result(output.data()[output.size() / 16]);
+}
+
+static void convolve_dotprod_200_taps(picobench::state &s) { convolve_long_taps(s, 200, true); }
+PICOBENCH(convolve_dotprod_200_taps);
+
+static void convolve_64_taps(picobench::state &s) { convolve_long_taps(s, 64, false); }
+PICOBENCH(convolve_64_taps);
+
+static void convolve_128_taps(picobench::state &s) { convolve_long_taps(s, 128, false); }
+PICOBENCH(convolve_128_taps);
+
+static void convolve_200_taps(picobench::state &s) { convolve_long_taps(s, 200, false); }
+PICOBENCH(convolve_200_taps);
+
+static void convolve_512_taps(picobench::state &s) { convolve_long_taps(s, 512, false); }
+PICOBENCH(convolve_512_taps);
+
+PICOBENCH_SUITE("Rate 1/2 K=7 encoding, Convolve per generator vs Encode");
+
+static std::vector<BitArray> k7_taps() { return {BitArray("1111001"), BitArray("1011011")}; }
+
+static void encode_convolve_and_interleave(picobench::state &s) {
+  std::vector<BitArray> taps = k7_taps();
+  BitArray input(1024 * 1024 * 10);
+  std::vector<BitArray> streams(taps.size(), BitArray(taps[0].size() + input.size() - 1));
+  BitArray output(streams[0].size() * taps.size());
+  srand(7);
+  for (size_t i = 0; i < input.size(); ++i)
+    input[i] = rand() % 2;
+
+  for (auto _ : s) {
+    for (size_t j = 0; j < taps.size(); ++j)
+      BitArray::Convolve(taps[j], input, streams[j]);
+    for (size_t i = 0; i < streams[0].size(); ++i)
+      for (size_t j = 0; j < taps.size(); ++j)
+        output[i * taps.size() + j] = streams[j][i];
+  }
+  s.set_result(output.data()[output.size() / 16]);
+}
+PICOBENCH(encode_convolve_and_interleave);
+
+static void encode_streams(picobench::state &s) {
+  std::vector<BitArray> taps = k7_taps();
+  BitArray input(1024 * 1024 * 10);
+  std::vector<BitArray> streams(taps.size(), BitArray(taps[0].size() + input.size() - 1));
+  srand(7);
+  for (size_t i = 0; i < input.size(); ++i)
+    input[i] = rand() % 2;
+
+  for (auto _ : s) {
+    BitArray::Encode(taps, input, streams);
+  }
+  s.set_result(streams[1].data()[streams[1].size() / 16]);
+}
+PICOBENCH(encode_streams);
+
+static void encode_interleaved(picobench::state &s) {
+  std::vector<BitArray> taps = k7_taps();
+  BitArray input(1024 * 1024 * 10);
+  BitArray output(BitArray::EncodedSize(taps, input.size()));
+  srand(7);
+  for (size_t i = 0; i < input.size(); ++i)
+    input[i] = rand() % 2;
+
+  for (auto _ : s) {
+    BitArray::Encode(taps, input, output);
+  }
+  s.set_result(output.data()[output.size() / 16]);
+}
+PICOBENCH(encode_interleaved);
+
+static void encode_punctured_3_4(picobench::state &s) {
+  std::vector<BitArray> taps = k7_taps(), puncture = {BitArray("110"), BitArray("101")};
+  BitArray input(1024 * 1024 * 10);
+  BitArray output(BitArray::EncodedSize(taps, input.size(), true, puncture));
+  srand(7);
+  for (size_t i = 0; i < input.size(); ++i)
+    input[i] = rand() % 2;
+
+  for (auto _ : s) {
+    BitArray::Encode(taps, input, output, true, NULL, puncture);
+  }
+  s.set_result(output.data()[output.size() / 16]);
+}
+PICOBENCH(encode_punctured_3_4);
+
+PICOBENCH_SUITE("Viterbi decoding, K=7 rate 1/2");
+
+static void viterbi_k7(picobench::state &s, bool soft, size_t tracebackLength) {
+  std::vector<BitArray> taps = k7_taps();
+  BitArray input(1024 * 1024);
+  BitArray encoded(BitArray::EncodedSize(taps, input.size()));
+  BitArray decoded(input.size());
+  srand(7);
+  for (size_t i = 0; i < input.size(); ++i)
+    input[i] = rand() % 2;
+  BitArray::Encode(taps, input, encoded);
+
+  std::vector<int8_t> symbols(encoded.size());
+  for (size_t i = 0; i < symbols.size(); ++i)
+    symbols[i] = (encoded[i] ? 64 : -64) + rand() % 32 - 16;
+
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    if (soft)
+      BitArray::Decode(taps, symbols.data(), symbols.size(), decoded, true, tracebackLength);
+    else
+      BitArray::Decode(taps, encoded, decoded, true, tracebackLength);
+  }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  std::cout << "viterbi_k7 " << (soft ? "soft" : "hard") << " traceback " << tracebackLength << ": "
+            << input.size() * double(s.iterations()) / seconds / 1e6 << " Mbit/s" << std::endl;
+  s.set_result(decoded.data()[decoded.size() / 16]);
+}
+
+static void viterbi_k7_hard(picobench::state &s) { viterbi_k7(s, false, 0); }
+PICOBENCH(viterbi_k7_hard);
+
+static void viterbi_k7_soft(picobench::state &s) { viterbi_k7(s, true, 0); }
+PICOBENCH(viterbi_k7_soft);
+
+static void viterbi_k7_soft_traceback_35(picobench::state &s) { viterbi_k7(s, true, 35); }
+PICOBENCH(viterbi_k7_soft_traceback_35);
+
+PICOBENCH_SUITE("Scrambling a frame, bit at a time vs bitwise operators");
+
+static void scramble(picobench::state &s, int method) {
+  size_t size(1024 * 1024 * 64);
+  BitArray frame(size), scrambler(size), mask(size), result(size);
+  srand(7);
+  for (size_t i = 0; i < size; ++i) {
+    frame[i] = rand() % 2;
+    scrambler[i] = rand() % 2;
+    mask[i] = rand() % 2;
+  }
+
+  for (auto _ : s) {
+    if (method == 0) {
+      for (size_t i = 0; i < size; ++i)
+        result[i] = frame[i] != (scrambler[i] && mask[i]);
+    } else if (method == 1) {
+      BitArray masked = scrambler & mask;
+      result = frame ^ masked;
+    } else if (method == 2)
+      result = frame ^ (scrambler & mask);
+    else
+      BitArray::Assign(result[3], BitArray::Range(frame[3], size - 20) ^ (BitArray::Range(scrambler[11], size - 20) & BitArray::Range(mask[0], size - 20)));
+  }
+  s.set_result(result.data()[size / 16]);
+}
+
+static void scramble_bit_at_a_time(picobench::state &s) { scramble(s, 0); }
+PICOBENCH(scramble_bit_at_a_time);
+
+static void scramble_with_temporary(picobench::state &s) { scramble(s, 1); }
+PICOBENCH(scramble_with_temporary);
+
+static void scramble_fused(picobench::state &s) { scramble(s, 2); }
+PICOBENCH(scramble_fused);
+
+static void scramble_fused_unaligned(picobench::state &s) { scramble(s, 3); }
+PICOBENCH(scramble_fused_unaligned);
+
+PICOBENCH_SUITE("Rank and select, prefix popcount vs RankSelect");
+
+static void rank_select(picobench::state &s, int method) {
+  size_t size(1024 * 1024 * 256);
+  BitArray bits(size);
+  srand(7);
+  for (size_t i = 0; i < size / 8; ++i)
+    bits.data()[i] = rand();
+  RankSelect index(bits);
+  size_t numQueries = method == 0 ? 16 : 1024 * 1024;
+  std::vector<size_t> queries(numQueries);
+  for (size_t q = 0; q < numQueries; ++q)
+    queries[q] = (size_t(rand()) * RAND_MAX + rand()) % (method == 2 ? index.Count() : size);
+
+  size_t sum(0);
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    for (size_t q = 0; q < numQueries; ++q)
+      if (method == 0)
+        sum += BitArray::DotProd(bits[0], bits[0], queries[q]);
+      else if (method == 1)
+        sum += index.Rank(queries[q]);
+      else
+        sum += index.Select(queries[q]);
+  }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  const char *names[] = {"prefix popcount", "rank", "select"};
+  std::cout << names[method] << ": " << seconds * 1e9 / (numQueries * double(s.iterations())) << " ns/query" << std::endl;
+  s.set_result(sum);
+}
+
+static void rank_prefix_popcount(picobench::state &s) { rank_select(s, 0); }
+PICOBENCH(rank_prefix_popcount);
+
+static void rank_index(picobench::state &s) { rank_select(s, 1); }
+PICOBENCH(rank_index);
+
+static void select_index(picobench::state &s) { rank_select(s, 2); }
+PICOBENCH(select_index);
+
+PICOBENCH_SUITE("Sync word search, DotProd per offset vs Search");
+
+static void sync_search(picobench::state &s, size_t patternSize, int method) {
+  BitArray rx(1024 * 1024 * 4), pattern(patternSize);
+  srand(7);
+  for (size_t i = 0; i < rx.size() / 8; ++i)
+    rx.data()[i] = rand();
+  for (size_t i = 0; i < pattern.size(); ++i)
+    pattern[i] = rand() % 2;
+
+  size_t numOffsets = rx.size() - pattern.size() + 1, found(0);
+  std::vector<uint16_t> agreements;
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    if (method == 0) {
+      for (size_t i = 0; i < numOffsets; ++i)
+        found += BitArray::DotProd(pattern[0], rx[i], pattern.size()) >= patternSize / 2 - 10;
+    } else if (method == 1)
+      found += BitArray::Search(pattern, rx, patternSize / 8).size();
+    else {
+      BitArray::Correlate(pattern, rx, agreements);
+      found += agreements[numOffsets / 2];
+    }
+  }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  const char *names[] = {"dotprod per offset", "search", "correlate"};
+  std::cout << names[method] << " " << patternSize << " bits: " << numOffsets * double(s.iterations()) / seconds / 1e6 << " Moffsets/s" << std::endl;
+  s.set_result(found);
+}
+
+static void sync_dotprod_per_offset_64(picobench::state &s) { sync_search(s, 64, 0); }
+PICOBENCH(sync_dotprod_per_offset_64);
+
+static void sync_search_64(picobench::state &s) { sync_search(s, 64, 1); }
+PICOBENCH(sync_search_64);
+
+static void sync_correlate_64(picobench::state &s) { sync_search(s, 64, 2); }
+PICOBENCH(sync_correlate_64);
+
+static void sync_dotprod_per_offset_256(picobench::state &s) { sync_search(s, 256, 0); }
+PICOBENCH(sync_dotprod_per_offset_256);
+
+static void sync_search_256(picobench::state &s) { sync_search(s, 256, 1); }
+PICOBENCH(sync_search_256);
+
+PICOBENCH_SUITE("Convolving frames of a receive buffer, copy into BitArray vs BitSpan");
+
+static void frames_convolve(picobench::state &s, size_t offset, bool copy) {
+  const size_t frameSize = 4096, numFrames = 1024;
+  std::vector<uint8_t> rx(offset / 8 + frameSize * numFrames / 8 + 8);
+  srand(7);
+  for (size_t i = 0; i < rx.size(); ++i)
+    rx[i] = rand();
+  BitArray taps("1011011"), result(frameSize + taps.size() - 1);
+
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s)
+    for (size_t f = 0; f < numFrames; ++f) {
+      BitSpan frame(rx.data(), offset + f * frameSize, frameSize);
+      if (copy) {
+        BitArray frameCopy = BitExpr(frame);
+        BitArray::Convolve(taps, frameCopy, result);
+      } else
+        BitArray::Convolve(taps, frame, result);
+    }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  std::cout << (copy ? "copy" : "span") << " at bit " << offset << ": " << frameSize * numFrames * double(s.iterations()) / seconds / 1e6 << " Mbit/s" << std::endl;
+  s.set_result(result[100]);
+}
+
+static void frames_copy_aligned(picobench::state &s) { frames_convolve(s, 0, true); }
+PICOBENCH(frames_copy_aligned);
+
+static void frames_span_aligned(picobench::state &s) { frames_convolve(s, 0, false); }
+PICOBENCH(frames_span_aligned);
+
+static void frames_copy_offset(picobench::state &s) { frames_convolve(s, 3, true); }
+PICOBENCH(frames_copy_offset);
+
+static void frames_span_offset(picobench::state &s) { frames_convolve(s, 3, false); }
+PICOBENCH(frames_span_offset);
+
+PICOBENCH_SUITE("Correlating a recorded capture, reading the file vs MappedBitArray");
+
+static void capture_job(picobench::state &s, bool mapped) {
+  const char *path = "BitArray_Benchmark.bits";
+  BitArray capture(size_t(1) << 28), pattern(64);
+  srand(7);
+  for (size_t i = 0; i < capture.size() / 8; ++i)
+    capture.data()[i] = rand();
+  MappedBitArray::Save(path, capture);
+
+  size_t found(0);
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    if (mapped) {
+      MappedBitArray bits(path, MappedBitArray::READ_ONLY, MappedBitArray::SEQUENTIAL);
+      found += BitArray::Search(pattern, bits, 20).size();
+    } else {
+      FILE *file = fopen(path, "rb");
+      BitArray bits(capture.size());
+      fseek(file, 64, SEEK_SET);
+      found += fread(bits.data(), 1, bits.size() / 8, file);
+      fclose(file);
+      found += BitArray::Search(pattern, bits, 20).size();
+    }
+  }
+  auto t2 = high_resolution_clock::now();
+  remove(path);
+  std::cout << (mapped ? "mapped" : "read") << ": " << duration_cast<nanoseconds>(t2 - t1).count() / 1e6 / s.iterations() << " ms per job" << std::endl;
+  s.set_result(found);
+}
+
+static void capture_read(picobench::state &s) { capture_job(s, false); }
+PICOBENCH(capture_read).iterations({2});
+
+static void capture_mapped(picobench::state &s) { capture_job(s, true); }
+PICOBENCH(capture_mapped).iterations({2});
+
+PICOBENCH_SUITE("Streaming K=7 convolution, Convolve per chunk vs Convolver");
+
+static void stream_chunks(picobench::state &s, size_t chunkSize, bool useConvolver) {
+  BitArray taps("1011011"), input(1024 * 1024), fill(taps.size()), result(input.size());
+  srand(7);
+  for (size_t i = 0; i < input.size() / 8; ++i)
+    input.data()[i] = rand();
+  size_t numChunks = input.size() / chunkSize;
+
+  Convolver convolver(taps);
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s)
+    for (size_t c = 0; c < numChunks; ++c) {
+      if (useConvolver)
+        convolver.Push(BitSpan(input[c * chunkSize], chunkSize), result, c * chunkSize);
+      else {
+        BitArray chunk = BitArray::Range(input[c * chunkSize], chunkSize), output(chunkSize);
+        BitArray::Convolve(taps, chunk, output, false, fill);
+        BitArray::Assign(result[c * chunkSize], output);
+      }
+    }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  std::cout << (useConvolver ? "convolver" : "convolve per chunk") << " " << chunkSize << " bit chunks: " << seconds * 1e9 / (numChunks * double(s.iterations()))
+            << " ns/chunk, " << numChunks * chunkSize * double(s.iterations()) / seconds / 1e6 << " Mbit/s" << std::endl;
+  s.set_result(result[100]);
+}
+
+static void stream_convolve_16(picobench::state &s) { stream_chunks(s, 16, false); }
+PICOBENCH(stream_convolve_16);
+
+static void stream_convolver_16(picobench::state &s) { stream_chunks(s, 16, true); }
+PICOBENCH(stream_convolver_16);
+
+static void stream_convolve_100(picobench::state &s) { stream_chunks(s, 100, false); }
+PICOBENCH(stream_convolve_100);
+
+static void stream_convolver_100(picobench::state &s) { stream_chunks(s, 100, true); }
+PICOBENCH(stream_convolver_100);
+
+static void stream_convolve_1500(picobench::state &s) { stream_chunks(s, 1500, false); }
+PICOBENCH(stream_convolve_1500);
+
+static void stream_convolver_1500(picobench::state &s) { stream_chunks(s, 1500, true); }
+PICOBENCH(stream_convolver_1500);
+
+static void stream_convolve_12000(picobench::state &s) { stream_chunks(s, 12000, false); }
+PICOBENCH(stream_convolve_12000);
+
+static void stream_convolver_12000(picobench::state &s) { stream_chunks(s, 12000, true); }
+PICOBENCH(stream_convolver_12000);
+
+PICOBENCH_SUITE("Parallel Convolve and DotProd over 256 Mbit, 1 to N threads");
+
+static void parallel_scaling(picobench::state &s, size_t threads, bool dotProd) {
+  BitArray taps("1011011101111011111"), a(size_t(1) << 28), b(a.size()), result(a.size() + taps.size() - 1);
+  srand(7);
+  for (size_t i = 0; i < a.size() / 8; ++i) {
+    a.data()[i] = rand();
+    b.data()[i] = rand();
+  }
+  BitArray::Parallel policy(threads);
+
+  uint64_t accum(0);
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    if (dotProd)
+      accum += BitArray::DotProd(policy, a, b);
+    else
+      BitArray::Convolve(policy, taps, a, result);
+  }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  std::cout << (dotProd ? "dotprod " : "convolve ") << policy.Threads(a.size()) << " threads: " << a.size() * double(s.iterations()) / seconds / 1e9 << " Gbit/s"
+            << std::endl;
+  s.set_result(accum + result[100]);
+}
+
+static void parallel_convolve_1(picobench::state &s) { parallel_scaling(s, 1, false); }
+PICOBENCH(parallel_convolve_1).iterations({4});
+
+static void parallel_convolve_2(picobench::state &s) { parallel_scaling(s, 2, false); }
+PICOBENCH(parallel_convolve_2).iterations({4});
+
+static void parallel_convolve_4(picobench::state &s) { parallel_scaling(s, 4, false); }
+PICOBENCH(parallel_convolve_4).iterations({4});
+
+static void parallel_convolve_all(picobench::state &s) { parallel_scaling(s, 0, false); }
+PICOBENCH(parallel_convolve_all).iterations({4});
+
+static void parallel_dotprod_1(picobench::state &s) { parallel_scaling(s, 1, true); }
+PICOBENCH(parallel_dotprod_1).iterations({4});
+
+static void parallel_dotprod_2(picobench::state &s) { parallel_scaling(s, 2, true); }
+PICOBENCH(parallel_dotprod_2).iterations({4});
+
+static void parallel_dotprod_4(picobench::state &s) { parallel_scaling(s, 4, true); }
+PICOBENCH(parallel_dotprod_4).iterations({4});
+
+static void parallel_dotprod_all(picobench::state &s) { parallel_scaling(s, 0, true); }
+PICOBENCH(parallel_dotprod_all).iterations({4});
+
+PICOBENCH_SUITE("Packing a byte per bit, ProxyBit loop vs Pack and Unpack");
+
+static void pack_bytes(picobench::state &s, int method) {
+  size_t size(1024 * 1024 * 16);
+  std::vector<uint8_t> bytes(size);
+  std::vector<int8_t> symbols(size);
+  std::string text(size, '0');
+  srand(7);
+  for (size_t i = 0; i < size; ++i) {
+    bytes[i] = rand() % 2;
+    symbols[i] = rand();
+    text[i] = '0' + bytes[i];
+  }
+  BitArray bits(size + 3);
+
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    if (method == 0)
+      for (size_t i = 0; i < size; ++i)
+        bits[i + 3] = bytes[i];
+    else if (method == 1)
+      BitArray::PackBytes(bytes.data(), size, bits, 3);
+    else if (method == 2)
+      BitArray::PackSymbols(symbols.data(), size, bits, 3);
+    else if (method == 3)
+      bits = BitArray(text);
+    else
+      BitArray::UnpackBytes(BitSpan(bits.data(), 3, size), bytes.data());
+  }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  const char *names[] = {"proxy loop", "pack bytes", "pack symbols", "string constructor", "unpack bytes"};
+  std::cout << names[method] << ": " << size * double(s.iterations()) / seconds / 1e9 << " Gbit/s" << std::endl;
+  s.set_result(bits[100] + bytes[100]);
+}
+
+static void pack_proxy_loop(picobench::state &s) { pack_bytes(s, 0); }
+PICOBENCH(pack_proxy_loop);
+
+static void pack_bytes_bulk(picobench::state &s) { pack_bytes(s, 1); }
+PICOBENCH(pack_bytes_bulk);
+
+static void pack_symbols_bulk(picobench::state &s) { pack_bytes(s, 2); }
+PICOBENCH(pack_symbols_bulk);
+
+static void pack_string_constructor(picobench::state &s) { pack_bytes(s, 3); }
+PICOBENCH(pack_string_constructor);
+
+static void unpack_bytes_bulk(picobench::state &s) { pack_bytes(s, 4); }
+PICOBENCH(unpack_bytes_bulk);
+
+PICOBENCH_SUITE("Moving 1 Mbit to another bit offset, memcpy vs ProxyBit loop vs Copy");
+
+static void copy_bits(picobench::state &s, int method) {
+  size_t size(1024 * 1024);
+  BitArray src(size + 64), dest(size + 64);
+  srand(3);
+  for (size_t i = 0; i < src.size(); ++i)
+    src[i] = rand() % 2;
+
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    if (method == 0)
+      memcpy(dest.data(), src.data(), size / 8);
+    else if (method == 1)
+      for (size_t i = 0; i < size; ++i)
+        dest[i + 5] = src[i + 13];
+    else if (method == 2)
+      BitArray::Copy(BitSpan(src.data(), 13, size), dest, 5);
+    else if (method == 3)
+      BitArray::Copy(BitSpan(dest.data(), 13, size), dest, 5);
+    else
+      dest = src.Slice(13, size);
+  }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  const char *names[] = {"memcpy", "proxy loop", "copy", "overlapping copy", "slice"};
+  std::cout << names[method] << ": " << size * double(s.iterations()) / seconds / 1e9 << " Gbit/s" << std::endl;
+  s.set_result(dest[100]);
+}
+
+static void copy_memcpy(picobench::state &s) { copy_bits(s, 0); }
+PICOBENCH(copy_memcpy);
+
+static void copy_proxy_loop(picobench::state &s) { copy_bits(s, 1); }
+PICOBENCH(copy_proxy_loop);
+
+static void copy_shifted(picobench::state &s) { copy_bits(s, 2); }
+PICOBENCH(copy_shifted);
+
+static void copy_overlapping(picobench::state &s) { copy_bits(s, 3); }
+PICOBENCH(copy_overlapping);
+
+static void copy_slice(picobench::state &s) { copy_bits(s, 4); }
+PICOBENCH(copy_slice);
+
+PICOBENCH_SUITE("PRBS31 and scrambling 16 Mbit, bit at a time register vs Lfsr");
+
+static void lfsr_bits(picobench::state &s, int method) {
+  size_t size(1024 * 1024 * 16);
+  BitArray input(size), output(size);
+  srand(5);
+  for (size_t i = 0; i < size; ++i)
+    input[i] = rand() % 2;
+  Lfsr prbs(Lfsr::Prbs(31));
+
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    if (method == 0) {
+      uint32_t reg = 0x7FFFFFFF;
+      for (size_t i = 0; i < size; ++i) {
+        uint32_t bit = ((reg >> 30) ^ (reg >> 27)) & 1;
+        reg = (reg << 1) | bit;
+        output[i] = bit;
+      }
+    } else if (method == 1)
+      prbs.Generate(size, output);
+    else if (method == 2)
+      prbs.Generate(BitArray::Parallel(0, 0), size, output);
+    else if (method == 3)
+      prbs.Apply(input, output);
+    else
+      prbs.Scramble(input, output);
+  }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  const char *names[] = {"bit loop", "generate", "parallel generate", "additive scramble", "multiplicative scramble"};
+  std::cout << names[method] << ": " << size * double(s.iterations()) / seconds / 1e9 << " Gbit/s" << std::endl;
+  s.set_result(output[100]);
+}
+
+static void lfsr_bit_loop(picobench::state &s) { lfsr_bits(s, 0); }
+PICOBENCH(lfsr_bit_loop).iterations({4});
+
+static void lfsr_generate(picobench::state &s) { lfsr_bits(s, 1); }
+PICOBENCH(lfsr_generate).iterations({4});
+
+static void lfsr_generate_parallel(picobench::state &s) { lfsr_bits(s, 2); }
+PICOBENCH(lfsr_generate_parallel).iterations({4});
+
+static void lfsr_apply(picobench::state &s) { lfsr_bits(s, 3); }
+PICOBENCH(lfsr_apply).iterations({4});
+
+static void lfsr_scramble(picobench::state &s) { lfsr_bits(s, 4); }
+PICOBENCH(lfsr_scramble).iterations({4});
+
+PICOBENCH_SUITE("CRC-32 of 16 Mbit, bit at a time vs Crc, aligned and at a bit offset");
+
+static void crc_bits(picobench::state &s, int method) {
+  size_t size(1024 * 1024 * 16);
+  BitArray bits(size + 3);
+  srand(9);
+  for (size_t i = 0; i < bits.size(); ++i)
+    bits[i] = rand() % 2;
+  Crc crc32 = Crc::Crc32(), crc24 = Crc::Crc24Lte();
+  uint64_t sum(0);
+
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    if (method == 0) {
+      uint32_t reg = 0xFFFFFFFF;
+      for (size_t i = 0; i < size; ++i) {
+        bool bit = (reg ^ bits[i + 3]) & 1;
+        reg = bit ? (reg >> 1) ^ 0xEDB88320 : reg >> 1;
+      }
+      sum += ~reg;
+    } else if (method == 1)
+      sum += crc32.Compute(bits[0], size);
+    else if (method == 2)
+      sum += crc32.Compute(bits[3], size);
+    else
+      sum += crc24.Compute(bits[3], size);
+  }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  const char *names[] = {"bit loop", "crc32 aligned", "crc32 at bit 3", "crc24 at bit 3"};
+  std::cout << names[method] << ": " << size * double(s.iterations()) / seconds / 1e9 << " Gbit/s" << std::endl;
+  s.set_result(sum);
+}
+
+static void crc_bit_loop(picobench::state &s) { crc_bits(s, 0); }
+PICOBENCH(crc_bit_loop).iterations({4});
+
+static void crc32_aligned(picobench::state &s) { crc_bits(s, 1); }
+PICOBENCH(crc32_aligned).iterations({4});
+
+static void crc32_offset(picobench::state &s) { crc_bits(s, 2); }
+PICOBENCH(crc32_offset).iterations({4});
+
+static void crc24_offset(picobench::state &s) { crc_bits(s, 3); }
+PICOBENCH(crc24_offset).iterations({4});
+
+PICOBENCH_SUITE("Interleaving frames of 3, 30 and 300 kbit, operator[] vs block vs permutation");
+
+static void interleave_frames(picobench::state &s, size_t rows, int method) {
+  size_t cols = 3 * rows, size = rows * cols;
+  BitArray frame(size), interleaved(size);
+  std::vector<size_t> permutation(size);
+  srand(11);
+  for (size_t i = 0; i < size; ++i) {
+    frame[i] = rand() % 2;
+    permutation[i] = i;
+  }
+  for (size_t i = size; i > 1; --i)
+    std::swap(permutation[i - 1], permutation[rand() % i]);
+  Interleaver block(rows, cols), general(permutation);
+  size_t frames = (size_t(1) << 24) / size;
+
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s)
+    for (size_t f = 0; f < frames; ++f) {
+      if (method == 0) {
+        for (size_t r = 0; r < rows; ++r)
+          for (size_t c = 0; c < cols; ++c)
+            interleaved[c * rows + r] = frame[r * cols + c];
+      } else if (method == 1)
+        block.Interleave(frame, interleaved);
+      else if (method == 2)
+        block.Deinterleave(frame, interleaved);
+      else
+        general.Interleave(frame, interleaved);
+    }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  const char *names[] = {"operator[]", "block", "block inverse", "permutation"};
+  std::cout << names[method] << " " << size << " bits: " << size * frames * double(s.iterations()) / seconds / 1e9 << " Gbit/s" << std::endl;
+  s.set_result(interleaved[3]);
+}
+
+static void interleave_3k_operator(picobench::state &s) { interleave_frames(s, 32, 0); }
+PICOBENCH(interleave_3k_operator).iterations({1});
+
+static void interleave_3k_block(picobench::state &s) { interleave_frames(s, 32, 1); }
+PICOBENCH(interleave_3k_block).iterations({4});
+
+static void interleave_3k_permutation(picobench::state &s) { interleave_frames(s, 32, 3); }
+PICOBENCH(interleave_3k_permutation).iterations({4});
+
+static void interleave_30k_operator(picobench::state &s) { interleave_frames(s, 100, 0); }
+PICOBENCH(interleave_30k_operator).iterations({1});
+
+static void interleave_30k_block(picobench::state &s) { interleave_frames(s, 100, 1); }
+PICOBENCH(interleave_30k_block).iterations({4});
+
+static void deinterleave_30k_block(picobench::state &s) { interleave_frames(s, 100, 2); }
+PICOBENCH(deinterleave_30k_block).iterations({4});
+
+static void interleave_30k_permutation(picobench::state &s) { interleave_frames(s, 100, 3); }
+PICOBENCH(interleave_30k_permutation).iterations({4});
+
+static void interleave_300k_operator(picobench::state &s) { interleave_frames(s, 320, 0); }
+PICOBENCH(interleave_300k_operator).iterations({1});
+
+static void interleave_300k_block(picobench::state &s) { interleave_frames(s, 320, 1); }
+PICOBENCH(interleave_300k_block).iterations({4});
+
+static void interleave_300k_permutation(picobench::state &s) { interleave_frames(s, 320, 3); }
+PICOBENCH(interleave_300k_permutation).iterations({4});
+
+PICOBENCH_SUITE("Convolve 64 Mbit, taps at runtime vs fixed at compile time, K=7 and 19 taps");
+
+static void convolve_fixed(picobench::state &s, int method) {
+  BitArray input(size_t(1) << 26), output(input.size() + 18);
+  srand(13);
+  for (size_t i = 0; i < input.size() / 8; ++i)
+    input.data()[i] = uint8_t(rand());
+  BitArray k7("1111001"), taps("1011011101111011111");
+
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    if (method == 0)
+      BitArray::Convolve(k7, input, output);
+    else if (method == 1)
+      BitArray::Convolve<1, 1, 1, 1, 0, 0, 1>(input, output);
+    else if (method == 2)
+      BitArray::Convolve(taps, input, output);
+    else
+      BitArray::Convolve<1, 0, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1>(input, output);
+  }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  const char *names[] = {"runtime K=7", "fixed K=7", "runtime 19 taps", "fixed 19 taps"};
+  std::cout << names[method] << ": " << input.size() * double(s.iterations()) / seconds / 1e9 << " Gbit/s" << std::endl;
+  s.set_result(output.data()[output.size() / 16]);
+}
+
+static void convolve_k7_runtime(picobench::state &s) { convolve_fixed(s, 0); }
+PICOBENCH(convolve_k7_runtime);
+
+static void convolve_k7_fixed(picobench::state &s) { convolve_fixed(s, 1); }
+PICOBENCH(convolve_k7_fixed);
+
+static void convolve_19_runtime(picobench::state &s) { convolve_fixed(s, 2); }
+PICOBENCH(convolve_19_runtime);
+
+static void convolve_19_fixed(picobench::state &s) { convolve_fixed(s, 3); }
+PICOBENCH(convolve_19_fixed);
+
+PICOBENCH_SUITE("All pairs of 2048 x 2048 1024-bit fingerprints, DotProd per pair vs BitMatrix scores and top 10");
+
+static void score_fingerprints(picobench::state &s, int method) {
+  const size_t numRows = 2048, numBits = 1024;
+  std::vector<BitArray> fingerprints(numRows, BitArray(numBits));
+  srand(17);
+  for (BitArray &fingerprint : fingerprints)
+    for (size_t i = 0; i < numBits / 8; ++i)
+      fingerprint.data()[i] = uint8_t(rand());
+  BitMatrix matrix(fingerprints);
+  uint64_t check(0);
+
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    if (method == 0) {
+      for (size_t i = 0; i < numRows; ++i)
+        for (size_t j = 0; j < numRows; ++j)
+          check += BitArray::DotProd(fingerprints[i], fingerprints[j]);
+    } else if (method == 1) {
+      check += BitMatrix::Scores(matrix, matrix, BitMatrix::AND_POPCOUNT)[numRows + 1];
+    } else {
+      check += BitMatrix::TopK(matrix, matrix, BitMatrix::XOR_POPCOUNT, 10)[11].ref;
+    }
+  }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  const char *names[] = {"DotProd per pair", "BitMatrix Scores", "BitMatrix TopK"};
+  std::cout << names[method] << ": " << numRows * numRows * double(s.iterations()) / seconds / 1e6 << " Mpairs/s" << std::endl;
+  s.set_result(check);
+}
+
+static void score_dotprod_pairs(picobench::state &s) { score_fingerprints(s, 0); }
+PICOBENCH(score_dotprod_pairs).iterations({1});
+
+static void score_bitmatrix(picobench::state &s) { score_fingerprints(s, 1); }
+PICOBENCH(score_bitmatrix).iterations({1});
+
+static void score_bitmatrix_top10(picobench::state &s) { score_fingerprints(s, 2); }
+PICOBENCH(score_bitmatrix_top10).iterations({1});
+
+PICOBENCH_SUITE("GF(2) products with a 4096 x 8192 matrix, DotProd % 2 per row vs BitMatrix::Multiply both ways");
+
+static void gf2_multiply(picobench::state &s, int method) {
+  const size_t numRows = 4096, numCols = 8192;
+  BitMatrix h(numRows, numCols);
+  BitArray row(numCols), x(numCols), result(numCols);
+  srand(19);
+  for (size_t r = 0; r < numRows; ++r) {
+    for (size_t i = 0; i < numCols / 8; ++i)
+      row.data()[i] = uint8_t(rand());
+    h.SetRow(r, row);
+  }
+  for (size_t i = 0; i < numCols / 8; ++i)
+    x.data()[i] = uint8_t(rand());
+  uint64_t check(0);
+
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    if (method == 0) {
+      for (size_t r = 0; r < numRows; ++r)
+        result[r] = BitArray::DotProd(h.Row(r), x) % 2 == 1;
+    } else if (method == 1) {
+      BitMatrix::Multiply(h, x, result);
+    } else {
+      BitMatrix::Multiply(BitSpan(x.data(), 0, numRows), h, result);
+    }
+    check += result.data()[7];
+  }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  const char *names[] = {"DotProd % 2 per row", "BitMatrix m x", "BitMatrix x m"};
+  std::cout << names[method] << ": " << numRows * numCols * double(s.iterations()) / seconds / 1e9 << " Gbit/s" << std::endl;
+  s.set_result(check);
+}
+
+static void gf2_dotprod_rows(picobench::state &s) { gf2_multiply(s, 0); }
+PICOBENCH(gf2_dotprod_rows).iterations({16});
+
+static void gf2_matrix_vector(picobench::state &s) { gf2_multiply(s, 1); }
+PICOBENCH(gf2_matrix_vector).iterations({16});
+
+static void gf2_vector_matrix(picobench::state &s) { gf2_multiply(s, 2); }
+PICOBENCH(gf2_vector_matrix).iterations({16});
+
+PICOBENCH_SUITE("Set bits of 100 Mbit at 0.1% density, operator[] vs FindNext vs Positions");
+
+static void set_bits(picobench::state &s, int method) {
+  BitArray bits(size_t(100) << 20);
+  srand(23);
+  for (size_t i = 0; i < bits.size() / 1000; ++i)
+    bits[rand() % bits.size()] = true;
+  std::vector<uint32_t> positions;
+  uint64_t check(0);
+
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    if (method == 0) {
+      for (size_t i = 0; i < bits.size(); ++i)
+        if (bits[i])
+          check += i;
+    } else if (method == 1) {
+      for (size_t i = BitArray::FindFirst(bits); i < bits.size(); i = BitArray::FindNext(bits, i))
+        check += i;
+    } else {
+      BitArray::Positions(bits, positions);
+      check += positions.size();
+    }
+  }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  const char *names[] = {"operator[]", "FindNext", "Positions"};
+  std::cout << names[method] << ": " << bits.size() * double(s.iterations()) / seconds / 1e9 << " Gbit/s" << std::endl;
+  s.set_result(check);
+}
+
+static void set_bits_operator(picobench::state &s) { set_bits(s, 0); }
+PICOBENCH(set_bits_operator).iterations({1});
+
+static void set_bits_find_next(picobench::state &s) { set_bits(s, 1); }
+PICOBENCH(set_bits_find_next).iterations({4});
+
+static void set_bits_positions(picobench::state &s) { set_bits(s, 2); }
+PICOBENCH(set_bits_positions).iterations({4});
+
+PICOBENCH_SUITE("256 Mbit bitmaps at 0.1% density and in long runs, dense BitArray vs CompressedBitArray");
+
+static void compressed_bitmaps(picobench::state &s, int method) {
+  const size_t size = size_t(256) << 20;
+  BitArray sparse(size), runs(size);
+  srand(29);
+  for (size_t i = 0; i < size / 1000; ++i)
+    sparse[rand() % size] = true;
+  for (size_t i = rand() % 100000; i < size; i += 50000 + rand() % 100000)
+    for (size_t j = i; j < std::min(size, i + 1000 + rand() % 10000); ++j)
+      runs[j] = true;
+  CompressedBitArray a(sparse), b(runs);
+  BitArray dense(size);
+  CompressedBitArray compressed;
+  uint64_t check(0);
+
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    if (method == 0) {
+      dense = sparse & runs;
+      check += dense.data()[7];
+    } else if (method == 1) {
+      compressed = a & b;
+      check += compressed.size();
+    } else if (method == 2) {
+      check += BitArray::DotProd(sparse, runs);
+    } else {
+      check += CompressedBitArray::DotProd(a, b);
+    }
+  }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  const char *names[] = {"BitArray AND", "CompressedBitArray AND", "BitArray DotProd", "CompressedBitArray DotProd"};
+  size_t bytes = method % 2 ? a.Bytes() + b.Bytes() : 2 * (size / 8);
+  std::cout << names[method] << ": " << bytes / 1024 << " KB, " << size * double(s.iterations()) / seconds / 1e9 << " Gbit/s" << std::endl;
+  s.set_result(check);
+}
+
+static void compressed_dense_and(picobench::state &s) { compressed_bitmaps(s, 0); }
+PICOBENCH(compressed_dense_and).iterations({4});
+
+static void compressed_and(picobench::state &s) { compressed_bitmaps(s, 1); }
+PICOBENCH(compressed_and).iterations({4});
+
+static void compressed_dense_dotprod(picobench::state &s) { compressed_bitmaps(s, 2); }
+PICOBENCH(compressed_dense_dotprod).iterations({4});
+
+static void compressed_dotprod(picobench::state &s) { compressed_bitmaps(s, 3); }
+PICOBENCH(compressed_dotprod).iterations({4});
+
+PICOBENCH_SUITE("64 Mbit frames, '0'/'1' text parse vs BitRecord save and load to buffers and streams vs a zero-copy view");
+
+static void serialize(picobench::state &s, int method) {
+  const size_t size = size_t(64) << 20;
+  BitArray bits(size);
+  srand(31);
+  for (size_t i = 0; i < size / 8; ++i)
+    bits.data()[i] = uint8_t(rand());
+  std::string text(size, '0');
+  for (size_t i = 0; i < size; ++i)
+    text[i] += bits[i];
+  std::vector<uint8_t> buffer(BitRecord::Size(bits));
+  BitRecord::Save(bits, buffer.data());
+  std::stringstream stream;
+  uint64_t check(0);
+
+  auto t1 = high_resolution_clock::now();
+  for (auto _ : s) {
+    if (method == 0) {
+      check += BitArray(text).size();
+    } else if (method == 1) {
+      BitRecord::Save(bits, buffer.data());
+      check += BitRecord::Load(buffer.data(), buffer.size()).size();
+    } else if (method == 2) {
+      stream.seekp(0);
+      stream.seekg(0);
+      BitRecord::Save(stream, bits);
+      check += BitRecord::Load(stream).size();
+    } else {
+      check += BitRecord::View(buffer.data(), buffer.size()).size();
+    }
+  }
+  auto t2 = high_resolution_clock::now();
+  double seconds = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+  const char *names[] = {"text parse", "BitRecord buffer save and load", "BitRecord stream save and load", "BitRecord view"};
+  size_t bytes = method ? buffer.size() : text.size();
+  std::cout << names[method] << ": " << bytes / 1024 << " KB, " << size * double(s.iterations()) / seconds / 1e9 << " Gbit/s" << std::endl;
+  s.set_result(check);
+}
+
+static void serialize_text(picobench::state &s) { serialize(s, 0); }
+PICOBENCH(serialize_text).iterations({1});
+
+static void serialize_buffer(picobench::state &s) { serialize(s, 1); }
+PICOBENCH(serialize_buffer).iterations({4});
+
+static void serialize_stream(picobench::state &s) { serialize(s, 2); }
+PICOBENCH(serialize_stream).iterations({4});
+
+static void serialize_view(picobench::state &s) { serialize(s, 3); }
+PICOBENCH(serialize_view).iterations({4});
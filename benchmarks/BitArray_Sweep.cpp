@@ -0,0 +1,203 @@
+// Sweeps the kernels over inputs from L1 resident to DRAM sized and over their parameters, e.g. the
+// number of taps, and reports the time per call, Gbit/s and TSC cycles per bit as a table, and as
+// JSON or CSV for tracking across releases. CMake builds it once per BITARRAY_MAX_ISA tier as
+// runSweep_default, runSweep_sse2, runSweep_avx2 and runSweep_avx512 so that the tiers can be
+// compared on one machine, and --dispatch selects implementations within a program like BITARRAY_DISPATCH.
+//
+//   runSweep_avx2 [--kernel=convolve] [--max-bits=268435456] [--min-time=0.05] [--dispatch=SPEC] [--json=FILE] [--csv=FILE]
+#include "BitArray.hpp"
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <x86intrin.h>
+
+using namespace std::chrono;
+
+namespace {
+
+struct Options {
+  std::string kernel;
+  size_t maxBits = size_t(1) << 28;
+  double minTime = 0.05;
+  std::string dispatch, json, csv;
+};
+
+struct Result {
+  std::string kernel, param;
+  size_t bits;
+  double ns, gbps, cyclesPerBit;
+};
+
+const char *isaNames[] = {"default", "sse2", "avx2", "avx512"};
+
+// TSC ticks per nanosecond, the cycles reported are TSC cycles at the nominal frequency.
+double TscPerNs() {
+  auto t0 = steady_clock::now();
+  uint64_t c0 = __rdtsc();
+  while (steady_clock::now() - t0 < milliseconds(50))
+    ;
+  uint64_t c1 = __rdtsc();
+  return double(c1 - c0) / duration_cast<nanoseconds>(steady_clock::now() - t0).count();
+}
+
+// The best of three samples, each of enough calls to take minTime.
+Result Time(const std::string &kernel, const std::string &param, size_t bits, const std::function<void()> &call, const Options &options,
+            double tscPerNs) {
+  auto t0 = steady_clock::now();
+  call();
+  double first = duration_cast<nanoseconds>(steady_clock::now() - t0).count();
+  size_t calls = std::max(size_t(1), size_t(options.minTime * 1e9 / std::max(first, 1.0)));
+  double best = 1e300;
+  for (int sample = 0; sample < 3; ++sample) {
+    auto start = steady_clock::now();
+    for (size_t k = 0; k < calls; ++k)
+      call();
+    best = std::min(best, double(duration_cast<nanoseconds>(steady_clock::now() - start).count()) / calls);
+  }
+  Result result = {kernel, param, bits, best, bits / best, best * tscPerNs / bits};
+  return result;
+}
+
+bool Selected(const Options &options, const std::string &kernel) { return options.kernel.empty() || kernel.find(options.kernel) != std::string::npos; }
+
+void WriteJson(const std::string &path, const std::vector<Result> &results, double tscPerNs) {
+  std::ofstream out(path.c_str());
+  out << "{\n  \"isa\": \"" << isaNames[BITARRAY_MAX_ISA] << "\",\n  \"tsc_ghz\": " << tscPerNs << ",\n  \"cpu\": {";
+  const char *features[] = {"popcnt", "pclmul", "avx2", "bmi", "bmi2", "avx512f", "avx512bw", "avx512vpopcntdq"};
+  bool has[] = {bool(__builtin_cpu_supports("popcnt")), bool(__builtin_cpu_supports("pclmul")), bool(__builtin_cpu_supports("avx2")),
+                bool(__builtin_cpu_supports("bmi")), bool(__builtin_cpu_supports("bmi2")), bool(__builtin_cpu_supports("avx512f")),
+                bool(__builtin_cpu_supports("avx512bw")), bool(__builtin_cpu_supports("avx512vpopcntdq"))};
+  for (size_t i = 0; i < 8; ++i)
+    out << (i ? ", " : "") << "\"" << features[i] << "\": " << (has[i] ? "true" : "false");
+  out << "},\n  \"dispatch\": {";
+  std::vector<std::string> kernels = Dispatch::Kernels();
+  for (size_t i = 0; i < kernels.size(); ++i)
+    out << (i ? ", " : "") << "\"" << kernels[i] << "\": \"" << Dispatch::Selected(kernels[i]) << "\"";
+  out << "},\n  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result &r = results[i];
+    out << "    {\"kernel\": \"" << r.kernel << "\", \"param\": \"" << r.param << "\", \"bits\": " << r.bits << ", \"ns_per_call\": " << r.ns
+        << ", \"gbit_per_s\": " << r.gbps << ", \"cycles_per_bit\": " << r.cyclesPerBit << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+}
+
+void WriteCsv(const std::string &path, const std::vector<Result> &results) {
+  std::ofstream out(path.c_str());
+  out << "isa,kernel,param,bits,ns_per_call,gbit_per_s,cycles_per_bit\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result &r = results[i];
+    out << isaNames[BITARRAY_MAX_ISA] << "," << r.kernel << "," << r.param << "," << r.bits << "," << r.ns << "," << r.gbps << "," << r.cyclesPerBit << "\n";
+  }
+}
+
+BitArray RandomBits(size_t size) {
+  BitArray bits(size);
+  for (size_t i = 0; i < (size + 7) / 8; ++i)
+    bits.data()[i] = uint8_t(rand());
+  bits.Resize(size);
+  return bits;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i], value = arg.find('=') == std::string::npos ? "" : arg.substr(arg.find('=') + 1);
+    if (arg.compare(0, 9, "--kernel=") == 0)
+      options.kernel = value;
+    else if (arg.compare(0, 11, "--max-bits=") == 0)
+      options.maxBits = std::stoull(value);
+    else if (arg.compare(0, 11, "--min-time=") == 0)
+      options.minTime = std::stod(value);
+    else if (arg.compare(0, 11, "--dispatch=") == 0)
+      options.dispatch = value;
+    else if (arg.compare(0, 7, "--json=") == 0)
+      options.json = value;
+    else if (arg.compare(0, 6, "--csv=") == 0)
+      options.csv = value;
+    else {
+      std::cerr << "usage: " << argv[0] << " [--kernel=NAME] [--max-bits=N] [--min-time=SECONDS] [--dispatch=SPEC] [--json=FILE] [--csv=FILE]" << std::endl;
+      return 1;
+    }
+  }
+
+  try {
+    Dispatch::Configure(options.dispatch);
+  } catch (const std::runtime_error &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  double tscPerNs = TscPerNs();
+  std::cout << "BITARRAY_MAX_ISA " << isaNames[BITARRAY_MAX_ISA] << ", TSC " << std::setprecision(3) << tscPerNs << " GHz" << std::endl;
+  std::cout << std::left << std::setw(12) << "kernel" << std::setw(12) << "param" << std::right << std::setw(12) << "bits" << std::setw(14) << "ns/call"
+            << std::setw(10) << "Gbit/s" << std::setw(12) << "cycles/bit" << std::endl;
+
+  // From 2 KB, in L1, to 32 MB, in DRAM or a large L3.
+  std::vector<size_t> sizes;
+  for (size_t bits = size_t(1) << 14; bits <= options.maxBits; bits *= 8)
+    sizes.push_back(bits);
+  if (options.maxBits >= (size_t(1) << 28) && sizes.back() != (size_t(1) << 28))
+    sizes.push_back(size_t(1) << 28);
+
+  size_t maxBits = sizes.empty() ? 0 : sizes.back();
+  srand(1);
+  BitArray a = RandomBits(maxBits + 64), b = RandomBits(maxBits + 64), out(maxBits + 64);
+  std::vector<uint8_t> bytes(std::min(maxBits, size_t(1) << 25));
+  for (size_t i = 0; i < bytes.size(); ++i)
+    bytes[i] = rand() % 2;
+  Crc crc32 = Crc::Crc32();
+  Lfsr prbs(Lfsr::Prbs(31));
+  BitArray pattern = RandomBits(64), sparse(maxBits);
+  for (size_t i = 0; i < maxBits / 1000; ++i)
+    sparse[rand() % maxBits] = true;
+  std::vector<uint32_t> positions;
+
+  std::vector<Result> results;
+  auto run = [&](const std::string &kernel, const std::string &param, size_t bits, const std::function<void()> &call) {
+    if (!Selected(options, kernel))
+      return;
+    Result r = Time(kernel, param, bits, call, options, tscPerNs);
+    std::cout << std::left << std::setw(12) << r.kernel << std::setw(12) << r.param << std::right << std::setw(12) << r.bits << std::fixed
+              << std::setprecision(0) << std::setw(14) << r.ns << std::setprecision(2) << std::setw(10) << r.gbps << std::setprecision(3)
+              << std::setw(12) << r.cyclesPerBit << std::defaultfloat << std::endl;
+    results.push_back(r);
+  };
+
+  for (size_t n : sizes) {
+    BitSpan input(a.data(), 0, n);
+    for (size_t numTaps : {3, 7, 16, 32}) {
+      BitArray taps = RandomBits(numTaps);
+      run("convolve", std::to_string(numTaps) + " taps", n, [&] { BitArray::Convolve(taps, input, out, false); });
+    }
+    run("convolve", "7 fixed", n, [&] { BitArray::Convolve<1, 1, 1, 1, 0, 0, 1>(input, out, false); });
+    run("convolve", "19 fixed", n, [&] { BitArray::Convolve<1, 0, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1>(input, out, false); });
+    run("dotprod", "aligned", n, [&] { out[0] = BitArray::DotProd(a[0], b[0], n) & 1; });
+    run("dotprod", "offset", n, [&] { out[0] = BitArray::DotProd(a[3], b[17], n) & 1; });
+    run("search", "64 bits", n, [&] { out[0] = BitArray::Search(pattern, input, 4).size() & 1; });
+    run("crc32", "aligned", n, [&] { out[0] = crc32.Compute(input) & 1; });
+    run("prbs31", "generate", n, [&] { prbs.Generate(n, out); });
+    run("transpose", "1024 rows", n, [&] { BitArray::Transpose(input, 1024, n / 1024, out); });
+    run("copy", "offset", n, [&] { BitArray::Copy(BitSpan(a.data(), 13, n), out, 5); });
+    run("positions", "0.1%", n, [&] { BitArray::Positions(BitSpan(sparse.data(), 0, n), positions); });
+    run("findnext", "0.1%", n, [&] {
+      size_t count(0);
+      for (size_t i = BitArray::FindFirst(BitSpan(sparse.data(), 0, n)); i < n; i = BitArray::FindNext(BitSpan(sparse.data(), 0, n), i))
+        ++count;
+      out[0] = count & 1;
+    });
+    if (n <= bytes.size())
+      run("pack", "bytes", n, [&] { BitArray::PackBytes(bytes.data(), n, out); });
+  }
+
+  if (!options.json.empty())
+    WriteJson(options.json, results, tscPerNs);
+  if (!options.csv.empty())
+    WriteCsv(options.csv, results);
+  return 0;
+}
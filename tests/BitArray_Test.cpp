@@ -3,6 +3,7 @@
 #include "doctest.hpp"
 #include <chrono>
 #include <limits.h>
+#include <sstream>
 #include <stdlib.h>
 #include <vector>
 
@@ -42,6 +43,27 @@ TEST_CASE("Testing DotProd") {
   CHECK(my_value == expected_value);
 }
 
+TEST_CASE("Testing DotProd at every offset") {
+  size_t size(40000);
+  BitArray a(size), b(size);
+  srand(21);
+  for (size_t i = 0; i < size; ++i) {
+    a[i] = rand() % 2;
+    b[i] = rand() % 3 != 0;
+  }
+
+  bool ok = true;
+  for (size_t start_a = 0; start_a < 9; ++start_a)
+    for (size_t start_b : {0, 5, 64, 71})
+      for (size_t num : {0, 1, 63, 64, 65, 1000, 4096, 4097, 20000, 39000}) {
+        uint64_t expected_value(0);
+        for (size_t i = 0; i < num; ++i)
+          expected_value += a[i + start_a] && b[i + start_b];
+        ok &= BitArray::DotProd(a[start_a], b[start_b], num) == expected_value;
+      }
+  CHECK(ok);
+}
+
 TEST_CASE("Testing Correlate with flush") {
   BitArray taps("1011011101111011111");
   BitArray input(1024*1024+13);
@@ -142,3 +164,1802 @@ TEST_CASE("Testing Continuous Correlate") {
     CHECK(expectedOutput[partialInput1.size()+i] == actualOutput2[i]);
   }
 }
+
+// The original bit at a time shift register, used as the reference for the word parallel versions.
+static void ReferenceConvolve(BitArray &taps, BitArray &bits, BitArray &result, bool flush, std::vector<bool> &reg) {
+  size_t resultSize = flush ? (taps.size() + bits.size() - 1) : (bits.size());
+  for (size_t i = 0; i < resultSize; ++i) {
+    reg.erase(reg.begin());
+    reg.push_back(i < bits.size() ? bool(bits[i]) : false);
+    bool parity(false);
+    for (size_t j = 0; j < taps.size(); ++j)
+      parity ^= (taps[j] & reg[j]);
+    result[i] = parity;
+  }
+}
+
+static void ReferenceConvolve(BitArray &taps, BitArray &bits, BitArray &result, bool flush, uint32_t *pInitialFill) {
+  std::vector<bool> reg(taps.size());
+  for (size_t i = 0; i < taps.size(); ++i)
+    reg[i] = pInitialFill ? (*pInitialFill >> i) & 0x01 : 0;
+
+  ReferenceConvolve(taps, bits, result, flush, reg);
+
+  if (pInitialFill) {
+    *pInitialFill = 0;
+    for (size_t i = 0; i < taps.size(); ++i)
+      *pInitialFill |= uint32_t(reg[i]) << i;
+  }
+}
+
+TEST_CASE("Testing Convolve against the bit at a time reference") {
+  size_t sizes[] = {1, 5, 31, 32, 33, 63, 64, 65, 127, 128, 129, 1000, 4099};
+  srand(11);
+  for (size_t tapsSize = 1; tapsSize <= 32; ++tapsSize) {
+    BitArray taps(tapsSize);
+    for (size_t i = 0; i < taps.size(); ++i)
+      taps[i] = rand() % 2;
+    taps[0] = 1;
+
+    for (size_t size : sizes) {
+      BitArray input(size);
+      for (size_t i = 0; i < input.size(); ++i)
+        input[i] = rand() % 2;
+
+      for (int flush = 0; flush < 2; ++flush) {
+        size_t resultSize = flush ? (taps.size() + input.size() - 1) : (input.size());
+        // Extra bits past the end of the result are set and must be left alone.
+        BitArray expectedOutput(resultSize + 70), actualOutput(resultSize + 70);
+        for (size_t i = resultSize; i < actualOutput.size(); ++i) {
+          expectedOutput[i] = 1;
+          actualOutput[i] = 1;
+        }
+
+        uint32_t expectedFill(rand()), actualFill(expectedFill);
+        ReferenceConvolve(taps, input, expectedOutput, flush, &expectedFill);
+        BitArray::Convolve(taps, input, actualOutput, flush, &actualFill);
+
+        size_t errorCounter(0);
+        for (size_t i = 0; i < expectedOutput.size(); ++i)
+          errorCounter += (expectedOutput[i] != actualOutput[i]);
+        CHECK(errorCounter == 0);
+        CHECK(expectedFill == actualFill);
+      }
+    }
+  }
+}
+
+TEST_CASE("Testing Convolve errors") {
+  BitArray taps("101"), input(100), result(101);
+  CHECK_THROWS(BitArray::Convolve(taps, input, result));
+  CHECK_NOTHROW(BitArray::Convolve(taps, input, result, false));
+
+  BitArray longTaps("1111111111 1111111111 1111111111 111"), fill(32);
+  uint32_t state(0);
+  CHECK_THROWS(BitArray::Convolve(longTaps, input, result, false, &state));
+  CHECK_THROWS(BitArray::Convolve(longTaps, input, result, false, fill));
+  CHECK_NOTHROW(BitArray::Convolve(longTaps, input, result, false));
+}
+
+TEST_CASE("Testing Convolve with long taps") {
+  size_t tapsSizes[] = {33, 40, 63, 64, 65, 100, 127, 128, 129, 200, 333};
+  size_t sizes[] = {1, 17, 64, 65, 130, 200, 1000, 4099};
+  srand(12);
+  for (size_t tapsSize : tapsSizes) {
+    BitArray taps(tapsSize);
+    for (size_t i = 0; i < taps.size(); ++i)
+      taps[i] = rand() % 2;
+
+    for (size_t size : sizes) {
+      BitArray input(size);
+      for (size_t i = 0; i < input.size(); ++i)
+        input[i] = rand() % 2;
+
+      for (int flush = 0; flush < 2; ++flush) {
+        size_t resultSize = flush ? (taps.size() + input.size() - 1) : (input.size());
+        BitArray expectedOutput(resultSize + 70), actualOutput(resultSize + 70);
+        for (size_t i = resultSize; i < actualOutput.size(); ++i) {
+          expectedOutput[i] = 1;
+          actualOutput[i] = 1;
+        }
+
+        // Extra fill bits past the taps must be left alone too.
+        std::vector<bool> expectedFill(taps.size());
+        BitArray actualFill(taps.size() + 3);
+        for (size_t i = 0; i < actualFill.size(); ++i) {
+          actualFill[i] = rand() % 2;
+          if (i < taps.size())
+            expectedFill[i] = actualFill[i];
+        }
+        bool extraFill = actualFill[taps.size()];
+
+        ReferenceConvolve(taps, input, expectedOutput, flush, expectedFill);
+        BitArray::Convolve(taps, input, actualOutput, flush, actualFill);
+
+        size_t errorCounter(0);
+        for (size_t i = 0; i < expectedOutput.size(); ++i)
+          errorCounter += (expectedOutput[i] != actualOutput[i]);
+        for (size_t i = 0; i < taps.size(); ++i)
+          errorCounter += (expectedFill[i] != actualFill[i]);
+        CHECK(errorCounter == 0);
+        CHECK(actualFill[taps.size()] == extraFill);
+      }
+    }
+  }
+}
+
+TEST_CASE("Testing Continuous Convolve with long taps") {
+  BitArray taps(150);
+  BitArray continuousInput(10000);
+  srand(13);
+  for (size_t i = 0; i < taps.size(); ++i)
+    taps[i] = rand() % 2;
+  for (size_t i = 0; i < continuousInput.size(); ++i)
+    continuousInput[i] = rand() % 2;
+
+  BitArray expectedOutput(taps.size() + continuousInput.size() - 1);
+  BitArray::Convolve(taps, continuousInput, expectedOutput);
+
+  // Uneven chunks, some shorter than the taps.
+  BitArray fill(taps.size());
+  size_t chunks[] = {100, 3000, 1, 77, 6822};
+  size_t offset(0);
+  for (size_t c = 0; c < 5; ++c) {
+    bool flush = (c == 4);
+    BitArray chunk(chunks[c]);
+    for (size_t i = 0; i < chunk.size(); ++i)
+      chunk[i] = continuousInput[offset + i];
+    BitArray output(chunk.size() + (flush ? taps.size() - 1 : 0));
+    BitArray::Convolve(taps, chunk, output, flush, fill);
+
+    size_t errorCounter(0);
+    for (size_t i = 0; i < output.size(); ++i)
+      errorCounter += (expectedOutput[offset + i] != output[i]);
+    CHECK(errorCounter == 0);
+    offset += chunk.size();
+  }
+}
+
+TEST_CASE("Testing Encode against Convolve") {
+  size_t tapsSizes[] = {3, 7, 9, 64, 70};
+  size_t sizes[] = {1, 50, 64, 1000, 4099, 10000};
+  srand(14);
+  for (size_t tapsSize : tapsSizes)
+    for (size_t numStreams = 1; numStreams <= 3; ++numStreams)
+      for (size_t size : sizes)
+        for (int flush = 0; flush < 2; ++flush) {
+          std::vector<BitArray> taps(numStreams, BitArray(tapsSize));
+          for (size_t j = 0; j < numStreams; ++j)
+            for (size_t i = 0; i < tapsSize; ++i)
+              taps[j][i] = rand() % 2;
+
+          BitArray input(size);
+          for (size_t i = 0; i < input.size(); ++i)
+            input[i] = rand() % 2;
+
+          BitArray startFill(tapsSize);
+          for (size_t i = 0; i < startFill.size(); ++i)
+            startFill[i] = rand() % 2;
+
+          size_t resultSize = flush ? (tapsSize + size - 1) : size;
+          std::vector<BitArray> expected(numStreams, BitArray(resultSize)), actual(numStreams, BitArray(resultSize));
+          BitArray expectedFill(startFill);
+          for (size_t j = 0; j < numStreams; ++j) {
+            expectedFill = startFill;
+            BitArray::Convolve(taps[j], input, expected[j], flush, expectedFill);
+          }
+
+          BitArray actualFill(startFill);
+          BitArray::Encode(taps, input, actual, flush, &actualFill);
+
+          BitArray interleaved(BitArray::EncodedSize(taps, size, flush));
+          BitArray interleavedFill(startFill);
+          CHECK(BitArray::Encode(taps, input, interleaved, flush, &interleavedFill) == resultSize * numStreams);
+
+          size_t errorCounter(0);
+          for (size_t j = 0; j < numStreams; ++j)
+            for (size_t i = 0; i < resultSize; ++i) {
+              errorCounter += (expected[j][i] != actual[j][i]);
+              errorCounter += (expected[j][i] != interleaved[i * numStreams + j]);
+            }
+          for (size_t i = 0; i < tapsSize; ++i)
+            errorCounter += (expectedFill[i] != actualFill[i]) + (expectedFill[i] != interleavedFill[i]);
+          CHECK(errorCounter == 0);
+        }
+}
+
+TEST_CASE("Testing punctured Encode") {
+  // K=7 generators 171 and 133 octal with the rate 2/3 and 3/4 patterns, and a rate 1/3 code punctured to 1/2.
+  std::vector<BitArray> rateHalf = {BitArray("1111001"), BitArray("1011011")};
+  std::vector<BitArray> rateThird = {BitArray("1111001"), BitArray("1011011"), BitArray("1110101")};
+  std::vector<std::vector<BitArray> > tapsSets = {rateHalf, rateHalf, rateThird};
+  std::vector<std::vector<BitArray> > punctures = {{BitArray("11"), BitArray("10")}, {BitArray("110"), BitArray("101")}, {BitArray("11"), BitArray("10"), BitArray("01")}};
+
+  srand(15);
+  for (size_t c = 0; c < tapsSets.size(); ++c)
+    for (size_t size : {1, 2, 3, 100, 1000, 9999}) {
+      std::vector<BitArray> &taps = tapsSets[c], &puncture = punctures[c];
+      BitArray input(size);
+      for (size_t i = 0; i < input.size(); ++i)
+        input[i] = rand() % 2;
+
+      size_t resultSize = taps[0].size() + size - 1;
+      std::vector<BitArray> streams(taps.size(), BitArray(resultSize));
+      BitArray::Encode(taps, input, streams);
+
+      std::vector<bool> expected;
+      for (size_t i = 0; i < resultSize; ++i)
+        for (size_t j = 0; j < taps.size(); ++j)
+          if (puncture[j][i % puncture[j].size()])
+            expected.push_back(streams[j][i]);
+
+      // Bits past the encoded ones must be left alone.
+      BitArray actual(expected.size() + 65);
+      for (size_t i = expected.size(); i < actual.size(); ++i)
+        actual[i] = 1;
+      CHECK(BitArray::EncodedSize(taps, size, true, puncture) == expected.size());
+      CHECK(BitArray::Encode(taps, input, actual, true, NULL, puncture) == expected.size());
+
+      size_t errorCounter(0);
+      for (size_t i = 0; i < actual.size(); ++i)
+        errorCounter += (i < expected.size() ? expected[i] : true) != actual[i];
+      CHECK(errorCounter == 0);
+    }
+}
+
+TEST_CASE("Testing Encode errors") {
+  std::vector<BitArray> taps = {BitArray("1111001"), BitArray("101101")};
+  BitArray input(100), result(1000);
+  std::vector<BitArray> results(2, BitArray(1000));
+  CHECK_THROWS(BitArray::Encode(taps, input, result));
+  CHECK_THROWS(BitArray::Encode(std::vector<BitArray>(), input, result));
+
+  taps[1] = BitArray("1011011");
+  CHECK_THROWS(BitArray::Encode(taps, input, results[0], true, NULL, {BitArray("11")}));
+  CHECK_THROWS(BitArray::Encode(taps, input, results[0], true, NULL, {BitArray("11"), BitArray("1")}));
+  CHECK_THROWS(BitArray::Encode(taps, BitArray(600), result));
+  results.pop_back();
+  CHECK_THROWS(BitArray::Encode(taps, input, results));
+}
+
+TEST_CASE("Testing Decode recovers Encode") {
+  std::vector<std::vector<BitArray> > codes = {{BitArray("111"), BitArray("101")},
+                                               {BitArray("1111001"), BitArray("1011011")},
+                                               {BitArray("101110001"), BitArray("110110011"), BitArray("111001001")},
+                                               {BitArray("1011011101111011"), BitArray("1100101000110111")}};
+  srand(16);
+  for (size_t c = 0; c < codes.size(); ++c)
+    for (size_t size : {1, 40, 1000, 5000})
+      for (int flush = 0; flush < 2; ++flush)
+        for (size_t tracebackLength : {size_t(0), size_t(5 * codes[c][0].size()), size_t(64)}) {
+          std::vector<BitArray> &taps = codes[c];
+          BitArray input(size);
+          for (size_t i = 0; i < input.size(); ++i)
+            input[i] = rand() % 2;
+
+          BitArray encoded(BitArray::EncodedSize(taps, size, flush));
+          BitArray::Encode(taps, input, encoded, flush);
+          CHECK(BitArray::DecodedSize(taps, encoded.size(), flush) == size);
+
+          // A few well spaced errors are corrected.
+          if (flush)
+            for (size_t i = 7; i < encoded.size(); i += 97)
+              encoded[i] = !encoded[i];
+
+          BitArray decoded(size + 9);
+          for (size_t i = size; i < decoded.size(); ++i)
+            decoded[i] = 1;
+          BitArray::Decode(taps, encoded, decoded, flush, tracebackLength);
+
+          size_t errorCounter(0);
+          for (size_t i = 0; i < decoded.size(); ++i)
+            errorCounter += (i < size ? input[i] : true) != decoded[i];
+          CHECK(errorCounter == 0);
+        }
+}
+
+TEST_CASE("Testing Decode with soft symbols") {
+  std::vector<BitArray> taps = {BitArray("1111001"), BitArray("1011011")};
+  BitArray input(20000);
+  srand(17);
+  for (size_t i = 0; i < input.size(); ++i)
+    input[i] = rand() % 2;
+
+  // Rate 3/4, the punctured bits are erasures.
+  std::vector<BitArray> puncture = {BitArray("110"), BitArray("101")};
+  BitArray encoded(BitArray::EncodedSize(taps, input.size(), true, puncture));
+  BitArray::Encode(taps, input, encoded, true, NULL, puncture);
+
+  std::vector<int8_t> symbols;
+  size_t e(0), flips(0);
+  for (size_t i = 0; i < input.size() + taps[0].size() - 1; ++i)
+    for (size_t j = 0; j < taps.size(); ++j) {
+      if (!puncture[j][i % 3]) {
+        symbols.push_back(0);
+        continue;
+      }
+      // Noisy symbols, with an occasional confident wrong one.
+      int noise = rand() % 60 - 30;
+      int value = (encoded[e++] ? 70 : -70) + noise;
+      if (rand() % 500 == 0) {
+        value = -value;
+        ++flips;
+      }
+      symbols.push_back(int8_t(value));
+    }
+  CHECK(flips > 0);
+
+  BitArray decoded(input.size());
+  BitArray::Decode(taps, symbols.data(), symbols.size(), decoded, true, 35);
+
+  size_t errorCounter(0);
+  for (size_t i = 0; i < input.size(); ++i)
+    errorCounter += input[i] != decoded[i];
+  CHECK(errorCounter == 0);
+}
+
+TEST_CASE("Testing Decode errors") {
+  std::vector<BitArray> taps = {BitArray("1111001"), BitArray("1011011")};
+  BitArray encoded(200), decoded(100);
+  CHECK_THROWS(BitArray::Decode(taps, BitArray(201), decoded));
+  CHECK_THROWS(BitArray::Decode(taps, BitArray(300), decoded, false));
+  CHECK_THROWS(BitArray::Decode(std::vector<BitArray>(5, BitArray("111")), BitArray(500), decoded));
+  CHECK_THROWS(BitArray::Decode({BitArray("1")}, encoded, decoded));
+  CHECK_NOTHROW(BitArray::Decode(taps, encoded, decoded, false));
+}
+
+static BitArray RandomBits(size_t size) {
+  BitArray bits(size);
+  for (size_t i = 0; i < bits.size(); ++i)
+    bits[i] = rand() % 2;
+  return bits;
+}
+
+// The padding past the last bit must stay zero for the word at a time code to work.
+static bool PaddingIsZero(const BitArray &bits) {
+  for (size_t i = bits.size(); i < ((bits.size() + 7) / 8 + 7) * 8; ++i)
+    if ((bits.data()[i / 8] >> (i % 8)) & 1)
+      return false;
+  return true;
+}
+
+TEST_CASE("Testing bitwise operators") {
+  srand(17);
+  for (size_t size : {1, 63, 64, 65, 1000, 16384, 40000 + 37}) {
+    const BitArray a = RandomBits(size), b = RandomBits(size), c = RandomBits(size);
+
+    BitArray result = a & b;
+    bool ok = result.size() == size;
+    for (size_t i = 0; i < size; ++i)
+      ok &= result[i] == (a[i] && b[i]);
+    CHECK(ok);
+
+    result = a | b;
+    for (size_t i = 0; i < size; ++i)
+      ok &= result[i] == (a[i] || b[i]);
+    CHECK(ok);
+
+    result = ~a;
+    for (size_t i = 0; i < size; ++i)
+      ok &= result[i] == !a[i];
+    CHECK(ok);
+    CHECK(PaddingIsZero(result));
+
+    result = a ^ (b & ~c);
+    for (size_t i = 0; i < size; ++i)
+      ok &= result[i] == (a[i] != (b[i] && !c[i]));
+    CHECK(ok);
+
+    result = a;
+    result ^= b;
+    result |= a & c;
+    result &= ~(b ^ c);
+    for (size_t i = 0; i < size; ++i)
+      ok &= result[i] == (((a[i] != b[i]) || (a[i] && c[i])) && b[i] == c[i]);
+    CHECK(ok);
+    CHECK(PaddingIsZero(result));
+
+    for (size_t n : {size_t(0), size_t(1), size_t(63), size_t(64), size_t(65), size_t(999), size, size + 10}) {
+      result = a << n;
+      BitArray right = a >> n, inPlace = a;
+      inPlace <<= n;
+      for (size_t i = 0; i < size; ++i)
+        ok &= result[i] == (i >= n && a[i - n]) && right[i] == (i + n < size && a[i + n]) && inPlace[i] == result[i];
+      inPlace = a;
+      inPlace >>= n;
+      for (size_t i = 0; i < size; ++i)
+        ok &= inPlace[i] == right[i];
+      CHECK(ok);
+
+      result = (a ^ b) << n | ~(c >> n);
+      for (size_t i = 0; i < size; ++i)
+        ok &= result[i] == ((i >= n && a[i - n] != b[i - n]) || !(i + n < size && c[i + n]));
+      CHECK(ok);
+      CHECK(PaddingIsZero(result));
+    }
+  }
+}
+
+TEST_CASE("Testing bitwise operators on ranges") {
+  srand(18);
+  BitArray a = RandomBits(20000), b = RandomBits(20000);
+  for (size_t len : {1, 7, 64, 100, 5000})
+    for (size_t startA : {0, 3, 64, 71})
+      for (size_t startB : {0, 5, 13, 130}) {
+        BitArray expected = a;
+        for (size_t i = 0; i < len; ++i)
+          expected[startA + i] = a[startA + i] != (b[startB + i] && !a[startB + i + 1]);
+        BitArray result = a;
+        BitArray::Assign(result[startA], BitArray::Range(result[startA], len) ^ (BitArray::Range(b[startB], len) & ~BitArray::Range(result[startB + 1], len)));
+        bool ok = result.size() == a.size();
+        for (size_t i = 0; i < a.size(); ++i)
+          ok &= result[i] == expected[i];
+        CHECK(ok);
+        CHECK(PaddingIsZero(result));
+
+        BitArray slice = BitArray::Range(a[startB], len) << 3;
+        ok = slice.size() == len;
+        for (size_t i = 0; i < len; ++i)
+          ok &= slice[i] == (i >= 3 && a[startB + i - 3]);
+        CHECK(ok);
+      }
+}
+
+TEST_CASE("Testing bitwise operator errors") {
+  BitArray a(100), b(101);
+  CHECK_THROWS(a & b);
+  CHECK_THROWS(a ^= b);
+  CHECK_THROWS(a | BitArray::Range(b[1], 99));
+  CHECK_NOTHROW(a |= BitArray::Range(b[1], 100));
+  BitArray empty = BitArray() ^ BitArray();
+  CHECK(empty.size() == 0);
+}
+
+TEST_CASE("Testing RankSelect against counting") {
+  srand(19);
+  for (size_t size : {0, 1, 64, 2048, 3 * 65536 + 77})
+    for (int density : {0, 1, 50, 1000}) {
+      // density is the chance of a bit being set per 1000, 1000 sets all of them.
+      BitArray bits(size);
+      for (size_t i = 0; i < size; ++i)
+        bits[i] = density == 1000 || rand() % 1000 < density;
+      RankSelect index(bits);
+
+      bool ok = true;
+      size_t rank(0);
+      std::vector<size_t> positions;
+      for (size_t i = 0; i < size; ++i) {
+        ok &= index.Rank(i) == rank;
+        if (bits[i]) {
+          positions.push_back(i);
+          ++rank;
+        }
+      }
+      ok &= index.Rank(size) == rank && index.Count() == rank;
+      for (size_t k = 0; k < positions.size(); ++k)
+        ok &= index.Select(k) == positions[k];
+      ok &= index.Select(positions.size()) == size;
+      CHECK(ok);
+    }
+}
+
+TEST_CASE("Testing RankSelect Update and Rebuild") {
+  srand(20);
+  BitArray bits = RandomBits(5 * 65536 + 1000);
+  RankSelect index(bits);
+  for (int round = 0; round < 20; ++round) {
+    size_t begin = rand() % bits.size(), end = std::min(bits.size(), begin + rand() % 100000);
+    for (size_t i = begin; i < end; ++i)
+      bits[i] = rand() % 3 == 0;
+    index.Update(begin, end);
+
+    RankSelect fresh(bits);
+    bool ok = index.Count() == fresh.Count();
+    for (size_t i = 0; i <= bits.size(); i += 97)
+      ok &= index.Rank(i) == fresh.Rank(i);
+    for (size_t k = 0; k < fresh.Count(); k += 31)
+      ok &= index.Select(k) == fresh.Select(k);
+    CHECK(ok);
+  }
+
+  bits = RandomBits(70000);
+  CHECK_THROWS(index.Update(0, 10));
+  index.Rebuild();
+  CHECK(index.Rank(70000) == RankSelect(bits).Count());
+  CHECK_THROWS(index.Update(10, 70001));
+}
+
+TEST_CASE("Testing Correlate and Search against counting") {
+  srand(22);
+  BitArray bits = RandomBits(30000);
+  for (size_t patternSize : {1, 13, 64, 100, 256, 300}) {
+    BitArray pattern = RandomBits(patternSize);
+    // Plant the pattern a few times, once with a bit flipped.
+    for (size_t at : {size_t(5), size_t(7777), size_t(30000 - patternSize)})
+      for (size_t i = 0; i < patternSize; ++i)
+        bits[at + i] = pattern[i];
+    bits[7777 + patternSize / 2] = !pattern[patternSize / 2];
+
+    std::vector<uint16_t> agreements;
+    BitArray::Correlate(pattern, bits, agreements);
+    bool ok = agreements.size() == bits.size() - patternSize + 1;
+    std::vector<size_t> expectedMatches;
+    size_t maxDistance = patternSize / 8;
+    for (size_t offset = 0; offset < agreements.size(); ++offset) {
+      size_t agree(0);
+      for (size_t i = 0; i < patternSize; ++i)
+        agree += bits[offset + i] == pattern[i];
+      ok &= agreements[offset] == agree;
+      if (patternSize - agree <= maxDistance)
+        expectedMatches.push_back(offset);
+    }
+    CHECK(ok);
+    CHECK(BitArray::Search(pattern, bits, maxDistance) == expectedMatches);
+    CHECK(agreements[5] == patternSize);
+    CHECK(agreements[7777] == patternSize - 1);
+    CHECK(agreements.back() == patternSize);
+  }
+
+  std::vector<uint16_t> agreements(10);
+  BitArray::Correlate(BitArray(100), BitArray(99), agreements);
+  CHECK(agreements.empty());
+  CHECK(BitArray::Search(BitArray(5), BitArray(5), 0) == std::vector<size_t>(1, 0));
+  CHECK_THROWS(BitArray::Search(BitArray(), bits, 0));
+  CHECK_THROWS(BitArray::Correlate(BitArray(65536), BitArray(70000), agreements));
+}
+
+// A span over a buffer at a bit offset holding a copy of bits, the bytes around it are not zero.
+static BitSpan SpanCopy(std::vector<uint8_t> &buffer, size_t offset, const BitArray &bits) {
+  buffer.assign(offset / 8 + (bits.size() + 7) / 8 + 8, 0xA5);
+  for (size_t i = 0; i < bits.size(); ++i) {
+    size_t b = offset + i;
+    buffer[b / 8] = (buffer[b / 8] & ~(1 << (b % 8))) | (bits[i] << (b % 8));
+  }
+  return BitSpan(buffer.data(), offset, bits.size());
+}
+
+static bool SameBits(const BitArray &a, const BitArray &b) {
+  bool same = a.size() == b.size();
+  for (size_t i = 0; same && i < a.size(); ++i)
+    same = a[i] == b[i];
+  return same;
+}
+
+// Convolve with the taps as template arguments against the same taps in a BitArray, in place and at
+// a bit offset, with every implementation.
+template <int... Taps> static bool CheckFixedConvolve() {
+  BitArray taps(sizeof...(Taps));
+  const int bits[] = {Taps...};
+  for (size_t i = 0; i < taps.size(); ++i)
+    taps[i] = bits[i];
+
+  bool ok(true);
+  for (const std::string &implementation : Dispatch::Implementations("fixedconvolve")) {
+    Dispatch::Select("fixedconvolve", implementation);
+    for (size_t size : {1, 63, 64, 65, 130, 1000, 4099})
+      for (size_t offset : {0, 3})
+        for (int flush = 0; flush < 2; ++flush) {
+          BitArray buffer(size + offset);
+          for (size_t i = 0; i < buffer.size(); ++i)
+            buffer[i] = rand() % 2;
+          BitSpan input(buffer.data(), offset, size);
+          size_t resultSize = flush ? (taps.size() + size - 1) : size;
+          BitArray expected(resultSize + 70), actual(resultSize + 70);
+          for (size_t i = resultSize; i < actual.size(); ++i) {
+            expected[i] = 1;
+            actual[i] = 1;
+          }
+          uint32_t expectedFill(rand()), actualFill(expectedFill);
+          BitArray::Convolve(taps, input, expected, flush, taps.size() <= 32 ? &expectedFill : NULL);
+          BitArray::Convolve<Taps...>(input, actual, flush, taps.size() <= 32 ? &actualFill : NULL);
+          for (size_t i = 0; i < expected.size(); ++i)
+            ok &= expected[i] == actual[i];
+          ok &= expectedFill == actualFill;
+        }
+  }
+  Dispatch::Select("fixedconvolve", "auto");
+  return ok;
+}
+
+TEST_CASE("Testing Convolve with fixed taps") {
+  srand(61);
+  CHECK(CheckFixedConvolve<1>());
+  CHECK(CheckFixedConvolve<0, 1>());
+  CHECK(CheckFixedConvolve<1, 1, 1, 1, 0, 0, 1>());
+  CHECK(CheckFixedConvolve<1, 0, 1, 1, 0, 1, 1>());
+  CHECK(CheckFixedConvolve<1, 0, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1>());
+  CHECK(CheckFixedConvolve<1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1>());
+  CHECK(CheckFixedConvolve<1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+                           1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1>());
+
+  BitArray input(100), result(101);
+  uint32_t fill(0);
+  CHECK_THROWS(BitArray::Convolve<1, 0, 1>(input, result));
+  CHECK_NOTHROW(BitArray::Convolve<1, 0, 1>(input, result, false));
+  CHECK_THROWS((BitArray::Convolve<1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1>(input, result, false, &fill)));
+}
+
+TEST_CASE("Testing FixedBitArray") {
+  FixedBitArray<19> taps("1011011101111011111");
+  BitArray expected("1011011101111011111");
+  CHECK(taps.size() == 19);
+  CHECK(uintptr_t(taps.data()) % 8 == 0);
+  for (size_t i = 0; i < 19; ++i)
+    CHECK(taps[i] == expected[i]);
+  for (size_t i = 19; i < 8 * (sizeof(taps) - 1); ++i)
+    CHECK(((taps.data()[i / 8] >> (i % 8)) & 1) == 0);
+
+  FixedBitArray<200> bits;
+  BitArray copy(200);
+  for (size_t i = 0; i < 200; ++i)
+    CHECK(bits[i] == 0);
+  for (size_t i = 0; i < 200; i += 3) {
+    bits[i] = 1;
+    copy[i] = 1;
+  }
+  CHECK(BitArray::DotProd(BitSpan(bits), copy) == 67);
+  CHECK(SameBits(BitArray(BitExpr(BitSpan(bits))), copy));
+
+  BitArray input = RandomBits(1000), result(1018), expectedResult(1018);
+  BitArray::Convolve(expected, input, expectedResult);
+  BitArray::Convolve(BitArray(BitExpr(BitSpan(taps))), input, result);
+  CHECK(SameBits(result, expectedResult));
+
+  CHECK_THROWS(FixedBitArray<3>("1011"));
+  CHECK_THROWS(FixedBitArray<3>("10"));
+  CHECK_NOTHROW(FixedBitArray<3>("1 0 1"));
+}
+
+TEST_CASE("Testing kernels on a BitSpan") {
+  srand(23);
+  CHECK(uintptr_t(BitArray(1).data()) % 64 == 0);
+  CHECK(uintptr_t(BitArray(100000).data()) % 64 == 0);
+
+  std::vector<BitArray> generators = {BitArray("1011011"), BitArray("1111001")};
+  for (size_t size : {1, 63, 64, 1000, 20000})
+    for (size_t offset : {0, 1, 7, 8, 13, 64, 99}) {
+      BitArray bits = RandomBits(size), other = RandomBits(size);
+      std::vector<uint8_t> buffer;
+      BitSpan span = SpanCopy(buffer, offset, bits);
+      CHECK(span.size() == size);
+      CHECK(span.offset() == offset % 8);
+      bool ok(true);
+      for (size_t i = 0; i < size; ++i)
+        ok &= span[i] == bits[i];
+      CHECK(ok);
+
+      for (size_t numTaps : {7, 100, 200}) {
+        BitArray taps = RandomBits(numTaps), fill = RandomBits(numTaps), spanFill(fill);
+        BitArray expected(size + numTaps - 1), result(size + numTaps - 1);
+        BitArray::Convolve(taps, bits, expected, true, fill);
+        BitArray::Convolve(taps, span, result, true, spanFill);
+        CHECK(SameBits(result, expected));
+        CHECK(SameBits(spanFill, fill));
+      }
+
+      BitArray expected(BitArray::EncodedSize(generators, size)), result(expected.size());
+      BitArray::Encode(generators, bits, expected);
+      BitArray::Encode(generators, span, result);
+      CHECK(SameBits(result, expected));
+
+      std::vector<uint8_t> encodedBuffer;
+      BitArray decoded(size), spanDecoded(size);
+      BitArray::Decode(generators, expected, decoded);
+      BitArray::Decode(generators, SpanCopy(encodedBuffer, offset, expected), spanDecoded);
+      CHECK(SameBits(spanDecoded, bits));
+
+      BitArray pattern = RandomBits(std::min(size, size_t(100)));
+      std::vector<uint16_t> agreements, spanAgreements;
+      BitArray::Correlate(pattern, bits, agreements);
+      BitArray::Correlate(pattern, span, spanAgreements);
+      CHECK(spanAgreements == agreements);
+      CHECK(BitArray::Search(pattern, span, pattern.size() / 4) == BitArray::Search(pattern, bits, pattern.size() / 4));
+
+      CHECK(BitArray::DotProd(span, other) == BitArray::DotProd(bits[0], other[0], size));
+      CHECK(BitArray::DotProd(BitSpan(bits[size / 2], size - size / 2), BitSpan(buffer.data(), offset, size - size / 2)) ==
+            BitArray::DotProd(bits[size / 2], bits[0], size - size / 2));
+      BitArray combined = span ^ other;
+      CHECK(SameBits(combined, bits ^ other));
+      CHECK(PaddingIsZero(combined));
+    }
+
+  CHECK_THROWS(BitArray::DotProd(BitArray(5), BitArray(6)));
+}
+
+TEST_CASE("Testing MappedBitArray") {
+  srand(24);
+  const char *path = "BitArray_Test.bits";
+  for (size_t size : {0, 1, 64, 1000, 100000}) {
+    BitArray bits = RandomBits(size);
+    MappedBitArray::Save(path, bits);
+    {
+      MappedBitArray mapped(path, MappedBitArray::READ_ONLY, MappedBitArray::SEQUENTIAL);
+      CHECK(mapped.size() == size);
+      CHECK(uintptr_t(mapped.data()) % 64 == 0);
+      CHECK(SameBits(BitExpr(mapped), bits));
+      mapped.Advise(MappedBitArray::WILLNEED, size / 2, size);
+
+      BitArray taps = RandomBits(13), expected(size + 12), result(size + 12);
+      BitArray::Convolve(taps, bits, expected);
+      BitArray::Convolve(taps, mapped, result);
+      CHECK(SameBits(result, expected));
+      CHECK(BitArray::DotProd(mapped, bits) == BitArray::DotProd(bits, bits));
+    }
+
+    // Saving a span at a bit offset.
+    std::vector<uint8_t> buffer;
+    MappedBitArray::Save(path, SpanCopy(buffer, 5, bits));
+    if (size) {
+      MappedBitArray mapped(path, MappedBitArray::COPY_ON_WRITE);
+      CHECK(SameBits(BitExpr(mapped), bits));
+      mapped[size - 1] = !bits[size - 1];
+      CHECK(mapped[size - 1] != bits[size - 1]);
+      MappedBitArray reopened(path);
+      CHECK(SameBits(BitExpr(reopened), bits));
+    }
+  }
+
+  FILE *file = fopen(path, "wb");
+  fputs("NOTABITARRAY, just some text long enough to hold the header and more...........", file);
+  fclose(file);
+  CHECK_THROWS(MappedBitArray(path, MappedBitArray::READ_ONLY));
+  MappedBitArray::Save(path, RandomBits(1000));
+  CHECK_NOTHROW(MappedBitArray(path, MappedBitArray::READ_ONLY));
+  CHECK(truncate(path, 64 + 125) == 0);
+  CHECK_THROWS(MappedBitArray(path, MappedBitArray::READ_ONLY));
+  remove(path);
+  CHECK_THROWS(MappedBitArray(path, MappedBitArray::READ_ONLY));
+}
+
+TEST_CASE("Testing BitRecord save and load") {
+  srand(41);
+  std::stringstream log;
+  std::vector<uint8_t> logBuffer;
+  std::vector<BitArray> logged;
+  for (size_t size : {0, 1, 7, 63, 64, 65, 1000, 100000})
+    for (size_t offset : {0, 3}) {
+      BitArray bits = RandomBits(size);
+      std::vector<uint8_t> spanBuffer;
+      BitSpan span = SpanCopy(spanBuffer, offset, bits);
+      size_t recordBytes = BitRecord::Size(span);
+      CHECK(recordBytes % 64 == 0);
+      CHECK(recordBytes >= BitRecord::HeaderSize + (size + 7) / 8 + 7);
+
+      // Buffers, copied and viewed in place.
+      std::vector<uint8_t> buffer(recordBytes + 64, 0xFF);
+      CHECK(BitRecord::Save(span, buffer.data()) == recordBytes);
+      CHECK(buffer[recordBytes] == 0xFF);
+      size_t used(0);
+      BitArray loaded = BitRecord::Load(buffer.data(), buffer.size(), &used);
+      CHECK(used == recordBytes);
+      CHECK(SameBits(loaded, bits));
+      CHECK(PaddingIsZero(loaded));
+      BitSpan view = BitRecord::View(buffer.data(), recordBytes);
+      CHECK(view.data() == buffer.data() + BitRecord::HeaderSize);
+      CHECK(SameBits(BitExpr(view), bits));
+
+      // Streams, records one after another.
+      std::stringstream stream;
+      BitRecord::Save(stream, span);
+      CHECK(stream.str() == std::string(buffer.begin(), buffer.begin() + recordBytes));
+      CHECK(SameBits(BitRecord::Load(stream), bits));
+      BitRecord::Save(log, span);
+      logBuffer.insert(logBuffer.end(), buffer.begin(), buffer.begin() + recordBytes);
+      logged.push_back(bits);
+
+      if (size) {
+        // A flipped bit is caught by the CRC, unless it is not checked.
+        buffer[BitRecord::HeaderSize + (size - 1) / 8] ^= 1 << ((size - 1) % 8);
+        CHECK_THROWS(BitRecord::Load(buffer.data(), recordBytes));
+        CHECK_THROWS(BitRecord::View(buffer.data(), recordBytes));
+        CHECK(BitRecord::Load(buffer.data(), recordBytes, NULL, false)[size - 1] != bits[size - 1]);
+      }
+      CHECK_THROWS(BitRecord::View(buffer.data(), recordBytes - 8));
+      buffer[9] ^= 1;
+      CHECK_THROWS(BitRecord::View(buffer.data(), recordBytes, NULL, false));
+    }
+
+  for (size_t i = 0; i < logged.size(); ++i)
+    CHECK(SameBits(BitRecord::Load(log), logged[i]));
+  CHECK(log.peek() == std::char_traits<char>::eof());
+  CHECK_THROWS(BitRecord::Load(log));
+
+  // A size near 2^64 wraps the record size around to a small one, with a header CRC to match.
+  std::vector<uint8_t> forged(128);
+  BitRecord::Save(BitArray(8), forged.data());
+  for (size_t i = 0; i < 8; ++i)
+    forged[8 + i] = 0xFF;
+  uint64_t headerCrc = Crc::Crc32C().Compute(BitSpan(forged.data(), 0, 8 * 60));
+  for (size_t i = 0; i < 4; ++i)
+    forged[60 + i] = uint8_t(headerCrc >> (8 * i));
+  std::stringstream forgedStream(std::string(forged.begin(), forged.end()));
+  CHECK_THROWS(BitRecord::Load(forgedStream, false));
+  CHECK_THROWS(BitRecord::Load(forged.data(), forged.size(), NULL, false));
+  std::vector<BitSpan> views = BitRecord::Views(logBuffer.data(), logBuffer.size());
+  REQUIRE(views.size() == logged.size());
+  for (size_t i = 0; i < views.size(); ++i)
+    CHECK(SameBits(BitExpr(views[i]), logged[i]));
+
+  // A log on disk, mapped, and a file saved before the version field.
+  const char *path = "BitArray_Test.bits";
+  FILE *file = fopen(path, "wb");
+  fwrite(logBuffer.data(), 1, logBuffer.size(), file);
+  fclose(file);
+  {
+    MappedBitArray mapped(path);
+    CHECK(SameBits(BitExpr(mapped), logged[0]));
+    std::vector<BitSpan> records = mapped.Records();
+    REQUIRE(records.size() == logged.size());
+    CHECK(SameBits(BitExpr(records.back()), logged.back()));
+  }
+  uint8_t legacy[64 + 132] = {'B', 'I', 'T', 'A', 'R', 'R', 'A', 'Y', 0xE8, 0x03};
+  file = fopen(path, "wb");
+  fwrite(legacy, 1, sizeof(legacy), file);
+  fclose(file);
+  CHECK(MappedBitArray(path).size() == 1000);
+  remove(path);
+}
+
+TEST_CASE("Testing Convolver against Convolve") {
+  srand(25);
+  for (size_t numTaps : {1, 7, 64, 65, 200})
+    for (size_t maxChunk : {1, 40, 300, 40000}) {
+      BitArray taps = RandomBits(numTaps), fill = RandomBits(numTaps), input = RandomBits(50000);
+      BitArray expectedFill(fill), expected(input.size() + numTaps - 1);
+      BitArray::Convolve(taps, input, expected, true, expectedFill);
+
+      // Chunks of random sizes, some empty, written one after the other or into the convolver's buffer.
+      Convolver convolver(taps, fill), pooled(taps, fill);
+      BitArray result(expected.size() + 5);
+      size_t pos(5), pooledPos(0);
+      bool ok(true);
+      for (size_t begin = 0; begin < input.size();) {
+        size_t len = std::min(size_t(rand()) % (maxChunk + 1), input.size() - begin);
+        BitSpan chunk(input[begin], len);
+        pos = convolver.Push(chunk, result, pos);
+        BitSpan output = pooled.Push(chunk);
+        ok &= output.size() == len;
+        for (size_t i = 0; i < len; ++i)
+          ok &= output[i] == expected[pooledPos++];
+        begin += len;
+      }
+      BitArray midFill(numTaps);
+      convolver.GetFill(midFill);
+      BitArray flushed = BitExpr(pooled.Flush());
+      for (size_t i = 0; i < flushed.size(); ++i)
+        ok &= flushed[i] == expected[pooledPos++];
+      CHECK(convolver.Flush(result, pos) == result.size());
+      CHECK(ok);
+      CHECK(SameBits(BitExpr(BitSpan(result[5], expected.size())), expected));
+      CHECK(PaddingIsZero(result));
+
+      BitArray actualFill(numTaps);
+      convolver.GetFill(actualFill);
+      CHECK(SameBits(actualFill, BitExpr(BitSpan(expectedFill[0], numTaps))));
+      BitArray unflushedFill(fill), unflushed(input.size());
+      BitArray::Convolve(taps, input, unflushed, false, unflushedFill);
+      CHECK(SameBits(midFill, BitExpr(BitSpan(unflushedFill[0], numTaps))));
+
+      convolver.Reset();
+      BitArray restarted(input.size() + numTaps - 1), zeroFilled(restarted.size());
+      convolver.Flush(restarted, convolver.Push(input, restarted));
+      BitArray::Convolve(taps, input, zeroFilled);
+      CHECK(SameBits(restarted, zeroFilled));
+    }
+
+  BitArray result(10);
+  Convolver convolver(BitArray("101"));
+  CHECK_THROWS(convolver.Push(BitArray(8), result, 3));
+  CHECK_THROWS(convolver.Push(BitArray(1), result, 11));
+  CHECK_NOTHROW(convolver.Push(BitArray(7), result, 3));
+  CHECK_THROWS(convolver.SetFill(BitArray(2)));
+  CHECK_THROWS(Convolver(BitArray()));
+}
+
+TEST_CASE("Testing parallel Convolve and DotProd against serial") {
+  srand(26);
+  for (size_t threads : {1, 2, 3, 8, 33})
+    for (size_t size : {0, 1, 600, 5000, 100000}) {
+      BitArray::Parallel policy(threads, 0);
+      BitArray bits = RandomBits(size), other = RandomBits(size);
+      std::vector<uint8_t> buffer;
+      BitSpan span = SpanCopy(buffer, 3, bits);
+      for (size_t numTaps : {7, 100}) {
+        BitArray taps = RandomBits(numTaps), fill = RandomBits(numTaps), parallelFill(fill);
+        for (bool flush : {false, true}) {
+          BitArray expected(size + numTaps), actual(size + numTaps);
+          BitArray::Convolve(taps, bits, expected, flush, fill);
+          BitArray::Convolve(policy, taps, span, actual, flush, parallelFill);
+          CHECK(SameBits(actual, expected));
+          CHECK(SameBits(parallelFill, fill));
+        }
+        uint32_t fill32 = 0x5A5A5A5A, parallelFill32 = fill32;
+        BitArray expected(size + 6), actual(size + 6);
+        BitArray::Convolve(BitArray("1011011"), bits, expected, true, &fill32);
+        BitArray::Convolve(policy, BitArray("1011011"), bits, actual, true, &parallelFill32);
+        CHECK(SameBits(actual, expected));
+        CHECK(parallelFill32 == fill32);
+      }
+      CHECK(BitArray::DotProd(policy, span, other) == BitArray::DotProd(bits, other));
+      CHECK(BitArray::DotProd(BitArray::Parallel(threads, size + 1), span, other) == BitArray::DotProd(bits, other));
+    }
+
+  CHECK_THROWS(BitArray::DotProd(BitArray::Parallel(4, 0), BitArray(5), BitArray(6)));
+  BitArray tooSmall(50);
+  CHECK_THROWS(BitArray::Convolve(BitArray::Parallel(4, 0), BitArray("101"), BitArray(100), tooSmall));
+  CHECK(BitArray::Parallel().Threads(100) == 1);
+  CHECK(BitArray::Parallel(64, 0).Threads(1000) == 2);
+}
+
+TEST_CASE("Testing Pack and Unpack") {
+  srand(27);
+  for (size_t n : {0, 1, 15, 64, 100, 1000, 40000})
+    for (size_t pos : {0, 1, 63, 64, 77}) {
+      std::vector<uint8_t> bytes(n);
+      std::vector<int8_t> symbols(n);
+      std::vector<char> text(n);
+      std::unique_ptr<bool[]> bools(new bool[n + 1]);
+      for (size_t i = 0; i < n; ++i) {
+        bytes[i] = rand() % 3 ? 0 : rand();
+        symbols[i] = rand();
+        text[i] = "01x"[rand() % 3];
+        bools[i] = rand() % 2;
+      }
+
+      BitArray packedBytes = RandomBits(pos + n + 9), packedSymbols(packedBytes), packedText(packedBytes), packedBools(packedBytes);
+      BitArray::PackBytes(bytes.data(), n, packedBytes, pos);
+      BitArray::PackSymbols(symbols.data(), n, packedSymbols, pos);
+      BitArray::PackText(text.data(), n, packedText, pos);
+      BitArray::PackBools(bools.get(), n, packedBools, pos);
+      BitArray original(packedBytes);
+      bool ok(true);
+      for (size_t i = 0; i < packedBytes.size(); ++i) {
+        if (i < pos || i >= pos + n) {
+          ok &= packedBytes[i] == original[i] && packedSymbols[i] == original[i] && packedText[i] == original[i] && packedBools[i] == original[i];
+          continue;
+        }
+        ok &= packedBytes[i] == (bytes[i - pos] != 0);
+        ok &= packedSymbols[i] == (symbols[i - pos] > 0);
+        ok &= packedText[i] == (text[i - pos] == '1');
+        ok &= packedBools[i] == bools[i - pos];
+      }
+      CHECK(ok);
+      CHECK(PaddingIsZero(packedBytes));
+
+      std::vector<uint8_t> unpacked(n + 1, 0xEE);
+      std::vector<int8_t> unpackedSymbols(n + 1, 0x11);
+      BitArray::UnpackBytes(BitSpan(packedBools.data(), pos, n), unpacked.data());
+      BitArray::UnpackSymbols(BitSpan(packedBools.data(), pos, n), unpackedSymbols.data(), 5);
+      BitArray::UnpackBools(BitSpan(packedBools.data(), pos, n), bools.get());
+      for (size_t i = 0; i < n; ++i)
+        ok &= unpacked[i] == packedBools[pos + i] && unpackedSymbols[i] == (packedBools[pos + i] ? 5 : -5) && bools[i] == packedBools[pos + i];
+      CHECK(ok);
+      CHECK(unpacked[n] == 0xEE);
+      CHECK(unpackedSymbols[n] == 0x11);
+    }
+
+  std::string text;
+  for (size_t i = 0; i < 1000; ++i)
+    text += "01 _"[rand() % 4];
+  BitArray fromText(text);
+  size_t k(0);
+  bool ok(true);
+  for (size_t i = 0; i < text.size(); ++i)
+    if (text[i] == '0' || text[i] == '1')
+      ok &= k < fromText.size() && fromText[k++] == (text[i] == '1');
+  CHECK(ok);
+  CHECK(k == fromText.size());
+  CHECK(PaddingIsZero(fromText));
+  CHECK(BitArray(std::string(200, '1')).size() == 200);
+
+  BitArray small(10);
+  CHECK_THROWS(BitArray::PackText("0101", 4, small, 7));
+  CHECK_NOTHROW(BitArray::PackText("0101", 4, small, 6));
+}
+
+TEST_CASE("Testing Copy, Slice, Concat, Resize and Append") {
+  srand(41);
+  for (size_t len : {0, 1, 37, 64, 65, 200, 1000, 20000})
+    for (size_t from : {0, 1, 13, 64, 100})
+      for (size_t to : {0, 5, 64, 71}) {
+        BitArray src = RandomBits(from + len + 80), dest = RandomBits(to + len + 9), before = dest;
+        BitArray::Copy(BitSpan(src.data(), from, len), dest, to);
+        bool ok(true);
+        for (size_t i = 0; i < dest.size(); ++i)
+          ok &= dest[i] == (i >= to && i < to + len ? src[from + i - to] : before[i]);
+        CHECK(ok);
+        CHECK(PaddingIsZero(dest));
+
+        // Overlapping, in both directions.
+        BitArray moved = src;
+        size_t n = len / 2 + 1;
+        BitArray::Copy(BitSpan(moved.data(), from, std::min(n, moved.size() - std::max(from, to % 8))), moved, to % 8);
+        BitArray back = src;
+        BitArray::Copy(BitSpan(back.data(), to % 8, std::min(n, back.size() - from)), back, from);
+        for (size_t i = 0, m = std::min(n, src.size() - std::max(from, to % 8)); i < m; ++i)
+          ok &= moved[to % 8 + i] == src[from + i];
+        for (size_t i = 0, m = std::min(n, src.size() - from); i < m; ++i)
+          ok &= back[from + i] == src[to % 8 + i];
+        CHECK(ok);
+
+        BitArray slice = src.Slice(from, len);
+        CHECK(slice.size() == len);
+        for (size_t i = 0; i < len; ++i)
+          ok &= slice[i] == src[from + i];
+        CHECK(ok);
+        CHECK(PaddingIsZero(slice));
+      }
+
+  BitArray header = RandomBits(13), payload = RandomBits(1001), crc = RandomBits(32);
+  BitArray frame = BitArray::Concat({header, BitSpan(payload.data(), 3, 998), crc});
+  CHECK(frame.size() == 13 + 998 + 32);
+  CHECK(SameBits(frame.Slice(0, 13), header));
+  CHECK(SameBits(frame.Slice(13, 998), BitArray(payload.Range(payload[3], 998))));
+  CHECK(SameBits(frame.Slice(1011, 32), crc));
+
+  std::vector<bool> reference;
+  BitArray appended;
+  for (size_t k = 0; k < 300; ++k) {
+    if (rand() % 4 == 0) {
+      bool bit = rand() % 2;
+      appended.Append(bit);
+      reference.push_back(bit);
+    } else if (rand() % 8 == 0) {
+      size_t len = rand() % (reference.size() + 1);
+      appended.Resize(len);
+      reference.resize(len);
+    } else {
+      BitArray part = RandomBits(rand() % 300);
+      appended.Append(part);
+      for (size_t i = 0; i < part.size(); ++i)
+        reference.push_back(part[i]);
+    }
+    CHECK(PaddingIsZero(appended));
+  }
+  appended.Append(BitSpan(appended.data(), 5, appended.size() - 5));
+  for (size_t i = 5, n = reference.size(); i < n; ++i)
+    reference.push_back(reference[i]);
+  CHECK(appended.size() == reference.size());
+  bool ok(true);
+  for (size_t i = 0; i < reference.size(); ++i)
+    ok &= appended[i] == reference[i];
+  CHECK(ok);
+
+  BitArray small(10);
+  CHECK_THROWS(small.Slice(5, 6));
+  CHECK_THROWS(BitArray::Copy(RandomBits(4), small, 7));
+  CHECK_NOTHROW(BitArray::Copy(RandomBits(4), small, 6));
+}
+
+// The register a bit at a time, the taps as for Convolve with the last one for the current bit.
+static BitArray ReferenceLfsr(const BitArray &taps, BitArray &fill, const BitArray &input, bool feedback, bool additive) {
+  size_t n = taps.size();
+  std::vector<bool> reg(n);
+  for (size_t i = 0; i < n; ++i)
+    reg[i] = fill[i];
+  BitArray output(input.size());
+  for (size_t t = 0; t < input.size(); ++t) {
+    bool bit = false;
+    for (size_t i = 0; i + 1 < n; ++i)
+      bit ^= taps[i] && reg[i + 1];
+    bool out = feedback ? bit ^ input[t] : (additive ? bit ^ input[t] : bit);
+    reg.erase(reg.begin());
+    reg.push_back(feedback ? out : bit);
+    output[t] = out;
+  }
+  for (size_t i = 0; i < n; ++i)
+    fill[i] = reg[i];
+  return output;
+}
+
+TEST_CASE("Testing Lfsr against a bit at a time register") {
+  srand(43);
+  for (size_t numTaps : {2, 8, 17, 32, 63, 64, 65}) {
+    BitArray taps = RandomBits(numTaps);
+    taps[numTaps - 1] = 1;
+    for (size_t size : {0, 1, 63, 64, 65, 1000, 40000 + 13}) {
+      BitArray fill = RandomBits(numTaps), input = RandomBits(size);
+      for (int mode = 0; mode < 3; ++mode) {
+        BitArray refFill = fill;
+        BitArray expected = ReferenceLfsr(taps, refFill, input, mode == 2, mode == 1);
+        Lfsr lfsr(taps, fill);
+        BitArray actual(size + 7);
+        size_t end;
+        if (mode == 0)
+          end = lfsr.Generate(size, actual, 7);
+        else if (mode == 1)
+          end = lfsr.Apply(input, actual, 7);
+        else
+          end = lfsr.Scramble(input, actual, 7);
+        CHECK(end == size + 7);
+        CHECK(SameBits(actual.Slice(7, size), expected));
+        BitArray actualFill(numTaps);
+        lfsr.GetFill(actualFill);
+        CHECK(SameBits(actualFill, refFill));
+
+        if (mode == 2) {
+          // Self-synchronizing, the Convolver with the same taps and fill descrambles.
+          Convolver descrambler(taps, fill);
+          BitArray descrambled(size);
+          descrambler.Push(actual.Slice(7, size), descrambled);
+          CHECK(SameBits(descrambled, input));
+        }
+      }
+
+      // Jumping ahead lands where generating does, in pieces too.
+      Lfsr generated(taps, fill), jumped(taps, fill);
+      BitArray sequence(size + 100), tail(100);
+      generated.Generate(size / 3, sequence);
+      generated.Generate(size - size / 3 + 100, sequence, size / 3);
+      jumped.Jump(size);
+      jumped.Generate(100, tail);
+      CHECK(SameBits(tail, sequence.Slice(size, 100)));
+      BitArray fillA(numTaps), fillB(numTaps);
+      generated.GetFill(fillA);
+      jumped.GetFill(fillB);
+      CHECK(SameBits(fillA, fillB));
+    }
+  }
+
+  // Maximal length sequences, PRBS7 repeats after 127 bits with 64 ones per period.
+  for (unsigned order : {7, 9, 11, 15}) {
+    size_t period = (size_t(1) << order) - 1;
+    Lfsr prbs(Lfsr::Prbs(order));
+    BitArray sequence(2 * period);
+    prbs.Generate(sequence.size(), sequence);
+    CHECK(SameBits(sequence.Slice(0, period), sequence.Slice(period, period)));
+    CHECK(BitArray::DotProd(sequence.Slice(0, period), BitArray(std::string(period, '1'))) == (period + 1) / 2);
+  }
+  Lfsr prbs31(Lfsr::Prbs(31)), start(Lfsr::Prbs(31));
+  BitArray head(64), wrapped(64);
+  start.Generate(64, head);
+  prbs31.Jump((uint64_t(1) << 31) - 1);
+  prbs31.Generate(64, wrapped);
+  CHECK(SameBits(head, wrapped));
+
+  // Parallel generation matches serial.
+  Lfsr serial(Lfsr::Prbs(23)), parallel(Lfsr::Prbs(23));
+  BitArray a(100000 + 5), b(100000 + 5);
+  serial.Generate(100000, a, 5);
+  parallel.Generate(BitArray::Parallel(4, 0), 100000, b, 5);
+  CHECK(SameBits(a, b));
+  BitArray fillA(24), fillB(24);
+  serial.GetFill(fillA);
+  parallel.GetFill(fillB);
+  CHECK(SameBits(fillA, fillB));
+
+  CHECK_THROWS(Lfsr(BitArray("1")));
+  CHECK_THROWS(Lfsr(BitArray("110")));
+  CHECK_THROWS(Lfsr::Prbs(8));
+  BitArray small(10);
+  CHECK_THROWS(serial.Generate(11, small));
+}
+
+// A CRC a bit at a time with the normal register.
+static uint64_t ReferenceCrc(unsigned width, uint64_t poly, uint64_t init, bool reflect, uint64_t xorOut, const BitArray &bits, size_t begin, size_t len) {
+  uint64_t mask = width == 64 ? ~uint64_t(0) : (uint64_t(1) << width) - 1, reg = init & mask;
+  for (size_t i = begin; i < begin + len; ++i) {
+    bool top = ((reg >> (width - 1)) & 1) ^ bits[i];
+    reg = (reg << 1) & mask;
+    if (top)
+      reg ^= poly & mask;
+  }
+  if (reflect) {
+    uint64_t reflected = 0;
+    for (unsigned i = 0; i < width; ++i)
+      reflected |= ((reg >> i) & 1) << (width - 1 - i);
+    reg = reflected;
+  }
+  return (reg ^ xorOut) & mask;
+}
+
+TEST_CASE("Testing Crc") {
+  srand(47);
+  const char *check = "123456789";
+  BitArray lsbFirst(72), msbFirst(72);
+  for (size_t i = 0; i < 72; ++i) {
+    lsbFirst[i] = (check[i / 8] >> (i % 8)) & 1;
+    msbFirst[i] = (check[i / 8] >> (7 - i % 8)) & 1;
+  }
+  CHECK(Crc::Crc32().Compute(lsbFirst) == 0xCBF43926);
+  CHECK(Crc::Crc32C().Compute(lsbFirst) == 0xE3069283);
+  CHECK(Crc::Crc16Ccitt().Compute(msbFirst) == 0x29B1);
+  CHECK(Crc::Crc24Lte().Compute(msbFirst) == 0xCDE703);
+  CHECK(Crc::Crc32().Width() == 32);
+
+  BitArray bits = RandomBits(20000);
+  for (unsigned width : {1, 5, 8, 16, 24, 31, 32, 33, 63, 64})
+    for (int trial = 0; trial < 3; ++trial) {
+      uint64_t mask = width == 64 ? ~uint64_t(0) : (uint64_t(1) << width) - 1;
+      uint64_t poly = ((uint64_t(rand()) << 40) ^ (uint64_t(rand()) << 20) ^ rand() ^ 1) & mask;
+      uint64_t init = trial ? ((uint64_t(rand()) << 33) ^ rand()) & mask : 0, xorOut = trial == 2 ? mask : 0;
+      bool reflect = trial == 1;
+      Crc crc(width, poly, init, reflect, xorOut);
+      bool ok(true);
+      for (size_t begin : {0, 1, 7, 64, 333})
+        for (size_t len : {0, 1, 7, 8, 9, 63, 64, 65, 127, 1000, 1024, 1031, 5000, 19000})
+          ok &= crc.Compute(bits[begin], len) == ReferenceCrc(width, poly, init, reflect, xorOut, bits, begin, len);
+      CHECK(ok);
+
+      // Appended in transmission order, and with init and xorOut zero the CRC then comes out zero.
+      BitArray frame = RandomBits(1000 + trial);
+      uint64_t value = crc.Compute(frame);
+      crc.Append(frame);
+      CHECK(frame.size() == 1000 + trial + width);
+      for (size_t i = 0; i < width; ++i)
+        ok &= frame[1000 + trial + i] == bool((value >> (reflect ? i : width - 1 - i)) & 1);
+      CHECK(ok);
+      if (init == 0 && xorOut == 0)
+        CHECK(crc.Compute(frame) == 0);
+    }
+
+  CHECK_THROWS(Crc(0, 1));
+  CHECK_THROWS(Crc(65, 1));
+}
+
+TEST_CASE("Testing Transpose and Interleaver") {
+  srand(53);
+  for (size_t rows : {1, 3, 64, 65, 130})
+    for (size_t cols : {1, 7, 64, 100, 200})
+      for (size_t offset : {0, 5}) {
+        BitArray matrix = RandomBits(rows * cols + offset), transposed(rows * cols + 3);
+        BitSpan bits(matrix.data(), offset, rows * cols);
+        BitArray::Transpose(bits, rows, cols, transposed, 3);
+        bool ok(true);
+        for (size_t r = 0; r < rows; ++r)
+          for (size_t c = 0; c < cols; ++c)
+            ok &= transposed[3 + c * rows + r] == bits[r * cols + c];
+        CHECK(ok);
+        CHECK(PaddingIsZero(transposed));
+
+        Interleaver block(rows, cols);
+        CHECK(block.size() == rows * cols);
+        BitArray interleaved(rows * cols), deinterleaved(rows * cols);
+        block.Interleave(bits, interleaved);
+        CHECK(SameBits(interleaved, transposed.Slice(3, rows * cols)));
+        block.Deinterleave(interleaved, deinterleaved);
+        CHECK(SameBits(deinterleaved, BitArray(BitExpr(bits))));
+      }
+
+  for (size_t size : {1, 8, 15, 16, 63, 64, 65, 1000, 100000 + 3}) {
+    std::vector<size_t> permutation(size);
+    for (size_t j = 0; j < size; ++j)
+      permutation[j] = j;
+    for (size_t j = size; j > 1; --j)
+      std::swap(permutation[j - 1], permutation[rand() % j]);
+    Interleaver interleaver(permutation);
+    CHECK(interleaver.size() == size);
+    BitArray frame = RandomBits(size + 6), interleaved(size + 1), deinterleaved(size);
+    BitSpan bits(frame.data(), 6, size);
+    interleaver.Interleave(bits, interleaved, 1);
+    bool ok(true);
+    for (size_t j = 0; j < size; ++j)
+      ok &= interleaved[1 + j] == bits[permutation[j]];
+    CHECK(ok);
+    CHECK(PaddingIsZero(interleaved));
+    interleaver.Deinterleave(BitSpan(interleaved.data(), 1, size), deinterleaved);
+    CHECK(SameBits(deinterleaved, BitArray(BitExpr(bits))));
+  }
+
+  CHECK_THROWS(Interleaver(std::vector<size_t>{0, 2, 2}));
+  CHECK_THROWS(Interleaver(std::vector<size_t>{0, 3, 1}));
+  BitArray frame(12), small(11);
+  CHECK_THROWS(Interleaver(3, 4).Interleave(frame, small));
+  CHECK_THROWS(Interleaver(3, 5).Interleave(frame, frame));
+}
+
+TEST_CASE("Testing BitMatrix scoring against DotProd") {
+  srand(61);
+  for (size_t cols : {1, 64, 100, 513, 1100})
+    for (size_t rows : {1, 3, 5, 37, 130}) {
+      std::vector<BitArray> rowsA, rowsB;
+      for (size_t r = 0; r < rows; ++r)
+        rowsA.push_back(RandomBits(cols));
+      for (size_t r = 0; r < 133 - rows; ++r)
+        rowsB.push_back(RandomBits(cols));
+      BitMatrix a(rowsA), b(rowsB);
+      CHECK(a.rows() == rows);
+      CHECK(a.cols() == cols);
+      CHECK(a.stride() % 512 == 0);
+
+      std::vector<uint32_t> dots = BitMatrix::Scores(a, b, BitMatrix::AND_POPCOUNT, BitArray::Parallel(3, 0));
+      std::vector<uint32_t> distances = BitMatrix::Scores(a, b, BitMatrix::XOR_POPCOUNT);
+      REQUIRE(dots.size() == rows * b.rows());
+      bool ok(true);
+      for (size_t i = 0; i < rows; ++i)
+        for (size_t j = 0; j < b.rows(); ++j) {
+          ok &= dots[i * b.rows() + j] == BitArray::DotProd(rowsA[i], rowsB[j]);
+          BitArray difference = rowsA[i] ^ rowsB[j];
+          ok &= distances[i * b.rows() + j] == BitArray::DotProd(difference, difference);
+        }
+      CHECK(ok);
+
+      for (BitMatrix::Metric metric : {BitMatrix::AND_POPCOUNT, BitMatrix::XOR_POPCOUNT}) {
+        std::vector<uint32_t> scores = metric == BitMatrix::AND_POPCOUNT ? dots : distances;
+        auto better = [&](size_t i, size_t x, size_t y) {
+          uint32_t sx = scores[i * b.rows() + x], sy = scores[i * b.rows() + y];
+          return sx != sy ? (metric == BitMatrix::AND_POPCOUNT ? sx > sy : sx < sy) : x < y;
+        };
+        for (size_t k : {0, 1, 5, 200}) {
+          std::vector<BitMatrix::Match> top = BitMatrix::TopK(a, b, metric, k, BitArray::Parallel(2, 0));
+          size_t perRow = std::min(k, b.rows());
+          REQUIRE(top.size() == rows * perRow);
+          for (size_t i = 0; i < rows; ++i) {
+            std::vector<size_t> refs(b.rows());
+            for (size_t j = 0; j < refs.size(); ++j)
+              refs[j] = j;
+            std::sort(refs.begin(), refs.end(), [&](size_t x, size_t y) { return better(i, x, y); });
+            for (size_t j = 0; j < perRow; ++j) {
+              const BitMatrix::Match &match = top[i * perRow + j];
+              ok &= match.row == i && match.ref == refs[j] && match.score == scores[i * b.rows() + refs[j]];
+            }
+          }
+          CHECK(ok);
+        }
+
+        uint32_t threshold = uint32_t(cols / (metric == BitMatrix::AND_POPCOUNT ? 3 : 2));
+        std::vector<BitMatrix::Match> found = BitMatrix::Threshold(a, b, metric, threshold, BitArray::Parallel(3, 0)), expected;
+        for (size_t i = 0; i < rows; ++i)
+          for (size_t j = 0; j < b.rows(); ++j) {
+            uint32_t score = scores[i * b.rows() + j];
+            if (metric == BitMatrix::AND_POPCOUNT ? score >= threshold : score <= threshold) {
+              BitMatrix::Match match = {i, j, score};
+              expected.push_back(match);
+            }
+          }
+        REQUIRE(found.size() == expected.size());
+        for (size_t m = 0; m < found.size(); ++m)
+          ok &= found[m].row == expected[m].row && found[m].ref == expected[m].ref && found[m].score == expected[m].score;
+        CHECK(ok);
+      }
+    }
+
+  BitMatrix matrix(3, 70);
+  matrix(1, 69) = true;
+  CHECK(matrix(1, 69));
+  CHECK_FALSE(matrix(2, 69));
+  BitArray row = RandomBits(70);
+  matrix.SetRow(2, row);
+  CHECK(SameBits(BitArray(BitExpr(matrix.Row(2))), row));
+  CHECK(BitMatrix::Scores(matrix, BitMatrix(0, 70), BitMatrix::AND_POPCOUNT).empty());
+  CHECK_THROWS(matrix.SetRow(3, row));
+  CHECK_THROWS(matrix.SetRow(0, RandomBits(71)));
+  CHECK_THROWS(BitMatrix(std::vector<BitArray>{RandomBits(70), RandomBits(71)}));
+  CHECK_THROWS(BitMatrix::Scores(matrix, BitMatrix(3, 71), BitMatrix::XOR_POPCOUNT));
+  CHECK_THROWS(BitMatrix::TopK(matrix, BitMatrix(3, 71), BitMatrix::XOR_POPCOUNT, 1));
+  CHECK_THROWS(BitMatrix::Threshold(matrix, BitMatrix(3, 71), BitMatrix::XOR_POPCOUNT, 1));
+}
+
+// The rank by elimination over rows of bools.
+static size_t ReferenceRank(std::vector<std::vector<bool> > rows) {
+  size_t rank(0);
+  for (size_t c = 0; !rows.empty() && c < rows[0].size(); ++c) {
+    size_t r = rank;
+    while (r < rows.size() && !rows[r][c])
+      ++r;
+    if (r == rows.size())
+      continue;
+    std::swap(rows[r], rows[rank]);
+    for (size_t i = rank + 1; i < rows.size(); ++i)
+      if (rows[i][c])
+        for (size_t j = c; j < rows[i].size(); ++j)
+          rows[i][j] = rows[i][j] != rows[rank][j];
+    ++rank;
+  }
+  return rank;
+}
+
+static BitMatrix RandomMatrix(size_t rows, size_t cols) {
+  BitMatrix m(rows, cols);
+  for (size_t r = 0; r < rows; ++r)
+    m.SetRow(r, RandomBits(cols));
+  return m;
+}
+
+TEST_CASE("Testing GF(2) products, elimination and generators") {
+  srand(67);
+  for (size_t rows : {1, 5, 64, 130})
+    for (size_t cols : {1, 63, 100, 600}) {
+      BitMatrix m = RandomMatrix(rows, cols);
+      BitArray x = RandomBits(cols + 5), y = RandomBits(rows + 3), product(rows + 2), transposedProduct(cols + 1);
+      BitMatrix::Multiply(m, BitSpan(x.data(), 5, cols), product, 2);
+      BitMatrix::Multiply(BitSpan(y.data(), 3, rows), m, transposedProduct, 1);
+      BitMatrix t = m.Transposed();
+      REQUIRE(t.rows() == cols);
+      REQUIRE(t.cols() == rows);
+      bool ok(true);
+      for (size_t r = 0; r < rows; ++r)
+        ok &= product[2 + r] == (BitArray::DotProd(m.Row(r), BitSpan(x.data(), 5, cols)) % 2 == 1);
+      for (size_t c = 0; c < cols; ++c) {
+        ok &= transposedProduct[1 + c] == (BitArray::DotProd(t.Row(c), BitSpan(y.data(), 3, rows)) % 2 == 1);
+        for (size_t r = 0; r < rows; ++r)
+          ok &= t(c, r) == m(r, c);
+      }
+      CHECK(ok);
+      CHECK(PaddingIsZero(product));
+      CHECK(PaddingIsZero(transposedProduct));
+
+      // A product through an inner dimension of 37 has rank at most 37.
+      BitMatrix b = RandomMatrix(cols, 37), c = BitMatrix::Multiply(m, b);
+      REQUIRE(c.rows() == rows);
+      REQUIRE(c.cols() == 37);
+      for (size_t r = 0; r < rows; ++r)
+        for (size_t j = 0; j < 37; ++j)
+          ok &= c(r, j) == (BitArray::DotProd(m.Row(r), b.Transposed().Row(j)) % 2 == 1);
+      CHECK(ok);
+      BitMatrix low = BitMatrix::Multiply(c, RandomMatrix(37, cols));
+      std::vector<std::vector<bool> > bools(rows, std::vector<bool>(cols));
+      for (size_t r = 0; r < rows; ++r)
+        for (size_t j = 0; j < cols; ++j)
+          bools[r][j] = low(r, j);
+      CHECK(low.Rank() == ReferenceRank(bools));
+      CHECK(low.Rank() <= 37);
+
+      // Reduced row echelon form, each pivot the only one in its column and right of the last.
+      size_t rank = m.Rank(), pivot(0);
+      BitMatrix reduced(m);
+      CHECK(reduced.Eliminate() == rank);
+      for (size_t r = 0; r < rows; ++r) {
+        size_t first = cols;
+        for (size_t j = 0; j < cols && first == cols; ++j)
+          if (reduced(r, j))
+            first = j;
+        CHECK((r < rank) == (first < cols));
+        if (r < rank) {
+          CHECK((r == 0 || first > pivot));
+          pivot = first;
+          for (size_t i = 0; i < rows; ++i)
+            ok &= reduced(i, first) == (i == r);
+        }
+      }
+      CHECK(ok);
+    }
+
+  for (size_t k : {1, 20, 300})
+    for (size_t m : {3, 64, 200}) {
+      // h = [p | i] gives g = [i | p^t], a product of random matrices has dependent rows.
+      const BitMatrix p = RandomMatrix(m, k);
+      BitMatrix h(m, k + m);
+      for (size_t r = 0; r < m; ++r) {
+        for (size_t j = 0; j < k; ++j)
+          h(r, j) = p(r, j);
+        h(r, k + r) = true;
+      }
+      BitMatrix dependent = BitMatrix::Multiply(RandomMatrix(m, m / 2 + 1), RandomMatrix(m / 2 + 1, k + m));
+      for (const BitMatrix &check : {h, dependent}) {
+        BitMatrix g = BitMatrix::Generator(check);
+        REQUIRE(g.rows() == k + m - check.Rank());
+        REQUIRE(g.cols() == k + m);
+        CHECK(g.Rank() == g.rows());
+        bool ok(true);
+        BitArray syndrome(m);
+        for (size_t i = 0; i < g.rows(); ++i) {
+          BitMatrix::Multiply(check, g.Row(i), syndrome);
+          ok &= BitArray::DotProd(syndrome, syndrome) == 0;
+        }
+        CHECK(ok);
+      }
+
+      BitMatrix g = BitMatrix::Generator(h);
+      BitArray message = RandomBits(k), codeword(k + m), syndrome(m);
+      BitMatrix::Multiply(message, g, codeword);
+      CHECK(SameBits(codeword.Slice(0, k), message));
+      BitMatrix::Multiply(h, codeword, syndrome);
+      CHECK(BitArray::DotProd(syndrome, syndrome) == 0);
+    }
+
+  for (size_t rows : {1, 7, 100})
+    for (size_t cols : {1, 64, 1000}) {
+      std::vector<std::vector<size_t> > ones(rows);
+      BitMatrix dense(rows, cols);
+      for (size_t r = 0; r < rows; ++r)
+        for (size_t n = rand() % 40; n; --n) {
+          ones[r].push_back(rand() % cols);
+          dense(r, ones[r].back()) = !dense(r, ones[r].back());
+        }
+      SparseBitMatrix sparse(cols, ones);
+      CHECK(sparse.rows() == rows);
+      CHECK(sparse.cols() == cols);
+      BitArray x = RandomBits(cols + 3), expected(rows), product(rows + 4);
+      BitMatrix::Multiply(dense, BitSpan(x.data(), 3, cols), expected);
+      SparseBitMatrix::Multiply(sparse, BitSpan(x.data(), 3, cols), product, 4);
+      CHECK(SameBits(product.Slice(4, rows), expected));
+      CHECK(PaddingIsZero(product));
+    }
+
+  BitMatrix m(3, 70);
+  BitArray small(2), bits(70);
+  CHECK_THROWS(BitMatrix::Multiply(m, BitArray(71), bits));
+  CHECK_THROWS(BitMatrix::Multiply(m, bits, small));
+  CHECK_THROWS(BitMatrix::Multiply(bits, m, bits));
+  CHECK_THROWS(BitMatrix::Multiply(BitArray(3), m, small));
+  CHECK_THROWS(BitMatrix::Multiply(m, m));
+  CHECK_THROWS(SparseBitMatrix(10, std::vector<std::vector<size_t> >{{1, 10}}));
+  CHECK_THROWS(SparseBitMatrix::Multiply(SparseBitMatrix(10, std::vector<std::vector<size_t> >{{1}, {2}, {3}}), BitArray(10), small));
+}
+
+TEST_CASE("Testing FindFirst, FindNext, FindPrev and Positions") {
+  srand(71);
+  for (size_t size : {0, 1, 63, 64, 65, 1000, 100003})
+    for (size_t offset : {0, 13})
+      for (int density : {0, 1, 100, 500, 1000}) {
+        // Random bits around the span check that the ends are masked.
+        BitArray bits = RandomBits(offset + size + 70);
+        for (size_t i = offset; i < offset + size; ++i)
+          bits[i] = rand() % 1000 < density;
+        BitSpan span(bits.data(), offset, size);
+
+        std::vector<size_t> ones, zeros;
+        for (size_t i = 0; i < size; ++i)
+          (span[i] ? ones : zeros).push_back(i);
+        for (bool value : {true, false}) {
+          const std::vector<size_t> &expected = value ? ones : zeros;
+          std::vector<size_t> found, reversed;
+          for (size_t i = BitArray::FindFirst(span, value); i < size; i = BitArray::FindNext(span, i, value))
+            found.push_back(i);
+          for (size_t i = BitArray::FindPrev(span, size, value); i < size; i = BitArray::FindPrev(span, i, value))
+            reversed.insert(reversed.begin(), i);
+          CHECK(found == expected);
+          CHECK(reversed == expected);
+          if (size > 0) {
+            size_t pos = size / 2;
+            auto next = std::upper_bound(expected.begin(), expected.end(), pos);
+            auto prev = std::lower_bound(expected.begin(), expected.end(), pos);
+            CHECK(BitArray::FindNext(span, pos, value) == (next == expected.end() ? size : *next));
+            CHECK(BitArray::FindPrev(span, pos, value) == (prev == expected.begin() ? size : *(prev - 1)));
+          }
+          CHECK(BitArray::FindNext(span, size, value) == size);
+          CHECK(BitArray::FindPrev(span, 0, value) == size);
+        }
+
+        std::vector<uint32_t> positions32;
+        std::vector<uint64_t> positions64(5, 7);
+        BitArray::Positions(span, positions32);
+        BitArray::Positions(span, positions64);
+        CHECK(std::vector<size_t>(positions32.begin(), positions32.end()) == ones);
+        CHECK(std::vector<size_t>(positions64.begin(), positions64.end()) == ones);
+      }
+}
+
+// Bits mixing chunks that are empty, sparse, dense, long runs and full, so that every container
+// meets every other.
+static BitArray MixedBits(size_t size) {
+  BitArray bits(size);
+  for (size_t start = 0; start < size; start += 65536) {
+    size_t end = std::min(size, start + 65536);
+    switch (rand() % 5) {
+    case 0:
+      break;
+    case 1:
+      for (size_t n = rand() % 200; n; --n)
+        bits[start + rand() % (end - start)] = true;
+      break;
+    case 2:
+      for (size_t i = start; i < end; ++i)
+        bits[i] = rand() % 2;
+      break;
+    case 3:
+      for (size_t i = start + rand() % 1000; i < end; i += 500 + rand() % 3000)
+        for (size_t j = i; j < std::min(end, i + 1 + rand() % 2000); ++j)
+          bits[j] = true;
+      break;
+    default:
+      for (size_t i = start; i < end; ++i)
+        bits[i] = true;
+    }
+  }
+  return bits;
+}
+
+TEST_CASE("Testing CompressedBitArray against BitArray") {
+  srand(73);
+  for (size_t size : {0, 1, 65535, 65536, 65537, 200000, 700000}) {
+    for (size_t trial = 0; trial < 4; ++trial) {
+      BitArray x = MixedBits(size + 3), y = MixedBits(size);
+      BitSpan xs(x.data(), 3, size);
+      CompressedBitArray a(xs), b(y);
+      CHECK(a.size() == size);
+      CHECK(a.Count() == BitArray::DotProd(xs, xs));
+      CHECK(SameBits(a.Decompress(), BitArray(BitExpr(xs))));
+      CHECK(SameBits(b.Decompress(), y));
+      CHECK(PaddingIsZero(a.Decompress()));
+      bool ok(true);
+      for (size_t k = 0; k < 1000 && size; ++k) {
+        size_t i = rand() % size;
+        ok &= a[i] == xs[i];
+      }
+      CHECK(ok);
+
+      CHECK(CompressedBitArray::DotProd(a, b) == BitArray::DotProd(xs, y));
+      CHECK(CompressedBitArray::DotProd(a, y) == BitArray::DotProd(xs, y));
+      CompressedBitArray both = a & b, either = a | b, one = a ^ b;
+      CHECK(SameBits(both.Decompress(), BitArray(BitExpr(xs) & y)));
+      CHECK(SameBits(either.Decompress(), BitArray(BitExpr(xs) | y)));
+      CHECK(SameBits(one.Decompress(), BitArray(BitExpr(xs) ^ y)));
+      CHECK(both.Count() == BitArray::DotProd(xs, y));
+      CHECK((one ^ b).Count() == a.Count());
+    }
+  }
+
+  // 0.1% of a large array takes a small fraction of the dense size, as do a few long runs.
+  BitArray sparse(size_t(1) << 24), runs(size_t(1) << 24);
+  for (size_t i = 0; i < sparse.size() / 1000; ++i)
+    sparse[rand() % sparse.size()] = true;
+  for (size_t i = 1000; i < runs.size(); i += 100000)
+    for (size_t j = i; j < i + 50000; ++j)
+      runs[j] = true;
+  CHECK(CompressedBitArray(sparse).Bytes() < sparse.size() / 8 / 20);
+  CHECK(CompressedBitArray(runs).Bytes() < runs.size() / 8 / 20);
+  CHECK(CompressedBitArray(runs).Count() == BitArray::DotProd(runs, runs));
+  CHECK(CompressedBitArray(100).Count() == 0);
+  CHECK(CompressedBitArray(100).Decompress().size() == 100);
+
+  CompressedBitArray small(100), large(101);
+  CHECK_THROWS(small & large);
+  CHECK_THROWS(small ^ large);
+  CHECK_THROWS(CompressedBitArray::DotProd(small, large));
+  CHECK_THROWS(CompressedBitArray::DotProd(small, BitArray(101)));
+}
+
+// Runs every dispatched kernel, at offsets and sizes that reach the vector loops and their tails, and
+// collects the results.
+static std::vector<uint64_t> DispatchWorkload() {
+  srand(59);
+  std::vector<uint64_t> results;
+  auto append = [&](const BitArray &bits) {
+    results.push_back(bits.size());
+    for (size_t i = 0; i < (bits.size() + 7) / 8; ++i)
+      results.push_back(bits.data()[i]);
+  };
+  BitArray a = RandomBits(100003), b = RandomBits(100003);
+
+  for (size_t offset : {0, 3, 17})
+    for (size_t len : {1, 100, 99000})
+      results.push_back(BitArray::DotProd(a[offset], b[offset / 2], len));
+
+  std::vector<uint16_t> agreements;
+  for (size_t patternSize : {64, 200}) {
+    BitArray::Correlate(RandomBits(patternSize), BitSpan(a.data(), 5, 20000), agreements);
+    results.insert(results.end(), agreements.begin(), agreements.end());
+  }
+
+  for (size_t numTaps : {3, 7, 64, 100}) {
+    BitArray taps = RandomBits(numTaps), convolved(numTaps + a.size() - 1);
+    BitArray::Convolve(taps, a, convolved, true);
+    append(convolved);
+  }
+
+  for (size_t offset : {0, 5}) {
+    BitArray convolved(a.size() + 6);
+    BitArray::Convolve<1, 1, 1, 1, 0, 0, 1>(BitSpan(a.data(), offset, a.size() - offset), convolved);
+    append(convolved);
+  }
+
+  std::vector<BitArray> taps = {BitArray("1111001"), BitArray("1011011")};
+  std::vector<BitArray> puncture = {BitArray("110"), BitArray("101")};
+  BitArray input = RandomBits(20000), encoded(BitArray::EncodedSize(taps, input.size(), true, puncture));
+  BitArray::Encode(taps, input, encoded, true, NULL, puncture);
+  append(encoded);
+  std::vector<int8_t> symbols((input.size() + 6) * 2);
+  for (size_t i = 0; i < symbols.size(); ++i)
+    symbols[i] = int8_t(rand() % 200 - 100);
+  BitArray decoded(input.size());
+  BitArray::Decode(taps, symbols.data(), symbols.size(), decoded, true, 35);
+  append(decoded);
+
+  BitArray combined = a ^ (b & ~(a << 5));
+  combined >>= 3;
+  BitArray::Assign(combined[13], BitArray::Range(a[5], 50000) ^ BitArray::Range(b[0], 50000));
+  BitArray::Copy(BitSpan(a.data(), 13, 50000), combined, 7);
+  append(combined);
+
+  std::vector<uint8_t> bytes(10007);
+  for (size_t i = 0; i < bytes.size(); ++i)
+    bytes[i] = rand() % 2;
+  BitArray packed(bytes.size() + 3);
+  BitArray::PackBytes(bytes.data(), bytes.size(), packed, 3);
+  append(packed);
+  BitArray packedSymbols(symbols.size());
+  BitArray::PackSymbols(symbols.data(), symbols.size(), packedSymbols);
+  append(packedSymbols);
+  BitArray::UnpackBytes(BitSpan(a.data(), 9, bytes.size()), bytes.data());
+  results.insert(results.end(), bytes.begin(), bytes.end());
+
+  BitArray transposed(130 * 200 + 3);
+  BitArray::Transpose(BitSpan(a.data(), 5, 130 * 200), 130, 200, transposed, 3);
+  append(transposed);
+
+  Crc crc32 = Crc::Crc32();
+  for (size_t offset : {0, 1, 333})
+    for (size_t len : {1000, 99000})
+      results.push_back(crc32.Compute(a[offset], len));
+
+  Lfsr prbs(Lfsr::Prbs(31));
+  BitArray sequence(a.size());
+  prbs.Generate(a.size(), sequence);
+  append(sequence);
+  prbs.Scramble(a, sequence);
+  append(sequence);
+
+  std::vector<size_t> permutation(a.size());
+  for (size_t j = 0; j < permutation.size(); ++j)
+    permutation[j] = j;
+  for (size_t j = permutation.size(); j > 1; --j)
+    std::swap(permutation[j - 1], permutation[rand() % j]);
+  BitArray interleaved(a.size());
+  Interleaver(permutation).Interleave(a, interleaved);
+  append(interleaved);
+
+  std::vector<BitArray> fingerprints;
+  for (size_t r = 0; r < 70; ++r)
+    fingerprints.push_back(RandomBits(1100));
+  BitMatrix queries(std::vector<BitArray>(fingerprints.begin(), fingerprints.begin() + 37)), references(fingerprints);
+  std::vector<uint32_t> scores = BitMatrix::Scores(queries, references, BitMatrix::AND_POPCOUNT);
+  results.insert(results.end(), scores.begin(), scores.end());
+  BitArray syndrome(references.rows());
+  BitMatrix::Multiply(references, BitSpan(a.data(), 3, 1100), syndrome);
+  append(syndrome);
+
+  BitArray sparse(a.size());
+  for (size_t i = 0; i < 300; ++i)
+    sparse[rand() % sparse.size()] = true;
+  for (BitSpan span : {BitSpan(sparse), BitSpan(sparse.data(), 5, sparse.size() - 5), BitSpan(a)})
+    for (bool value : {true, false}) {
+      for (size_t i = BitArray::FindFirst(span, value), k = 0; i < span.size() && k < 1000; i = BitArray::FindNext(span, i, value), ++k)
+        results.push_back(i);
+      for (size_t i = BitArray::FindPrev(span, span.size(), value), k = 0; i < span.size() && k < 1000; i = BitArray::FindPrev(span, i, value), ++k)
+        results.push_back(i);
+    }
+  std::vector<uint64_t> positions;
+  BitArray::Positions(BitSpan(sparse.data(), 5, sparse.size() - 5), positions);
+  results.insert(results.end(), positions.begin(), positions.end());
+  BitArray::Positions(a, positions);
+  results.insert(results.end(), positions.begin(), positions.end());
+  return results;
+}
+
+TEST_CASE("Testing every dispatched implementation against the default") {
+  Dispatch::Configure("*=default");
+  std::vector<uint64_t> expected = DispatchWorkload();
+
+  std::vector<std::string> kernels = Dispatch::Kernels();
+  CHECK(kernels.size() == 17);
+  for (const std::string &kernel : kernels) {
+    CHECK(Dispatch::Selected(kernel) == "default");
+    for (const std::string &implementation : Dispatch::Implementations(kernel)) {
+      Dispatch::Configure("*=default");
+      Dispatch::Select(kernel, implementation);
+      CHECK(Dispatch::Selected(kernel) == implementation);
+      INFO(kernel + "=" + implementation);
+      CHECK(DispatchWorkload() == expected);
+    }
+  }
+
+  // A tier caps every kernel, which keep the widest implementation the CPU supports below it.
+  Dispatch::Configure(" * = avx2 , pack=sse2");
+  for (const std::string &kernel : kernels) {
+    std::vector<std::string> implementations = Dispatch::Implementations(kernel);
+    CHECK(Dispatch::Selected(kernel) != "avx512");
+    if (kernel != "pack" && std::find(implementations.begin(), implementations.end(), "avx2") != implementations.end())
+      CHECK(Dispatch::Selected(kernel) == "avx2");
+  }
+  CHECK(Dispatch::Selected("pack") != "avx2");
+
+  // Implementations are named after what they check for, the position decoder needing only BMI.
+  std::vector<std::string> positions = Dispatch::Implementations("positions");
+  CHECK(std::find(positions.begin(), positions.end(), "bmi2") == positions.end());
+#if BITARRAY_MAX_ISA >= BITARRAY_ISA_AVX2
+  if (__builtin_cpu_supports("bmi") && __builtin_cpu_supports("popcnt"))
+    CHECK(std::find(positions.begin(), positions.end(), "bmi") != positions.end());
+#endif
+  Dispatch::Configure("positions=bmi");
+  CHECK(Dispatch::Selected("positions") != "avx512");
+
+  CHECK_THROWS_AS(Dispatch::Select("popcount", "avx2"), std::runtime_error);
+  CHECK_THROWS_AS(Dispatch::Select("dotprod", "neon"), std::runtime_error);
+  CHECK_THROWS_AS(Dispatch::Configure("dotprod"), std::runtime_error);
+  CHECK_THROWS_AS(Dispatch::Implementations("popcount"), std::runtime_error);
+  Dispatch::Configure("*=auto");
+  for (const std::string &kernel : kernels)
+    CHECK(Dispatch::Selected(kernel) == Dispatch::Implementations(kernel).back());
+}